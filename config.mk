@@ -1 +1,2 @@
 SRC+=$(wildcard __DIRNAME/src/*.c)
+LDFLAGS+=-lpthread
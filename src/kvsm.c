@@ -1,661 +1,6255 @@
-/*#include <stdint.h>*/
-/*#include <string.h>*/
-/**/
-/*#include "finwo/endian.h"*/
-/*#include "finwo/io.h"*/
-/*#include "rxi/log.h"*/
-/*#include "tidwall/buf.h"*/
-/**/
-/*#include "kvsm.h"*/
-/**/
-/*#define FLAG_HYDRATED     1*/
-/*#define FLAG_NONRECURSIVE 2*/
-/**/
-/*// Loads JUST the info, not the data*/
-/*struct kvsm_cursor * kvsm_cursor_load(const struct kvsm *ctx, PALLOC_OFFSET offset) {*/
-/*  struct kvsm_cursor *cursor = NULL;*/
-/**/
-/*  // Version check*/
-/*  uint8_t version;*/
-/*  seek_os(ctx->fd, offset  , SEEK_SET);*/
-/*  read_os(ctx->fd, &version, sizeof(version));*/
-/*  if (version != 0) {*/
-/*    log_error("Incompatible version at %lld", offset);*/
-/*    return NULL;*/
-/*  }*/
-/**/
-/*  // Actually reserve memory*/
-/*  cursor         = calloc(1, sizeof(struct kvsm_cursor));*/
-/*  cursor->offset = offset;*/
-/*  cursor->ctx    = ctx;*/
-/**/
-/*  // Parent pointer overlaps with version, 56 bits of offset should be plenty*/
-/*  // Why offset and not increment: offset is single-volume, increment may be shared between systems*/
-/*  PALLOC_OFFSET parent;*/
-/*  seek_os(ctx->fd, offset , SEEK_SET);*/
-/*  read_os(ctx->fd, &parent, sizeof(parent));*/
-/*  cursor->parent = be64toh(parent);*/
-/*  // No need to remove version, we're version 0*/
-/**/
-/*  uint64_t increment;*/
-/*  read_os(ctx->fd, &increment, sizeof(increment));*/
-/*  cursor->increment = be64toh(increment);*/
-/*  log_trace("Read increment %lld", cursor->increment);*/
-/**/
-/*  return cursor;*/
-/*}*/
-/**/
-/*// Assumes the parent still exists and hasn't been deleted by compaction*/
-/*struct kvsm_cursor * kvsm_cursor_previous(const struct kvsm_cursor *cursor) {*/
-/*  if (!cursor) return NULL;*/
-/*  if (!cursor->ctx) return NULL;*/
-/*  if (!cursor->parent) return NULL;*/
-/*  // Turns the cursor into it's own parent*/
-/*  return kvsm_cursor_load(cursor->ctx, cursor->parent);*/
-/*}*/
-/**/
-/*// Assumes the cursor still exists and hasn't been deleted by compaction*/
-/*struct kvsm_cursor * kvsm_cursor_next(const struct kvsm_cursor *cursor) {*/
-/*  if (!cursor) return NULL;*/
-/*  if (!cursor->ctx) return NULL;*/
-/*  const struct kvsm *ctx = cursor->ctx;*/
-/**/
-/*  PALLOC_OFFSET parent;*/
-/*  PALLOC_OFFSET current = ctx->current_offset;*/
-/*  PALLOC_OFFSET child   = 0;*/
-/*  uint64_t increment;*/
-/*  uint8_t len8;*/
-/**/
-/*  while(current) {*/
-/*    // Sanity-check version*/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &len8, sizeof(len8));*/
-/*    if (len8 != 0) return NULL;*/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &parent, sizeof(parent));*/
-/*    parent = be64toh(parent);*/
-/*    // No need to un-mix version, we're 0*/
-/**/
-/*    // Return child (a.k.a. next in time) when we find ourselves*/
-/*    read_os(ctx->fd, &increment, sizeof(increment));*/
-/*    increment = be64toh(increment);*/
-/*    if (increment == cursor->increment) {*/
-/*      return kvsm_cursor_load(ctx, child);*/
-/*    }*/
-/**/
-/*    // Go to the parent*/
-/*    child   = current;*/
-/*    current = parent;*/
-/*  }*/
-/**/
-/*  // Not found*/
-/*  return NULL;*/
-/*}*/
-/**/
-/*// Fetches a specific increment, not a specific offset*/
-/*struct kvsm_cursor * kvsm_cursor_fetch(const struct kvsm *ctx, const uint64_t increment) {*/
-/*  if (!ctx) return NULL;*/
-/**/
-/*  PALLOC_OFFSET parent;*/
-/*  PALLOC_OFFSET current = ctx->current_offset;*/
-/*  PALLOC_OFFSET child   = ctx->current_offset;*/
-/*  uint64_t _increment;*/
-/*  uint8_t len8;*/
-/**/
-/*  while(current) {*/
-/*    // Sanity-check version*/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &len8, sizeof(len8));*/
-/*    if (len8 != 0) return NULL;*/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &parent, sizeof(parent));*/
-/*    parent = be64toh(parent);*/
-/*    // No need to un-mix version, we're 0*/
-/*    read_os(ctx->fd, &_increment, sizeof(_increment));*/
-/*    _increment = be64toh(_increment);*/
-/**/
-/*    // Found target increment*/
-/*    if (_increment == increment) {*/
-/*      return kvsm_cursor_load(ctx, current);*/
-/*    }*/
-/**/
-/*    // Found target increment*/
-/*    if (_increment <= increment) {*/
-/*      return kvsm_cursor_load(ctx, child);*/
-/*    }*/
-/**/
-/*    // TODO: make optional*/
-/*    // Return if we're the "oldest"*/
-/*    if (!parent) {*/
-/*      return kvsm_cursor_load(ctx, current);*/
-/*    }*/
-/**/
-/*    // Go to the parent*/
-/*    child   = current;*/
-/*    current = parent;*/
-/*  }*/
-/**/
-/*  // Not found*/
-/*  return NULL;*/
-/*}*/
-/**/
-/*struct kvsm * kvsm_open(const char *filename, const int isBlockDev) {*/
-/*  log_trace("call: kvsm_open(%s,%d)", filename, isBlockDev);*/
-/*  struct kvsm_cursor *cursor = NULL;*/
-/*  PALLOC_FLAGS flags = PALLOC_DEFAULT;*/
-/*  if (!isBlockDev) flags |= PALLOC_DYNAMIC;*/
-/*  struct kvsm *ctx = calloc(1, sizeof(*ctx));*/
-/**/
-/*  if (!ctx) {*/
-/*    log_error("Could not reserve memory for kvsm context");*/
-/*    return NULL;*/
-/*  }*/
-/**/
-/*  ctx->fd = palloc_open(filename, flags);*/
-/*  if (!ctx->fd) {*/
-/*    log_error("Could not open storage medium: %d", filename);*/
-/*    return NULL;*/
-/*  }*/
-/**/
-/*  log_debug("Initializing blob storage");*/
-/*  PALLOC_RESPONSE r = palloc_init(ctx->fd, flags);*/
-/*  if (r != PALLOC_OK) {*/
-/*    log_error("Error during medium initialization", filename);*/
-/*    palloc_close(ctx->fd);*/
-/*    return NULL;*/
-/*  }*/
-/**/
-/*  log_debug("Searching for kv root");*/
-/*  PALLOC_OFFSET off = palloc_next(ctx->fd, 0);*/
-/*  while(off) {*/
-/*    log_trace("Scanning %lld for root", off);*/
-/*    cursor = kvsm_cursor_load(ctx, off);*/
-/*    if (!cursor) {*/
-/*      log_trace("Not supported: %lld", off);*/
-/*      off = palloc_next(ctx->fd, off);*/
-/*      continue;*/
-/*    }*/
-/**/
-/*    log_trace("Loaded tx: %llx, %lld", cursor->offset, cursor->increment);*/
-/*    if (cursor->increment > ctx->current_increment) {*/
-/*      log_trace("Promoted to new root");*/
-/*      ctx->current_increment = cursor->increment;*/
-/*      ctx->current_offset    = off;*/
-/*    }*/
-/**/
-/*    kvsm_cursor_free(cursor);*/
-/*    off = palloc_next(ctx->fd, off);*/
-/*  }*/
-/**/
-/*  log_debug("Detected root: %llx, %d", ctx->current_offset, ctx->current_increment);*/
-/*  return ctx;*/
-/*}*/
-/**/
-/*KVSM_RESPONSE kvsm_close(struct kvsm *ctx) {*/
-/*  if (!ctx) return KVSM_ERROR;*/
-/*  palloc_close(ctx->fd);*/
-/*  free(ctx);*/
-/*  return KVSM_OK;*/
-/*}*/
-/**/
-/*KVSM_RESPONSE kvsm_cursor_free(struct kvsm_cursor *cursor) {*/
-/*  free(cursor);*/
-/*  return KVSM_OK;*/
-/*}*/
-/**/
-/*struct _kvsm_get_response {*/
-/*  const struct buf *key;*/
-/*  struct buf *value;*/
-/*  uint64_t increment;*/
-/*};*/
-/*// DOES support multi-value transactions*/
-/*struct _kvsm_get_response * _kvsm_get(const struct kvsm *ctx, const struct buf *key, bool load_value) {*/
-/*  log_trace("call: kvsm_get(...)");*/
-/**/
-/*  if (key->len >= 32768) {*/
-/*    log_error("key too large");*/
-/*    return NULL;*/
-/*  }*/
-/**/
-/*  uint8_t len8;*/
-/*  uint16_t len16;*/
-/*  uint64_t len64;*/
-/*  PALLOC_OFFSET off = ctx->current_offset;*/
-/*  PALLOC_OFFSET parent;*/
-/*  uint64_t increment;*/
-/*  struct buf k = {};*/
-/*  struct buf *v = NULL;*/
-/*  struct _kvsm_get_response *resp = NULL;*/
-/**/
-/*  while(off) {*/
-/*    log_trace("Checking %lld", off);*/
-/*    seek_os(ctx->fd, off, SEEK_SET);*/
-/*    read_os(ctx->fd, &len8, sizeof(len8));*/
-/*    if (len8 != 0) return NULL;*/
-/**/
-/*    seek_os(ctx->fd, off, SEEK_SET);*/
-/*    read_os(ctx->fd, &parent, sizeof(parent));*/
-/*    parent = be64toh(parent);*/
-/**/
-/*    read_os(ctx->fd, &increment, sizeof(increment));*/
-/*    increment = be64toh(increment);*/
-/**/
-/*    while(true) {*/
-/**/
-/*      // Read key length*/
-/*      read_os(ctx->fd, &len8, sizeof(len8));*/
-/*      if (!len8) break;*/
-/*      len16 = len8 & 127;*/
-/*      if (len8 & 128) {*/
-/*        len16 = len16 << 8;*/
-/*        read_os(ctx->fd, &len8, sizeof(len8));*/
-/*        len16 |= len8;*/
-/*      }*/
-/**/
-/*      // Read key data*/
-/*      k.data = malloc(len16);*/
-/*      k.len  = len16;*/
-/*      k.cap  = len16;*/
-/*      read_os(ctx->fd, k.data, k.len);*/
-/**/
-/*      // Read value length*/
-/*      read_os(ctx->fd, &len64, sizeof(len64));*/
-/*      len64 = be64toh(len64);*/
-/**/
-/*      // Different length = no match*/
-/*      if (k.len != key->len) {*/
-/*        seek_os(ctx->fd, len64, SEEK_CUR);*/
-/*        buf_clear(&k);*/
-/*        continue;*/
-/*      }*/
-/**/
-/*      // Different data = no match*/
-/*      if (memcmp(k.data, key->data, k.len)) {*/
-/*        seek_os(ctx->fd, len64, SEEK_CUR);*/
-/*        buf_clear(&k);*/
-/*        continue;*/
-/*      }*/
-/**/
-/*      // Here = found*/
-/*      buf_clear(&k);*/
-/**/
-/*      // Handle delete marker response*/
-/*      if (!len64) {*/
-/*        return NULL;*/
-/*      }*/
-/**/
-/*      resp = malloc(sizeof(struct _kvsm_get_response));*/
-/*      if (!resp) {*/
-/*        log_error("Error during memory allocation for get return wrapper");*/
-/*        return NULL;*/
-/*      }*/
-/*      resp->increment = increment;*/
-/*      resp->key       = key;*/
-/**/
-/*      if (load_value) {*/
-/*        v = calloc(1, sizeof(struct buf));*/
-/*        if (!v) {*/
-/*          log_error("Error during memory allocation for get return struct");*/
-/*          return NULL;*/
-/*        }*/
-/*        v->len = len64;*/
-/*        v->cap = len64;*/
-/*        v->data = malloc(len64);*/
-/*        if (!v->data) {*/
-/*          free(v);*/
-/*          log_error("Error during memory allocation for get return blob");*/
-/*          return NULL;*/
-/*        }*/
-/**/
-/*        read_os(ctx->fd, v->data, len64);*/
-/*        resp->value = v;*/
-/*      }*/
-/**/
-/*      return resp;*/
-/*    }*/
-/**/
-/*    off = parent;*/
-/*  }*/
-/**/
-/*  // Not found*/
-/*  return NULL;*/
-/*}*/
-/*struct buf  * kvsm_get(const struct kvsm *ctx, const struct buf *key) {*/
-/*  struct _kvsm_get_response *response = _kvsm_get(ctx, key, true);*/
-/*  if (!response) return NULL;*/
-/*  struct buf *value = response->value;*/
-/*  free(response);*/
-/*  return value;*/
-/*}*/
-/**/
-/*// Only gets the increment*/
-/*uint64_t kvsm_get_increment(const struct kvsm *ctx, const struct buf *key) {*/
-/*  struct _kvsm_get_response *response = _kvsm_get(ctx, key, false);*/
-/*  if (!response) return 0;*/
-/*  uint64_t increment = response->increment;*/
-/*  free(response);*/
-/*  return increment;*/
-/*}*/
-/**/
-/*// DOES NOT support multi-value transactions*/
-/*// Does close the list as if it supports them though*/
-/*KVSM_RESPONSE kvsm_set(struct kvsm *ctx, const struct buf *key, const struct buf *value) {*/
-/*  log_trace("call: kvsm_set(...)");*/
-/**/
-/*  if (key->len >= 32768) {*/
-/*    log_error("key too large");*/
-/*    return KVSM_ERROR;*/
-/*  }*/
-/**/
-/*  // Calculate transaction size*/
-/*  size_t tx_size = 0;*/
-/*  tx_size += 8; // version|parent*/
-/*  tx_size += 8; // increment*/
-/*  if (key->len >= 128) {*/
-/*    tx_size += 2;*/
-/*  } else {*/
-/*    tx_size += 1;*/
-/*  }*/
-/*  tx_size += key->len;*/
-/*  tx_size += 8; // value size*/
-/*  tx_size += value->len;*/
-/*  tx_size += 1; // End-of-list*/
-/**/
-/*  log_trace("Reserving %lld bytes", tx_size);*/
-/*  PALLOC_OFFSET offset = palloc(ctx->fd, tx_size);*/
-/*  PALLOC_OFFSET parent = htobe64(ctx->current_offset);*/
-/*  // No need to merge version, we're 0*/
-/*  seek_os(ctx->fd, offset, SEEK_SET);*/
-/*  write_os(ctx->fd, &parent, sizeof(parent));*/
-/*  parent = be64toh(parent);*/
-/**/
-/*  uint64_t increment = htobe64(ctx->current_increment + 1);*/
-/*  write_os(ctx->fd, &increment, sizeof(parent));*/
-/*  increment = be64toh(increment);*/
-/**/
-/*  uint8_t len8;*/
-/*  if (key->len >= 128) {*/
-/*    len8 = 128 | (key->len >> 8);*/
-/*    write_os(ctx->fd, &len8, sizeof(len8));*/
-/*    len8 = key->len & 255;*/
-/*    write_os(ctx->fd, &len8, sizeof(len8));*/
-/*  } else {*/
-/*    len8 = key->len;*/
-/*    write_os(ctx->fd, &len8, sizeof(len8));*/
-/*  }*/
-/**/
-/*  write_os(ctx->fd, key->data, key->len);*/
-/**/
-/*  uint64_t valsize = htobe64(value->len);*/
-/*  write_os(ctx->fd, &valsize, sizeof(valsize));*/
-/*  write_os(ctx->fd, value->data, value->len);*/
-/**/
-/*  len8 = 0;*/
-/*  write_os(ctx->fd, &len8, sizeof(len8));*/
-/**/
-/*  if (increment > ctx->current_increment) {*/
-/*    ctx->current_increment = increment;*/
-/*    ctx->current_offset    = offset;*/
-/*  }*/
-/**/
-/*  return KVSM_OK;*/
-/*}*/
-/**/
-/*// Caution: lazy algorithm*/
-/*// Goes through every "transaction", and discards them if it only contains non-current versions*/
-/*struct kvsm_compact_track {*/
-/*  uint16_t  len;*/
-/*  char     *dat;*/
-/*};*/
-/*KVSM_RESPONSE kvsm_compact(const struct kvsm *ctx) {*/
-/*  PALLOC_OFFSET child = 0;*/
-/*  PALLOC_OFFSET current = ctx->current_offset;*/
-/*  PALLOC_OFFSET parent = 0;*/
-/*  PALLOC_OFFSET tmp    = 0;*/
-/**/
-/*  bool discardable;*/
-/*  uint64_t current_increment;*/
-/**/
-/*  uint8_t len8;*/
-/*  uint16_t len16;*/
-/*  uint64_t len64;*/
-/**/
-/*  struct buf key;*/
-/**/
-/*  while(current) {*/
-/*    discardable = true;*/
-/*    log_trace("Checking 0x%llx for being discardable", current);*/
-/**/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &len8, sizeof(len8));*/
-/*    if (len8 != 0) return KVSM_ERROR; // Only version 0 supported*/
-/**/
-/*    seek_os(ctx->fd, current, SEEK_SET);*/
-/*    read_os(ctx->fd, &parent, sizeof(parent));*/
-/*    parent = be64toh(parent);*/
-/*    // No need to un-mix version, we're 0*/
-/**/
-/*    read_os(ctx->fd, &current_increment, sizeof(current_increment));*/
-/*    current_increment = be64toh(current_increment);*/
-/**/
-/*    while(true) {*/
-/*      log_trace("Cursor: 0x%llx", seek_os(ctx->fd, 0, SEEK_CUR));*/
-/**/
-/*      // Read key length*/
-/*      read_os(ctx->fd, &len8, sizeof(len8));*/
-/*      log_trace("Len: %d", len8);*/
-/*      if (!len8) break; // End of list*/
-/*      len16 = len8 & 127;*/
-/*      if (len8 >= 128) {*/
-/*        len16 = len16 << 8;*/
-/*        read_os(ctx->fd, &len8, sizeof(len8));*/
-/*        len16 |= len8;*/
-/*      }*/
-/*      log_trace("Keylen %d in 0x%llx", len16, current);*/
-/**/
-/*      // Read key data*/
-/*      key.data = malloc(len16);*/
-/*      key.len  = len16;*/
-/*      key.cap  = len16;*/
-/*      read_os(ctx->fd, key.data, key.len);*/
-/**/
-/*      // Read value length*/
-/*      read_os(ctx->fd, &len64, sizeof(len64));*/
-/*      len64 = be64toh(len64);*/
-/**/
-/*      // Save current location, fetching increment moves fd cursor*/
-/*      tmp = seek_os(ctx->fd, 0, SEEK_CUR);*/
-/**/
-/*      // Mark as non-discardable if it's being used for the found key*/
-/*      if (kvsm_get_increment(ctx, &key) == current_increment) {*/
-/*        discardable = false;*/
-/*        seek_os(ctx->fd, tmp, SEEK_SET);*/
-/*        buf_clear(&key);*/
-/*        break;*/
-/*      }*/
-/**/
-/*      // Return to after data to continue checking the list*/
-/*      buf_clear(&key);*/
-/*      seek_os(ctx->fd, tmp+len64, SEEK_SET);*/
-/**/
-/*    }*/
-/**/
-/*    log_trace("status for %llx: %sdiscardable", current, discardable ? "" : "not ");*/
-/**/
-/*    // Go to the next transaction*/
-/*    if (!discardable) {*/
-/*      child   = current;*/
-/*      current = parent;*/
-/*      continue;*/
-/*    }*/
-/**/
-/*    log_debug("Discarding increment %d at %llx", current_increment, current);*/
-/**/
-/*    if (child) {*/
-/*      // Update child to point to our parent*/
-/*      // Sanity check*/
-/*      seek_os(ctx->fd, child, SEEK_SET);*/
-/*      read_os(ctx->fd, &len8, sizeof(len8));*/
-/*      if (len8 != 0) return KVSM_ERROR; // Only version 0 supported, bail*/
-/**/
-/*      seek_os(ctx->fd, child, SEEK_SET);*/
-/*      // No need to mix version, we're 0*/
-/*      parent = htobe64(parent);*/
-/*      write_os(ctx->fd, &parent, sizeof(parent));*/
-/*      parent = be64toh(parent);*/
-/*    } else {*/
-/*      // No child, but we won't remove root, it's always up-to-date*/
-/*    }*/
-/**/
-/*    // Free used space*/
-/*    pfree(ctx->fd, current);*/
-/*    current = parent;*/
-/*    // Don't update child, hasn't changed*/
-/*  }*/
-/**/
-/*  return KVSM_OK;*/
-/*}*/
-/**/
-/*struct buf * kvsm_cursor_serialize(const struct kvsm_cursor *cursor) {*/
-/*  log_trace("call: kvsm_cursor_serialize(%lld)", cursor->increment);*/
-/*  const struct kvsm *ctx = cursor->ctx;*/
-/**/
-/*  uint8_t len8;*/
-/*  uint16_t len16;*/
-/*  uint64_t len64;*/
-/**/
-/*  // Sanity-check the version*/
-/*  seek_os(ctx->fd, cursor->offset, SEEK_SET);*/
-/*  read_os(ctx->fd, &len8, sizeof(len8));*/
-/*  if (len8 != 0) return NULL;*/
-/**/
-/*  struct buf *output = calloc(1, sizeof(struct buf));*/
-/**/
-/*  buf_append_byte(output, 0); // Serialized format 0*/
-/**/
-/*  seek_os(ctx->fd, cursor->offset + sizeof(PALLOC_OFFSET), SEEK_SET);*/
-/*  read_os(ctx->fd, &len64, sizeof(len64));*/
-/*  buf_append(output, &len64, sizeof(len64));*/
-/**/
-/*  while(1) {*/
-/*    read_os(ctx->fd, &len8, sizeof(len8));*/
-/*    buf_append(output, &len8, sizeof(len8));*/
-/*    if (!len8) break;*/
-/**/
-/*    len16 = len8 & 127;*/
-/*    if (len8 & 128) {*/
-/*      len16 = len16 << 8;*/
-/*      read_os(ctx->fd, &len8, sizeof(len8));*/
-/*      buf_append(output, &len8, sizeof(len8));*/
-/*      len16 |= len8;*/
-/*    }*/
-/**/
-/*    if ((output->cap - output->len) < len16) {*/
-/*      output->data = realloc(output->data, output->len + len16);*/
-/*      output->cap  = output->len + len16;*/
-/*    }*/
-/*    read_os(ctx->fd, output->data + output->len, len16);*/
-/*    output->len += len16;*/
-/**/
-/*    read_os(ctx->fd, &len64, sizeof(len64));*/
-/*    buf_append(output, &len64, sizeof(len64));*/
-/*    len64 = be64toh(len64);*/
-/*    if ((output->cap - output->len) < len64) {*/
-/*      output->data = realloc(output->data, output->len + len64);*/
-/*      output->cap  = output->len + len64;*/
-/*    }*/
-/*    read_os(ctx->fd, output->data + output->len, len64);*/
-/*    output->len += len64;*/
-/*  }*/
-/**/
-/*  return output;*/
-/*}*/
-/**/
-/*KVSM_RESPONSE kvsm_cursor_ingest(struct kvsm *ctx, const struct buf *serialized) {*/
-/*  log_trace("call: kvsm_cursor_ingest(...)");*/
-/**/
-/*  if (serialized->len < 1) {*/
-/*    log_error("Invalid length to ingest");*/
-/*    return KVSM_ERROR;*/
-/*  }*/
-/**/
-/*  if (serialized->data[0] != 0) {*/
-/*    log_error("Ingestable has unsupported version");*/
-/*    return KVSM_ERROR;*/
-/*  }*/
-/**/
-/*  uint8_t len8;*/
-/*  uint8_t len64;*/
-/*  uint64_t increment;*/
-/*  memcpy(&increment, &(serialized->data[1]), sizeof(increment));*/
-/*  increment = be64toh(increment);*/
-/**/
-/*  PALLOC_OFFSET child   = 0;*/
-/*  PALLOC_OFFSET current = 0;*/
-/*  PALLOC_OFFSET parent  = 0;*/
-/*  if (increment > ctx->current_increment) {*/
-/*    // Newer than we currently have, dangle at the front*/
-/*    parent = ctx->current_offset;*/
-/*  } else {*/
-/**/
-/*    current = ctx->current_offset;*/
-/*    while(1) {*/
-/*      seek_os(ctx->fd, current, SEEK_SET);*/
-/*      read_os(ctx->fd, &len8, sizeof(len8));*/
-/*      if (len8 != 0) {*/
-/*        log_error("Encountered unsupported transaction version %d at %lld", len8, seek_os(ctx->fd, 0, SEEK_CUR) - 1);*/
-/*        return KVSM_ERROR;*/
-/*      }*/
-/**/
-/*      seek_os(ctx->fd, current, SEEK_SET);*/
-/*      read_os(ctx->fd, &parent, sizeof(parent));*/
-/*      parent = be64toh(parent);*/
-/*      log_trace("Parent of %llx is %llx", current, parent);*/
-/*      read_os(ctx->fd, &len64, sizeof(len64));*/
-/*      len64 = be64toh(len64);*/
-/**/
-/*      // No more parents*/
-/*      // Return to dangle at the end*/
-/*      if (!parent) {*/
-/*        child = current;*/
-/*        break;*/
-/*      }*/
-/**/
-/*      // Found spot to insert between*/
-/*      if (len64 < increment) {*/
-/*        parent = current;*/
-/*        break;*/
-/*      }*/
-/**/
-/*      // Loop to the next parent*/
-/*      child   = current;*/
-/*      current = parent;*/
-/*    }*/
-/*  }*/
-/**/
-/*  // Start actually writing*/
-/*  current = palloc(ctx->fd, serialized->len + sizeof(parent) - 1);*/
-/*  seek_os(ctx->fd, current, SEEK_SET);*/
-/*  // No need to mix version, we're 0*/
-/*  log_debug("Ingesting with parent %llx", parent);*/
-/*  parent = htobe64(parent);*/
-/*  write_os(ctx->fd, &parent, sizeof(parent));*/
-/*  // Write serialized data as-is, it matches our on-disk format*/
-/*  write_os(ctx->fd, serialized->data + 1, serialized->len - 1);*/
-/**/
-/*  // Update child's parent pointer if we got one*/
-/*  log_debug("Ingesting with child %llx", child);*/
-/*  if (child) {*/
-/*    current = htobe64(current);*/
-/*    seek_os(ctx->fd, child, SEEK_SET);*/
-/*    write_os(ctx->fd, &current, sizeof(current));*/
-/*  }*/
-/**/
-/*  // Update root marker if needed*/
-/*  if (increment > ctx->current_increment) {*/
-/*    ctx->current_increment = increment;*/
-/*    ctx->current_offset    = current;*/
-/*  }*/
-/**/
-/*  return KVSM_OK;*/
-/*}*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // copy_file_range
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef _WIN32
+#include <io.h> // _commit
+#endif
+
+// Asynchronous reads go through io_uring where the kernel headers have it,
+// falling back to a thread pool when the kernel refuses it at runtime
+#if defined(__linux__) && !defined(KVSM_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KVSM_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#include "finwo/endian.h"
+#include "finwo/io.h"
+#include "rxi/log.h"
+#include "tidwall/buf.h"
+
+#include "kvsm.h"
+#include "lz.h"
+
+// version + identifier + height
+#define KVSM_HEADER_SIZE (1 + KVSM_ID_LENGTH + sizeof(uint64_t))
+
+// Offset of the entry list, behind the parent list and filter
+#define KVSM_TX_ENTRIES(tx) ((tx)->entries)
+
+// Transaction version bits, describing optional sections
+#define KVSM_VERSION_FILTER    0x01
+#define KVSM_VERSION_SORTED    0x02
+#define KVSM_VERSION_MERGED    0x04
+#define KVSM_VERSION_COMPRESS  0x08
+#define KVSM_VERSION_SUPPORTED (KVSM_VERSION_FILTER | KVSM_VERSION_SORTED | KVSM_VERSION_MERGED | KVSM_VERSION_COMPRESS)
+
+// Serialized transaction versions, entries as stored with the matching blob bits
+#define KVSM_SERIAL_COMPRESS 0x01
+#define KVSM_SERIAL_MERGED   0x02
+
+// With KVSM_VERSION_COMPRESS, the top bit of an entry's value length marks a
+// compressed value: 8 bytes of uncompressed length followed by the codec's
+// output. Serialized format 1 carries such entries as-is.
+#define KVSM_ENTRY_COMPRESSED (1ULL << 63)
+#define KVSM_COMPRESS_HEADER  8
+#define KVSM_COMPRESS_MIN     256
+
+// Blocked bloom filter, ~10 bits per key in 64-bit blocks, 6 bits per key
+#define KVSM_FILTER_BLOCKS(n) (((((uint64_t)(n)) * 10) + 63) / 64)
+#define KVSM_FILTER_SIZE(n)   (4 + (KVSM_FILTER_BLOCKS(n) * sizeof(uint64_t)))
+
+// Key-ordered table of entry offsets, relative to the entry list
+// Only written from this amount of entries, a scan is cheaper below it
+#define KVSM_SORTED_MIN     16
+#define KVSM_SORTED_SIZE(n) (4 + (((uint64_t)(n)) * sizeof(uint64_t)))
+
+// Start of the optional sections' arrays, working back from the entry list
+#define KVSM_TX_SORTED(tx) (KVSM_TX_ENTRIES(tx) - ((tx)->sorted_count * sizeof(uint64_t)))
+#define KVSM_TX_FILTER(tx) (KVSM_TX_ENTRIES(tx) - ((tx)->sorted_count ? KVSM_SORTED_SIZE((tx)->sorted_count) : 0) - ((tx)->filter_blocks * sizeof(uint64_t)))
+
+#define KVSM_KEY_MAX 32767
+
+// Non-transaction blobs, marked by their first byte
+#define KVSM_BLOB_ANCHOR     0x80
+#define KVSM_BLOB_CHECKPOINT 0x81
+#define KVSM_BLOB_HEADS      0x82
+
+// type + checksum + checkpoint offset + head count + heads
+#define KVSM_ANCHOR_HEADS 32
+#define KVSM_ANCHOR_SIZE  (1 + 8 + 8 + 4 + (KVSM_ANCHOR_HEADS * sizeof(PALLOC_OFFSET)))
+
+// Marks the medium as opened in the anchor's head count, cleared on close
+#define KVSM_ANCHOR_LIVE 0x80000000
+
+// type + checksum + head count, heads that didn't fit the anchor follow
+#define KVSM_HEADS_HEADER (1 + 8 + 4)
+
+// type + payload length + checksum
+#define KVSM_CHECKPOINT_HEADER   (1 + 8 + 8)
+#define KVSM_CHECKPOINT_INTERVAL 1024
+
+// Default memory budget for the keys seen during compaction, and the amount
+// of partitions after which the budget is no longer enforced
+#define KVSM_COMPACT_MEMORY     (64 * 1024 * 1024)
+#define KVSM_COMPACT_PARTITIONS 65536
+
+// Transactions and bytes read per background compaction step, and seconds
+// between checks
+#define KVSM_COMPACT_STEP  64
+#define KVSM_COMPACT_BYTES (64 * 1024)
+#define KVSM_COMPACT_WAIT  1
+
+// Default group commit window, in milliseconds and bytes written
+#define KVSM_SYNC_INTERVAL 10
+#define KVSM_SYNC_BYTES    (1024 * 1024)
+
+// Levels of the index's key order, each holding about a quarter of the one
+// below it
+#define KVSM_SKIP_LEVELS 16
+
+// Unit of the read cache, reads spanning more bypass it
+#define KVSM_CACHE_BLOCK 4096
+
+#define KVSM_CHECKPOINT_KEYS     1
+#define KVSM_CHECKPOINT_IDS      2
+#define KVSM_CHECKPOINT_COMPACT  4
+#define KVSM_CHECKPOINT_USAGE    8
+
+#define KVSM_TXINFO_REFERENCED 1
+
+// Chunk size when values can not be streamed by the kernel
+#define KVSM_STREAM_CHUNK 65536
+
+// Default requests in flight per aio descriptor, the most worker threads
+// backing one, and the most one io_uring read asks for at once
+#define KVSM_AIO_DEPTH   64
+#define KVSM_AIO_THREADS 8
+#define KVSM_AIO_CHUNK   (1UL << 30)
+
+#define KVSM_AIO_GET    1
+#define KVSM_AIO_COMMIT 2
+#define KVSM_AIO_FLUSH  3
+
+struct kvsm_index_entry {
+  struct buf    key;
+  uint64_t      hash;
+  PALLOC_OFFSET offset;
+  uint64_t      height;
+  PALLOC_OFFSET value;
+  uint64_t      length;
+  bool          compressed;
+};
+
+// Key order over the index for scans, nodes borrow the index's key memory
+struct _kvsm_skipnode {
+  const char            *key;
+  size_t                 len;
+  uint64_t               hash;
+  struct _kvsm_skipnode *next[];
+};
+
+struct kvsm_index {
+  struct kvsm_index_entry *entry;
+  size_t                   count;
+  size_t                   cap;
+  struct _kvsm_skipnode   *order[KVSM_SKIP_LEVELS];
+  uint64_t                 seed;
+};
+
+struct kvsm_txinfo {
+  PALLOC_OFFSET offset;
+  uint64_t      height;
+  char          id[KVSM_ID_LENGTH];
+  int           flags;
+};
+
+struct kvsm_txtable {
+  struct kvsm_txinfo *tx;
+  size_t              count;
+  size_t              cap;
+};
+
+struct kvsm_idinfo {
+  char          id[KVSM_ID_LENGTH];
+  PALLOC_OFFSET offset;
+};
+
+struct kvsm_idtable {
+  struct kvsm_idinfo *tx;
+  size_t              count;
+  size_t              cap;
+};
+
+// Transactions in (height, identifier) order, removed ones are left as holes
+// (offset 0) that keep their position until the array is packed
+struct kvsm_txorder {
+  struct kvsm_txinfo *tx;
+  size_t              count; // Slots in use, holes included
+  size_t              holes;
+  size_t              cap;
+};
+
+// Mappings are only ever added, so views handed out stay valid until close
+struct kvsm_map {
+  char           *data;
+  uint64_t        size; // Known medium size, the readable part of the mapping
+  uint64_t        len;  // Mapped length, may extend beyond the medium
+  char          **retired;
+  size_t         *retired_len;
+  size_t          retired_count;
+#ifndef _WIN32
+  pthread_mutex_t lock; // Guards growing the mapping
+#endif
+};
+
+struct _kvsm_entry {
+  uint16_t      keylen;
+  PALLOC_OFFSET key;
+  uint64_t      height;
+  uint64_t      length; // As stored
+  PALLOC_OFFSET value;
+  PALLOC_OFFSET next;
+  bool          compressed;
+};
+
+// Set of keys seen during compaction, keys are stored back-to-back in an arena
+struct _kvsm_keyset_slot {
+  uint64_t hash;
+  size_t   pos;
+  size_t   len;
+  bool     used;
+};
+
+struct _kvsm_keyset {
+  struct buf                arena;
+  struct _kvsm_keyset_slot *slot;
+  size_t                    count;
+  size_t                    cap;
+};
+
+// Children of each transaction, discovered while compaction walks the history
+struct _kvsm_children_slot {
+  PALLOC_OFFSET  parent;
+  PALLOC_OFFSET *child;
+  size_t         count;
+};
+
+struct _kvsm_children {
+  struct _kvsm_children_slot *slot;
+  size_t                      count;
+  size_t                      cap;
+};
+
+// State of an incremental compaction round
+struct kvsm_compaction {
+  struct kvsm_txinfo   *node; // Snapshot of the transactions, newest first
+  bool                 *live;
+  uint64_t             *dead; // Superseded entry bytes per transaction
+  uint64_t              kept; // Superseded entry bytes not reclaimed
+  uint64_t              pinned; // Part of kept held back for snapshots
+  size_t                count;
+  size_t                cap;
+  size_t                pos;
+  bool                  filling; // Snapshot taken below fill_height/fill_id
+  uint64_t              fill_height;
+  char                  fill_id[KVSM_ID_LENGTH];
+  struct kvsm_transaction *tx; // Transaction at pos, visited across steps
+  PALLOC_OFFSET         entry; // It's next entry to visit
+  uint64_t              size; // It's entry bytes visited so far
+  bool                  finished; // Round done, only the checkpoint is left
+  uint64_t              partitions;
+  uint64_t              partition;
+  struct _kvsm_keyset   seen;
+  struct _kvsm_children children;
+  bool                  cursor; // Last transaction visited by the discarding pass
+  uint64_t              cursor_height;
+  char                  cursor_id[KVSM_ID_LENGTH];
+};
+
+struct _kvsm_get_response {
+  PALLOC_OFFSET offset;
+  uint64_t      height;
+  PALLOC_OFFSET value;
+  uint64_t      length;
+  bool          compressed;
+};
+
+#ifndef _WIN32
+// Background compaction, it's mutex only guards the wake-up condition
+struct kvsm_worker {
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+  bool            stop;
+  double          ratio;
+};
+#endif
+
+// Transaction written but not flushed yet, kept for the durability callback
+struct kvsm_sync_item {
+  char     id[KVSM_ID_LENGTH];
+  uint64_t height;
+};
+
+// Durability state, only present with KVSM_SYNC or KVSM_GROUP
+struct kvsm_sync {
+  struct kvsm_sync_item *pending;
+  size_t                 count;
+  size_t                 cap;
+  uint64_t               bytes; // Written since the last flush
+#ifndef _WIN32
+  pthread_mutex_t        lock;
+  pthread_cond_t         wake;
+  pthread_t              thread;
+  bool                   running;
+  bool                   idle;
+  bool                   stop;
+#endif
+};
+
+// Cached block of the medium, `length` is short at the end of the medium
+struct kvsm_cache_slot {
+  PALLOC_OFFSET block;
+  uint32_t      length;
+  int32_t       next; // Chain within the bucket
+  bool          used;
+  bool          referenced;
+};
+
+// Read cache, evicting with CLOCK. Blocks are dropped whenever they're
+// written to, so it never holds anything the medium doesn't
+struct kvsm_cache {
+  struct kvsm_cache_slot *slot;
+  char                   *data;
+  int32_t                *bucket;
+  size_t                  count;
+  size_t                  used;
+  size_t                  mask;
+  size_t                  hand;
+  uint64_t                hits;
+  uint64_t                misses;
+  uint64_t                evictions;
+#ifndef _WIN32
+  pthread_mutex_t         lock; // Readers share the descriptor
+#endif
+};
+
+#ifndef _WIN32
+// Guards the in-memory state, readers share it while writers are exclusive
+// A writer may re-enter, like kvsm_set committing a batch or a commit
+// loading a transaction
+struct kvsm_lock {
+  pthread_rwlock_t rw;
+  pthread_t        owner;
+  bool             owned;
+  int              depth;
+};
+
+static bool _kvsm_lock_owned(struct kvsm_lock *lock) {
+  pthread_t owner;
+  if (!__atomic_load_n(&(lock->owned), __ATOMIC_ACQUIRE)) return false;
+  __atomic_load(&(lock->owner), &owner, __ATOMIC_RELAXED);
+  return pthread_equal(owner, pthread_self());
+}
+#endif
+
+// Exclusive, for anything that changes the medium or in-memory state
+static void _kvsm_lock(const struct kvsm *ctx) {
+#ifndef _WIN32
+  struct kvsm_lock *lock = ctx ? ctx->lock : NULL;
+  pthread_t self = pthread_self();
+  if (!lock) return;
+  if (_kvsm_lock_owned(lock)) {
+    lock->depth++;
+    return;
+  }
+  pthread_rwlock_wrlock(&(lock->rw));
+  __atomic_store(&(lock->owner), &self, __ATOMIC_RELAXED);
+  __atomic_store_n(&(lock->owned), true, __ATOMIC_RELEASE);
+  lock->depth = 1;
+#endif
+}
+
+// Shared, read paths must not nest it outside of a writer
+static void _kvsm_lock_read(const struct kvsm *ctx) {
+#ifndef _WIN32
+  struct kvsm_lock *lock = ctx ? ctx->lock : NULL;
+  if (!lock) return;
+  if (_kvsm_lock_owned(lock)) {
+    lock->depth++;
+    return;
+  }
+  pthread_rwlock_rdlock(&(lock->rw));
+#endif
+}
+
+static void _kvsm_unlock(const struct kvsm *ctx) {
+#ifndef _WIN32
+  struct kvsm_lock *lock = ctx ? ctx->lock : NULL;
+  if (!lock) return;
+  if (_kvsm_lock_owned(lock)) {
+    if (--lock->depth) return;
+    __atomic_store_n(&(lock->owned), false, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&(lock->rw));
+#endif
+}
+
+// Whether enough was superseded since the last compaction round
+static bool _kvsm_compact_due(const struct kvsm *ctx) {
+#ifndef _WIN32
+  if (!ctx->worker) return false;
+  if (ctx->bytes_dead <= ctx->bytes_kept) return false;
+  return (ctx->bytes_dead - ctx->bytes_kept) >= (ctx->worker->ratio * ctx->bytes_total);
+#else
+  return false;
+#endif
+}
+
+// Lets the background compaction know it may have work
+static void _kvsm_compact_wake(const struct kvsm *ctx) {
+#ifndef _WIN32
+  if (!_kvsm_compact_due(ctx)) return;
+  pthread_mutex_lock(&(ctx->worker->lock));
+  pthread_cond_signal(&(ctx->worker->wake));
+  pthread_mutex_unlock(&(ctx->worker->lock));
+#endif
+}
+
+static void _kvsm_sync_lock(struct kvsm_sync *sync) {
+#ifndef _WIN32
+  pthread_mutex_lock(&(sync->lock));
+#endif
+}
+
+static void _kvsm_sync_unlock(struct kvsm_sync *sync) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&(sync->lock));
+#endif
+}
+
+static KVSM_RESPONSE _kvsm_fsync(const struct kvsm *ctx) {
+#ifdef _WIN32
+  if (_commit(ctx->fd)) {
+#else
+  if (fsync(ctx->fd)) {
+#endif
+    log_error("Could not flush medium to stable storage");
+    return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+// Flushes the medium, then reports everything written before it as durable
+static KVSM_RESPONSE _kvsm_sync_flush(struct kvsm *ctx) {
+  struct kvsm_sync *sync = ctx->sync;
+  struct kvsm_sync_item *pending;
+  struct buf id = { .len = KVSM_ID_LENGTH, .cap = KVSM_ID_LENGTH };
+  size_t count, i;
+
+  // Take the list, commits may continue while we flush
+  _kvsm_sync_lock(sync);
+  pending       = sync->pending;
+  count         = sync->count;
+  sync->pending = NULL;
+  sync->count   = 0;
+  sync->cap     = 0;
+  sync->bytes   = 0;
+  _kvsm_sync_unlock(sync);
+
+  if (_kvsm_fsync(ctx) != KVSM_OK) {
+    free(pending);
+    return KVSM_ERROR;
+  }
+  for( i = 0 ; ctx->sync_callback && (i < count) ; i++ ) {
+    id.data = pending[i].id;
+    ctx->sync_callback(ctx, &id, pending[i].height, ctx->sync_udata);
+  }
+  free(pending);
+  return KVSM_OK;
+}
+
+// Remembers a written transaction until the next flush
+static void _kvsm_sync_queue(struct kvsm *ctx, const char *id, uint64_t height, uint64_t bytes) {
+  struct kvsm_sync *sync = ctx->sync;
+  struct kvsm_sync_item *pending;
+  size_t cap;
+
+  if (!sync) return;
+  _kvsm_sync_lock(sync);
+  sync->bytes += bytes;
+  if (ctx->sync_callback) {
+    if (sync->count == sync->cap) {
+      cap     = sync->cap ? sync->cap * 2 : 64;
+      pending = realloc(sync->pending, cap * sizeof(struct kvsm_sync_item));
+      if (!pending) {
+        log_warn("Could not remember transaction for the durability callback");
+        _kvsm_sync_unlock(sync);
+        return;
+      }
+      sync->pending = pending;
+      sync->cap     = cap;
+    }
+    memcpy(sync->pending[sync->count].id, id, KVSM_ID_LENGTH);
+    sync->pending[sync->count].height = height;
+    sync->count++;
+  }
+  _kvsm_sync_unlock(sync);
+}
+
+#ifndef _WIN32
+// Waits for the first write, then gathers writes for one window and flushes
+static void * _kvsm_sync_run(void *arg) {
+  struct kvsm *ctx = arg;
+  struct kvsm_sync *sync = ctx->sync;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&(sync->lock));
+  while((!sync->stop) || sync->bytes) {
+    if (!sync->bytes) {
+      sync->idle = true;
+      pthread_cond_wait(&(sync->wake), &(sync->lock));
+      sync->idle = false;
+      continue;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += ctx->sync_interval / 1000;
+    deadline.tv_nsec += (ctx->sync_interval % 1000) * 1000000;
+    deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while((!sync->stop) && (sync->bytes < ctx->sync_bytes)) {
+      if (pthread_cond_timedwait(&(sync->wake), &(sync->lock), &deadline) == ETIMEDOUT) break;
+    }
+
+    pthread_mutex_unlock(&(sync->lock));
+    if (_kvsm_sync_flush(ctx) != KVSM_OK) {
+      log_warn("Group commit could not flush the medium");
+    }
+    pthread_mutex_lock(&(sync->lock));
+  }
+  pthread_mutex_unlock(&(sync->lock));
+
+  return NULL;
+}
+#endif
+
+// Called once a commit or ingest is done writing
+static void _kvsm_sync_commit(struct kvsm *ctx) {
+  struct kvsm_sync *sync = ctx->sync;
+  if (!sync) return;
+
+#ifndef _WIN32
+  // Started on the first write, so settings changed after opening are seen
+  if ((ctx->flags & KVSM_GROUP) && !sync->running) {
+    sync->running = !pthread_create(&(sync->thread), NULL, _kvsm_sync_run, ctx);
+    if (!sync->running) log_warn("Could not start group commit, flushing every commit");
+  }
+  if (sync->running) {
+    pthread_mutex_lock(&(sync->lock));
+    if (sync->idle || (sync->bytes >= ctx->sync_bytes)) pthread_cond_signal(&(sync->wake));
+    pthread_mutex_unlock(&(sync->lock));
+    return;
+  }
+#endif
+
+  if (_kvsm_sync_flush(ctx) != KVSM_OK) {
+    log_warn("Could not flush transaction to stable storage");
+  }
+}
+
+// Flushes whatever is left and stops the group commit thread
+static void _kvsm_sync_free(struct kvsm *ctx) {
+  struct kvsm_sync *sync = ctx->sync;
+  if (!sync) return;
+#ifndef _WIN32
+  if (sync->running) {
+    pthread_mutex_lock(&(sync->lock));
+    sync->stop = true;
+    pthread_cond_signal(&(sync->wake));
+    pthread_mutex_unlock(&(sync->lock));
+    pthread_join(sync->thread, NULL);
+  }
+#endif
+  if (sync->bytes) _kvsm_sync_flush(ctx);
+#ifndef _WIN32
+  pthread_cond_destroy(&(sync->wake));
+  pthread_mutex_destroy(&(sync->lock));
+#endif
+  free(sync->pending);
+  free(sync);
+  ctx->sync = NULL;
+}
+
+#ifndef _WIN32
+static void _kvsm_map_free(struct kvsm_map *map) {
+  size_t i;
+  if (!map) return;
+  for( i = 0 ; i < map->retired_count ; i++ ) {
+    munmap(map->retired[i], map->retired_len[i]);
+  }
+  if (map->data) munmap(map->data, map->len);
+  pthread_mutex_destroy(&(map->lock));
+  free(map->retired);
+  free(map->retired_len);
+  free(map);
+}
+
+// Returns a pointer into the mapping, growing it if the medium did
+// Readers race for the growth under the map's mutex. Mappings are never
+// unmapped before close, so any published data pointer covers at least the
+// published size
+static const char * _kvsm_map_ptr(const struct kvsm *ctx, PALLOC_OFFSET offset, size_t len) {
+  struct kvsm_map *map = ctx->map;
+  uint64_t size, mlen;
+  const char *ptr = NULL;
+  char **retired;
+  size_t *retired_len;
+  off_t end;
+  char *data;
+
+  if ((offset + len) <= __atomic_load_n(&(map->size), __ATOMIC_ACQUIRE)) {
+    return __atomic_load_n(&(map->data), __ATOMIC_ACQUIRE) + offset;
+  }
+
+  pthread_mutex_lock(&(map->lock));
+  if ((offset + len) <= map->size) {
+    ptr = map->data + offset;
+    goto done;
+  }
+
+  // Works for block devices too, where stat reports no size
+  end = lseek(ctx->fd, 0, SEEK_END);
+  if (end < 0) goto done;
+  size = end;
+  if ((offset + len) > size) goto done;
+
+  // Map in powers of 2 ahead of the medium, keeping the amount of remaps low
+  if (size > map->len) {
+    mlen = map->len ? map->len : 65536;
+    while(mlen < size) mlen *= 2;
+    data = mmap(NULL, mlen, PROT_READ, MAP_SHARED, ctx->fd, 0);
+    if (data == MAP_FAILED) {
+      log_error("Could not map medium");
+      goto done;
+    }
+    if (map->data) {
+      retired     = realloc(map->retired, (map->retired_count + 1) * sizeof(char *));
+      retired_len = retired ? realloc(map->retired_len, (map->retired_count + 1) * sizeof(size_t)) : NULL;
+      if (retired) map->retired = retired;
+      if (retired_len) map->retired_len = retired_len;
+      if ((!retired) || (!retired_len)) {
+        log_error("Could not reserve memory for medium mapping");
+        munmap(data, mlen);
+        goto done;
+      }
+      map->retired[map->retired_count]     = map->data;
+      map->retired_len[map->retired_count] = map->len;
+      map->retired_count++;
+    }
+    __atomic_store_n(&(map->data), data, __ATOMIC_RELEASE);
+    map->len = mlen;
+  }
+
+  __atomic_store_n(&(map->size), size, __ATOMIC_RELEASE);
+  ptr = map->data + offset;
+
+done:
+  pthread_mutex_unlock(&(map->lock));
+  return ptr;
+}
+#endif
+
+// Positioned where the platform allows, so readers don't share a file position
+// Returns the amount of bytes read, short at the end of the medium
+static ssize_t _kvsm_pread(const struct kvsm *ctx, PALLOC_OFFSET offset, void *data, size_t len) {
+#ifdef _WIN32
+  seek_os(ctx->fd, offset, SEEK_SET);
+  return read_os(ctx->fd, data, len);
+#else
+  size_t done = 0;
+  ssize_t n;
+  while(done < len) {
+    n = pread(ctx->fd, ((char *)data) + done, len - done, offset + done);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n < 0) return -1;
+    if (!n) break;
+    done += n;
+  }
+  return done;
+#endif
+}
+
+// splitmix64 finalizer, spreads offsets over the table
+static uint64_t _kvsm_mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static void _kvsm_cache_free(struct kvsm_cache *cache) {
+  if (!cache) return;
+#ifndef _WIN32
+  pthread_mutex_destroy(&(cache->lock));
+#endif
+  free(cache->slot);
+  free(cache->data);
+  free(cache->bucket);
+  free(cache);
+}
+
+static struct kvsm_cache_slot * _kvsm_cache_find(struct kvsm_cache *cache, PALLOC_OFFSET block) {
+  int32_t i = cache->bucket[_kvsm_mix(block) & cache->mask];
+  while(i >= 0) {
+    if (cache->slot[i].block == block) return &(cache->slot[i]);
+    i = cache->slot[i].next;
+  }
+  return NULL;
+}
+
+static void _kvsm_cache_remove(struct kvsm_cache *cache, struct kvsm_cache_slot *slot) {
+  int32_t *link = &(cache->bucket[_kvsm_mix(slot->block) & cache->mask]);
+  while(*link >= 0) {
+    if (&(cache->slot[*link]) == slot) {
+      *link = slot->next;
+      break;
+    }
+    link = &(cache->slot[*link].next);
+  }
+  slot->used       = false;
+  slot->referenced = false;
+  cache->used--;
+}
+
+// Takes the first slot the clock hand finds unreferenced
+static struct kvsm_cache_slot * _kvsm_cache_claim(struct kvsm_cache *cache, PALLOC_OFFSET block) {
+  struct kvsm_cache_slot *slot;
+  int32_t *bucket;
+  while(1) {
+    slot        = &(cache->slot[cache->hand]);
+    cache->hand = (cache->hand + 1) % cache->count;
+    if (!slot->used) break;
+    if (!slot->referenced) {
+      _kvsm_cache_remove(cache, slot);
+      cache->evictions++;
+      break;
+    }
+    slot->referenced = false;
+  }
+  bucket      = &(cache->bucket[_kvsm_mix(block) & cache->mask]);
+  slot->block = block;
+  slot->used  = true;
+  slot->next  = *bucket;
+  *bucket     = slot - cache->slot;
+  cache->used++;
+  return slot;
+}
+
+static void _kvsm_cache_lock(struct kvsm_cache *cache) {
+#ifndef _WIN32
+  pthread_mutex_lock(&(cache->lock));
+#endif
+}
+
+static void _kvsm_cache_unlock(struct kvsm_cache *cache) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&(cache->lock));
+#endif
+}
+
+// Copies part of a single block, reading the whole block on a miss
+// The medium is read outside of the cache's mutex, writers are excluded by
+// the descriptor's lock, so concurrent misses read the same bytes
+static KVSM_RESPONSE _kvsm_cache_copy(const struct kvsm *ctx, PALLOC_OFFSET block, size_t skip, void *data, size_t len) {
+  struct kvsm_cache *cache = ctx->cache;
+  struct kvsm_cache_slot *slot;
+  char buffer[KVSM_CACHE_BLOCK];
+  ssize_t n;
+
+  _kvsm_cache_lock(cache);
+  slot = _kvsm_cache_find(cache, block);
+  if (slot && ((skip + len) <= slot->length)) {
+    memcpy(data, cache->data + ((slot - cache->slot) * KVSM_CACHE_BLOCK) + skip, len);
+    slot->referenced = true;
+    cache->hits++;
+    _kvsm_cache_unlock(cache);
+    return KVSM_OK;
+  }
+  cache->misses++;
+  _kvsm_cache_unlock(cache);
+
+  n = _kvsm_pread(ctx, block * KVSM_CACHE_BLOCK, buffer, KVSM_CACHE_BLOCK);
+  if ((n < 0) || ((skip + len) > (size_t)n)) return KVSM_ERROR;
+  memcpy(data, buffer + skip, len);
+
+  _kvsm_cache_lock(cache);
+  slot = _kvsm_cache_find(cache, block);
+  if (!slot) slot = _kvsm_cache_claim(cache, block);
+  memcpy(cache->data + ((slot - cache->slot) * KVSM_CACHE_BLOCK), buffer, n);
+  slot->length = n;
+  _kvsm_cache_unlock(cache);
+  return KVSM_OK;
+}
+
+// Drops every cached block overlapping the range
+static void _kvsm_cache_invalidate(const struct kvsm *ctx, PALLOC_OFFSET offset, size_t len) {
+  struct kvsm_cache *cache = ctx->cache;
+  struct kvsm_cache_slot *slot;
+  PALLOC_OFFSET first, last, block;
+  size_t i;
+  if (!cache || !len) return;
+  first = offset / KVSM_CACHE_BLOCK;
+  last  = (offset + len - 1) / KVSM_CACHE_BLOCK;
+  _kvsm_cache_lock(cache);
+  if ((last - first) >= cache->count) {
+    for( i = 0 ; i < cache->count ; i++ ) {
+      slot = &(cache->slot[i]);
+      if (slot->used && (slot->block >= first) && (slot->block <= last)) _kvsm_cache_remove(cache, slot);
+    }
+  } else {
+    for( block = first ; block <= last ; block++ ) {
+      if ((slot = _kvsm_cache_find(cache, block))) _kvsm_cache_remove(cache, slot);
+    }
+  }
+  _kvsm_cache_unlock(cache);
+}
+
+// Reads straight from the medium, bypassing the cache
+static KVSM_RESPONSE _kvsm_read_medium(const struct kvsm *ctx, PALLOC_OFFSET offset, void *data, size_t len) {
+  if (!len) return KVSM_OK;
+#ifndef _WIN32
+  if (ctx->map) {
+    const char *ptr = _kvsm_map_ptr(ctx, offset, len);
+    if (!ptr) return KVSM_ERROR;
+    memcpy(data, ptr, len);
+    return KVSM_OK;
+  }
+#endif
+  if (_kvsm_pread(ctx, offset, data, len) != (ssize_t)len) return KVSM_ERROR;
+  return KVSM_OK;
+}
+
+// Served from the cache when there's one, unless the read spans too much
+static KVSM_RESPONSE _kvsm_read(const struct kvsm *ctx, PALLOC_OFFSET offset, void *data, size_t len) {
+  PALLOC_OFFSET block;
+  size_t skip, part;
+  if (!len) return KVSM_OK;
+  if ((!ctx->cache) || ctx->map || (len > KVSM_CACHE_BLOCK)) return _kvsm_read_medium(ctx, offset, data, len);
+  block = offset / KVSM_CACHE_BLOCK;
+  skip  = offset % KVSM_CACHE_BLOCK;
+  while(len) {
+    part = KVSM_CACHE_BLOCK - skip;
+    if (part > len) part = len;
+    if (_kvsm_cache_copy(ctx, block, skip, data, part) != KVSM_OK) return KVSM_ERROR;
+    data = ((char *)data) + part;
+    len -= part;
+    skip = 0;
+    block++;
+  }
+  return KVSM_OK;
+}
+
+// Values only pass through the cache when asked for
+static KVSM_RESPONSE _kvsm_read_value(const struct kvsm *ctx, PALLOC_OFFSET offset, void *data, size_t len) {
+  if (!ctx->cache_values) return _kvsm_read_medium(ctx, offset, data, len);
+  return _kvsm_read(ctx, offset, data, len);
+}
+
+// Positioned where the platform allows, so a write is a single syscall
+static KVSM_RESPONSE _kvsm_write(const struct kvsm *ctx, PALLOC_OFFSET offset, const void *data, size_t len) {
+  if (!len) return KVSM_OK;
+  _kvsm_cache_invalidate(ctx, offset, len);
+#ifdef _WIN32
+  seek_os(ctx->fd, offset, SEEK_SET);
+  if (write_os(ctx->fd, data, len) != len) return KVSM_ERROR;
+#else
+  ssize_t n;
+  while(len) {
+    n = pwrite(ctx->fd, data, len, offset);
+    if (n <= 0) return KVSM_ERROR;
+    data    = ((const char *)data) + n;
+    offset += n;
+    len    -= n;
+  }
+#endif
+  return KVSM_OK;
+}
+
+// splitmix64, seeded once during open
+static uint64_t _kvsm_random(struct kvsm *ctx) {
+  uint64_t z = (ctx->seed += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static void _kvsm_random_id(struct kvsm *ctx, char *id) {
+  uint64_t r;
+  int i;
+  for( i = 0 ; i < KVSM_ID_LENGTH ; i += sizeof(r) ) {
+    r = _kvsm_random(ctx);
+    memcpy(id + i, &r, (KVSM_ID_LENGTH - i) < sizeof(r) ? (KVSM_ID_LENGTH - i) : sizeof(r));
+  }
+}
+
+// FNV-1a
+static uint64_t _kvsm_hash(const char *data, size_t len) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t i;
+  for( i = 0 ; i < len ; i++ ) {
+    hash ^= (uint8_t)data[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+// Filter position of a key, derived from the key's hash
+static uint64_t _kvsm_filter_mask(uint64_t hash, uint32_t blocks, uint32_t *block) {
+  uint64_t mask = 0;
+  int i;
+  hash   = _kvsm_mix(hash);
+  *block = (hash >> 36) % blocks;
+  for( i = 0 ; i < 6 ; i++ ) {
+    mask |= 1ULL << ((hash >> (i * 6)) & 63);
+  }
+  return mask;
+}
+
+// Writes the filter covering the given key hashes, returns it's size
+static size_t _kvsm_filter_write(char *output, const uint64_t *hash, size_t count) {
+  uint32_t blocks = KVSM_FILTER_BLOCKS(count);
+  uint32_t block;
+  uint64_t bits, current;
+  size_t i;
+
+  blocks = htobe32(blocks);
+  memcpy(output, &blocks, sizeof(blocks));
+  blocks = be32toh(blocks);
+  output += sizeof(blocks);
+  memset(output, 0, blocks * sizeof(uint64_t));
+  for( i = 0 ; i < count ; i++ ) {
+    bits = _kvsm_filter_mask(hash[i], blocks, &block);
+    memcpy(&current, output + (block * sizeof(uint64_t)), sizeof(current));
+    bits = htobe64(bits) | current;
+    memcpy(output + (block * sizeof(uint64_t)), &bits, sizeof(bits));
+  }
+  return KVSM_FILTER_SIZE(count);
+}
+
+// Writes the ordered offset table, returns it's size
+static size_t _kvsm_sorted_write(char *output, const uint64_t *offset, uint32_t count) {
+  uint64_t be64;
+  uint32_t be32;
+  uint32_t i;
+  be32 = htobe32(count);
+  memcpy(output, &be32, sizeof(be32));
+  output += sizeof(be32);
+  for( i = 0 ; i < count ; i++ ) {
+    be64 = htobe64(offset[i]);
+    memcpy(output + (i * sizeof(be64)), &be64, sizeof(be64));
+  }
+  return KVSM_SORTED_SIZE(count);
+}
+
+// Byte-wise key order, shorter keys first on a shared prefix
+static int _kvsm_key_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  int r = memcmp(a, b, (alen < blen) ? alen : blen);
+  if (r) return r;
+  if (alen < blen) return -1;
+  if (alen > blen) return  1;
+  return 0;
+}
+
+static void _kvsm_append64(struct buf *output, uint64_t value) {
+  value = htobe64(value);
+  buf_append(output, (char *)&value, sizeof(value));
+}
+
+static void _kvsm_txtable_free(struct kvsm_txtable *table) {
+  if (!table) return;
+  free(table->tx);
+  free(table);
+}
+
+static struct kvsm_txinfo * _kvsm_txtable_find(const struct kvsm_txtable *table, PALLOC_OFFSET offset) {
+  size_t i;
+  if (!table->cap) return NULL;
+  for( i = _kvsm_mix(offset) & (table->cap - 1) ; table->tx[i].offset ; i = (i + 1) & (table->cap - 1) ) {
+    if (table->tx[i].offset == offset) return &(table->tx[i]);
+  }
+  return NULL;
+}
+
+static struct kvsm_txinfo * _kvsm_txtable_put(struct kvsm_txtable *table, PALLOC_OFFSET offset, uint64_t height) {
+  struct kvsm_txinfo *found = _kvsm_txtable_find(table, offset);
+  struct kvsm_txinfo *entries;
+  size_t cap, i, j;
+
+  if (found) {
+    found->height = height;
+    return found;
+  }
+
+  // Keep the load factor below 50%
+  if ((table->count + 1) * 2 > table->cap) {
+    cap     = table->cap ? table->cap * 2 : 1024;
+    entries = calloc(cap, sizeof(struct kvsm_txinfo));
+    if (!entries) {
+      log_error("Could not reserve memory for transaction table");
+      return NULL;
+    }
+    for( i = 0 ; i < table->cap ; i++ ) {
+      if (!table->tx[i].offset) continue;
+      for( j = _kvsm_mix(table->tx[i].offset) & (cap - 1) ; entries[j].offset ; j = (j + 1) & (cap - 1) );
+      entries[j] = table->tx[i];
+    }
+    free(table->tx);
+    table->tx  = entries;
+    table->cap = cap;
+  }
+
+  for( i = _kvsm_mix(offset) & (table->cap - 1) ; table->tx[i].offset ; i = (i + 1) & (table->cap - 1) );
+  table->tx[i].offset = offset;
+  table->tx[i].height = height;
+  table->tx[i].flags  = 0;
+  table->count++;
+  return &(table->tx[i]);
+}
+
+// Backward-shift deletion, keeps probe sequences intact without tombstones
+static void _kvsm_txtable_del(struct kvsm_txtable *table, PALLOC_OFFSET offset) {
+  struct kvsm_txinfo *found = _kvsm_txtable_find(table, offset);
+  size_t mask = table->cap - 1;
+  size_t i, j, k;
+  if (!found) return;
+
+  i = found - table->tx;
+  j = i;
+  while(1) {
+    j = (j + 1) & mask;
+    if (!table->tx[j].offset) break;
+    k = _kvsm_mix(table->tx[j].offset) & mask;
+    if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+    table->tx[i] = table->tx[j];
+    i = j;
+  }
+  table->tx[i].offset = 0;
+  table->count--;
+}
+
+// Identifiers are random already, their leading bytes make a fine hash
+static uint64_t _kvsm_idhash(const char *id) {
+  uint64_t hash;
+  memcpy(&hash, id, sizeof(hash));
+  return hash;
+}
+
+static void _kvsm_idtable_free(struct kvsm_idtable *table) {
+  if (!table) return;
+  free(table->tx);
+  free(table);
+}
+
+static struct kvsm_idinfo * _kvsm_idtable_find(const struct kvsm_idtable *table, const char *id) {
+  size_t i;
+  if (!table->cap) return NULL;
+  for( i = _kvsm_idhash(id) & (table->cap - 1) ; table->tx[i].offset ; i = (i + 1) & (table->cap - 1) ) {
+    if (!memcmp(table->tx[i].id, id, KVSM_ID_LENGTH)) return &(table->tx[i]);
+  }
+  return NULL;
+}
+
+static struct kvsm_idinfo * _kvsm_idtable_put(struct kvsm_idtable *table, const char *id, PALLOC_OFFSET offset) {
+  struct kvsm_idinfo *found = _kvsm_idtable_find(table, id);
+  struct kvsm_idinfo *entries;
+  size_t cap, i, j;
+
+  if (found) {
+    found->offset = offset;
+    return found;
+  }
+
+  // Keep the load factor below 50%
+  if ((table->count + 1) * 2 > table->cap) {
+    cap     = table->cap ? table->cap * 2 : 1024;
+    entries = calloc(cap, sizeof(struct kvsm_idinfo));
+    if (!entries) {
+      log_error("Could not reserve memory for identifier table");
+      return NULL;
+    }
+    for( i = 0 ; i < table->cap ; i++ ) {
+      if (!table->tx[i].offset) continue;
+      for( j = _kvsm_idhash(table->tx[i].id) & (cap - 1) ; entries[j].offset ; j = (j + 1) & (cap - 1) );
+      entries[j] = table->tx[i];
+    }
+    free(table->tx);
+    table->tx  = entries;
+    table->cap = cap;
+  }
+
+  for( i = _kvsm_idhash(id) & (table->cap - 1) ; table->tx[i].offset ; i = (i + 1) & (table->cap - 1) );
+  memcpy(table->tx[i].id, id, KVSM_ID_LENGTH);
+  table->tx[i].offset = offset;
+  table->count++;
+  return &(table->tx[i]);
+}
+
+// Backward-shift deletion, same as the transaction table
+static void _kvsm_idtable_del(struct kvsm_idtable *table, const char *id) {
+  struct kvsm_idinfo *found = _kvsm_idtable_find(table, id);
+  size_t mask = table->cap - 1;
+  size_t i, j, k;
+  if (!found) return;
+
+  i = found - table->tx;
+  j = i;
+  while(1) {
+    j = (j + 1) & mask;
+    if (!table->tx[j].offset) break;
+    k = _kvsm_idhash(table->tx[j].id) & mask;
+    if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+    table->tx[i] = table->tx[j];
+    i = j;
+  }
+  table->tx[i].offset = 0;
+  table->count--;
+}
+
+static void _kvsm_txorder_free(struct kvsm_txorder *order) {
+  if (!order) return;
+  free(order->tx);
+  free(order);
+}
+
+// Orders transactions by height, using the identifier as tie-breaker so all
+// nodes agree on which version of a key is the current one
+static int _kvsm_txorder_cmp(const struct kvsm_txinfo *info, uint64_t height, const char *id) {
+  if (info->height < height) return -1;
+  if (info->height > height) return  1;
+  return memcmp(info->id, id, KVSM_ID_LENGTH);
+}
+
+// Position of the first slot not below the given height and identifier,
+// holes included
+static size_t _kvsm_txorder_seek(const struct kvsm_txorder *order, uint64_t height, const char *id) {
+  size_t lo = 0, hi = order->count, mid;
+  while(lo < hi) {
+    mid = lo + ((hi - lo) / 2);
+    if (_kvsm_txorder_cmp(&(order->tx[mid]), height, id) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Nearest live slot from the given position in the given direction, -1 = none
+static ssize_t _kvsm_txorder_step(const struct kvsm_txorder *order, ssize_t pos, int direction) {
+  while((pos >= 0) && ((size_t)pos < order->count)) {
+    if (order->tx[pos].offset) return pos;
+    pos += direction;
+  }
+  return -1;
+}
+
+// Squeezes out the holes
+static void _kvsm_txorder_pack(struct kvsm_txorder *order) {
+  size_t i, j = 0;
+  for( i = 0 ; i < order->count ; i++ ) {
+    if (!order->tx[i].offset) continue;
+    order->tx[j++] = order->tx[i];
+  }
+  order->count = j;
+  order->holes = 0;
+}
+
+// Writes in height order are appended, anything else shifts the tail
+static KVSM_RESPONSE _kvsm_txorder_put(struct kvsm_txorder *order, const struct kvsm_txinfo *info) {
+  struct kvsm_txinfo *entries;
+  size_t pos = _kvsm_txorder_seek(order, info->height, info->id);
+  size_t cap;
+
+  if ((pos < order->count) && !_kvsm_txorder_cmp(&(order->tx[pos]), info->height, info->id)) {
+    if (!order->tx[pos].offset) order->holes--;
+    order->tx[pos] = *info;
+    return KVSM_OK;
+  }
+
+  // Reuse a neighbouring hole, ordering is kept either way
+  if ((pos < order->count) && !order->tx[pos].offset) {
+    order->tx[pos] = *info;
+    order->holes--;
+    return KVSM_OK;
+  }
+  if (pos && !order->tx[pos - 1].offset) {
+    order->tx[pos - 1] = *info;
+    order->holes--;
+    return KVSM_OK;
+  }
+
+  if (order->count == order->cap) {
+    cap     = order->cap ? order->cap * 2 : 1024;
+    entries = realloc(order->tx, cap * sizeof(struct kvsm_txinfo));
+    if (!entries) {
+      log_error("Could not reserve memory for transaction order");
+      return KVSM_ERROR;
+    }
+    order->tx  = entries;
+    order->cap = cap;
+  }
+
+  memmove(&(order->tx[pos + 1]), &(order->tx[pos]), (order->count - pos) * sizeof(struct kvsm_txinfo));
+  order->tx[pos] = *info;
+  order->count++;
+  return KVSM_OK;
+}
+
+// Leaves a hole, packing once they make up half the array
+static void _kvsm_txorder_del(struct kvsm_txorder *order, const struct kvsm_txinfo *info) {
+  size_t pos = _kvsm_txorder_seek(order, info->height, info->id);
+  if (pos >= order->count) return;
+  if (order->tx[pos].offset != info->offset) return;
+  order->tx[pos].offset = 0;
+  order->holes++;
+  if ((order->holes * 2) > order->count) _kvsm_txorder_pack(order);
+}
+
+static void _kvsm_keyset_free(struct _kvsm_keyset *set) {
+  buf_clear(&(set->arena));
+  free(set->slot);
+  memset(set, 0, sizeof(struct _kvsm_keyset));
+}
+
+static size_t _kvsm_keyset_size(const struct _kvsm_keyset *set) {
+  return set->arena.cap + (set->cap * sizeof(struct _kvsm_keyset_slot));
+}
+
+// Returns 1 if the key was added, 0 if it was already present, -1 on error
+static int _kvsm_keyset_add(struct _kvsm_keyset *set, const char *key, size_t len, uint64_t hash) {
+  struct _kvsm_keyset_slot *slot;
+  size_t cap, i, j;
+
+  // Keep the load factor below 50%
+  if (((set->count + 1) * 2) > set->cap) {
+    cap  = set->cap ? set->cap * 2 : 1024;
+    slot = calloc(cap, sizeof(struct _kvsm_keyset_slot));
+    if (!slot) return -1;
+    for( i = 0 ; i < set->cap ; i++ ) {
+      if (!set->slot[i].used) continue;
+      for( j = set->slot[i].hash & (cap - 1) ; slot[j].used ; j = (j + 1) & (cap - 1) );
+      slot[j] = set->slot[i];
+    }
+    free(set->slot);
+    set->slot = slot;
+    set->cap  = cap;
+  }
+
+  for( i = hash & (set->cap - 1) ; set->slot[i].used ; i = (i + 1) & (set->cap - 1) ) {
+    slot = &(set->slot[i]);
+    if (slot->hash != hash) continue;
+    if (slot->len != len) continue;
+    if (memcmp(set->arena.data + slot->pos, key, len)) continue;
+    return 0;
+  }
+
+  slot       = &(set->slot[i]);
+  slot->hash = hash;
+  slot->pos  = set->arena.len;
+  slot->len  = len;
+  slot->used = true;
+  if (len && !buf_append(&(set->arena), key, len)) return -1;
+  set->count++;
+  return 1;
+}
+
+static void _kvsm_children_free(struct _kvsm_children *map) {
+  size_t i;
+  for( i = 0 ; i < map->cap ; i++ ) {
+    free(map->slot[i].child);
+  }
+  free(map->slot);
+  memset(map, 0, sizeof(struct _kvsm_children));
+}
+
+static struct _kvsm_children_slot * _kvsm_children_get(struct _kvsm_children *map, PALLOC_OFFSET parent, bool create) {
+  struct _kvsm_children_slot *slot;
+  size_t cap, i, j;
+
+  if (create && (((map->count + 1) * 2) > map->cap)) {
+    cap  = map->cap ? map->cap * 2 : 1024;
+    slot = calloc(cap, sizeof(struct _kvsm_children_slot));
+    if (!slot) return NULL;
+    for( i = 0 ; i < map->cap ; i++ ) {
+      if (!map->slot[i].parent) continue;
+      for( j = _kvsm_mix(map->slot[i].parent) & (cap - 1) ; slot[j].parent ; j = (j + 1) & (cap - 1) );
+      slot[j] = map->slot[i];
+    }
+    free(map->slot);
+    map->slot = slot;
+    map->cap  = cap;
+  }
+  if (!map->cap) return NULL;
+
+  for( i = _kvsm_mix(parent) & (map->cap - 1) ; map->slot[i].parent ; i = (i + 1) & (map->cap - 1) ) {
+    if (map->slot[i].parent == parent) return &(map->slot[i]);
+  }
+  if (!create) return NULL;
+  map->slot[i].parent = parent;
+  map->count++;
+  return &(map->slot[i]);
+}
+
+static KVSM_RESPONSE _kvsm_children_add(struct _kvsm_children *map, PALLOC_OFFSET parent, PALLOC_OFFSET child) {
+  struct _kvsm_children_slot *slot = _kvsm_children_get(map, parent, true);
+  PALLOC_OFFSET *list;
+  size_t i;
+  if (!slot) return KVSM_ERROR;
+  for( i = 0 ; i < slot->count ; i++ ) {
+    if (slot->child[i] == child) return KVSM_OK;
+  }
+  list = realloc(slot->child, (slot->count + 1) * sizeof(PALLOC_OFFSET));
+  if (!list) return KVSM_ERROR;
+  slot->child = list;
+  slot->child[slot->count++] = child;
+  return KVSM_OK;
+}
+
+static void _kvsm_compaction_free(struct kvsm_compaction *c) {
+  if (!c) return;
+  kvsm_transaction_free(c->tx);
+  free(c->node);
+  free(c->live);
+  free(c->dead);
+  _kvsm_keyset_free(&(c->seen));
+  _kvsm_children_free(&(c->children));
+  free(c);
+}
+
+// Lets a running compaction know about a transaction written after it started
+static KVSM_RESPONSE _kvsm_compaction_link(const struct kvsm *ctx, PALLOC_OFFSET offset, const PALLOC_OFFSET *parent, int parent_count) {
+  int i;
+  if (!ctx->compaction) return KVSM_OK;
+  if (!ctx->compaction->node) return KVSM_OK;
+  for( i = 0 ; i < parent_count ; i++ ) {
+    if (_kvsm_children_add(&(ctx->compaction->children), parent[i], offset) != KVSM_OK) return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+// Takes back _kvsm_compaction_link for a transaction that didn't make it
+static void _kvsm_compaction_unlink(const struct kvsm *ctx, PALLOC_OFFSET offset, const PALLOC_OFFSET *parent, int parent_count) {
+  struct _kvsm_children_slot *slot;
+  size_t j;
+  int i;
+  if (!ctx->compaction) return;
+  if (!ctx->compaction->node) return;
+  for( i = 0 ; i < parent_count ; i++ ) {
+    slot = _kvsm_children_get(&(ctx->compaction->children), parent[i], false);
+    for( j = 0 ; slot && (j < slot->count) ; j++ ) {
+      if (slot->child[j] != offset) continue;
+      slot->child[j] = slot->child[--slot->count];
+      break;
+    }
+  }
+}
+
+// Registers a transaction in the offset, identifier and height tables
+static struct kvsm_txinfo * _kvsm_track(const struct kvsm *ctx, PALLOC_OFFSET offset, uint64_t height, const char *id) {
+  struct kvsm_txinfo *info = _kvsm_txtable_find(ctx->txtable, offset);
+  if (info) _kvsm_txorder_del(ctx->txorder, info);
+  info = _kvsm_txtable_put(ctx->txtable, offset, height);
+  if (!info) return NULL;
+  memcpy(info->id, id, KVSM_ID_LENGTH);
+  if (!_kvsm_idtable_put(ctx->idtable, id, offset)) {
+    _kvsm_txtable_del(ctx->txtable, offset);
+    return NULL;
+  }
+  if (_kvsm_txorder_put(ctx->txorder, info) != KVSM_OK) {
+    _kvsm_idtable_del(ctx->idtable, id);
+    _kvsm_txtable_del(ctx->txtable, offset);
+    return NULL;
+  }
+  return info;
+}
+
+// The identifier may have been taken over by a merged transaction already
+static void _kvsm_untrack(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct kvsm_txinfo *info = _kvsm_txtable_find(ctx->txtable, offset);
+  struct kvsm_idinfo *id;
+  if (!info) return;
+  _kvsm_txorder_del(ctx->txorder, info);
+  id = _kvsm_idtable_find(ctx->idtable, info->id);
+  if (id && (id->offset == offset)) _kvsm_idtable_del(ctx->idtable, info->id);
+  _kvsm_txtable_del(ctx->txtable, offset);
+}
+
+// Reads the entry at the given offset
+// Returns false on end-of-list or read failure
+// Merged transactions store each entry's height in front of the value length
+static bool _kvsm_entry_read(const struct kvsm *ctx, const struct kvsm_transaction *tx, PALLOC_OFFSET offset, struct _kvsm_entry *entry) {
+  uint8_t len8;
+  uint64_t len64;
+
+  if (_kvsm_read(ctx, offset++, &len8, sizeof(len8)) != KVSM_OK) return false;
+  if (!len8) return false;
+  entry->keylen = len8 & 127;
+  if (len8 & 128) {
+    if (_kvsm_read(ctx, offset++, &len8, sizeof(len8)) != KVSM_OK) return false;
+    entry->keylen = (entry->keylen << 8) | len8;
+  }
+
+  entry->key    = offset;
+  entry->height = tx->height;
+  offset       += entry->keylen;
+  if (tx->merged) {
+    if (_kvsm_read(ctx, offset, &len64, sizeof(len64)) != KVSM_OK) return false;
+    entry->height = be64toh(len64);
+    offset       += sizeof(len64);
+  }
+  if (_kvsm_read(ctx, offset, &len64, sizeof(len64)) != KVSM_OK) return false;
+  entry->length     = be64toh(len64);
+  entry->compressed = false;
+  if (tx->compressed) {
+    entry->compressed = (entry->length & KVSM_ENTRY_COMPRESSED) != 0;
+    entry->length    &= ~KVSM_ENTRY_COMPRESSED;
+  }
+  entry->value = offset + sizeof(len64);
+  entry->next  = entry->value + entry->length;
+  return true;
+}
+
+// Returns whether the entry's key matches the given one
+static bool _kvsm_entry_match(const struct kvsm *ctx, const struct _kvsm_entry *entry, const struct buf *key, char *scratch) {
+  if (entry->keylen != key->len) return false;
+#ifndef _WIN32
+  if (ctx->map) {
+    const char *ptr = _kvsm_map_ptr(ctx, entry->key, entry->keylen);
+    return ptr && !memcmp(ptr, key->data, key->len);
+  }
+#endif
+  if (_kvsm_read(ctx, entry->key, scratch, entry->keylen) != KVSM_OK) return false;
+  return !memcmp(scratch, key->data, key->len);
+}
+
+// Compares the entry's key against the given one, in _kvsm_key_cmp order
+static int _kvsm_entry_cmp(const struct kvsm *ctx, const struct _kvsm_entry *entry, const struct buf *key, char *scratch) {
+  const char *ptr = NULL;
+#ifndef _WIN32
+  if (ctx->map) ptr = _kvsm_map_ptr(ctx, entry->key, entry->keylen);
+#endif
+  if ((!ctx->map) && (_kvsm_read(ctx, entry->key, scratch, entry->keylen) == KVSM_OK)) ptr = scratch;
+  if (!ptr) return -1;
+  return _kvsm_key_cmp(ptr, entry->keylen, key->data, key->len);
+}
+
+static void _kvsm_index_free(struct kvsm_index *index) {
+  struct _kvsm_skipnode *node, *next;
+  size_t i;
+  if (!index) return;
+  for( node = index->order[0] ; node ; node = next ) {
+    next = node->next[0];
+    free(node);
+  }
+  for( i = 0 ; i < index->cap ; i++ ) {
+    buf_clear(&(index->entry[i].key));
+  }
+  free(index->entry);
+  free(index);
+}
+
+// Returns the link at each level after which the key belongs, the head's
+// own links where nothing comes before it
+static struct _kvsm_skipnode ** _kvsm_index_order_seek(struct kvsm_index *index, const char *key, size_t len, struct _kvsm_skipnode ***update) {
+  struct _kvsm_skipnode **links = index->order;
+  int level;
+  for( level = KVSM_SKIP_LEVELS - 1 ; level >= 0 ; level-- ) {
+    while(links[level] && (_kvsm_key_cmp(links[level]->key, links[level]->len, key, len) < 0)) {
+      links = links[level]->next;
+    }
+    if (update) update[level] = &(links[level]);
+  }
+  return links;
+}
+
+// Adds a key new to the index to the key order
+static KVSM_RESPONSE _kvsm_index_order_add(struct kvsm_index *index, const char *key, size_t len, uint64_t hash) {
+  struct _kvsm_skipnode **update[KVSM_SKIP_LEVELS];
+  struct _kvsm_skipnode *node;
+  int levels = 1, i;
+  uint64_t r;
+
+  // xorshift64, only the distribution matters
+  if (!index->seed) index->seed = 0x9E3779B97F4A7C15ULL;
+  index->seed ^= index->seed << 13;
+  index->seed ^= index->seed >> 7;
+  index->seed ^= index->seed << 17;
+  for( r = index->seed ; (levels < KVSM_SKIP_LEVELS) && !(r & 3) ; r >>= 2 ) levels++;
+
+  node = malloc(sizeof(struct _kvsm_skipnode) + (levels * sizeof(struct _kvsm_skipnode *)));
+  if (!node) {
+    log_error("Could not reserve memory for key order");
+    return KVSM_ERROR;
+  }
+  node->key  = key;
+  node->len  = len;
+  node->hash = hash;
+  _kvsm_index_order_seek(index, key, len, update);
+  for( i = 0 ; i < levels ; i++ ) {
+    node->next[i] = *update[i];
+    *update[i]    = node;
+  }
+  return KVSM_OK;
+}
+
+static struct kvsm_index_entry * _kvsm_index_find(const struct kvsm_index *index, const char *key, size_t len, uint64_t hash) {
+  size_t i;
+  struct kvsm_index_entry *entry;
+  if (!index->cap) return NULL;
+  for( i = hash & (index->cap - 1) ; ; i = (i + 1) & (index->cap - 1) ) {
+    entry = &(index->entry[i]);
+    if (!entry->key.data) return NULL;
+    if (entry->hash != hash) continue;
+    if (entry->key.len != len) continue;
+    if (memcmp(entry->key.data, key, len)) continue;
+    return entry;
+  }
+}
+
+static KVSM_RESPONSE _kvsm_index_grow(struct kvsm_index *index) {
+  size_t cap = index->cap ? index->cap * 2 : 1024;
+  size_t i, j;
+  struct kvsm_index_entry *entries = calloc(cap, sizeof(struct kvsm_index_entry));
+  if (!entries) {
+    log_error("Could not reserve memory for key index");
+    return KVSM_ERROR;
+  }
+  for( i = 0 ; i < index->cap ; i++ ) {
+    if (!index->entry[i].key.data) continue;
+    for( j = index->entry[i].hash & (cap - 1) ; entries[j].key.data ; j = (j + 1) & (cap - 1) );
+    entries[j] = index->entry[i];
+  }
+  free(index->entry);
+  index->entry = entries;
+  index->cap   = cap;
+  return KVSM_OK;
+}
+
+// Claims a slot for a key known not to be in the index yet
+static struct kvsm_index_entry * _kvsm_index_insert(struct kvsm_index *index, const char *key, size_t len, uint64_t hash) {
+  struct kvsm_index_entry *found;
+  size_t i;
+
+  // Keep the load factor below 50%
+  if ((index->count + 1) * 2 > index->cap) {
+    if (_kvsm_index_grow(index) != KVSM_OK) return NULL;
+  }
+
+  for( i = hash & (index->cap - 1) ; index->entry[i].key.data ; i = (i + 1) & (index->cap - 1) );
+  found = &(index->entry[i]);
+  found->key.data = malloc(len ? len : 1);
+  if (!found->key.data) {
+    log_error("Could not reserve memory for index key");
+    return NULL;
+  }
+  memcpy(found->key.data, key, len);
+  if (_kvsm_index_order_add(index, found->key.data, len, hash) != KVSM_OK) {
+    free(found->key.data);
+    found->key.data = NULL;
+    return NULL;
+  }
+  found->key.len = len;
+  found->key.cap = len;
+  found->hash    = hash;
+  index->count++;
+  return found;
+}
+
+// Bytes an entry occupies on the medium
+static uint64_t _kvsm_entry_size(size_t keylen, uint64_t length) {
+  return ((keylen >= 128) ? 2 : 1) + keylen + sizeof(uint64_t) + length;
+}
+
+// Registers the entry in the index if it's newer than what's already known
+// Whichever version loses is counted as dead
+static KVSM_RESPONSE _kvsm_index_put(struct kvsm *ctx, const struct kvsm_transaction *tx, const struct _kvsm_entry *entry, const char *key) {
+  struct kvsm_index *index = ctx->index;
+  struct kvsm_index_entry *found;
+  char id[KVSM_ID_LENGTH];
+  uint64_t hash = _kvsm_hash(key, entry->keylen);
+
+  found = _kvsm_index_find(index, key, entry->keylen, hash);
+  if (found) {
+    // First occurrence within a transaction wins, same as a walk would find
+    if (
+      (found->offset == tx->offset) ||
+      (found->height >  entry->height)
+    ) {
+      ctx->bytes_dead += _kvsm_entry_size(entry->keylen, entry->length);
+      return KVSM_OK;
+    }
+    if (found->height == entry->height) {
+      if (_kvsm_read(ctx, found->offset + 1, id, KVSM_ID_LENGTH) != KVSM_OK) return KVSM_ERROR;
+      if (memcmp(id, tx->id->data, KVSM_ID_LENGTH) > 0) {
+        ctx->bytes_dead += _kvsm_entry_size(entry->keylen, entry->length);
+        return KVSM_OK;
+      }
+    }
+    ctx->bytes_dead += _kvsm_entry_size(found->key.len, found->length);
+    found->offset     = tx->offset;
+    found->height     = entry->height;
+    found->value      = entry->value;
+    found->length     = entry->length;
+    found->compressed = entry->compressed;
+    return KVSM_OK;
+  }
+
+  found = _kvsm_index_insert(index, key, entry->keylen, hash);
+  if (!found) return KVSM_ERROR;
+  found->offset     = tx->offset;
+  found->height     = entry->height;
+  found->value      = entry->value;
+  found->length     = entry->length;
+  found->compressed = entry->compressed;
+  return KVSM_OK;
+}
+
+// Adds all entries of the given transaction to the index
+static KVSM_RESPONSE _kvsm_index_tx(struct kvsm *ctx, const struct kvsm_transaction *tx) {
+  struct _kvsm_entry entry;
+  PALLOC_OFFSET off = KVSM_TX_ENTRIES(tx);
+  char *key;
+
+  if (!ctx->index) return KVSM_OK;
+  key = malloc(KVSM_KEY_MAX);
+  if (!key) return KVSM_ERROR;
+
+  while(_kvsm_entry_read(ctx, tx, off, &entry)) {
+    if (
+      (_kvsm_read(ctx, entry.key, key, entry.keylen) != KVSM_OK) ||
+      (_kvsm_index_put(ctx, tx, &entry, key) != KVSM_OK)
+    ) {
+      free(key);
+      return KVSM_ERROR;
+    }
+    off = entry.next;
+  }
+
+  free(key);
+  return KVSM_OK;
+}
+
+// Loads JUST the info, not the data
+static struct kvsm_transaction * _kvsm_transaction_load(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct kvsm_transaction *tx = NULL;
+  PALLOC_OFFSET *list;
+  PALLOC_OFFSET parent;
+  uint64_t height;
+  uint32_t blocks;
+  uint8_t version;
+
+  if (!ctx) return NULL;
+  if (!offset) return NULL;
+
+  // Version check
+  if (_kvsm_read(ctx, offset, &version, sizeof(version)) != KVSM_OK) return NULL;
+  if (version & ~KVSM_VERSION_SUPPORTED) {
+    log_trace("Incompatible version at %lld", offset);
+    return NULL;
+  }
+
+  // Actually reserve memory
+  tx = calloc(1, sizeof(struct kvsm_transaction));
+  if (!tx) {
+    log_error("Could not reserve memory for transaction");
+    return NULL;
+  }
+  tx->id = calloc(1, sizeof(struct buf));
+  if (!tx->id) {
+    log_error("Could not reserve memory for transaction id");
+    free(tx);
+    return NULL;
+  }
+  tx->ctx    = ctx;
+  tx->offset = offset;
+
+  tx->id->data = malloc(KVSM_ID_LENGTH);
+  tx->id->len  = KVSM_ID_LENGTH;
+  tx->id->cap  = KVSM_ID_LENGTH;
+  if (
+    (!tx->id->data) ||
+    (_kvsm_read(ctx, offset + 1, tx->id->data, KVSM_ID_LENGTH) != KVSM_OK) ||
+    (_kvsm_read(ctx, offset + 1 + KVSM_ID_LENGTH, &height, sizeof(height)) != KVSM_OK)
+  ) {
+    kvsm_transaction_free(tx);
+    return NULL;
+  }
+  tx->height = be64toh(height);
+
+  // Parent list, 0-terminated
+  offset += KVSM_HEADER_SIZE;
+  while(1) {
+    if (_kvsm_read(ctx, offset, &parent, sizeof(parent)) != KVSM_OK) {
+      kvsm_transaction_free(tx);
+      return NULL;
+    }
+    offset += sizeof(parent);
+    parent  = be64toh(parent);
+    if (!parent) break;
+    list = realloc(tx->parent, (tx->parent_count + 1) * sizeof(PALLOC_OFFSET));
+    if (!list) {
+      kvsm_transaction_free(tx);
+      return NULL;
+    }
+    tx->parent = list;
+    tx->parent[tx->parent_count++] = parent;
+  }
+
+  // Key filter, followed by the entries
+  if (version & KVSM_VERSION_FILTER) {
+    if (_kvsm_read(ctx, offset, &blocks, sizeof(blocks)) != KVSM_OK) {
+      kvsm_transaction_free(tx);
+      return NULL;
+    }
+    tx->filter_blocks = be32toh(blocks);
+    offset += sizeof(blocks) + (tx->filter_blocks * sizeof(uint64_t));
+  }
+
+  // Ordered offset table, followed by the entries
+  if (version & KVSM_VERSION_SORTED) {
+    if (_kvsm_read(ctx, offset, &blocks, sizeof(blocks)) != KVSM_OK) {
+      kvsm_transaction_free(tx);
+      return NULL;
+    }
+    tx->sorted_count = be32toh(blocks);
+    offset += KVSM_SORTED_SIZE(tx->sorted_count);
+  }
+  tx->entries = offset;
+  tx->merged     = version & KVSM_VERSION_MERGED;
+  tx->compressed = version & KVSM_VERSION_COMPRESS;
+
+  return tx;
+}
+
+struct kvsm_transaction * kvsm_transaction_load(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct kvsm_transaction *result;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_transaction_load(ctx, offset);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_transaction_free(struct kvsm_transaction *tx) {
+  if (!tx) return KVSM_ERROR;
+  if (tx->id) {
+    buf_clear(tx->id);
+    free(tx->id);
+  }
+  if (tx->parent) free(tx->parent);
+  free(tx);
+  return KVSM_OK;
+}
+
+// Height-ordered traversal of the history, shared by lookups and replay
+// Pending transactions live in a max-heap on (height, id), the offsets
+// queued so far in an open-addressed set, so diamond-shaped histories visit
+// every transaction once
+struct _kvsm_walk_item {
+  PALLOC_OFFSET            offset;
+  uint64_t                 height;
+  char                     id[KVSM_ID_LENGTH];
+  struct kvsm_transaction *tx; // Loaded on push when not tracked
+};
+
+struct _kvsm_walk {
+  struct _kvsm_walk_item *heap;
+  size_t                  count;
+  size_t                  cap;
+  PALLOC_OFFSET          *seen;
+  size_t                  seen_count;
+  size_t                  seen_cap;
+  bool                    error;
+};
+
+static void _kvsm_walk_free(struct _kvsm_walk *walk) {
+  while(walk->count) {
+    walk->count--;
+    if (walk->heap[walk->count].tx) kvsm_transaction_free(walk->heap[walk->count].tx);
+  }
+  free(walk->heap);
+  free(walk->seen);
+  memset(walk, 0, sizeof(struct _kvsm_walk));
+}
+
+static int _kvsm_walk_cmp(const struct _kvsm_walk_item *a, const struct _kvsm_walk_item *b) {
+  if (a->height < b->height) return -1;
+  if (a->height > b->height) return  1;
+  return memcmp(a->id, b->id, KVSM_ID_LENGTH);
+}
+
+// Marks the offset as queued, returns 0 if it already was, -1 on failure
+static int _kvsm_walk_mark(struct _kvsm_walk *walk, PALLOC_OFFSET offset) {
+  PALLOC_OFFSET *seen;
+  size_t cap, i, j;
+
+  if ((walk->seen_count + 1) * 2 > walk->seen_cap) {
+    cap  = walk->seen_cap ? walk->seen_cap * 2 : 32;
+    seen = calloc(cap, sizeof(PALLOC_OFFSET));
+    if (!seen) return -1;
+    for( i = 0 ; i < walk->seen_cap ; i++ ) {
+      if (!walk->seen[i]) continue;
+      for( j = _kvsm_mix(walk->seen[i]) & (cap - 1) ; seen[j] ; j = (j + 1) & (cap - 1) );
+      seen[j] = walk->seen[i];
+    }
+    free(walk->seen);
+    walk->seen     = seen;
+    walk->seen_cap = cap;
+  }
+
+  for( i = _kvsm_mix(offset) & (walk->seen_cap - 1) ; walk->seen[i] ; i = (i + 1) & (walk->seen_cap - 1) ) {
+    if (walk->seen[i] == offset) return 0;
+  }
+  walk->seen[i] = offset;
+  walk->seen_count++;
+  return 1;
+}
+
+// Queues a transaction, tracked ones are only loaded once they're popped
+static KVSM_RESPONSE _kvsm_walk_push(struct _kvsm_walk *walk, const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct _kvsm_walk_item item = {0};
+  struct _kvsm_walk_item *heap;
+  struct kvsm_txinfo *info;
+  size_t i;
+
+  switch(_kvsm_walk_mark(walk, offset)) {
+    case 0: return KVSM_OK;
+    case 1: break;
+    default:
+      walk->error = true;
+      return KVSM_ERROR;
+  }
+
+  item.offset = offset;
+  if ((info = _kvsm_txtable_find(ctx->txtable, offset))) {
+    item.height = info->height;
+    memcpy(item.id, info->id, KVSM_ID_LENGTH);
+  } else {
+    item.tx = _kvsm_transaction_load(ctx, offset);
+    if (!item.tx) {
+      log_error("Could not load transaction at %lld", offset);
+      walk->error = true;
+      return KVSM_ERROR;
+    }
+    item.height = item.tx->height;
+    memcpy(item.id, item.tx->id->data, KVSM_ID_LENGTH);
+  }
+
+  if (walk->count == walk->cap) {
+    heap = realloc(walk->heap, (walk->cap ? walk->cap * 2 : 16) * sizeof(struct _kvsm_walk_item));
+    if (!heap) {
+      if (item.tx) kvsm_transaction_free(item.tx);
+      walk->error = true;
+      return KVSM_ERROR;
+    }
+    walk->heap = heap;
+    walk->cap  = walk->cap ? walk->cap * 2 : 16;
+  }
+
+  // Sift up
+  i = walk->count++;
+  while(i && (_kvsm_walk_cmp(&(walk->heap[(i - 1) / 2]), &item) < 0)) {
+    walk->heap[i] = walk->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  walk->heap[i] = item;
+  return KVSM_OK;
+}
+
+// Queues all parents of the given transaction
+static KVSM_RESPONSE _kvsm_walk_parents(struct _kvsm_walk *walk, const struct kvsm *ctx, const struct kvsm_transaction *tx) {
+  int i;
+  for( i = 0 ; i < tx->parent_count ; i++ ) {
+    if (_kvsm_walk_push(walk, ctx, tx->parent[i]) != KVSM_OK) return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+// Height of the next transaction to be popped, 0 when empty
+static uint64_t _kvsm_walk_peek(const struct _kvsm_walk *walk) {
+  return walk->count ? walk->heap[0].height : 0;
+}
+
+// Pops and loads the highest queued transaction, caller frees
+// Returns NULL when done or on failure, the latter also sets walk->error
+static struct kvsm_transaction * _kvsm_walk_next(struct _kvsm_walk *walk, const struct kvsm *ctx) {
+  struct _kvsm_walk_item top, last;
+  size_t i, child;
+
+  if (!walk->count) return NULL;
+  top  = walk->heap[0];
+  last = walk->heap[--walk->count];
+
+  // Sift down
+  i = 0;
+  while((child = (i * 2) + 1) < walk->count) {
+    if (((child + 1) < walk->count) && (_kvsm_walk_cmp(&(walk->heap[child + 1]), &(walk->heap[child])) > 0)) child++;
+    if (_kvsm_walk_cmp(&(walk->heap[child]), &last) <= 0) break;
+    walk->heap[i] = walk->heap[child];
+    i = child;
+  }
+  if (walk->count) walk->heap[i] = last;
+
+  if (top.tx) return top.tx;
+  top.tx = _kvsm_transaction_load(ctx, top.offset);
+  if (!top.tx) {
+    log_error("Could not load transaction at %lld", top.offset);
+    walk->error = true;
+  }
+  return top.tx;
+}
+
+static void _kvsm_scan_free(struct kvsm_transaction **list, size_t count) {
+  while(count) kvsm_transaction_free(list[--count]);
+  free(list);
+}
+
+// Anchor layout, always the first blob on media created by us
+//   1 byte type (KVSM_BLOB_ANCHOR)
+//   8 bytes checksum of the remainder
+//   8 bytes offset of the latest checkpoint (0 = none)
+//   4 bytes head count (UINT32_MAX = unknown), | KVSM_ANCHOR_LIVE while open
+//   8 bytes head offset [KVSM_ANCHOR_HEADS]
+//
+// With more heads than fit, the first slot holds the offset of a blob with
+// all of them instead
+//   1 byte type (KVSM_BLOB_HEADS)
+//   8 bytes checksum of the remainder
+//   4 bytes head count
+//   8 bytes head offset [count]
+static KVSM_RESPONSE _kvsm_anchor_write(struct kvsm *ctx) {
+  char anchor[KVSM_ANCHOR_SIZE] = {0};
+  struct buf heads = {0};
+  PALLOC_OFFSET overflow = 0;
+  uint64_t tmp64;
+  uint32_t tmp32;
+  int i;
+
+  if (!ctx->anchor) return KVSM_OK;
+
+  // Written before the anchor refers to it, the previous one is released after
+  if (ctx->head_count > KVSM_ANCHOR_HEADS) {
+    heads.cap  = KVSM_HEADS_HEADER + (ctx->head_count * sizeof(PALLOC_OFFSET));
+    heads.data = calloc(1, heads.cap);
+    overflow   = heads.data ? palloc(ctx->fd, heads.cap) : 0;
+    if (!overflow) {
+      log_error("Could not allocate space for heads");
+      buf_clear(&heads);
+      return KVSM_ERROR;
+    }
+    heads.data[0] = KVSM_BLOB_HEADS;
+    tmp32 = htobe32(ctx->head_count);
+    memcpy(heads.data + 9, &tmp32, sizeof(tmp32));
+    for( i = 0 ; i < ctx->head_count ; i++ ) {
+      tmp64 = htobe64(ctx->head[i]);
+      memcpy(heads.data + KVSM_HEADS_HEADER + (i * sizeof(tmp64)), &tmp64, sizeof(tmp64));
+    }
+    tmp64 = htobe64(_kvsm_hash(heads.data + 9, heads.cap - 9));
+    memcpy(heads.data + 1, &tmp64, sizeof(tmp64));
+    if (_kvsm_write(ctx, overflow, heads.data, heads.cap) != KVSM_OK) {
+      log_error("Could not write heads");
+      pfree(ctx->fd, overflow);
+      buf_clear(&heads);
+      return KVSM_ERROR;
+    }
+    buf_clear(&heads);
+  }
+
+  anchor[0] = KVSM_BLOB_ANCHOR;
+  tmp64 = htobe64(ctx->checkpoint);
+  memcpy(anchor + 9, &tmp64, sizeof(tmp64));
+  tmp32 = htobe32(ctx->head_count | (ctx->live ? KVSM_ANCHOR_LIVE : 0));
+  memcpy(anchor + 17, &tmp32, sizeof(tmp32));
+  if (overflow) {
+    tmp64 = htobe64(overflow);
+    memcpy(anchor + 21, &tmp64, sizeof(tmp64));
+  }
+  for( i = 0 ; (!overflow) && (i < ctx->head_count) ; i++ ) {
+    tmp64 = htobe64(ctx->head[i]);
+    memcpy(anchor + 21 + (i * sizeof(tmp64)), &tmp64, sizeof(tmp64));
+  }
+  tmp64 = htobe64(_kvsm_hash(anchor + 9, KVSM_ANCHOR_SIZE - 9));
+  memcpy(anchor + 1, &tmp64, sizeof(tmp64));
+
+  if (_kvsm_write(ctx, ctx->anchor, anchor, KVSM_ANCHOR_SIZE) != KVSM_OK) {
+    if (overflow) pfree(ctx->fd, overflow);
+    return KVSM_ERROR;
+  }
+  if (ctx->anchor_heads) pfree(ctx->fd, ctx->anchor_heads);
+  ctx->anchor_heads = overflow;
+  return KVSM_OK;
+}
+
+// Loads the heads that didn't fit the anchor
+static KVSM_RESPONSE _kvsm_anchor_heads_load(struct kvsm *ctx, PALLOC_OFFSET offset, uint32_t count) {
+  char header[KVSM_HEADS_HEADER];
+  PALLOC_OFFSET *list;
+  uint64_t checksum;
+  uint32_t tmp32;
+  char *heads;
+  int i;
+
+  if (_kvsm_read(ctx, offset, header, KVSM_HEADS_HEADER) != KVSM_OK) return KVSM_ERROR;
+  memcpy(&checksum, header + 1, sizeof(checksum));
+  memcpy(&tmp32   , header + 9, sizeof(tmp32));
+  if ((((uint8_t)header[0]) != KVSM_BLOB_HEADS) || (be32toh(tmp32) != count)) {
+    log_warn("Anchor refers to invalid heads at %llx", offset);
+    return KVSM_ERROR;
+  }
+
+  heads = malloc(4 + (count * sizeof(PALLOC_OFFSET)));
+  list  = heads ? malloc(count * sizeof(PALLOC_OFFSET)) : NULL;
+  if (!list) {
+    free(heads);
+    return KVSM_ERROR;
+  }
+  memcpy(heads, header + 9, 4);
+  if (
+    (_kvsm_read(ctx, offset + KVSM_HEADS_HEADER, heads + 4, count * sizeof(PALLOC_OFFSET)) != KVSM_OK) ||
+    (_kvsm_hash(heads, 4 + (count * sizeof(PALLOC_OFFSET))) != be64toh(checksum))
+  ) {
+    log_warn("Heads at %llx are corrupt", offset);
+    free(heads);
+    free(list);
+    return KVSM_ERROR;
+  }
+  for( i = 0 ; i < count ; i++ ) {
+    memcpy(&checksum, heads + 4 + (i * sizeof(PALLOC_OFFSET)), sizeof(checksum));
+    list[i] = be64toh(checksum);
+  }
+  free(heads);
+
+  free(ctx->head);
+  ctx->head         = list;
+  ctx->head_count   = count;
+  ctx->anchor_heads = offset;
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_anchor_load(struct kvsm *ctx, PALLOC_OFFSET offset, bool *live) {
+  char anchor[KVSM_ANCHOR_SIZE];
+  PALLOC_OFFSET *list;
+  uint64_t tmp64;
+  uint32_t tmp32;
+  int i;
+
+  if (_kvsm_read(ctx, offset, anchor, KVSM_ANCHOR_SIZE) != KVSM_OK) return KVSM_ERROR;
+  if (((uint8_t)anchor[0]) != KVSM_BLOB_ANCHOR) return KVSM_ERROR;
+  memcpy(&tmp64, anchor + 1, sizeof(tmp64));
+  if (be64toh(tmp64) != _kvsm_hash(anchor + 9, KVSM_ANCHOR_SIZE - 9)) {
+    log_warn("Anchor checksum mismatch at %llx", offset);
+    return KVSM_ERROR;
+  }
+  ctx->anchor = offset;
+
+  memcpy(&tmp32, anchor + 17, sizeof(tmp32));
+  tmp32 = be32toh(tmp32);
+  if (tmp32 == UINT32_MAX) {
+    log_debug("Anchor does not hold the heads");
+    return KVSM_ERROR;
+  }
+  *live  = (tmp32 & KVSM_ANCHOR_LIVE) != 0;
+  tmp32 &= ~KVSM_ANCHOR_LIVE;
+
+  memcpy(&tmp64, anchor + 9, sizeof(tmp64));
+  ctx->checkpoint = be64toh(tmp64);
+  if (tmp32 > KVSM_ANCHOR_HEADS) {
+    memcpy(&tmp64, anchor + 21, sizeof(tmp64));
+    return _kvsm_anchor_heads_load(ctx, be64toh(tmp64), tmp32);
+  }
+
+  list = realloc(ctx->head, (tmp32 + 1) * sizeof(PALLOC_OFFSET));
+  if (!list) return KVSM_ERROR;
+  ctx->head       = list;
+  ctx->head_count = tmp32;
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    memcpy(&tmp64, anchor + 21 + (i * sizeof(tmp64)), sizeof(tmp64));
+    ctx->head[i] = be64toh(tmp64);
+  }
+
+  return KVSM_OK;
+}
+
+// Checkpoint layout
+//   1 byte type (KVSM_BLOB_CHECKPOINT)
+//   8 bytes payload length
+//   8 bytes checksum of the payload
+//   payload
+//     1 byte flags (KVSM_CHECKPOINT_KEYS = key index included, KVSM_CHECKPOINT_IDS = identifiers included,
+//                   KVSM_CHECKPOINT_COMPACT = compaction progress included, KVSM_CHECKPOINT_USAGE = byte counts included)
+//     8 bytes transaction count
+//     [8 bytes offset, 8 bytes height, 15 bytes identifier] per transaction
+//     8 bytes key count
+//     [2 bytes key length, key, 8 bytes offset, height, value offset, value length] per key
+//     [8 bytes partitions, 8 bytes cursor height, 15 bytes cursor identifier] if compacting
+//     8 bytes total, dead and kept byte counts
+static KVSM_RESPONSE _kvsm_checkpoint(struct kvsm *ctx) {
+  log_trace("call: kvsm_checkpoint(...)");
+  struct kvsm_index_entry *entry;
+  struct buf output = {0};
+  PALLOC_OFFSET offset, previous;
+  uint64_t tmp64;
+  uint16_t len16;
+  size_t i;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!ctx->anchor) return KVSM_ERROR;
+
+  // Reserve the header, filled in once the payload is known
+  buf_append(&output, (char[KVSM_CHECKPOINT_HEADER]){ (char)KVSM_BLOB_CHECKPOINT }, KVSM_CHECKPOINT_HEADER);
+  buf_append_byte(&output,
+    KVSM_CHECKPOINT_IDS | KVSM_CHECKPOINT_USAGE |
+    (ctx->index      ? KVSM_CHECKPOINT_KEYS    : 0) |
+    ((ctx->compaction && !ctx->compaction->finished) ? KVSM_CHECKPOINT_COMPACT : 0)
+  );
+
+  _kvsm_append64(&output, ctx->txtable->count);
+  for( i = 0 ; i < ctx->txtable->cap ; i++ ) {
+    if (!ctx->txtable->tx[i].offset) continue;
+    _kvsm_append64(&output, ctx->txtable->tx[i].offset);
+    _kvsm_append64(&output, ctx->txtable->tx[i].height);
+    buf_append(&output, ctx->txtable->tx[i].id, KVSM_ID_LENGTH);
+  }
+
+  _kvsm_append64(&output, ctx->index ? ctx->index->count : 0);
+  for( i = 0 ; ctx->index && (i < ctx->index->cap) ; i++ ) {
+    entry = &(ctx->index->entry[i]);
+    if (!entry->key.data) continue;
+    len16 = htobe16(entry->key.len);
+    buf_append(&output, (char *)&len16, sizeof(len16));
+    buf_append(&output, entry->key.data, entry->key.len);
+    _kvsm_append64(&output, entry->offset);
+    _kvsm_append64(&output, entry->height);
+    _kvsm_append64(&output, entry->value);
+    _kvsm_append64(&output, entry->length | (entry->compressed ? KVSM_ENTRY_COMPRESSED : 0));
+  }
+
+  // No cursor yet is stored as height 0, which no transaction has
+  if (ctx->compaction && !ctx->compaction->finished) {
+    _kvsm_append64(&output, ctx->compaction->partitions);
+    _kvsm_append64(&output, ctx->compaction->cursor ? ctx->compaction->cursor_height : 0);
+    buf_append(&output, ctx->compaction->cursor_id, KVSM_ID_LENGTH);
+  }
+
+  _kvsm_append64(&output, ctx->bytes_total);
+  _kvsm_append64(&output, ctx->bytes_dead);
+  // Snapshots don't outlive the descriptor, neither does what they pinned
+  _kvsm_append64(&output, ctx->bytes_kept - ((ctx->bytes_pinned < ctx->bytes_kept) ? ctx->bytes_pinned : ctx->bytes_kept));
+
+  tmp64 = htobe64(output.len - KVSM_CHECKPOINT_HEADER);
+  memcpy(output.data + 1, &tmp64, sizeof(tmp64));
+  tmp64 = htobe64(_kvsm_hash(output.data + KVSM_CHECKPOINT_HEADER, output.len - KVSM_CHECKPOINT_HEADER));
+  memcpy(output.data + 9, &tmp64, sizeof(tmp64));
+
+  offset = palloc(ctx->fd, output.len);
+  if (!offset) {
+    log_error("Could not allocate %lld bytes for checkpoint", output.len);
+    buf_clear(&output);
+    return KVSM_ERROR;
+  }
+  if (_kvsm_write(ctx, offset, output.data, output.len) != KVSM_OK) {
+    log_error("Could not write checkpoint");
+    pfree(ctx->fd, offset);
+    buf_clear(&output);
+    return KVSM_ERROR;
+  }
+  buf_clear(&output);
+
+  // Only release the previous checkpoint once the anchor no longer refers to it
+  previous        = ctx->checkpoint;
+  ctx->checkpoint = offset;
+  if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+    log_error("Could not update anchor");
+    return KVSM_ERROR;
+  }
+  if (previous) pfree(ctx->fd, previous);
+
+  ctx->checkpoint_pending = 0;
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_checkpoint(struct kvsm *ctx) {
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_checkpoint(ctx);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+// Takes no lock, flushing doesn't touch the in-memory state
+KVSM_RESPONSE kvsm_sync(struct kvsm *ctx) {
+  if (!ctx) return KVSM_ERROR;
+  if (!ctx->sync) return _kvsm_fsync(ctx);
+  return _kvsm_sync_flush(ctx);
+}
+
+KVSM_RESPONSE kvsm_cache_resize(struct kvsm *ctx, uint64_t size) {
+  struct kvsm_cache *cache = NULL;
+  size_t i, buckets;
+  if (!ctx) return KVSM_ERROR;
+
+  if (size >= KVSM_CACHE_BLOCK) {
+    cache = calloc(1, sizeof(struct kvsm_cache));
+    if (!cache) goto error;
+    cache->count = size / KVSM_CACHE_BLOCK;
+    buckets = 1;
+    while(buckets < cache->count) buckets *= 2;
+    cache->mask   = buckets - 1;
+    cache->slot   = calloc(cache->count, sizeof(struct kvsm_cache_slot));
+    cache->data   = malloc(cache->count * KVSM_CACHE_BLOCK);
+    cache->bucket = malloc(buckets * sizeof(int32_t));
+    if ((!cache->slot) || (!cache->data) || (!cache->bucket)) {
+      free(cache->slot);
+      free(cache->data);
+      free(cache->bucket);
+      free(cache);
+      goto error;
+    }
+    for( i = 0 ; i < buckets ; i++ ) cache->bucket[i] = -1;
+#ifndef _WIN32
+    pthread_mutex_init(&(cache->lock), NULL);
+#endif
+  }
+
+  _kvsm_lock(ctx);
+  _kvsm_cache_free(ctx->cache);
+  ctx->cache = cache;
+  _kvsm_unlock(ctx);
+  return KVSM_OK;
+
+error:
+  log_error("Could not reserve memory for the read cache");
+  return KVSM_ERROR;
+}
+
+KVSM_RESPONSE kvsm_cache_stats(const struct kvsm *ctx, struct kvsm_cache_stats *stats) {
+  struct kvsm_cache *cache;
+  if (!ctx) return KVSM_ERROR;
+  if (!stats) return KVSM_ERROR;
+  memset(stats, 0, sizeof(struct kvsm_cache_stats));
+  _kvsm_lock_read(ctx);
+  if ((cache = ctx->cache)) {
+    _kvsm_cache_lock(cache);
+    stats->size      = cache->count * KVSM_CACHE_BLOCK;
+    stats->used      = cache->used * KVSM_CACHE_BLOCK;
+    stats->hits      = cache->hits;
+    stats->misses    = cache->misses;
+    stats->evictions = cache->evictions;
+    _kvsm_cache_unlock(cache);
+  }
+  _kvsm_unlock(ctx);
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_checkpoint_load(struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct kvsm_index_entry *entry;
+  const char *data, *end;
+  char header[KVSM_CHECKPOINT_HEADER];
+  char *payload;
+  uint64_t length, checksum, count, i;
+  uint64_t offsets[4];
+  uint16_t len16;
+  uint8_t flags;
+  int j;
+
+  if (_kvsm_read(ctx, offset, header, KVSM_CHECKPOINT_HEADER) != KVSM_OK) return KVSM_ERROR;
+  if (((uint8_t)header[0]) != KVSM_BLOB_CHECKPOINT) return KVSM_ERROR;
+  memcpy(&length  , header + 1, sizeof(length));
+  memcpy(&checksum, header + 9, sizeof(checksum));
+  length   = be64toh(length);
+  checksum = be64toh(checksum);
+
+  payload = malloc(length ? length : 1);
+  if (!payload) return KVSM_ERROR;
+  if (
+    (_kvsm_read(ctx, offset + KVSM_CHECKPOINT_HEADER, payload, length) != KVSM_OK) ||
+    (_kvsm_hash(payload, length) != checksum) ||
+    (length < 17)
+  ) {
+    log_warn("Checkpoint at %llx is corrupt", offset);
+    free(payload);
+    return KVSM_ERROR;
+  }
+
+  data  = payload;
+  end   = payload + length;
+  flags = *(data++);
+
+  // An index can only be restored if it was included
+  if (ctx->index && !(flags & KVSM_CHECKPOINT_KEYS)) {
+    log_debug("Checkpoint does not include the key index");
+    free(payload);
+    return KVSM_ERROR;
+  }
+  if (!(flags & KVSM_CHECKPOINT_IDS)) {
+    log_debug("Checkpoint does not include identifiers");
+    free(payload);
+    return KVSM_ERROR;
+  }
+
+  memcpy(&count, data, sizeof(count));
+  data += sizeof(count);
+  count = be64toh(count);
+  if (count > ((end - data) / (16 + KVSM_ID_LENGTH))) goto corrupt;
+  for( i = 0 ; i < count ; i++ ) {
+    memcpy(offsets, data, 16);
+    data += 16;
+    if (!_kvsm_track(ctx, be64toh(offsets[0]), be64toh(offsets[1]), data)) goto corrupt;
+    data += KVSM_ID_LENGTH;
+  }
+
+  if ((end - data) < 8) goto corrupt;
+  memcpy(&count, data, sizeof(count));
+  data += sizeof(count);
+  count = be64toh(count);
+  for( i = 0 ; i < count ; i++ ) {
+    if ((end - data) < 2) goto corrupt;
+    memcpy(&len16, data, sizeof(len16));
+    data += sizeof(len16);
+    len16 = be16toh(len16);
+    if ((end - data) < (len16 + sizeof(offsets))) goto corrupt;
+    if (!ctx->index) {
+      data += len16 + sizeof(offsets);
+      continue;
+    }
+    entry = _kvsm_index_insert(ctx->index, data, len16, _kvsm_hash(data, len16));
+    if (!entry) goto corrupt;
+    data += len16;
+    memcpy(offsets, data, sizeof(offsets));
+    data += sizeof(offsets);
+    for( j = 0 ; j < 4 ; j++ ) offsets[j] = be64toh(offsets[j]);
+    entry->offset = offsets[0];
+    entry->height = offsets[1];
+    entry->value      = offsets[2];
+    entry->length     = offsets[3] & ~KVSM_ENTRY_COMPRESSED;
+    entry->compressed = (offsets[3] & KVSM_ENTRY_COMPRESSED) != 0;
+  }
+
+  // Resume the compaction round that was in progress
+  if (flags & KVSM_CHECKPOINT_COMPACT) {
+    if ((end - data) < (16 + KVSM_ID_LENGTH)) goto corrupt;
+    ctx->compaction = calloc(1, sizeof(struct kvsm_compaction));
+    if (!ctx->compaction) goto corrupt;
+    memcpy(offsets, data, 16);
+    data += 16;
+    ctx->compaction->partitions    = be64toh(offsets[0]);
+    ctx->compaction->cursor_height = be64toh(offsets[1]);
+    ctx->compaction->cursor        = ctx->compaction->cursor_height > 0;
+    memcpy(ctx->compaction->cursor_id, data, KVSM_ID_LENGTH);
+    data += KVSM_ID_LENGTH;
+  }
+
+  // Older checkpoints only allow recovering the size of the medium
+  if (flags & KVSM_CHECKPOINT_USAGE) {
+    if ((end - data) < 24) goto corrupt;
+    memcpy(offsets, data, 24);
+    ctx->bytes_total = be64toh(offsets[0]);
+    ctx->bytes_dead  = be64toh(offsets[1]);
+    ctx->bytes_kept  = be64toh(offsets[2]);
+  } else {
+    for( i = 0 ; i < ctx->txtable->cap ; i++ ) {
+      if (!ctx->txtable->tx[i].offset) continue;
+      ctx->bytes_total += palloc_size(ctx->fd, ctx->txtable->tx[i].offset);
+    }
+  }
+
+  free(payload);
+  return KVSM_OK;
+
+corrupt:
+  log_warn("Checkpoint at %llx is malformed", offset);
+  free(payload);
+  return KVSM_ERROR;
+}
+
+// Loads everything reachable from the heads that isn't known yet
+static KVSM_RESPONSE _kvsm_replay(struct kvsm *ctx) {
+  struct _kvsm_walk walk = {0};
+  struct kvsm_transaction *tx;
+  int i;
+
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    if (_kvsm_txtable_find(ctx->txtable, ctx->head[i])) continue;
+    if (_kvsm_walk_push(&walk, ctx, ctx->head[i]) != KVSM_OK) break;
+  }
+
+  while((!walk.error) && (tx = _kvsm_walk_next(&walk, ctx))) {
+    log_trace("Replaying %llx, %lld", tx->offset, tx->height);
+    if (
+      (!_kvsm_track(ctx, tx->offset, tx->height, tx->id->data)) ||
+      (_kvsm_index_tx(ctx, tx) != KVSM_OK)
+    ) {
+      kvsm_transaction_free(tx);
+      walk.error = true;
+      break;
+    }
+    ctx->checkpoint_pending++;
+    ctx->bytes_total += palloc_size(ctx->fd, tx->offset);
+    for( i = 0 ; i < tx->parent_count ; i++ ) {
+      if (_kvsm_txtable_find(ctx->txtable, tx->parent[i])) continue;
+      if (_kvsm_walk_push(&walk, ctx, tx->parent[i]) != KVSM_OK) break;
+    }
+    kvsm_transaction_free(tx);
+  }
+
+  if (walk.error) {
+    log_warn("Could not replay history");
+    _kvsm_walk_free(&walk);
+    return KVSM_ERROR;
+  }
+  _kvsm_walk_free(&walk);
+  return KVSM_OK;
+}
+
+// Drops all in-memory state derived from the medium
+static KVSM_RESPONSE _kvsm_state_reset(struct kvsm *ctx) {
+  _kvsm_txtable_free(ctx->txtable);
+  ctx->txtable = calloc(1, sizeof(struct kvsm_txtable));
+  if (!ctx->txtable) return KVSM_ERROR;
+
+  _kvsm_idtable_free(ctx->idtable);
+  ctx->idtable = calloc(1, sizeof(struct kvsm_idtable));
+  if (!ctx->idtable) return KVSM_ERROR;
+
+  _kvsm_txorder_free(ctx->txorder);
+  ctx->txorder = calloc(1, sizeof(struct kvsm_txorder));
+  if (!ctx->txorder) return KVSM_ERROR;
+
+  if (ctx->index) {
+    _kvsm_index_free(ctx->index);
+    ctx->index = calloc(1, sizeof(struct kvsm_index));
+    if (!ctx->index) return KVSM_ERROR;
+  }
+
+  _kvsm_compaction_free(ctx->compaction);
+  ctx->compaction = NULL;
+
+  ctx->head_count         = 0;
+  ctx->anchor             = 0;
+  ctx->anchor_heads       = 0;
+  ctx->checkpoint         = 0;
+  ctx->checkpoint_pending = 0;
+  ctx->bytes_total        = 0;
+  ctx->bytes_dead         = 0;
+  ctx->bytes_kept         = 0;
+  ctx->bytes_pinned       = 0;
+  return KVSM_OK;
+}
+
+// Releases what an interrupted write left behind: blobs allocated before the
+// anchor could refer to them, and checkpoints or heads it no longer refers to
+static KVSM_RESPONSE _kvsm_reconcile(struct kvsm *ctx) {
+  PALLOC_OFFSET *orphan = NULL;
+  PALLOC_OFFSET *more;
+  PALLOC_OFFSET off;
+  size_t count = 0, i;
+  uint8_t type;
+
+  for( off = palloc_next(ctx->fd, 0) ; off ; off = palloc_next(ctx->fd, off) ) {
+    if ((off == ctx->anchor) || (off == ctx->anchor_heads) || (off == ctx->checkpoint)) continue;
+    if (_kvsm_read(ctx, off, &type, sizeof(type)) != KVSM_OK) continue;
+    if ((type != KVSM_BLOB_ANCHOR) && (type != KVSM_BLOB_CHECKPOINT) && (type != KVSM_BLOB_HEADS)) {
+      if (type & ~KVSM_VERSION_SUPPORTED) continue;
+      if (_kvsm_txtable_find(ctx->txtable, off)) continue;
+    }
+    more = realloc(orphan, (count + 1) * sizeof(PALLOC_OFFSET));
+    if (!more) {
+      free(orphan);
+      return KVSM_ERROR;
+    }
+    orphan = more;
+    orphan[count++] = off;
+  }
+
+  if (count) log_warn("Releasing %lld blob(s) left behind by an interrupted write", (long long)count);
+  for( i = 0 ; i < count ; i++ ) {
+    pfree(ctx->fd, orphan[i]);
+  }
+  free(orphan);
+  return KVSM_OK;
+}
+
+// Restores state from the anchor and checkpoint, replaying what came after.
+// Media that weren't closed get unreferenced blobs reclaimed as well.
+static KVSM_RESPONSE _kvsm_open_checkpoint(struct kvsm *ctx) {
+  PALLOC_OFFSET first = palloc_next(ctx->fd, 0);
+  bool live = false;
+  if (!first) return KVSM_ERROR;
+  if (_kvsm_anchor_load(ctx, first, &live) != KVSM_OK) return KVSM_ERROR;
+  if (ctx->checkpoint && (_kvsm_checkpoint_load(ctx, ctx->checkpoint) != KVSM_OK)) return KVSM_ERROR;
+  if (_kvsm_replay(ctx) != KVSM_OK) return KVSM_ERROR;
+  return live ? _kvsm_reconcile(ctx) : KVSM_OK;
+}
+
+// Restores state by going through every blob on the medium
+static KVSM_RESPONSE _kvsm_open_scan(struct kvsm *ctx) {
+  struct kvsm_transaction **list = NULL;
+  struct kvsm_transaction **grown;
+  struct kvsm_transaction *tx;
+  struct kvsm_txinfo *info;
+  PALLOC_OFFSET *stale = NULL;
+  PALLOC_OFFSET *more;
+  PALLOC_OFFSET off;
+  size_t count = 0, cap = 0, stale_count = 0, i;
+  uint8_t type;
+  int k;
+
+  off = palloc_next(ctx->fd, 0);
+  while(off) {
+    if (_kvsm_read(ctx, off, &type, sizeof(type)) != KVSM_OK) {
+      off = palloc_next(ctx->fd, off);
+      continue;
+    }
+
+    if ((type == KVSM_BLOB_ANCHOR) && !ctx->anchor) {
+      ctx->anchor = off;
+    } else if ((type == KVSM_BLOB_ANCHOR) || (type == KVSM_BLOB_CHECKPOINT) || (type == KVSM_BLOB_HEADS)) {
+      // We can't trust these, new ones will be written
+      more = realloc(stale, (stale_count + 1) * sizeof(PALLOC_OFFSET));
+      if (!more) {
+        _kvsm_scan_free(list, count);
+        free(stale);
+        return KVSM_ERROR;
+      }
+      stale = more;
+      stale[stale_count++] = off;
+    } else if ((tx = _kvsm_transaction_load(ctx, off))) {
+      if (count == cap) {
+        grown = realloc(list, (cap ? cap * 2 : 64) * sizeof(struct kvsm_transaction *));
+        if (!grown) {
+          kvsm_transaction_free(tx);
+          _kvsm_scan_free(list, count);
+          free(stale);
+          return KVSM_ERROR;
+        }
+        list = grown;
+        cap  = cap ? cap * 2 : 64;
+      }
+      list[count++] = tx;
+      if (!_kvsm_track(ctx, tx->offset, tx->height, tx->id->data)) {
+        _kvsm_scan_free(list, count);
+        free(stale);
+        return KVSM_ERROR;
+      }
+      ctx->bytes_total += palloc_size(ctx->fd, tx->offset);
+    }
+
+    off = palloc_next(ctx->fd, off);
+  }
+
+  for( i = 0 ; i < stale_count ; i++ ) {
+    pfree(ctx->fd, stale[i]);
+  }
+  free(stale);
+
+  // Heads are the transactions no other transaction refers to as parent
+  for( i = 0 ; i < count ; i++ ) {
+    for( k = 0 ; k < list[i]->parent_count ; k++ ) {
+      info = _kvsm_txtable_find(ctx->txtable, list[i]->parent[k]);
+      if (info) info->flags |= KVSM_TXINFO_REFERENCED;
+    }
+  }
+
+  for( i = 0 ; i < count ; i++ ) {
+    info = _kvsm_txtable_find(ctx->txtable, list[i]->offset);
+    if (!(info->flags & KVSM_TXINFO_REFERENCED)) {
+      log_trace("Detected head: %llx, %lld", list[i]->offset, list[i]->height);
+      more = realloc(ctx->head, (ctx->head_count + 1) * sizeof(PALLOC_OFFSET));
+      if (!more) {
+        _kvsm_scan_free(list, count);
+        return KVSM_ERROR;
+      }
+      ctx->head = more;
+      ctx->head[ctx->head_count++] = list[i]->offset;
+    }
+    info->flags &= ~KVSM_TXINFO_REFERENCED;
+    if (_kvsm_index_tx(ctx, list[i]) != KVSM_OK) {
+      log_error("Could not index transaction at %llx", list[i]->offset);
+      _kvsm_scan_free(list, count);
+      return KVSM_ERROR;
+    }
+  }
+
+  _kvsm_scan_free(list, count);
+  ctx->checkpoint_pending = count;
+
+  // Media from before anchors existed get one wherever there's space
+  if (!ctx->anchor) {
+    ctx->anchor = palloc(ctx->fd, KVSM_ANCHOR_SIZE);
+    if (!ctx->anchor) {
+      log_error("Could not allocate anchor");
+      return KVSM_ERROR;
+    }
+  }
+
+  return _kvsm_anchor_write(ctx);
+}
+
+struct kvsm * kvsm_open(const char *filename, const KVSM_FLAGS flags) {
+  log_trace("call: kvsm_open(%s,%d)", filename, flags);
+  FILE *urandom;
+
+  if (!filename) {
+    log_error("No storage medium given");
+    return NULL;
+  }
+
+  PALLOC_FLAGS pflags = PALLOC_DEFAULT;
+  if (!(flags & KVSM_BLOCKDEV)) pflags |= PALLOC_DYNAMIC;
+  struct kvsm *ctx = calloc(1, sizeof(*ctx));
+
+  if (!ctx) {
+    log_error("Could not reserve memory for kvsm context");
+    return NULL;
+  }
+  ctx->flags               = flags;
+  ctx->checkpoint_interval = KVSM_CHECKPOINT_INTERVAL;
+  ctx->compact_memory      = KVSM_COMPACT_MEMORY;
+  ctx->compress_min        = KVSM_COMPRESS_MIN;
+  ctx->sync_interval       = KVSM_SYNC_INTERVAL;
+  ctx->sync_bytes          = KVSM_SYNC_BYTES;
+
+  ctx->fd = palloc_open(filename, pflags);
+  if (!ctx->fd) {
+    log_error("Could not open storage medium: %s", filename);
+    free(ctx);
+    return NULL;
+  }
+
+  log_debug("Initializing blob storage");
+  PALLOC_RESPONSE r = palloc_init(ctx->fd, pflags);
+  if (r != PALLOC_OK) {
+    log_error("Error during medium initialization: %s", filename);
+    palloc_close(ctx->fd);
+    free(ctx);
+    return NULL;
+  }
+
+  // Identifiers must not collide between nodes, seed from the os if possible
+  ctx->seed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)(uintptr_t)ctx;
+  urandom   = fopen("/dev/urandom", "rb");
+  if (urandom) {
+    if (fread(&(ctx->seed), sizeof(ctx->seed), 1, urandom) != 1) {
+      log_warn("Could not read random seed, falling back to time");
+    }
+    fclose(urandom);
+  }
+
+#ifndef _WIN32
+  if (flags & KVSM_MMAP) {
+    ctx->map = calloc(1, sizeof(struct kvsm_map));
+    if (!ctx->map) {
+      log_error("Could not reserve memory for medium mapping");
+      kvsm_close(ctx);
+      return NULL;
+    }
+    pthread_mutex_init(&(ctx->map->lock), NULL);
+  }
+
+  ctx->lock = calloc(1, sizeof(struct kvsm_lock));
+  if (!ctx->lock) {
+    log_error("Could not reserve memory for state lock");
+    kvsm_close(ctx);
+    return NULL;
+  }
+  pthread_rwlock_init(&(ctx->lock->rw), NULL);
+#endif
+
+  if (flags & (KVSM_SYNC | KVSM_GROUP)) {
+    ctx->sync = calloc(1, sizeof(struct kvsm_sync));
+    if (!ctx->sync) {
+      log_error("Could not reserve memory for durability state");
+      kvsm_close(ctx);
+      return NULL;
+    }
+#ifndef _WIN32
+    pthread_mutex_init(&(ctx->sync->lock), NULL);
+    pthread_cond_init(&(ctx->sync->wake), NULL);
+#endif
+  }
+
+  if (flags & KVSM_INDEX) {
+    ctx->index = calloc(1, sizeof(struct kvsm_index));
+    if (!ctx->index) {
+      log_error("Could not reserve memory for key index");
+      kvsm_close(ctx);
+      return NULL;
+    }
+  }
+
+  if (_kvsm_state_reset(ctx) != KVSM_OK) {
+    log_error("Could not reserve memory for kvsm state");
+    kvsm_close(ctx);
+    return NULL;
+  }
+
+  log_debug("Loading checkpoint");
+  if (_kvsm_open_checkpoint(ctx) != KVSM_OK) {
+    log_debug("No usable checkpoint, searching for kv heads");
+    if (
+      (_kvsm_state_reset(ctx) != KVSM_OK) ||
+      (_kvsm_open_scan(ctx) != KVSM_OK)
+    ) {
+      log_error("Could not load state from medium: %s", filename);
+      kvsm_close(ctx);
+      return NULL;
+    }
+  }
+
+  // Until closed, a next open can't trust every allocation to be referenced
+  ctx->live = true;
+  if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+    log_error("Could not update anchor: %s", filename);
+    ctx->live = false;
+    kvsm_close(ctx);
+    return NULL;
+  }
+
+  log_debug("Detected %d head(s)", ctx->head_count);
+  return ctx;
+}
+
+KVSM_RESPONSE kvsm_close(struct kvsm *ctx) {
+  if (!ctx) return KVSM_ERROR;
+  kvsm_compact_stop(ctx);
+  if (ctx->checkpoint_pending && ctx->txtable) {
+    if (kvsm_checkpoint(ctx) != KVSM_OK) {
+      log_warn("Could not write checkpoint, next open will replay");
+    }
+  }
+  if (ctx->live) {
+    _kvsm_lock(ctx);
+    ctx->live = false;
+    if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+      log_warn("Could not update anchor, next open will reconcile");
+    }
+    _kvsm_unlock(ctx);
+  }
+  _kvsm_sync_free(ctx);
+  _kvsm_cache_free(ctx->cache);
+
+  // Snapshots left open can only be ended from here on
+  while(ctx->snapshot) {
+    log_warn("Snapshot still open during close");
+    ctx->snapshot->ctx = NULL;
+    ctx->snapshot      = ctx->snapshot->next;
+  }
+#ifndef _WIN32
+  _kvsm_map_free(ctx->map);
+  if (ctx->lock) {
+    pthread_rwlock_destroy(&(ctx->lock->rw));
+    free(ctx->lock);
+  }
+#endif
+  palloc_close(ctx->fd);
+  _kvsm_compaction_free(ctx->compaction);
+  _kvsm_index_free(ctx->index);
+  _kvsm_txtable_free(ctx->txtable);
+  _kvsm_idtable_free(ctx->idtable);
+  _kvsm_txorder_free(ctx->txorder);
+  if (ctx->head) free(ctx->head);
+  free(ctx);
+  return KVSM_OK;
+}
+
+// Called for the transactions written, checkpoints once enough piled up
+static void _kvsm_checkpoint_tick(struct kvsm *ctx, uint64_t count) {
+  ctx->checkpoint_pending += count;
+  if (!ctx->checkpoint_interval) return;
+  if (ctx->checkpoint_pending < ctx->checkpoint_interval) return;
+  if (kvsm_checkpoint(ctx) != KVSM_OK) {
+    log_warn("Could not write checkpoint");
+  }
+}
+
+// Returns whether the transaction may contain the key, reading a single block
+static bool _kvsm_filter_check(const struct kvsm *ctx, const struct kvsm_transaction *tx, uint64_t hash) {
+  uint64_t mask, bits;
+  uint32_t block;
+  if (!tx->filter_blocks) return true;
+  mask = _kvsm_filter_mask(hash, tx->filter_blocks, &block);
+  if (_kvsm_read(ctx, KVSM_TX_FILTER(tx) + (block * sizeof(uint64_t)), &bits, sizeof(bits)) != KVSM_OK) return true;
+  return (be64toh(bits) & mask) == mask;
+}
+
+// Finds the first entry for the key within a single transaction
+static bool _kvsm_tx_find(const struct kvsm *ctx, const struct kvsm_transaction *tx, const struct buf *key, uint64_t hash, char *scratch, struct _kvsm_entry *entry) {
+  struct _kvsm_entry probe;
+  PALLOC_OFFSET off;
+  uint64_t lo, hi, mid;
+  bool found = false;
+  int r;
+
+  if (!_kvsm_filter_check(ctx, tx, hash)) return false;
+
+  // Ordered = binary search through the table, no values touched
+  if (tx->sorted_count) {
+    lo = 0;
+    hi = tx->sorted_count;
+    while(lo < hi) {
+      mid = lo + ((hi - lo) / 2);
+      if (_kvsm_read(ctx, KVSM_TX_SORTED(tx) + (mid * sizeof(off)), &off, sizeof(off)) != KVSM_OK) return false;
+      if (!_kvsm_entry_read(ctx, tx, KVSM_TX_ENTRIES(tx) + be64toh(off), &probe)) return false;
+      r = _kvsm_entry_cmp(ctx, &probe, key, scratch);
+      if (r < 0) {
+        lo = mid + 1;
+        continue;
+      }
+      if (!r) {
+        *entry = probe;
+        found  = true;
+      }
+      hi = mid;
+    }
+    return found;
+  }
+
+  off = KVSM_TX_ENTRIES(tx);
+  while(_kvsm_entry_read(ctx, tx, off, entry)) {
+    if (_kvsm_entry_match(ctx, entry, key, scratch)) return true;
+    off = entry->next;
+  }
+  return false;
+}
+
+// DOES support multi-value transactions
+static bool _kvsm_get(const struct kvsm *ctx, const PALLOC_OFFSET *head, int head_count, const struct buf *key, struct _kvsm_get_response *response) {
+  log_trace("call: _kvsm_get(...)");
+  struct _kvsm_walk walk = {0};
+  struct kvsm_transaction *tx;
+  struct kvsm_index_entry *found;
+  struct _kvsm_entry entry;
+  bool hit = false;
+  uint64_t hash;
+  char *scratch;
+  int i;
+
+  if (key->len > KVSM_KEY_MAX) {
+    log_error("key too large");
+    return false;
+  }
+  hash = _kvsm_hash(key->data, key->len);
+
+  // Indexed = single probe, the index only describes the current heads
+  if (ctx->index && (head == ctx->head)) {
+    found = _kvsm_index_find(ctx->index, key->data, key->len, hash);
+    if (!found) return false;
+    response->offset = found->offset;
+    response->height = found->height;
+    response->value      = found->value;
+    response->length     = found->length;
+    response->compressed = found->compressed;
+    return true;
+  }
+
+  // Mapped keys are compared in-place
+  scratch = NULL;
+  if (!ctx->map) {
+    scratch = malloc(KVSM_KEY_MAX);
+    if (!scratch) return false;
+  }
+
+  for( i = 0 ; i < head_count ; i++ ) {
+    if (_kvsm_walk_push(&walk, ctx, head[i]) != KVSM_OK) goto done;
+  }
+
+  // Read keys of highest tx in queue
+  // Entries of merged transactions may be older than the transaction itself,
+  // so keep going until nothing higher than what was found is left
+  while(walk.count) {
+    if (hit && (_kvsm_walk_peek(&walk) <= response->height)) break;
+    if (!(tx = _kvsm_walk_next(&walk, ctx))) break;
+    log_trace("Checking %lld", tx->offset);
+    if (
+      _kvsm_tx_find(ctx, tx, key, hash, scratch, &entry) &&
+      ((!hit) || (entry.height > response->height))
+    ) {
+      response->offset = tx->offset;
+      response->height = entry.height;
+      response->value      = entry.value;
+      response->length     = entry.length;
+      response->compressed = entry.compressed;
+      hit = true;
+      if (entry.height == tx->height) {
+        kvsm_transaction_free(tx);
+        break;
+      }
+    }
+    _kvsm_walk_parents(&walk, ctx, tx);
+    kvsm_transaction_free(tx);
+  }
+
+done:
+  if (walk.error) hit = false;
+  _kvsm_walk_free(&walk);
+  free(scratch);
+  return hit;
+}
+
+// Inflates a compressed value already in memory into memory of it's own
+static KVSM_RESPONSE _kvsm_value_unpack(PALLOC_OFFSET offset, const char *packed, uint64_t length, struct buf *output) {
+  uint64_t len64;
+
+  output->data = NULL;
+  output->len  = 0;
+  output->cap  = 0;
+  if (length < KVSM_COMPRESS_HEADER) return KVSM_ERROR;
+  memcpy(&len64, packed, sizeof(len64));
+  len64 = be64toh(len64);
+
+  // The codec expands by at most 255 times, anything beyond is corrupt
+  if (len64 > ((length - KVSM_COMPRESS_HEADER) * 255)) {
+    log_error("Corrupt compressed value at %lld", offset);
+    return KVSM_ERROR;
+  }
+  output->data = malloc(len64 ? len64 : 1);
+  if (!output->data) {
+    log_error("Could not reserve memory for value");
+    return KVSM_ERROR;
+  }
+  if (kvsm_lz_decompress(packed + KVSM_COMPRESS_HEADER, length - KVSM_COMPRESS_HEADER, output->data, len64)) {
+    log_error("Corrupt compressed value at %lld", offset);
+    free(output->data);
+    output->data = NULL;
+    return KVSM_ERROR;
+  }
+  output->len = len64;
+  output->cap = len64;
+  return KVSM_OK;
+}
+
+// Reads a compressed value into memory of it's own
+static KVSM_RESPONSE _kvsm_value_inflate(const struct kvsm *ctx, PALLOC_OFFSET offset, uint64_t length, struct buf *output) {
+  KVSM_RESPONSE result;
+  char *packed;
+
+  output->data = NULL;
+  output->len  = 0;
+  output->cap  = 0;
+  if (length < KVSM_COMPRESS_HEADER) return KVSM_ERROR;
+  packed = malloc(length);
+  if (!packed) {
+    log_error("Could not reserve memory for compressed value");
+    return KVSM_ERROR;
+  }
+  if (_kvsm_read_value(ctx, offset, packed, length) != KVSM_OK) {
+    log_error("Could not read value at %lld", offset);
+    free(packed);
+    return KVSM_ERROR;
+  }
+  result = _kvsm_value_unpack(offset, packed, length, output);
+  free(packed);
+  return result;
+}
+
+// Reads a stored value into memory of it's own, inflating it if needed
+static KVSM_RESPONSE _kvsm_value_load(const struct kvsm *ctx, PALLOC_OFFSET offset, uint64_t length, bool compressed, struct buf *value) {
+  if (compressed) return _kvsm_value_inflate(ctx, offset, length, value);
+  value->data = malloc(length ? length : 1);
+  if (!value->data) {
+    log_error("Error during memory allocation for get return blob");
+    return KVSM_ERROR;
+  }
+  value->len = length;
+  value->cap = length;
+
+  if (_kvsm_read_value(ctx, offset, value->data, value->len) != KVSM_OK) {
+    log_error("Could not read value at %lld", offset);
+    buf_clear(value);
+    return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+static struct buf * _kvsm_get_copy(const struct kvsm *ctx, const PALLOC_OFFSET *head, int head_count, const struct buf *key) {
+  struct _kvsm_get_response response;
+  struct buf *value;
+
+  if (!ctx) return NULL;
+  if (!key) return NULL;
+  if (!_kvsm_get(ctx, head, head_count, key, &response)) return NULL;
+
+  // Handle delete marker response
+  if (!response.length) return NULL;
+
+  value = calloc(1, sizeof(struct buf));
+  if (!value) {
+    log_error("Error during memory allocation for get return struct");
+    return NULL;
+  }
+  if (_kvsm_value_load(ctx, response.value, response.length, response.compressed, value) != KVSM_OK) {
+    free(value);
+    return NULL;
+  }
+  return value;
+}
+
+struct buf * kvsm_get(const struct kvsm *ctx, const struct buf *key) {
+  struct buf *result;
+  if (!ctx) return NULL;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_get_copy(ctx, ctx->head, ctx->head_count, key);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+static KVSM_RESPONSE _kvsm_get_view(const struct kvsm *ctx, const PALLOC_OFFSET *head, int head_count, const struct buf *key, struct buf *view) {
+  struct _kvsm_get_response response;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!key) return KVSM_ERROR;
+  if (!view) return KVSM_ERROR;
+  view->data = NULL;
+  view->len  = 0;
+  view->cap  = 0;
+  if (!ctx->map) {
+    log_error("Views require the medium to be opened with KVSM_MMAP");
+    return KVSM_ERROR;
+  }
+  if (!_kvsm_get(ctx, head, head_count, key, &response)) return KVSM_ERROR;
+
+  // Handle delete marker response
+  if (!response.length) return KVSM_ERROR;
+  if (response.compressed) {
+    log_error("Compressed values can not be viewed");
+    return KVSM_ERROR;
+  }
+
+#ifndef _WIN32
+  view->data = (char *)_kvsm_map_ptr(ctx, response.value, response.length);
+#endif
+  if (!view->data) {
+    log_error("Could not map value at %lld", response.value);
+    return KVSM_ERROR;
+  }
+  view->len = response.length;
+  return KVSM_OK;
+}
+
+// State of a single key during kvsm_multiget, `first` refers to the first
+// occurrence of a key requested more than once
+struct _kvsm_multiget_key {
+  const struct buf         *key;
+  uint64_t                  hash;
+  size_t                    first;
+  bool                      hit;
+  bool                      final;
+  struct _kvsm_get_response response;
+};
+
+// Keys still looked for, open-addressed by hash, holding key index + 1
+struct _kvsm_multiget {
+  struct _kvsm_multiget_key *key;
+  size_t                     count;
+  size_t                    *slot;
+  size_t                     mask;
+  size_t                     pending; // Distinct keys without a final hit
+  size_t                     missing; // Distinct keys without any hit
+};
+
+static struct _kvsm_multiget_key * _kvsm_multiget_find(const struct _kvsm_multiget *mg, const char *key, size_t len, uint64_t hash) {
+  struct _kvsm_multiget_key *found;
+  size_t i;
+  for( i = hash & mg->mask ; mg->slot[i] ; i = (i + 1) & mg->mask ) {
+    found = &(mg->key[mg->slot[i] - 1]);
+    if (found->hash != hash) continue;
+    if (found->key->len != len) continue;
+    if (memcmp(found->key->data, key, len)) continue;
+    return found;
+  }
+  return NULL;
+}
+
+// Records an entry of tx for the key, if it beats what was found before
+// Same rules as _kvsm_get, first occurrence within a transaction wins
+static void _kvsm_multiget_hit(struct _kvsm_multiget *mg, struct _kvsm_multiget_key *k, const struct kvsm_transaction *tx, const struct _kvsm_entry *entry) {
+  if (k->final) return;
+  if (k->hit && ((k->response.offset == tx->offset) || (entry->height <= k->response.height))) return;
+  if (!k->hit) mg->missing--;
+  k->hit                 = true;
+  k->response.offset     = tx->offset;
+  k->response.height     = entry->height;
+  k->response.value      = entry->value;
+  k->response.length     = entry->length;
+  k->response.compressed = entry->compressed;
+  if (entry->height == tx->height) {
+    k->final = true;
+    mg->pending--;
+  }
+}
+
+// Whether nothing left in the walk could hold a newer version of any key
+static bool _kvsm_multiget_done(const struct _kvsm_multiget *mg, uint64_t next) {
+  size_t i;
+  if (!mg->pending) return true;
+  if (mg->missing) return false;
+  for( i = 0 ; i < mg->count ; i++ ) {
+    if (mg->key[i].first != i) continue;
+    if (mg->key[i].final) continue;
+    if ((!mg->key[i].hit) || (next > mg->key[i].response.height)) return false;
+  }
+  return true;
+}
+
+// Matches a single transaction against the keys still looked for
+static KVSM_RESPONSE _kvsm_multiget_tx(const struct kvsm *ctx, struct _kvsm_multiget *mg, const struct kvsm_transaction *tx, char *scratch) {
+  struct _kvsm_multiget_key *k;
+  struct _kvsm_entry entry;
+  const char *key;
+  PALLOC_OFFSET off;
+  size_t i;
+
+  // Large transactions are cheaper to probe per key, through their filter
+  // and ordered table, than to read in full
+  if (tx->sorted_count > mg->pending) {
+    for( i = 0 ; i < mg->count ; i++ ) {
+      k = &(mg->key[i]);
+      if ((k->first != i) || k->final) continue;
+      if (_kvsm_tx_find(ctx, tx, k->key, k->hash, scratch, &entry)) _kvsm_multiget_hit(mg, k, tx, &entry);
+    }
+    return KVSM_OK;
+  }
+
+  off = KVSM_TX_ENTRIES(tx);
+  while(mg->pending && _kvsm_entry_read(ctx, tx, off, &entry)) {
+    off = entry.next;
+    key = NULL;
+#ifndef _WIN32
+    if (ctx->map) key = _kvsm_map_ptr(ctx, entry.key, entry.keylen);
+#endif
+    if (!key) {
+      if (_kvsm_read(ctx, entry.key, scratch, entry.keylen) != KVSM_OK) return KVSM_ERROR;
+      key = scratch;
+    }
+    k = _kvsm_multiget_find(mg, key, entry.keylen, _kvsm_hash(key, entry.keylen));
+    if (k) _kvsm_multiget_hit(mg, k, tx, &entry);
+  }
+  return KVSM_OK;
+}
+
+// Walks the history once for all keys, stopping once every key is resolved
+static KVSM_RESPONSE _kvsm_multiget_walk(const struct kvsm *ctx, struct _kvsm_multiget *mg) {
+  struct _kvsm_walk walk = {0};
+  struct kvsm_transaction *tx;
+  KVSM_RESPONSE result = KVSM_ERROR;
+  char *scratch;
+  int i;
+
+  scratch = malloc(KVSM_KEY_MAX);
+  if (!scratch) return KVSM_ERROR;
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    if (_kvsm_walk_push(&walk, ctx, ctx->head[i]) != KVSM_OK) goto done;
+  }
+
+  while(walk.count) {
+    if (_kvsm_multiget_done(mg, _kvsm_walk_peek(&walk))) break;
+    if (!(tx = _kvsm_walk_next(&walk, ctx))) break;
+    if (
+      (_kvsm_multiget_tx(ctx, mg, tx, scratch) != KVSM_OK) ||
+      (_kvsm_walk_parents(&walk, ctx, tx) != KVSM_OK)
+    ) {
+      kvsm_transaction_free(tx);
+      goto done;
+    }
+    kvsm_transaction_free(tx);
+  }
+  if (!walk.error) result = KVSM_OK;
+
+done:
+  _kvsm_walk_free(&walk);
+  free(scratch);
+  return result;
+}
+
+static KVSM_RESPONSE _kvsm_multiget(const struct kvsm *ctx, const struct buf *keys, size_t count, struct buf **results) {
+  struct _kvsm_multiget mg = {0};
+  struct _kvsm_multiget_key *k, *found;
+  size_t cap, i, j;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!results) return KVSM_ERROR;
+  for( i = 0 ; i < count ; i++ ) results[i] = NULL;
+  if (!count) return KVSM_OK;
+  if (!keys) return KVSM_ERROR;
+
+  // The index answers each key with a single probe already
+  if (ctx->index) {
+    for( i = 0 ; i < count ; i++ ) {
+      results[i] = _kvsm_get_copy(ctx, ctx->head, ctx->head_count, &(keys[i]));
+    }
+    return KVSM_OK;
+  }
+
+  for( cap = 16 ; cap < (count * 2) ; cap *= 2 );
+  mg.key   = calloc(count, sizeof(struct _kvsm_multiget_key));
+  mg.slot  = calloc(cap, sizeof(size_t));
+  mg.count = count;
+  mg.mask  = cap - 1;
+  if ((!mg.key) || (!mg.slot)) {
+    log_error("Could not reserve memory for multiget");
+    goto error;
+  }
+  for( i = 0 ; i < count ; i++ ) {
+    if (keys[i].len > KVSM_KEY_MAX) {
+      log_error("key too large");
+      goto error;
+    }
+    k = &(mg.key[i]);
+    k->key   = &(keys[i]);
+    k->hash  = _kvsm_hash(keys[i].data, keys[i].len);
+    k->first = i;
+    found    = _kvsm_multiget_find(&mg, keys[i].data, keys[i].len, k->hash);
+    if (found) {
+      k->first = found - mg.key;
+      continue;
+    }
+    for( j = k->hash & mg.mask ; mg.slot[j] ; j = (j + 1) & mg.mask );
+    mg.slot[j] = i + 1;
+    mg.pending++;
+    mg.missing++;
+  }
+
+  if (_kvsm_multiget_walk(ctx, &mg) != KVSM_OK) goto error;
+
+  // Duplicates share the first occurrence's answer
+  for( i = 0 ; i < count ; i++ ) {
+    k = &(mg.key[mg.key[i].first]);
+    if ((!k->hit) || (!k->response.length)) continue;
+    results[i] = calloc(1, sizeof(struct buf));
+    if (!results[i]) goto error;
+    if (_kvsm_value_load(ctx, k->response.value, k->response.length, k->response.compressed, results[i]) != KVSM_OK) {
+      free(results[i]);
+      results[i] = NULL;
+      goto error;
+    }
+  }
+
+  free(mg.key);
+  free(mg.slot);
+  return KVSM_OK;
+
+error:
+  for( i = 0 ; i < count ; i++ ) {
+    if (!results[i]) continue;
+    buf_clear(results[i]);
+    free(results[i]);
+    results[i] = NULL;
+  }
+  free(mg.key);
+  free(mg.slot);
+  return KVSM_ERROR;
+}
+
+KVSM_RESPONSE kvsm_multiget(const struct kvsm *ctx, const struct buf *keys, size_t count, struct buf **results) {
+  KVSM_RESPONSE result;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_multiget(ctx, keys, count, results);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+// Walks the index's key order from start, up to end or as long as keys have
+// the prefix, skipping deleted keys
+static KVSM_RESPONSE _kvsm_scan(const struct kvsm *ctx, const struct buf *start, const struct buf *end, const struct buf *prefix, int (*callback)(const struct buf *key, const struct buf *value, void *udata), void *udata) {
+  struct kvsm_index_entry *found;
+  struct _kvsm_skipnode *node;
+  struct buf key, value;
+  int stop;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!callback) return KVSM_ERROR;
+  if (!ctx->index) {
+    log_error("Scans require the medium to be opened with KVSM_INDEX");
+    return KVSM_ERROR;
+  }
+
+  node = start ? _kvsm_index_order_seek(ctx->index, start->data, start->len, NULL)[0] : ctx->index->order[0];
+  for( ; node ; node = node->next[0] ) {
+    if (end && (_kvsm_key_cmp(node->key, node->len, end->data, end->len) >= 0)) break;
+    if (prefix && ((node->len < prefix->len) || memcmp(node->key, prefix->data, prefix->len))) break;
+    found = _kvsm_index_find(ctx->index, node->key, node->len, node->hash);
+    if ((!found) || (!found->length)) continue;
+
+    if (_kvsm_value_load(ctx, found->value, found->length, found->compressed, &value) != KVSM_OK) return KVSM_ERROR;
+    key.data = (char *)node->key;
+    key.len  = node->len;
+    key.cap  = 0;
+    stop = callback(&key, &value, udata);
+    buf_clear(&value);
+    if (stop) break;
+  }
+
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_scan(const struct kvsm *ctx, const struct buf *start, const struct buf *end, int (*callback)(const struct buf *key, const struct buf *value, void *udata), void *udata) {
+  KVSM_RESPONSE result;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_scan(ctx, start, end, NULL, callback, udata);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_scan_prefix(const struct kvsm *ctx, const struct buf *prefix, int (*callback)(const struct buf *key, const struct buf *value, void *udata), void *udata) {
+  KVSM_RESPONSE result;
+  if (!prefix) return KVSM_ERROR;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_scan(ctx, prefix, NULL, prefix, callback, udata);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_get_view(const struct kvsm *ctx, const struct buf *key, struct buf *view) {
+  KVSM_RESPONSE result;
+  if (!ctx) return KVSM_ERROR;
+  _kvsm_lock_read(ctx);
+
+  // Nothing pins the view, the worker could hand it's space to a writer
+  if (ctx->worker) {
+    log_error("Views require a snapshot while compacting in the background");
+    _kvsm_unlock(ctx);
+    return KVSM_ERROR;
+  }
+  result = _kvsm_get_view(ctx, ctx->head, ctx->head_count, key, view);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+// Whether nothing was written since the snapshot began, the caller holds the
+// descriptor's lock
+static bool _kvsm_snapshot_current(const struct kvsm_snapshot *snapshot) {
+  const struct kvsm *ctx = snapshot->ctx;
+  return (
+    (snapshot->head_count == ctx->head_count) &&
+    ((!ctx->head_count) || !memcmp(snapshot->head, ctx->head, ctx->head_count * sizeof(PALLOC_OFFSET)))
+  );
+}
+
+static struct kvsm_value * _kvsm_value_open(const struct kvsm *ctx, const struct kvsm_snapshot *snapshot, const struct buf *key) {
+  struct _kvsm_get_response response;
+  struct kvsm_value *value;
+  struct buf inflated;
+
+  if (!ctx) return NULL;
+  if (!key) return NULL;
+  if (!_kvsm_get(ctx, _kvsm_snapshot_current(snapshot) ? ctx->head : snapshot->head, snapshot->head_count, key, &response)) return NULL;
+
+  // Handle delete marker response
+  if (!response.length) return NULL;
+
+  value = calloc(1, sizeof(struct kvsm_value));
+  if (!value) {
+    log_error("Error during memory allocation for value handle");
+    return NULL;
+  }
+  value->ctx    = ctx;
+  value->offset = response.value;
+  value->length = response.length;
+
+  // Compressed values can't be read by range, hold all of it instead
+  if (response.compressed) {
+    if (_kvsm_value_inflate(ctx, response.value, response.length, &inflated) != KVSM_OK) {
+      free(value);
+      return NULL;
+    }
+    value->data   = inflated.data;
+    value->length = inflated.len;
+  }
+  return value;
+}
+
+// The handle holds a snapshot, so compaction leaves the version in place
+// until it's freed. Inflated values are in memory and don't need it.
+struct kvsm_value * kvsm_value_open(struct kvsm *ctx, const struct buf *key) {
+  struct kvsm_snapshot *snapshot;
+  struct kvsm_value *result;
+  snapshot = kvsm_snapshot_begin(ctx);
+  if (!snapshot) return NULL;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_value_open(ctx, snapshot, key);
+  _kvsm_unlock(ctx);
+  if (result && !result->data) {
+    result->snapshot = snapshot;
+  } else {
+    kvsm_snapshot_end(snapshot);
+  }
+  return result;
+}
+
+static KVSM_RESPONSE _kvsm_value_read(const struct kvsm_value *value, uint64_t offset, void *data, size_t len) {
+  if (!value) return KVSM_ERROR;
+  if ((offset > value->length) || (len > (value->length - offset))) {
+    log_error("Read beyond end of value");
+    return KVSM_ERROR;
+  }
+  if (value->data) {
+    memcpy(data, value->data + offset, len);
+    return KVSM_OK;
+  }
+  return _kvsm_read_value(value->ctx, value->offset + offset, data, len);
+}
+
+KVSM_RESPONSE kvsm_value_read(const struct kvsm_value *value, uint64_t offset, void *data, size_t len) {
+  KVSM_RESPONSE result;
+  _kvsm_lock_read(value ? value->ctx : NULL);
+  result = _kvsm_value_read(value, offset, data, len);
+  _kvsm_unlock(value ? value->ctx : NULL);
+  return result;
+}
+
+static KVSM_RESPONSE _kvsm_value_send(const struct kvsm_value *value, uint64_t offset, uint64_t len, int fd) {
+  if (!value) return KVSM_ERROR;
+  if ((offset > value->length) || (len > (value->length - offset))) {
+    log_error("Send beyond end of value");
+    return KVSM_ERROR;
+  }
+#ifdef _WIN32
+  log_error("Streaming values is not supported on this platform");
+  return KVSM_ERROR;
+#else
+  const struct kvsm *ctx = value->ctx;
+  off_t pos = value->offset + offset;
+  const char *ptr;
+  char *chunk;
+  ssize_t n;
+  size_t c;
+
+  // Inflated values are already in memory
+  if (value->data) {
+    ptr = value->data + offset;
+    while(len) {
+      n = write(fd, ptr, len);
+      if ((n < 0) && (errno == EINTR)) continue;
+      if (n <= 0) break;
+      ptr += n;
+      len -= n;
+    }
+    if (len) {
+      log_error("Could not stream value");
+      return KVSM_ERROR;
+    }
+    return KVSM_OK;
+  }
+
+#ifdef __linux__
+  // Let the kernel move the data, file targets first, anything else second
+  while(len) {
+    n = copy_file_range(ctx->fd, &pos, fd, NULL, len, 0);
+    if (n <= 0) break;
+    len -= n;
+  }
+  while(len) {
+    n = sendfile(fd, ctx->fd, &pos, len);
+    if (n <= 0) break;
+    len -= n;
+  }
+#endif
+  if (!len) return KVSM_OK;
+
+  // Fallback, straight from the mapping or in bounded chunks
+  chunk = NULL;
+  if (!ctx->map) {
+    chunk = malloc(KVSM_STREAM_CHUNK);
+    if (!chunk) {
+      log_error("Could not reserve memory for streaming");
+      return KVSM_ERROR;
+    }
+  }
+  while(len) {
+    c = (len < KVSM_STREAM_CHUNK) ? len : KVSM_STREAM_CHUNK;
+    if (ctx->map) {
+      ptr = _kvsm_map_ptr(ctx, pos, c);
+    } else {
+      ptr = (_kvsm_read(ctx, pos, chunk, c) == KVSM_OK) ? chunk : NULL;
+    }
+    if (!ptr) break;
+    while(c) {
+      n = write(fd, ptr, c);
+      if ((n < 0) && (errno == EINTR)) continue;
+      if (n <= 0) break;
+      ptr += n;
+      pos += n;
+      len -= n;
+      c   -= n;
+    }
+    if (c) break;
+  }
+  free(chunk);
+  if (len) {
+    log_error("Could not stream value");
+    return KVSM_ERROR;
+  }
+  return KVSM_OK;
+#endif
+}
+
+KVSM_RESPONSE kvsm_value_send(const struct kvsm_value *value, uint64_t offset, uint64_t len, int fd) {
+  KVSM_RESPONSE result;
+  _kvsm_lock_read(value ? value->ctx : NULL);
+  result = _kvsm_value_send(value, offset, len, fd);
+  _kvsm_unlock(value ? value->ctx : NULL);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_value_free(struct kvsm_value *value) {
+  if (!value) return KVSM_ERROR;
+  if (value->snapshot) kvsm_snapshot_end(value->snapshot);
+  free(value->data);
+  free(value);
+  return KVSM_OK;
+}
+
+// Highest height amongst the current heads
+static uint64_t _kvsm_head_height(const struct kvsm *ctx) {
+  struct kvsm_txinfo *info;
+  uint64_t height = 0;
+  int i;
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    info = _kvsm_txtable_find(ctx->txtable, ctx->head[i]);
+    if (info && (info->height > height)) height = info->height;
+  }
+  return height;
+}
+
+// Highest height pinned by any open snapshot, compaction leaves everything
+// up to it in place
+static uint64_t _kvsm_snapshot_height(const struct kvsm *ctx) {
+  struct kvsm_snapshot *snapshot;
+  uint64_t height = 0;
+  for( snapshot = ctx->snapshot ; snapshot ; snapshot = snapshot->next ) {
+    if (snapshot->height > height) height = snapshot->height;
+  }
+  return height;
+}
+
+struct kvsm_snapshot * kvsm_snapshot_begin(struct kvsm *ctx) {
+  struct kvsm_snapshot *snapshot;
+  if (!ctx) return NULL;
+  snapshot = calloc(1, sizeof(struct kvsm_snapshot));
+  if (!snapshot) {
+    log_error("Could not reserve memory for snapshot");
+    return NULL;
+  }
+  _kvsm_lock(ctx);
+  if (ctx->head_count) {
+    snapshot->head = malloc(ctx->head_count * sizeof(PALLOC_OFFSET));
+    if (!snapshot->head) {
+      _kvsm_unlock(ctx);
+      log_error("Could not reserve memory for snapshot heads");
+      free(snapshot);
+      return NULL;
+    }
+    memcpy(snapshot->head, ctx->head, ctx->head_count * sizeof(PALLOC_OFFSET));
+  }
+  snapshot->ctx        = ctx;
+  snapshot->head_count = ctx->head_count;
+  snapshot->height     = _kvsm_head_height(ctx);
+  snapshot->next       = ctx->snapshot;
+  if (ctx->snapshot) ctx->snapshot->prev = snapshot;
+  ctx->snapshot = snapshot;
+  _kvsm_unlock(ctx);
+  return snapshot;
+}
+
+struct buf * kvsm_snapshot_get(const struct kvsm_snapshot *snapshot, const struct buf *key) {
+  const struct kvsm *ctx;
+  const PALLOC_OFFSET *head;
+  struct buf *result;
+  if (!snapshot) return NULL;
+  if (!(ctx = snapshot->ctx)) return NULL;
+  _kvsm_lock_read(ctx);
+
+  // Nothing written since, the current heads may use the index
+  head = _kvsm_snapshot_current(snapshot) ? ctx->head : snapshot->head;
+  result = _kvsm_get_copy(ctx, head, snapshot->head_count, key);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_snapshot_get_view(const struct kvsm_snapshot *snapshot, const struct buf *key, struct buf *view) {
+  const struct kvsm *ctx;
+  const PALLOC_OFFSET *head;
+  KVSM_RESPONSE result;
+  if (!snapshot) return KVSM_ERROR;
+  if (!(ctx = snapshot->ctx)) return KVSM_ERROR;
+  _kvsm_lock_read(ctx);
+  head = _kvsm_snapshot_current(snapshot) ? ctx->head : snapshot->head;
+  result = _kvsm_get_view(ctx, head, snapshot->head_count, key, view);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_snapshot_end(struct kvsm_snapshot *snapshot) {
+  struct kvsm *ctx;
+  if (!snapshot) return KVSM_ERROR;
+  ctx = snapshot->ctx;
+  if (ctx) {
+    _kvsm_lock(ctx);
+    if (snapshot->prev) snapshot->prev->next = snapshot->next;
+    if (snapshot->next) snapshot->next->prev = snapshot->prev;
+    if (ctx->snapshot == snapshot) ctx->snapshot = snapshot->next;
+
+    // What the snapshots held back is reclaimable again
+    if (!ctx->snapshot) {
+      ctx->bytes_kept  -= (ctx->bytes_pinned < ctx->bytes_kept) ? ctx->bytes_pinned : ctx->bytes_kept;
+      ctx->bytes_pinned = 0;
+      _kvsm_compact_wake(ctx);
+    }
+    _kvsm_unlock(ctx);
+  }
+  if (snapshot->head) free(snapshot->head);
+  free(snapshot);
+  return KVSM_OK;
+}
+
+struct kvsm_batch * kvsm_batch_begin(struct kvsm *ctx) {
+  struct kvsm_batch *batch;
+  if (!ctx) return NULL;
+  batch = calloc(1, sizeof(struct kvsm_batch));
+  if (!batch) {
+    log_error("Could not reserve memory for batch");
+    return NULL;
+  }
+  batch->ctx = ctx;
+  return batch;
+}
+
+KVSM_RESPONSE kvsm_batch_free(struct kvsm_batch *batch) {
+  int i;
+  if (!batch) return KVSM_ERROR;
+  for( i = 0 ; i < batch->count ; i++ ) {
+    buf_clear(&(batch->key[i]));
+    buf_clear(&(batch->value[i]));
+  }
+  free(batch->key);
+  free(batch->value);
+  free(batch->slot);
+  free(batch->compressed);
+  free(batch);
+  return KVSM_OK;
+}
+
+// Slot table maps key hashes to entry index + 1, for last-write-wins puts
+static int * _kvsm_batch_slot(struct kvsm_batch *batch, const struct buf *key) {
+  size_t i;
+  int *entry;
+  for( i = _kvsm_hash(key->data, key->len) & (batch->slot_cap - 1) ; ; i = (i + 1) & (batch->slot_cap - 1) ) {
+    entry = &(batch->slot[i]);
+    if (!*entry) return entry;
+    if (batch->key[*entry - 1].len != key->len) continue;
+    if (memcmp(batch->key[*entry - 1].data, key->data, key->len)) continue;
+    return entry;
+  }
+}
+
+KVSM_RESPONSE kvsm_batch_put(struct kvsm_batch *batch, const struct buf *key, const struct buf *value) {
+  struct buf *keys, *values;
+  int *slot;
+  int i;
+
+  if (!batch) return KVSM_ERROR;
+  if (!key) return KVSM_ERROR;
+  if (!value) return KVSM_ERROR;
+  if (key->len > KVSM_KEY_MAX) {
+    log_error("key too large");
+    return KVSM_ERROR;
+  }
+
+  // A zero length byte is what ends a transaction's entry list
+  if (!key->len) {
+    log_error("key is empty");
+    return KVSM_ERROR;
+  }
+
+  // Keep the slot table's load factor below 50%
+  if ((batch->count + 1) * 2 > batch->slot_cap) {
+    slot = calloc(batch->slot_cap ? batch->slot_cap * 2 : 16, sizeof(int));
+    if (!slot) {
+      log_error("Could not reserve memory for batch");
+      return KVSM_ERROR;
+    }
+    free(batch->slot);
+    batch->slot     = slot;
+    batch->slot_cap = batch->slot_cap ? batch->slot_cap * 2 : 16;
+    for( i = 0 ; i < batch->count ; i++ ) {
+      *_kvsm_batch_slot(batch, &(batch->key[i])) = i + 1;
+    }
+  }
+
+  // Same key again = replace the value
+  slot = _kvsm_batch_slot(batch, key);
+  if (*slot) {
+    i = *slot - 1;
+    batch->value[i].len = 0;
+    if (value->len && !buf_append(&(batch->value[i]), value->data, value->len)) {
+      log_error("Could not reserve memory for batch entry");
+      return KVSM_ERROR;
+    }
+    return KVSM_OK;
+  }
+
+  // Both arrays keep their old contents if growing either fails
+  if (batch->count == batch->cap) {
+    keys = realloc(batch->key, (batch->cap ? batch->cap * 2 : 16) * sizeof(struct buf));
+    if (keys) batch->key = keys;
+    values = keys ? realloc(batch->value, (batch->cap ? batch->cap * 2 : 16) * sizeof(struct buf)) : NULL;
+    if (values) batch->value = values;
+    if (!values) {
+      log_error("Could not reserve memory for batch entry");
+      return KVSM_ERROR;
+    }
+    batch->cap = batch->cap ? batch->cap * 2 : 16;
+  }
+  i = batch->count;
+  memset(&(batch->key[i])  , 0, sizeof(struct buf));
+  memset(&(batch->value[i]), 0, sizeof(struct buf));
+  if (
+    (!buf_append(&(batch->key[i]), key->data, key->len)) ||
+    (value->len && !buf_append(&(batch->value[i]), value->data, value->len))
+  ) {
+    log_error("Could not reserve memory for batch entry");
+    buf_clear(&(batch->key[i]));
+    buf_clear(&(batch->value[i]));
+    return KVSM_ERROR;
+  }
+  batch->count++;
+  *slot = batch->count;
+  return KVSM_OK;
+}
+
+static int _kvsm_batch_cmp(const void *a, const void *b) {
+  const struct buf *ka = *((const struct buf **)a);
+  const struct buf *kb = *((const struct buf **)b);
+  return _kvsm_key_cmp(ka->data, ka->len, kb->data, kb->len);
+}
+
+// Orders the batch's entries by key, keys are unique within a batch
+static KVSM_RESPONSE _kvsm_batch_sort(struct kvsm_batch *batch) {
+  struct buf **order = malloc(batch->count * sizeof(struct buf *));
+  struct buf *key    = malloc(batch->count * sizeof(struct buf));
+  struct buf *value  = malloc(batch->count * sizeof(struct buf));
+  int i;
+
+  if ((!order) || (!key) || (!value)) {
+    free(order);
+    free(key);
+    free(value);
+    return KVSM_ERROR;
+  }
+  for( i = 0 ; i < batch->count ; i++ ) {
+    order[i] = &(batch->key[i]);
+  }
+  qsort(order, batch->count, sizeof(struct buf *), _kvsm_batch_cmp);
+  for( i = 0 ; i < batch->count ; i++ ) {
+    key[i]   = *(order[i]);
+    value[i] = batch->value[order[i] - batch->key];
+  }
+  free(order);
+  free(batch->key);
+  free(batch->value);
+  batch->key   = key;
+  batch->value = value;
+  batch->cap   = batch->count;
+
+  // Slots referred to the old order
+  memset(batch->slot, 0, batch->slot_cap * sizeof(int));
+  for( i = 0 ; i < batch->count ; i++ ) {
+    *_kvsm_batch_slot(batch, &(batch->key[i])) = i + 1;
+  }
+  return KVSM_OK;
+}
+
+// Swaps values for their compressed form where that saves space
+// Returns whether any value was compressed
+static bool _kvsm_batch_compress(struct kvsm_batch *batch) {
+  struct kvsm *ctx = batch->ctx;
+  struct buf *value;
+  bool any = false;
+  uint64_t len64;
+  size_t length;
+  char *packed;
+  int i;
+
+  batch->compressed = calloc(batch->count, sizeof(bool));
+  if (!batch->compressed) return false;
+  for( i = 0 ; i < batch->count ; i++ ) {
+    value = &(batch->value[i]);
+    if ((value->len < ctx->compress_min) || (value->len <= (KVSM_COMPRESS_HEADER + 1))) continue;
+    packed = malloc(value->len);
+    if (!packed) continue;
+    length = kvsm_lz_compress(value->data, value->len, packed + KVSM_COMPRESS_HEADER, value->len - KVSM_COMPRESS_HEADER - 1);
+    if (!length) {
+      free(packed);
+      continue;
+    }
+    len64 = htobe64(value->len);
+    memcpy(packed, &len64, sizeof(len64));
+    free(value->data);
+    value->data = packed;
+    value->len  = KVSM_COMPRESS_HEADER + length;
+    value->cap  = value->len;
+    batch->compressed[i] = any = true;
+  }
+  return any;
+}
+
+// Writes all entries as a single transaction, frees the batch
+static KVSM_RESPONSE _kvsm_batch_commit(struct kvsm_batch *batch) {
+  log_trace("call: kvsm_batch_commit(...)");
+  struct kvsm_transaction tx = {0};
+  struct _kvsm_entry entry;
+  struct buf id = {0};
+  struct kvsm *ctx;
+  PALLOC_OFFSET off;
+  PALLOC_OFFSET *head, *prev;
+  uint64_t *hash;
+  uint64_t *rel = NULL;
+  uint8_t version = KVSM_VERSION_FILTER;
+  size_t table = 0;
+  int i, prev_count;
+
+  if (!batch) return KVSM_ERROR;
+  ctx = batch->ctx;
+
+  // Nothing to write
+  if (!batch->count) return kvsm_batch_free(batch);
+
+  // Large transactions get a table to binary search through
+  if (batch->count >= KVSM_SORTED_MIN) {
+    rel = malloc(batch->count * sizeof(uint64_t));
+    if ((!rel) || (_kvsm_batch_sort(batch) != KVSM_OK)) {
+      log_error("Could not reserve memory for transaction");
+      free(rel);
+      kvsm_batch_free(batch);
+      return KVSM_ERROR;
+    }
+    version |= KVSM_VERSION_SORTED;
+    table    = KVSM_SORTED_SIZE(batch->count);
+  }
+
+  // Values are compressed after sorting, the flags follow their entries
+  if ((ctx->flags & KVSM_COMPRESS) && _kvsm_batch_compress(batch)) {
+    version |= KVSM_VERSION_COMPRESS;
+  }
+
+  // Calculate transaction size
+  size_t tx_size = KVSM_HEADER_SIZE;
+  tx_size += (ctx->head_count + 1) * sizeof(PALLOC_OFFSET); // parents + end-of-list
+  tx_size += KVSM_FILTER_SIZE(batch->count);
+  tx_size += table;
+  off      = tx_size; // Start of the entry list
+  for( i = 0 ; i < batch->count ; i++ ) {
+    if (rel) rel[i] = tx_size - off;
+    tx_size += (batch->key[i].len >= 128) ? 2 : 1;
+    tx_size += batch->key[i].len;
+    tx_size += 8; // value size
+    tx_size += batch->value[i].len;
+  }
+  tx_size += 1; // End-of-list
+
+  log_trace("Reserving %lld bytes", tx_size);
+  PALLOC_OFFSET offset = palloc(ctx->fd, tx_size);
+  if (!offset) {
+    log_error("Could not allocate %lld bytes for transaction", tx_size);
+    free(rel);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+
+  id.data = (char[KVSM_ID_LENGTH]){0};
+  id.len  = KVSM_ID_LENGTH;
+  tx.ctx    = ctx;
+  tx.id     = &id;
+  tx.offset = offset;
+  tx.height = _kvsm_head_height(ctx) + 1;
+  _kvsm_random_id(ctx, id.data);
+
+  // Assemble the whole transaction, so it hits the medium in one write
+  struct buf image = {0};
+  uint64_t len64;
+  image.data = malloc(tx_size);
+  hash       = malloc(batch->count * sizeof(uint64_t));
+  prev       = malloc((ctx->head_count ? ctx->head_count : 1) * sizeof(PALLOC_OFFSET));
+  head       = ctx->head_count ? ctx->head : realloc(ctx->head, sizeof(PALLOC_OFFSET));
+  if (head) ctx->head = head;
+  if ((!image.data) || (!hash) || (!prev) || (!head)) {
+    log_error("Could not reserve memory for transaction");
+    free(image.data);
+    free(hash);
+    free(prev);
+    free(rel);
+    pfree(ctx->fd, offset);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  image.cap  = tx_size;
+  prev_count = ctx->head_count;
+  if (prev_count) memcpy(prev, ctx->head, prev_count * sizeof(PALLOC_OFFSET));
+
+  image.data[image.len++] = version;
+  memcpy(image.data + image.len, id.data, KVSM_ID_LENGTH);
+  image.len += KVSM_ID_LENGTH;
+  len64 = htobe64(tx.height);
+  memcpy(image.data + image.len, &len64, sizeof(len64));
+  image.len += sizeof(len64);
+
+  // Merge all current heads into the new transaction, 0-terminated
+  memset(image.data + image.len, 0, (ctx->head_count + 1) * sizeof(PALLOC_OFFSET));
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    len64 = htobe64(ctx->head[i]);
+    memcpy(image.data + image.len, &len64, sizeof(len64));
+    image.len += sizeof(len64);
+  }
+  image.len += sizeof(PALLOC_OFFSET);
+
+  for( i = 0 ; i < batch->count ; i++ ) {
+    hash[i] = _kvsm_hash(batch->key[i].data, batch->key[i].len);
+  }
+  image.len += _kvsm_filter_write(image.data + image.len, hash, batch->count);
+  free(hash);
+  if (rel) image.len += _kvsm_sorted_write(image.data + image.len, rel, batch->count);
+  free(rel);
+
+  for( i = 0 ; i < batch->count ; i++ ) {
+    if (batch->key[i].len >= 128) {
+      image.data[image.len++] = 128 | (batch->key[i].len >> 8);
+    }
+    image.data[image.len++] = batch->key[i].len & 255;
+    if (batch->key[i].len) memcpy(image.data + image.len, batch->key[i].data, batch->key[i].len);
+    image.len += batch->key[i].len;
+    len64 = batch->value[i].len;
+    if ((version & KVSM_VERSION_COMPRESS) && batch->compressed[i]) len64 |= KVSM_ENTRY_COMPRESSED;
+    len64 = htobe64(len64);
+    memcpy(image.data + image.len, &len64, sizeof(len64));
+    image.len += sizeof(len64);
+    if (batch->value[i].len) memcpy(image.data + image.len, batch->value[i].data, batch->value[i].len);
+    image.len += batch->value[i].len;
+  }
+  image.data[image.len++] = 0; // End-of-list
+
+  if (_kvsm_write(ctx, offset, image.data, image.len) != KVSM_OK) {
+    log_error("Could not write transaction");
+    buf_clear(&image);
+    free(prev);
+    pfree(ctx->fd, offset);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  buf_clear(&image);
+
+  // Whatever fails from here on leaves the heads as they were and the blob
+  // released, so nothing refers to a transaction that's not registered
+  if (_kvsm_compaction_link(ctx, offset, prev, prev_count) != KVSM_OK) {
+    log_error("Could not register transaction with compaction");
+    _kvsm_compaction_unlink(ctx, offset, prev, prev_count);
+    free(prev);
+    pfree(ctx->fd, offset);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  if (!_kvsm_track(ctx, offset, tx.height, id.data)) {
+    log_error("Could not register transaction");
+    _kvsm_compaction_unlink(ctx, offset, prev, prev_count);
+    free(prev);
+    pfree(ctx->fd, offset);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+
+  // We're the only head now
+  off = offset + KVSM_HEADER_SIZE + ((prev_count + 1) * sizeof(PALLOC_OFFSET)) + KVSM_FILTER_SIZE(batch->count) + table;
+  ctx->head[0]    = offset;
+  ctx->head_count = 1;
+
+  if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+    log_error("Could not register transaction");
+    memcpy(ctx->head, prev, prev_count * sizeof(PALLOC_OFFSET));
+    ctx->head_count = prev_count;
+    _kvsm_untrack(ctx, offset);
+    _kvsm_compaction_unlink(ctx, offset, prev, prev_count);
+    free(prev);
+    pfree(ctx->fd, offset);
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  free(prev);
+  ctx->bytes_total += palloc_size(ctx->fd, offset);
+  _kvsm_sync_queue(ctx, id.data, tx.height, palloc_size(ctx->fd, offset));
+
+  // Without the index there's no telling what we supersede, assume all of it
+  for( i = 0 ; (!ctx->index) && (i < batch->count) ; i++ ) {
+    ctx->bytes_dead += _kvsm_entry_size(batch->key[i].len, batch->value[i].len);
+  }
+
+  // We know where everything landed, no need to read it back for the index
+  for( i = 0 ; ctx->index && (i < batch->count) ; i++ ) {
+    entry.keylen = batch->key[i].len;
+    entry.key    = off + ((entry.keylen >= 128) ? 2 : 1);
+    entry.height = tx.height;
+    entry.length     = batch->value[i].len;
+    entry.compressed = (version & KVSM_VERSION_COMPRESS) && batch->compressed[i];
+    entry.value      = entry.key + entry.keylen + sizeof(uint64_t);
+    entry.next       = entry.value + entry.length;
+    if (_kvsm_index_put(ctx, &tx, &entry, batch->key[i].data) != KVSM_OK) {
+      log_error("Could not update index");
+      kvsm_batch_free(batch);
+      return KVSM_ERROR;
+    }
+    off = entry.next;
+  }
+
+  kvsm_batch_free(batch);
+  _kvsm_sync_commit(ctx);
+  _kvsm_checkpoint_tick(ctx, 1);
+  _kvsm_compact_wake(ctx);
+  return KVSM_OK;
+}
+
+// Commit frees the batch, so hold on to it's descriptor
+KVSM_RESPONSE kvsm_batch_commit(struct kvsm_batch *batch) {
+  struct kvsm *ctx = batch ? batch->ctx : NULL;
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_batch_commit(batch);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_set(struct kvsm *ctx, const struct buf *key, const struct buf *value) {
+  log_trace("call: kvsm_set(...)");
+  struct kvsm_batch *batch = kvsm_batch_begin(ctx);
+  if (!batch) return KVSM_ERROR;
+  if (kvsm_batch_put(batch, key, value) != KVSM_OK) {
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  return kvsm_batch_commit(batch);
+}
+
+// Request of an aio descriptor, from being issued until it's callback ran
+struct _kvsm_aio_op {
+  int                   type;
+  struct _kvsm_aio_op  *next;
+  struct _kvsm_aio_pin *pin;
+  PALLOC_OFFSET         offset;
+  uint64_t              length;
+  uint64_t              done;       // Bytes read so far
+  bool                  compressed;
+  char                 *data;
+  KVSM_RESPONSE         status;
+  struct _kvsm_aio_op  *group;      // Commits a flush makes durable
+#ifdef KVSM_URING
+  struct iovec          iov;
+#endif
+  void                (*callback)(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata);
+  void                 *udata;
+};
+
+// Snapshot shared by the reads issued while the heads stayed the same, it
+// keeps compaction away from values until they're read
+struct _kvsm_aio_pin {
+  struct kvsm_snapshot *snapshot;
+  unsigned int          refs;
+};
+
+#ifdef KVSM_URING
+// Submission and completion rings shared with the kernel
+struct kvsm_aio_ring {
+  int                  fd;
+  char                *sq_ptr;
+  size_t               sq_size;
+  char                *cq_ptr;
+  size_t               cq_size;
+  struct io_uring_sqe *sqe;
+  size_t               sqe_size;
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqe;
+};
+#endif
+
+#ifndef _WIN32
+// Workers performing requests with blocking calls, handing them back through
+// `finished`
+struct kvsm_aio_pool {
+  pthread_t           *thread;
+  unsigned int         count;
+  pthread_mutex_t      lock;
+  pthread_cond_t       work;
+  pthread_cond_t       done;
+  struct _kvsm_aio_op *queue;
+  struct _kvsm_aio_op *queue_tail;
+  struct _kvsm_aio_op *finished;
+  bool                 stop;
+};
+#endif
+
+struct kvsm_aio_state {
+  struct _kvsm_aio_op   *ready;        // Completed, callback not ran yet
+  struct _kvsm_aio_op   *ready_tail;
+  struct _kvsm_aio_op   *waiting;      // Commits written after the flush in flight started
+  struct _kvsm_aio_op   *waiting_tail;
+  struct _kvsm_aio_op   *flush;
+  struct _kvsm_aio_pin  *pin;
+  unsigned int           inflight;     // Handed to the backend
+#ifdef KVSM_URING
+  struct kvsm_aio_ring  *ring;
+#endif
+#ifndef _WIN32
+  struct kvsm_aio_pool  *pool;
+#endif
+};
+
+// Takes a reference to a snapshot of the current heads
+static struct _kvsm_aio_pin * _kvsm_aio_pin(struct kvsm_aio *aio) {
+  struct kvsm_aio_state *state = aio->state;
+  struct _kvsm_aio_pin *pin = state->pin;
+
+  if (pin) {
+    _kvsm_lock_read(aio->ctx);
+    if (!_kvsm_snapshot_current(pin->snapshot)) pin = NULL;
+    _kvsm_unlock(aio->ctx);
+  }
+
+  // The previous one lives on until it's reads completed
+  if (!pin) {
+    pin = calloc(1, sizeof(struct _kvsm_aio_pin));
+    if (!pin) {
+      log_error("Could not reserve memory for aio snapshot");
+      return NULL;
+    }
+    pin->snapshot = kvsm_snapshot_begin(aio->ctx);
+    if (!pin->snapshot) {
+      free(pin);
+      return NULL;
+    }
+    state->pin = pin;
+  }
+
+  pin->refs++;
+  return pin;
+}
+
+// Ends the snapshot once nothing reads through it anymore
+static void _kvsm_aio_unpin(struct kvsm_aio *aio, struct _kvsm_aio_pin *pin) {
+  if (!pin) return;
+  if (--pin->refs) return;
+  if (aio->state->pin == pin) aio->state->pin = NULL;
+  kvsm_snapshot_end(pin->snapshot);
+  free(pin);
+}
+
+// Queues the request's callback for kvsm_aio_wait
+static void _kvsm_aio_ready(struct kvsm_aio *aio, struct _kvsm_aio_op *op) {
+  struct kvsm_aio_state *state = aio->state;
+  _kvsm_aio_unpin(aio, op->pin);
+  op->pin  = NULL;
+  op->next = NULL;
+  if (state->ready_tail) state->ready_tail->next = op;
+  else state->ready = op;
+  state->ready_tail = op;
+}
+
+// Performs a request with blocking calls
+static void _kvsm_aio_perform(const struct kvsm *ctx, struct _kvsm_aio_op *op) {
+  if (op->type == KVSM_AIO_FLUSH) {
+    op->status = _kvsm_fsync(ctx);
+    return;
+  }
+  op->status = KVSM_OK;
+  if (_kvsm_pread(ctx, op->offset, op->data, op->length) != (ssize_t)op->length) {
+    log_error("Could not read value at %lld", op->offset);
+    op->status = KVSM_ERROR;
+  }
+}
+
+static void _kvsm_aio_submit(struct kvsm_aio *aio, struct _kvsm_aio_op *op);
+
+// Starts flushing the medium for every commit waiting on it, one flush is in
+// flight at a time so commits written meanwhile share the next
+static void _kvsm_aio_flush(struct kvsm_aio *aio) {
+  struct kvsm_aio_state *state = aio->state;
+  struct _kvsm_aio_op *op, *commit, *next;
+
+  if (state->flush || !state->waiting) return;
+  op = calloc(1, sizeof(struct _kvsm_aio_op));
+  if (!op) {
+    log_error("Could not reserve memory for aio flush");
+    for( commit = state->waiting ; commit ; commit = next ) {
+      next           = commit->next;
+      commit->status = KVSM_ERROR;
+      _kvsm_aio_ready(aio, commit);
+    }
+    state->waiting      = NULL;
+    state->waiting_tail = NULL;
+    return;
+  }
+
+  op->type            = KVSM_AIO_FLUSH;
+  op->group           = state->waiting;
+  state->waiting      = NULL;
+  state->waiting_tail = NULL;
+  state->flush        = op;
+  _kvsm_aio_submit(aio, op);
+}
+
+// Called once the backend is done with a request
+static void _kvsm_aio_done(struct kvsm_aio *aio, struct _kvsm_aio_op *op) {
+  struct kvsm_aio_state *state = aio->state;
+  struct _kvsm_aio_op *commit, *next;
+
+  state->inflight--;
+  if (op->type != KVSM_AIO_FLUSH) {
+    _kvsm_aio_ready(aio, op);
+    return;
+  }
+
+  for( commit = op->group ; commit ; commit = next ) {
+    next           = commit->next;
+    commit->status = op->status;
+    _kvsm_aio_ready(aio, commit);
+  }
+  state->flush = NULL;
+  free(op);
+  _kvsm_aio_flush(aio);
+}
+
+#ifdef KVSM_URING
+static void _kvsm_aio_ring_close(struct kvsm_aio_ring *ring) {
+  if (!ring) return;
+  if (ring->sqe && (ring->sqe != MAP_FAILED)) munmap(ring->sqe, ring->sqe_size);
+  if (ring->cq_ptr && (ring->cq_ptr != MAP_FAILED) && (ring->cq_ptr != ring->sq_ptr)) munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr && (ring->sq_ptr != MAP_FAILED)) munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+  free(ring);
+}
+
+// Returns NULL where the kernel refuses io_uring, like older kernels or
+// sandboxes filtering it
+static struct kvsm_aio_ring * _kvsm_aio_ring_open(unsigned int entries) {
+  struct io_uring_params params;
+  struct kvsm_aio_ring *ring;
+
+  ring = calloc(1, sizeof(struct kvsm_aio_ring));
+  if (!ring) return NULL;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_size  = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  ring->cq_size  = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+  ring->sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) goto fail;
+  ring->cq_ptr = ring->sq_ptr;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) goto fail;
+  }
+  ring->sqe = mmap(NULL, ring->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqe == MAP_FAILED) goto fail;
+
+  ring->sq_head  = (unsigned *)(ring->sq_ptr + params.sq_off.head);
+  ring->sq_tail  = (unsigned *)(ring->sq_ptr + params.sq_off.tail);
+  ring->sq_mask  = (unsigned *)(ring->sq_ptr + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(ring->sq_ptr + params.sq_off.array);
+  ring->cq_head  = (unsigned *)(ring->cq_ptr + params.cq_off.head);
+  ring->cq_tail  = (unsigned *)(ring->cq_ptr + params.cq_off.tail);
+  ring->cq_mask  = (unsigned *)(ring->cq_ptr + params.cq_off.ring_mask);
+  ring->cqe      = (struct io_uring_cqe *)(ring->cq_ptr + params.cq_off.cqes);
+  return ring;
+
+fail:
+  _kvsm_aio_ring_close(ring);
+  return NULL;
+}
+
+// Hands a read of what's left of the value, or a flush, to the kernel
+static KVSM_RESPONSE _kvsm_aio_ring_submit(struct kvsm_aio_ring *ring, int fd, struct _kvsm_aio_op *op) {
+  unsigned tail  = *(ring->sq_tail);
+  unsigned index = tail & *(ring->sq_mask);
+  struct io_uring_sqe *sqe = &(ring->sqe[index]);
+  int n;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd        = fd;
+  sqe->user_data = (uintptr_t)op;
+  if (op->type == KVSM_AIO_FLUSH) {
+    sqe->opcode = IORING_OP_FSYNC;
+  } else {
+    op->iov.iov_base = op->data + op->done;
+    op->iov.iov_len  = op->length - op->done;
+    if (op->iov.iov_len > KVSM_AIO_CHUNK) op->iov.iov_len = KVSM_AIO_CHUNK;
+    sqe->opcode = IORING_OP_READV;
+    sqe->addr   = (uintptr_t)&(op->iov);
+    sqe->len    = 1;
+    sqe->off    = op->offset + op->done;
+  }
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do {
+    n = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+  } while((n < 0) && (errno == EINTR));
+  if (n == 1) return KVSM_OK;
+
+  // Not consumed, take it back so it can't complete later
+  if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  }
+  log_error("Could not submit asynchronous request");
+  return KVSM_ERROR;
+}
+
+static KVSM_RESPONSE _kvsm_aio_ring_reap(struct kvsm_aio *aio, bool block) {
+  struct kvsm_aio_ring *ring = aio->state->ring;
+  struct _kvsm_aio_op *op;
+  unsigned head, tail;
+  int n, res;
+
+  if (block) {
+    do {
+      n = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while((n < 0) && (errno == EINTR));
+    if (n < 0) {
+      log_error("Could not wait for asynchronous requests");
+      return KVSM_ERROR;
+    }
+  }
+
+  head = *(ring->cq_head);
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while(head != tail) {
+    op  = (struct _kvsm_aio_op *)(uintptr_t)ring->cqe[head & *(ring->cq_mask)].user_data;
+    res = ring->cqe[head & *(ring->cq_mask)].res;
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (op->type == KVSM_AIO_FLUSH) {
+      op->status = KVSM_OK;
+      if (res < 0) {
+        log_error("Could not flush medium to stable storage");
+        op->status = KVSM_ERROR;
+      }
+      _kvsm_aio_done(aio, op);
+      continue;
+    }
+
+    // Short reads continue where they left off, the end of the medium fails
+    if (res <= 0) {
+      log_error("Could not read value at %lld", op->offset);
+      op->status = KVSM_ERROR;
+      _kvsm_aio_done(aio, op);
+      continue;
+    }
+    op->done += res;
+    if (op->done < op->length) {
+      if (_kvsm_aio_ring_submit(ring, aio->ctx->fd, op) == KVSM_OK) continue;
+      op->status = KVSM_ERROR;
+    }
+    _kvsm_aio_done(aio, op);
+  }
+
+  return KVSM_OK;
+}
+#endif
+
+#ifndef _WIN32
+static void * _kvsm_aio_worker(void *arg) {
+  struct kvsm_aio *aio = arg;
+  struct kvsm_aio_pool *pool = aio->state->pool;
+  struct _kvsm_aio_op *op;
+
+  pthread_mutex_lock(&(pool->lock));
+  for(;;) {
+    while((!pool->queue) && (!pool->stop)) pthread_cond_wait(&(pool->work), &(pool->lock));
+    if (!(op = pool->queue)) break;
+    pool->queue = op->next;
+    if (!pool->queue) pool->queue_tail = NULL;
+    pthread_mutex_unlock(&(pool->lock));
+
+    _kvsm_aio_perform(aio->ctx, op);
+
+    pthread_mutex_lock(&(pool->lock));
+    op->next       = pool->finished;
+    pool->finished = op;
+    pthread_cond_signal(&(pool->done));
+  }
+  pthread_mutex_unlock(&(pool->lock));
+
+  return NULL;
+}
+
+static void _kvsm_aio_pool_close(struct kvsm_aio_pool *pool) {
+  unsigned int i;
+  if (!pool) return;
+  pthread_mutex_lock(&(pool->lock));
+  pool->stop = true;
+  pthread_cond_broadcast(&(pool->work));
+  pthread_mutex_unlock(&(pool->lock));
+  for( i = 0 ; i < pool->count ; i++ ) {
+    pthread_join(pool->thread[i], NULL);
+  }
+  pthread_cond_destroy(&(pool->done));
+  pthread_cond_destroy(&(pool->work));
+  pthread_mutex_destroy(&(pool->lock));
+  free(pool->thread);
+  free(pool);
+}
+
+// Starts up to `count` workers, fewer if the system refuses more
+static struct kvsm_aio_pool * _kvsm_aio_pool_open(struct kvsm_aio *aio, unsigned int count) {
+  struct kvsm_aio_pool *pool;
+
+  pool = calloc(1, sizeof(struct kvsm_aio_pool));
+  if (!pool) return NULL;
+  pool->thread = calloc(count, sizeof(pthread_t));
+  if (!pool->thread) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->work), NULL);
+  pthread_cond_init(&(pool->done), NULL);
+
+  aio->state->pool = pool;
+  while(pool->count < count) {
+    if (pthread_create(&(pool->thread[pool->count]), NULL, _kvsm_aio_worker, aio)) break;
+    pool->count++;
+  }
+  if (!pool->count) {
+    aio->state->pool = NULL;
+    _kvsm_aio_pool_close(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+static KVSM_RESPONSE _kvsm_aio_pool_reap(struct kvsm_aio *aio, bool block) {
+  struct kvsm_aio_pool *pool = aio->state->pool;
+  struct _kvsm_aio_op *finished = NULL, *op;
+
+  pthread_mutex_lock(&(pool->lock));
+  while(block && !pool->finished) pthread_cond_wait(&(pool->done), &(pool->lock));
+  while((op = pool->finished)) {
+    pool->finished = op->next;
+    op->next       = finished;
+    finished       = op;
+  }
+  pthread_mutex_unlock(&(pool->lock));
+
+  while((op = finished)) {
+    finished = op->next;
+    _kvsm_aio_done(aio, op);
+  }
+  return KVSM_OK;
+}
+#endif
+
+static void _kvsm_aio_submit(struct kvsm_aio *aio, struct _kvsm_aio_op *op) {
+  struct kvsm_aio_state *state = aio->state;
+  state->inflight++;
+
+#ifdef KVSM_URING
+  if (state->ring) {
+    if (_kvsm_aio_ring_submit(state->ring, aio->ctx->fd, op) != KVSM_OK) {
+      op->status = KVSM_ERROR;
+      _kvsm_aio_done(aio, op);
+    }
+    return;
+  }
+#endif
+
+#ifndef _WIN32
+  if (state->pool) {
+    op->next = NULL;
+    pthread_mutex_lock(&(state->pool->lock));
+    if (state->pool->queue_tail) state->pool->queue_tail->next = op;
+    else state->pool->queue = op;
+    state->pool->queue_tail = op;
+    pthread_cond_signal(&(state->pool->work));
+    pthread_mutex_unlock(&(state->pool->lock));
+    return;
+  }
+#endif
+
+  // Nothing to hand it to
+  _kvsm_aio_perform(aio->ctx, op);
+  _kvsm_aio_done(aio, op);
+}
+
+// Gathers what the backend completed, waiting for at least one if asked
+static KVSM_RESPONSE _kvsm_aio_reap(struct kvsm_aio *aio, bool block) {
+  if (!aio->state->inflight) return KVSM_OK;
+#ifdef KVSM_URING
+  if (aio->state->ring) return _kvsm_aio_ring_reap(aio, block);
+#endif
+#ifndef _WIN32
+  if (aio->state->pool) return _kvsm_aio_pool_reap(aio, block);
+#endif
+  return KVSM_OK;
+}
+
+// Hands the value to the callback, it's the callback's to free
+static void _kvsm_aio_finish(struct kvsm_aio *aio, struct _kvsm_aio_op *op) {
+  KVSM_RESPONSE status = op->status;
+  struct buf *value = NULL;
+
+  if ((op->type == KVSM_AIO_GET) && (status == KVSM_OK) && op->data) {
+    value = calloc(1, sizeof(struct buf));
+    if (!value) {
+      log_error("Error during memory allocation for get return struct");
+      status = KVSM_ERROR;
+    } else if (op->compressed) {
+      if (_kvsm_value_unpack(op->offset, op->data, op->length, value) != KVSM_OK) {
+        free(value);
+        value  = NULL;
+        status = KVSM_ERROR;
+      }
+    } else {
+      value->data = op->data;
+      value->len  = op->length;
+      value->cap  = op->length;
+      op->data    = NULL;
+    }
+  }
+
+  aio->pending--;
+  free(op->data);
+  op->callback(aio, status, value, op->udata);
+  free(op);
+}
+
+struct kvsm_aio * kvsm_aio_open(struct kvsm *ctx, unsigned int depth, KVSM_FLAGS flags) {
+  struct kvsm_aio *aio;
+  if (!ctx) return NULL;
+
+  // Without the index a lookup walks the history, which would block the caller
+  if (!ctx->index) {
+    log_error("Asynchronous requests require the medium to be opened with KVSM_INDEX");
+    return NULL;
+  }
+
+  aio = calloc(1, sizeof(struct kvsm_aio));
+  if (!aio) {
+    log_error("Could not reserve memory for aio descriptor");
+    return NULL;
+  }
+  aio->state = calloc(1, sizeof(struct kvsm_aio_state));
+  if (!aio->state) {
+    log_error("Could not reserve memory for aio descriptor");
+    free(aio);
+    return NULL;
+  }
+  aio->ctx   = ctx;
+  aio->depth = depth ? depth : KVSM_AIO_DEPTH;
+
+#ifdef KVSM_URING
+  // One extra entry for the flush
+  if (!(flags & KVSM_AIO_POOL)) aio->state->ring = _kvsm_aio_ring_open(aio->depth + 1);
+  aio->uring = aio->state->ring != NULL;
+  if (aio->uring) return aio;
+#endif
+
+#ifndef _WIN32
+  if (!_kvsm_aio_pool_open(aio, (aio->depth < KVSM_AIO_THREADS) ? aio->depth : KVSM_AIO_THREADS)) {
+    log_warn("Could not start aio workers, requests complete as they're issued");
+  }
+#endif
+  return aio;
+}
+
+KVSM_RESPONSE kvsm_aio_get(struct kvsm_aio *aio, const struct buf *key, void (*callback)(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata), void *udata) {
+  struct _kvsm_get_response response;
+  struct _kvsm_aio_op *op;
+  struct kvsm *ctx;
+  bool found;
+
+  if (!aio) return KVSM_ERROR;
+  if (!key) return KVSM_ERROR;
+  if (!callback) return KVSM_ERROR;
+  ctx = aio->ctx;
+
+  // Make room first, callbacks only run from kvsm_aio_wait
+  while(aio->state->inflight >= aio->depth) {
+    if (_kvsm_aio_reap(aio, true) != KVSM_OK) return KVSM_ERROR;
+  }
+
+  op = calloc(1, sizeof(struct _kvsm_aio_op));
+  if (!op) {
+    log_error("Could not reserve memory for aio request");
+    return KVSM_ERROR;
+  }
+  op->type     = KVSM_AIO_GET;
+  op->callback = callback;
+  op->udata    = udata;
+
+  // Mapped values are copied right away, there's nothing to pin
+  if (!ctx->map) {
+    op->pin = _kvsm_aio_pin(aio);
+    if (!op->pin) {
+      free(op);
+      return KVSM_ERROR;
+    }
+  }
+
+  // Only the index probe happens now, so the pin must hold the current heads
+  _kvsm_lock_read(ctx);
+  while(op->pin && !_kvsm_snapshot_current(op->pin->snapshot)) {
+    _kvsm_unlock(ctx);
+    _kvsm_aio_unpin(aio, op->pin);
+    op->pin = _kvsm_aio_pin(aio);
+    if (!op->pin) {
+      free(op);
+      return KVSM_ERROR;
+    }
+    _kvsm_lock_read(ctx);
+  }
+  found = _kvsm_get(ctx, ctx->head, ctx->head_count, key, &response);
+  op->status = KVSM_OK;
+  if (found && response.length) {
+    op->offset     = response.value;
+    op->length     = response.length;
+    op->compressed = response.compressed;
+    op->data       = malloc(op->length);
+    if (!op->data) {
+      log_error("Error during memory allocation for get return blob");
+      op->status = KVSM_ERROR;
+    } else if (ctx->map) {
+      op->status = _kvsm_read_medium(ctx, op->offset, op->data, op->length);
+    }
+  }
+  _kvsm_unlock(ctx);
+  aio->pending++;
+
+  // Missing, deleted or mapped need no reading
+  if ((!op->data) || ctx->map || (op->status != KVSM_OK)) {
+    _kvsm_aio_ready(aio, op);
+    return KVSM_OK;
+  }
+  _kvsm_aio_submit(aio, op);
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_aio_commit(struct kvsm_aio *aio, struct kvsm_batch *batch, void (*callback)(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata), void *udata) {
+  struct kvsm_aio_state *state;
+  struct _kvsm_aio_op *op;
+
+  if ((!aio) || (!callback) || (batch && (batch->ctx != aio->ctx))) {
+    log_error("Batch does not belong to the aio descriptor");
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  state = aio->state;
+
+  op = calloc(1, sizeof(struct _kvsm_aio_op));
+  if (!op) {
+    log_error("Could not reserve memory for aio request");
+    kvsm_batch_free(batch);
+    return KVSM_ERROR;
+  }
+  if (kvsm_batch_commit(batch) != KVSM_OK) {
+    free(op);
+    return KVSM_ERROR;
+  }
+  op->type     = KVSM_AIO_COMMIT;
+  op->status   = KVSM_OK;
+  op->callback = callback;
+  op->udata    = udata;
+  aio->pending++;
+
+  // Already flushed by the commit itself
+  if (aio->ctx->flags & KVSM_SYNC) {
+    _kvsm_aio_ready(aio, op);
+    return KVSM_OK;
+  }
+
+  if (state->waiting_tail) state->waiting_tail->next = op;
+  else state->waiting = op;
+  state->waiting_tail = op;
+  _kvsm_aio_flush(aio);
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_aio_wait(struct kvsm_aio *aio, unsigned int count) {
+  struct kvsm_aio_state *state;
+  struct _kvsm_aio_op *op;
+  unsigned int done = 0;
+
+  if (!aio) return KVSM_ERROR;
+  state = aio->state;
+  if (_kvsm_aio_reap(aio, false) != KVSM_OK) return KVSM_ERROR;
+
+  // Callbacks may issue new requests, which are waited for likewise
+  for(;;) {
+    while((op = state->ready)) {
+      state->ready = op->next;
+      if (!state->ready) state->ready_tail = NULL;
+      _kvsm_aio_finish(aio, op);
+      done++;
+    }
+    if ((done >= count) || (!state->inflight)) break;
+    if (_kvsm_aio_reap(aio, true) != KVSM_OK) return KVSM_ERROR;
+  }
+
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_aio_close(struct kvsm_aio *aio) {
+  KVSM_RESPONSE result = KVSM_OK;
+  if (!aio) return KVSM_ERROR;
+
+  // Every request still gets it's callback
+  while(aio->pending) {
+    if ((result = kvsm_aio_wait(aio, aio->pending)) != KVSM_OK) break;
+  }
+
+#ifdef KVSM_URING
+  _kvsm_aio_ring_close(aio->state->ring);
+#endif
+#ifndef _WIN32
+  _kvsm_aio_pool_close(aio->state->pool);
+#endif
+  free(aio->state);
+  free(aio);
+  return result;
+}
+
+static bool _kvsm_is_head(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  int i;
+  for( i = 0 ; i < ctx->head_count ; i++ ) {
+    if (ctx->head[i] == offset) return true;
+  }
+  return false;
+}
+
+// Drops the checkpoint before anything it refers to is freed
+static KVSM_RESPONSE _kvsm_checkpoint_drop(struct kvsm *ctx) {
+  PALLOC_OFFSET off = ctx->checkpoint;
+  ctx->checkpoint_pending++;
+  if (!off) return KVSM_OK;
+  ctx->checkpoint = 0;
+  if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+    log_error("Could not update anchor");
+    return KVSM_ERROR;
+  }
+  pfree(ctx->fd, off);
+  return KVSM_OK;
+}
+
+// Starts a round over a snapshot of all transactions, newest first being the
+// order in which lookups would encounter them. The snapshot is copied by
+// _kvsm_compaction_fill, everything written from here on is left out of it.
+static KVSM_RESPONSE _kvsm_compaction_start(struct kvsm *ctx) {
+  struct kvsm_compaction *c = ctx->compaction;
+
+  c->count = 0;
+  c->pos   = 0;
+  c->cap   = ctx->txtable->count ? ctx->txtable->count : 1;
+  c->node  = malloc(c->cap * sizeof(struct kvsm_txinfo));
+  c->live  = calloc(c->cap, sizeof(bool));
+  c->dead  = calloc(c->cap, sizeof(uint64_t));
+  c->kept  = 0;
+  if ((!c->node) || (!c->live) || (!c->dead)) return KVSM_ERROR;
+  c->filling     = true;
+  c->fill_height = UINT64_MAX;
+  memset(c->fill_id, 0xff, KVSM_ID_LENGTH);
+  if (!c->partitions) c->partitions = 1;
+  c->partition = 0;
+  return KVSM_OK;
+}
+
+// Copies the next part of the snapshot, continuing below the last copied
+// transaction so it doesn't matter how the table moved in between
+static KVSM_RESPONSE _kvsm_compaction_fill(struct kvsm *ctx, uint64_t *bytes) {
+  struct kvsm_compaction *c = ctx->compaction;
+  struct kvsm_txinfo *node;
+  uint64_t *dead;
+  bool *live;
+  ssize_t pos;
+
+  pos = _kvsm_txorder_seek(ctx->txorder, c->fill_height, c->fill_id);
+  while(*bytes && ((pos = _kvsm_txorder_step(ctx->txorder, pos - 1, -1)) >= 0)) {
+
+    // Transactions ingested below the snapshot's top since it was started
+    if (c->count == c->cap) {
+      node = realloc(c->node, c->cap * 2 * sizeof(struct kvsm_txinfo));
+      if (node) c->node = node;
+      live = node ? realloc(c->live, c->cap * 2 * sizeof(bool)) : NULL;
+      if (live) c->live = live;
+      dead = live ? realloc(c->dead, c->cap * 2 * sizeof(uint64_t)) : NULL;
+      if (dead) c->dead = dead;
+      if (!dead) return KVSM_ERROR;
+      memset(c->live + c->cap, 0, c->cap * sizeof(bool));
+      memset(c->dead + c->cap, 0, c->cap * sizeof(uint64_t));
+      c->cap *= 2;
+    }
+
+    c->node[c->count++] = ctx->txorder->tx[pos];
+    c->fill_height      = ctx->txorder->tx[pos].height;
+    memcpy(c->fill_id, ctx->txorder->tx[pos].id, KVSM_ID_LENGTH);
+    *bytes -= (*bytes < sizeof(struct kvsm_txinfo)) ? *bytes : sizeof(struct kvsm_txinfo);
+  }
+  if (pos < 0) c->filling = false;
+  return KVSM_OK;
+}
+
+// Restarts the round, splitting the keys over more partitions
+static void _kvsm_compaction_restart(struct kvsm_compaction *c) {
+  kvsm_transaction_free(c->tx);
+  free(c->node);
+  free(c->live);
+  free(c->dead);
+  c->tx    = NULL;
+  c->node  = NULL;
+  c->live  = NULL;
+  c->dead  = NULL;
+  _kvsm_keyset_free(&(c->seen));
+  _kvsm_children_free(&(c->children));
+  c->partitions *= 2;
+  log_debug("Compacting in %lld partitions", c->partitions);
+}
+
+// Removes a transaction nothing refers to the contents of anymore, holding
+// the given amount of entry bytes. Returns KVSM_OK if it was kept as well
+static KVSM_RESPONSE _kvsm_compaction_discard(struct kvsm *ctx, struct kvsm_transaction *tx, uint64_t size) {
+  struct kvsm_compaction *c = ctx->compaction;
+  struct _kvsm_children_slot *slot, *pslot;
+  struct kvsm_transaction **children;
+  struct kvsm_transaction *child;
+  PALLOC_OFFSET *replacement;
+  uint64_t blob;
+  size_t i, count;
+  int k, l, m, n;
+  bool discardable = true;
+
+  slot  = _kvsm_children_get(&(c->children), tx->offset, false);
+  count = slot ? slot->count : 0;
+  children = calloc(count ? count : 1, sizeof(struct kvsm_transaction *));
+  if (!children) return KVSM_ERROR;
+
+  // Children take over our parents in our place, but only if that fits in
+  // their existing parent list. Transactions without parents are kept so
+  // their children are never left without any.
+  for( i = 0 ; (i < count) && discardable ; i++ ) {
+    child = children[i] = _kvsm_transaction_load(ctx, slot->child[i]);
+    if (!child) {
+      discardable = false;
+      break;
+    }
+    n = child->parent_count - 1;
+    for( l = 0 ; l < tx->parent_count ; l++ ) {
+      for( m = 0 ; m < child->parent_count ; m++ ) {
+        if (child->parent[m] == tx->parent[l]) break;
+      }
+      if (m == child->parent_count) n++;
+    }
+    if ((n < 1) || (n > child->parent_count)) discardable = false;
+  }
+  if (!discardable) {
+    for( i = 0 ; i < count ; i++ ) kvsm_transaction_free(children[i]);
+    free(children);
+    return KVSM_OK;
+  }
+
+  if (_kvsm_checkpoint_drop(ctx) != KVSM_OK) {
+    free(children);
+    return KVSM_ERROR;
+  }
+
+  log_debug("Discarding height %lld at %llx", tx->height, tx->offset);
+  for( i = 0 ; i < count ; i++ ) {
+    child = children[i];
+
+    // Build the new list, padding with duplicates to keep the entries in place
+    replacement = malloc(child->parent_count * sizeof(PALLOC_OFFSET));
+    if (!replacement) goto error;
+    n = 0;
+    for( k = 0 ; k < child->parent_count ; k++ ) {
+      if (child->parent[k] == tx->offset) continue;
+      replacement[n++] = child->parent[k];
+    }
+    for( l = 0 ; l < tx->parent_count ; l++ ) {
+      for( m = 0 ; m < n ; m++ ) {
+        if (replacement[m] == tx->parent[l]) break;
+      }
+      if (m == n) replacement[n++] = tx->parent[l];
+    }
+    while(n < child->parent_count) {
+      replacement[n] = replacement[n - 1];
+      n++;
+    }
+
+    for( k = 0 ; k < child->parent_count ; k++ ) {
+      replacement[k] = htobe64(replacement[k]);
+    }
+    if (_kvsm_write(ctx, child->offset + KVSM_HEADER_SIZE, replacement, child->parent_count * sizeof(PALLOC_OFFSET)) != KVSM_OK) {
+      log_error("Could not update parents of %llx", child->offset);
+      free(replacement);
+      goto error;
+    }
+    free(replacement);
+  }
+
+  // Our parents adopt our children
+  for( l = 0 ; l < tx->parent_count ; l++ ) {
+    pslot = _kvsm_children_get(&(c->children), tx->parent[l], true);
+    if (!pslot) goto error;
+    for( i = 0 ; i < pslot->count ; i++ ) {
+      if (pslot->child[i] != tx->offset) continue;
+      pslot->child[i] = pslot->child[--pslot->count];
+      break;
+    }
+    slot = _kvsm_children_get(&(c->children), tx->offset, false);
+    for( i = 0 ; slot && (i < slot->count) ; i++ ) {
+      if (_kvsm_children_add(&(c->children), tx->parent[l], slot->child[i]) != KVSM_OK) goto error;
+    }
+  }
+  slot = _kvsm_children_get(&(c->children), tx->offset, false);
+  if (slot) slot->count = 0;
+
+  // Free used space
+  blob = palloc_size(ctx->fd, tx->offset);
+  ctx->bytes_total -= (blob < ctx->bytes_total) ? blob : ctx->bytes_total;
+  ctx->bytes_dead  -= (size < ctx->bytes_dead ) ? size : ctx->bytes_dead;
+  _kvsm_untrack(ctx, tx->offset);
+  pfree(ctx->fd, tx->offset);
+
+  for( i = 0 ; i < count ; i++ ) kvsm_transaction_free(children[i]);
+  free(children);
+  return KVSM_OK;
+
+error:
+  for( i = 0 ; i < count ; i++ ) kvsm_transaction_free(children[i]);
+  free(children);
+  return KVSM_ERROR;
+}
+
+// Visits the next transaction of the round, newest to oldest. Large ones are
+// visited over several calls, done is set once it's been handled.
+static KVSM_RESPONSE _kvsm_compaction_visit(struct kvsm *ctx, uint64_t *bytes, bool *overflow, bool *done) {
+  struct kvsm_compaction *c = ctx->compaction;
+  struct kvsm_txinfo *info = &(c->node[c->pos]);
+  struct kvsm_index_entry *found;
+  struct kvsm_transaction *tx;
+  struct _kvsm_entry entry;
+  uint64_t hash, cost, size;
+  bool final, replay;
+  char *key;
+  int i, r;
+
+  *done = false;
+  final = c->partition == (c->partitions - 1);
+
+  if (!c->tx) {
+    cost    = KVSM_HEADER_SIZE;
+    *bytes -= (*bytes < cost) ? *bytes : cost;
+
+    // Skip anything that's gone, or whose space was reused since the snapshot
+    tx = _kvsm_transaction_load(ctx, info->offset);
+    if (tx && memcmp(tx->id->data, info->id, KVSM_ID_LENGTH)) {
+      kvsm_transaction_free(tx);
+      tx = NULL;
+    }
+    if (!tx) {
+      c->pos++;
+      *done = true;
+      return KVSM_OK;
+    }
+
+    // Children are always visited before their parents
+    if (!c->partition) {
+      for( i = 0 ; i < tx->parent_count ; i++ ) {
+        if (_kvsm_children_add(&(c->children), tx->parent[i], tx->offset) != KVSM_OK) {
+          kvsm_transaction_free(tx);
+          return KVSM_ERROR;
+        }
+      }
+    }
+
+    if (_kvsm_is_head(ctx, info->offset)) c->live[c->pos] = true;
+    c->tx    = tx;
+    c->entry = KVSM_TX_ENTRIES(tx);
+    c->size  = 0;
+  }
+  tx = c->tx;
+
+  key = malloc(KVSM_KEY_MAX);
+  if (!key) return KVSM_ERROR;
+  while(*bytes && _kvsm_entry_read(ctx, tx, c->entry, &entry)) {
+    c->entry = entry.next;
+    size     = _kvsm_entry_size(entry.keylen, entry.length);
+    cost     = _kvsm_entry_size(entry.keylen, 0); // Values aren't read
+    *bytes  -= (*bytes < cost) ? *bytes : cost;
+    c->size += size;
+    if (_kvsm_read(ctx, entry.key, key, entry.keylen) != KVSM_OK) {
+      free(key);
+      return KVSM_ERROR;
+    }
+    hash = _kvsm_hash(key, entry.keylen);
+
+    // The index already knows where every current value lives
+    if (ctx->index) {
+      found = _kvsm_index_find(ctx->index, key, entry.keylen, hash);
+      if (found && (found->offset == tx->offset) && (found->value == entry.value)) {
+        c->live[c->pos] = true;
+      } else {
+        c->dead[c->pos] += size;
+      }
+      continue;
+    }
+
+    // Otherwise, the first transaction to hold a key has it's current value
+    if ((_kvsm_mix(hash) % c->partitions) != c->partition) continue;
+
+    // Unless the entry is older than it's merged transaction, something in
+    // between may still hold a newer version
+    if (entry.height != tx->height) {
+      c->live[c->pos] = true;
+      continue;
+    }
+    r = _kvsm_keyset_add(&(c->seen), key, entry.keylen, hash);
+    if (r < 0) {
+      free(key);
+      return KVSM_ERROR;
+    }
+    if (r) {
+      c->live[c->pos] = true;
+    } else {
+      c->dead[c->pos] += size;
+    }
+  }
+  free(key);
+
+  // Continued in the next step
+  if (_kvsm_entry_read(ctx, tx, c->entry, &entry)) return KVSM_OK;
+
+  c->tx = NULL;
+  c->pos++;
+  *done = true;
+
+  if (
+    (c->partitions < KVSM_COMPACT_PARTITIONS) &&
+    (c->seen.count > 1) &&
+    (_kvsm_keyset_size(&(c->seen)) > ctx->compact_memory)
+  ) {
+    *overflow = true;
+    kvsm_transaction_free(tx);
+    return KVSM_OK;
+  }
+
+  // Already handled before the cursor was persisted, only needs re-learning
+  replay = final && c->cursor && (
+    (info->height > c->cursor_height) ||
+    ((info->height == c->cursor_height) && (memcmp(info->id, c->cursor_id, KVSM_ID_LENGTH) > 0))
+  );
+
+  if (final && !replay) {
+    if ((!c->live[c->pos - 1]) && (tx->height <= _kvsm_snapshot_height(ctx))) {
+      c->pinned += c->dead[c->pos - 1];
+    } else if ((!c->live[c->pos - 1]) && (_kvsm_compaction_discard(ctx, tx, c->size) != KVSM_OK)) {
+      kvsm_transaction_free(tx);
+      return KVSM_ERROR;
+    }
+    c->cursor        = true;
+    c->cursor_height = info->height;
+    memcpy(c->cursor_id, info->id, KVSM_ID_LENGTH);
+  }
+  if (final && _kvsm_txtable_find(ctx->txtable, tx->offset)) {
+    c->kept += c->dead[c->pos - 1];
+  }
+
+  kvsm_transaction_free(tx);
+  return KVSM_OK;
+}
+
+// Budgets are checked between transactions and entries, so either may be
+// overdrawn by a single one of them
+static KVSM_RESPONSE _kvsm_compact_step(struct kvsm *ctx, uint64_t limit, uint64_t bytes) {
+  struct kvsm_compaction *c;
+  bool overflow, done;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!ctx->compaction) {
+    ctx->compaction = calloc(1, sizeof(struct kvsm_compaction));
+    if (!ctx->compaction) {
+      log_error("Could not reserve memory for compaction");
+      return KVSM_ERROR;
+    }
+  }
+  c = ctx->compaction;
+
+  // Storing the result gets a step of it's own, it covers all of the state
+  if (c->finished) {
+    _kvsm_compaction_free(c);
+    ctx->compaction = NULL;
+    return _kvsm_checkpoint(ctx);
+  }
+
+  while(limit && bytes) {
+    if ((!c->node) && (_kvsm_compaction_start(ctx) != KVSM_OK)) {
+      log_error("Could not reserve memory for compaction");
+      return KVSM_ERROR;
+    }
+    if (c->filling) {
+      if (_kvsm_compaction_fill(ctx, &bytes) != KVSM_OK) {
+        log_error("Could not reserve memory for compaction");
+        return KVSM_ERROR;
+      }
+      continue;
+    }
+
+    // Next partition, or done
+    if (c->pos == c->count) {
+      if ((c->partition + 1) < c->partitions) {
+        c->partition++;
+        c->pos = 0;
+        _kvsm_keyset_free(&(c->seen));
+        continue;
+      }
+      // What's left can't be reclaimed until it's superseded some more
+      ctx->bytes_kept   = c->kept;
+      ctx->bytes_pinned = c->pinned;
+      if (!ctx->index) ctx->bytes_dead = c->kept;
+      c->finished = true;
+      ctx->checkpoint_pending++;
+      return KVSM_OK;
+    }
+
+    overflow = false;
+    if (_kvsm_compaction_visit(ctx, &bytes, &overflow, &done) != KVSM_OK) {
+      log_error("Could not compact transaction");
+      return KVSM_ERROR;
+    }
+    if (overflow) _kvsm_compaction_restart(c);
+    if (done) limit--;
+  }
+
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_compact_step(struct kvsm *ctx, uint64_t limit, uint64_t bytes) {
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_compact_step(ctx, limit, bytes);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_compact(struct kvsm *ctx) {
+  KVSM_RESPONSE result;
+  bool pending;
+  if (!ctx) return KVSM_ERROR;
+  do {
+    _kvsm_lock(ctx);
+    result  = _kvsm_compact_step(ctx, UINT64_MAX, UINT64_MAX);
+    pending = ctx->compaction != NULL;
+    _kvsm_unlock(ctx);
+  } while((result == KVSM_OK) && pending);
+  return result;
+}
+
+// Transaction considered for merging
+struct _kvsm_merge_node {
+  PALLOC_OFFSET offset;
+  uint64_t      height;
+  char          id[KVSM_ID_LENGTH];
+  int           parents; // Distinct parents
+  uint64_t      size;
+  bool          used;
+};
+
+// Entry carried over into a merged transaction
+struct _kvsm_merge_entry {
+  struct buf    key;
+  uint64_t      hash;
+  uint64_t      height;
+  struct buf    value; // As stored
+  bool          compressed;
+  PALLOC_OFFSET offset; // Of the value, once written
+};
+
+static int _kvsm_merge_node_cmp(const void *a, const void *b) {
+  const struct _kvsm_merge_node *na = a;
+  const struct _kvsm_merge_node *nb = b;
+  if (na->offset < nb->offset) return -1;
+  if (na->offset > nb->offset) return  1;
+  return 0;
+}
+
+static int _kvsm_merge_entry_cmp(const void *a, const void *b) {
+  const struct _kvsm_merge_entry *ea = a;
+  const struct _kvsm_merge_entry *eb = b;
+  return _kvsm_key_cmp(ea->key.data, ea->key.len, eb->key.data, eb->key.len);
+}
+
+// Oldest first
+static int _kvsm_merge_order_cmp(const void *a, const void *b) {
+  const struct _kvsm_merge_node *na = *(const struct _kvsm_merge_node **)a;
+  const struct _kvsm_merge_node *nb = *(const struct _kvsm_merge_node **)b;
+  if (na->height < nb->height) return -1;
+  if (na->height > nb->height) return  1;
+  return memcmp(na->id, nb->id, KVSM_ID_LENGTH);
+}
+
+static struct _kvsm_merge_node * _kvsm_merge_node_find(struct _kvsm_merge_node *node, size_t count, PALLOC_OFFSET offset) {
+  struct _kvsm_merge_node probe = { .offset = offset };
+  return bsearch(&probe, node, count, sizeof(struct _kvsm_merge_node), _kvsm_merge_node_cmp);
+}
+
+static void _kvsm_merge_entries_free(struct _kvsm_merge_entry *entry, size_t count) {
+  while(count--) {
+    buf_clear(&(entry[count].key));
+    buf_clear(&(entry[count].value));
+  }
+  free(entry);
+}
+
+// Collects the entries a chain still shows, newest first, dropping the rest
+static KVSM_RESPONSE _kvsm_merge_collect(struct kvsm *ctx, struct kvsm_transaction **tx, size_t count, struct _kvsm_merge_entry **output, size_t *output_count, uint64_t *dropped) {
+  struct _kvsm_merge_entry *entry = NULL;
+  struct kvsm_index_entry *found;
+  struct _kvsm_keyset seen = {0};
+  struct _kvsm_entry current;
+  PALLOC_OFFSET off;
+  size_t n = 0, cap = 0, i;
+  char *key;
+  int r;
+
+  key = malloc(KVSM_KEY_MAX);
+  if (!key) return KVSM_ERROR;
+
+  for( i = count ; i-- ; ) {
+    off = KVSM_TX_ENTRIES(tx[i]);
+    while(_kvsm_entry_read(ctx, tx[i], off, &current)) {
+      off = current.next;
+      if (_kvsm_read(ctx, current.key, key, current.keylen) != KVSM_OK) goto error;
+
+      // Shadowed within the chain, or by something newer according to the index
+      r = _kvsm_keyset_add(&seen, key, current.keylen, _kvsm_hash(key, current.keylen));
+      if (r < 0) goto error;
+      found = ctx->index ? _kvsm_index_find(ctx->index, key, current.keylen, _kvsm_hash(key, current.keylen)) : NULL;
+      if ((!r) || (ctx->index && !(found && (found->offset == tx[i]->offset) && (found->value == current.value)))) {
+        *dropped += _kvsm_entry_size(current.keylen, current.length);
+        continue;
+      }
+
+      if (n == cap) {
+        cap   = cap ? cap * 2 : 64;
+        entry = realloc(entry, cap * sizeof(struct _kvsm_merge_entry));
+        if (!entry) goto error;
+      }
+      memset(&(entry[n]), 0, sizeof(struct _kvsm_merge_entry));
+      entry[n].hash       = _kvsm_hash(key, current.keylen);
+      entry[n].height     = current.height;
+      entry[n].compressed = current.compressed;
+      entry[n].key.data   = malloc(current.keylen ? current.keylen : 1);
+      entry[n].value.data = malloc(current.length ? current.length : 1);
+      n++;
+      if ((!entry[n - 1].key.data) || (!entry[n - 1].value.data)) goto error;
+      memcpy(entry[n - 1].key.data, key, current.keylen);
+      entry[n - 1].key.len   = current.keylen;
+      entry[n - 1].key.cap   = current.keylen;
+      entry[n - 1].value.len = current.length;
+      entry[n - 1].value.cap = current.length;
+      if (_kvsm_read_medium(ctx, current.value, entry[n - 1].value.data, current.length) != KVSM_OK) goto error;
+    }
+  }
+
+  free(key);
+  _kvsm_keyset_free(&seen);
+  *output       = entry;
+  *output_count = n;
+  return KVSM_OK;
+
+error:
+  free(key);
+  _kvsm_keyset_free(&seen);
+  _kvsm_merge_entries_free(entry, n);
+  return KVSM_ERROR;
+}
+
+// Points the children of a merged chain at the given parent instead of the
+// chain's newest transaction, or back again. Returns how many were written.
+static size_t _kvsm_merge_rewire(struct kvsm *ctx, struct kvsm_transaction **child, size_t count, PALLOC_OFFSET from, PALLOC_OFFSET to, PALLOC_OFFSET *parent) {
+  size_t i;
+  int j;
+
+  for( i = 0 ; i < count ; i++ ) {
+    for( j = 0 ; j < child[i]->parent_count ; j++ ) {
+      parent[j] = htobe64((child[i]->parent[j] == from) ? to : child[i]->parent[j]);
+    }
+    if (_kvsm_write(ctx, child[i]->offset + KVSM_HEADER_SIZE, parent, child[i]->parent_count * sizeof(PALLOC_OFFSET)) != KVSM_OK) {
+      log_error("Could not update parents of %llx", child[i]->offset);
+      return i;
+    }
+  }
+  return count;
+}
+
+// Replaces a chain of transactions, oldest first, by a single one
+static KVSM_RESPONSE _kvsm_merge_chain(struct kvsm *ctx, const PALLOC_OFFSET *chain, size_t count, struct _kvsm_children *children) {
+  struct kvsm_transaction **tx;
+  struct kvsm_transaction **child = NULL;
+  struct kvsm_transaction *oldest, *newest;
+  struct _kvsm_children_slot *slot;
+  struct _kvsm_merge_entry *entry = NULL;
+  struct kvsm_index_entry *found;
+  struct buf image = {0};
+  PALLOC_OFFSET offset, *parent = NULL;
+  uint64_t *hash = NULL, *rel = NULL;
+  uint64_t dropped = 0, blob, len64;
+  size_t entries = 0, start, i, k, child_count = 0, rewired;
+  uint8_t version = KVSM_VERSION_FILTER | KVSM_VERSION_MERGED;
+  KVSM_RESPONSE result = KVSM_ERROR;
+  bool *head = NULL;
+  bool moved;
+  int j, parents = 1;
+
+  tx = calloc(count, sizeof(struct kvsm_transaction *));
+  if (!tx) return KVSM_ERROR;
+  for( i = 0 ; i < count ; i++ ) {
+    tx[i] = _kvsm_transaction_load(ctx, chain[i]);
+    if (!tx[i]) goto cleanup;
+  }
+  oldest = tx[0];
+  newest = tx[count - 1];
+
+  // Everything that can fail short of writing happens before the first write
+  slot  = _kvsm_children_get(children, newest->offset, false);
+  child = calloc((slot && slot->count) ? slot->count : 1, sizeof(struct kvsm_transaction *));
+  head  = calloc(ctx->head_count ? ctx->head_count : 1, sizeof(bool));
+  if ((!child) || (!head)) goto cleanup;
+  for( i = 0 ; slot && (i < slot->count) ; i++ ) {
+    child[i] = _kvsm_transaction_load(ctx, slot->child[i]);
+    if (!child[i]) goto cleanup;
+    child_count++;
+    if (child[i]->parent_count > parents) parents = child[i]->parent_count;
+  }
+  parent = malloc(parents * sizeof(PALLOC_OFFSET));
+  if (!parent) goto cleanup;
+
+  if (_kvsm_merge_collect(ctx, tx, count, &entry, &entries, &dropped) != KVSM_OK) goto cleanup;
+  if (entries >= KVSM_SORTED_MIN) {
+    qsort(entry, entries, sizeof(struct _kvsm_merge_entry), _kvsm_merge_entry_cmp);
+    version |= KVSM_VERSION_SORTED;
+  }
+
+  // Looks like the newest transaction, with the oldest one's parents
+  image.cap = KVSM_HEADER_SIZE + ((oldest->parent_count + 1) * sizeof(PALLOC_OFFSET)) + KVSM_FILTER_SIZE(entries) + 1;
+  if (version & KVSM_VERSION_SORTED) image.cap += KVSM_SORTED_SIZE(entries);
+  for( i = 0 ; i < entries ; i++ ) {
+    image.cap += _kvsm_entry_size(entry[i].key.len, entry[i].value.len) + sizeof(uint64_t);
+    if (entry[i].compressed) version |= KVSM_VERSION_COMPRESS;
+  }
+  image.data = malloc(image.cap);
+  hash       = malloc((entries ? entries : 1) * sizeof(uint64_t));
+  rel        = malloc((entries ? entries : 1) * sizeof(uint64_t));
+  if ((!image.data) || (!hash) || (!rel)) goto cleanup;
+  offset = palloc(ctx->fd, image.cap);
+  if (!offset) {
+    log_error("Could not allocate %lld bytes for merged transaction", image.cap);
+    goto cleanup;
+  }
+
+  image.data[image.len++] = version;
+  memcpy(image.data + image.len, newest->id->data, KVSM_ID_LENGTH);
+  image.len += KVSM_ID_LENGTH;
+  len64 = htobe64(newest->height);
+  memcpy(image.data + image.len, &len64, sizeof(len64));
+  image.len += sizeof(len64);
+  for( j = 0 ; j < oldest->parent_count ; j++ ) {
+    len64 = htobe64(oldest->parent[j]);
+    memcpy(image.data + image.len, &len64, sizeof(len64));
+    image.len += sizeof(len64);
+  }
+  memset(image.data + image.len, 0, sizeof(PALLOC_OFFSET));
+  image.len += sizeof(PALLOC_OFFSET);
+
+  for( i = 0 ; i < entries ; i++ ) hash[i] = entry[i].hash;
+  image.len += _kvsm_filter_write(image.data + image.len, hash, entries);
+  start = image.len + ((version & KVSM_VERSION_SORTED) ? KVSM_SORTED_SIZE(entries) : 0);
+
+  // Entries are in key order when sorted, so the table is ascending
+  k = start;
+  for( i = 0 ; i < entries ; i++ ) {
+    rel[i] = k - start;
+    k     += _kvsm_entry_size(entry[i].key.len, entry[i].value.len) + sizeof(uint64_t);
+  }
+  if (version & KVSM_VERSION_SORTED) image.len += _kvsm_sorted_write(image.data + image.len, rel, entries);
+
+  for( i = 0 ; i < entries ; i++ ) {
+    if (entry[i].key.len >= 128) {
+      image.data[image.len++] = 128 | (entry[i].key.len >> 8);
+    }
+    image.data[image.len++] = entry[i].key.len & 255;
+    if (entry[i].key.len) memcpy(image.data + image.len, entry[i].key.data, entry[i].key.len);
+    image.len += entry[i].key.len;
+    len64 = htobe64(entry[i].height);
+    memcpy(image.data + image.len, &len64, sizeof(len64));
+    image.len += sizeof(len64);
+    len64 = htobe64(entry[i].value.len | (entry[i].compressed ? KVSM_ENTRY_COMPRESSED : 0));
+    memcpy(image.data + image.len, &len64, sizeof(len64));
+    image.len += sizeof(len64);
+    entry[i].offset = offset + image.len;
+    if (entry[i].value.len) memcpy(image.data + image.len, entry[i].value.data, entry[i].value.len);
+    image.len += entry[i].value.len;
+  }
+  image.data[image.len++] = 0; // End-of-list
+
+  if (_kvsm_write(ctx, offset, image.data, image.len) != KVSM_OK) {
+    log_error("Could not write merged transaction");
+    pfree(ctx->fd, offset);
+    goto cleanup;
+  }
+
+  // Nothing may refer to the originals anymore before they're freed
+  if (_kvsm_checkpoint_drop(ctx) != KVSM_OK) {
+    pfree(ctx->fd, offset);
+    goto cleanup;
+  }
+
+  // Children and heads move over, or back again if that fails halfway
+  rewired = _kvsm_merge_rewire(ctx, child, child_count, newest->offset, offset, parent);
+  moved   = rewired == child_count;
+  if (moved) {
+    for( j = 0 ; j < ctx->head_count ; j++ ) {
+      if (ctx->head[j] != newest->offset) continue;
+      ctx->head[j] = offset;
+      head[j]      = true;
+    }
+    if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+      log_error("Could not update anchor");
+      for( j = 0 ; j < ctx->head_count ; j++ ) {
+        if (head[j]) ctx->head[j] = newest->offset;
+      }
+      moved = false;
+    }
+  }
+  if (!moved) {
+    if (_kvsm_merge_rewire(ctx, child, rewired, offset, newest->offset, parent) == rewired) {
+      pfree(ctx->fd, offset);
+    } else {
+      // Never free what a child may still refer to, replay picks it up
+      log_error("Could not restore parents, merged transaction at %llx remains", offset);
+    }
+    goto cleanup;
+  }
+
+  // Swap the originals for the merged transaction. The tables only shrank,
+  // so tracking it reuses their space.
+  for( i = 0 ; i < count ; i++ ) {
+    blob = palloc_size(ctx->fd, tx[i]->offset);
+    ctx->bytes_total -= (blob < ctx->bytes_total) ? blob : ctx->bytes_total;
+    _kvsm_untrack(ctx, tx[i]->offset);
+    pfree(ctx->fd, tx[i]->offset);
+  }
+  ctx->bytes_total += palloc_size(ctx->fd, offset);
+  ctx->bytes_dead  -= (dropped < ctx->bytes_dead) ? dropped : ctx->bytes_dead;
+  if (!_kvsm_track(ctx, offset, newest->height, newest->id->data)) goto cleanup;
+  for( i = 0 ; ctx->index && (i < entries) ; i++ ) {
+    found = _kvsm_index_find(ctx->index, entry[i].key.data, entry[i].key.len, entry[i].hash);
+    if (!found) continue;
+    found->offset = offset;
+    found->value  = entry[i].offset;
+  }
+  result = KVSM_OK;
+
+cleanup:
+  for( i = 0 ; i < count ; i++ ) kvsm_transaction_free(tx[i]);
+  for( i = 0 ; i < child_count ; i++ ) kvsm_transaction_free(child[i]);
+  free(tx);
+  free(child);
+  free(head);
+  free(parent);
+  _kvsm_merge_entries_free(entry, entries);
+  buf_clear(&image);
+  free(hash);
+  free(rel);
+  return result;
+}
+
+static KVSM_RESPONSE _kvsm_compact_merge(struct kvsm *ctx, uint64_t size) {
+  struct _kvsm_merge_node *node, *current, *next;
+  struct _kvsm_children children = {0};
+  struct _kvsm_children_slot *slot;
+  struct kvsm_transaction *tx;
+  struct _kvsm_merge_node **order = NULL;
+  PALLOC_OFFSET *chain = NULL;
+  size_t count = 0, length, i, o;
+  uint64_t total, pinned;
+  KVSM_RESPONSE result = KVSM_ERROR;
+  int j, k;
+
+  if (!ctx) return KVSM_ERROR;
+  if (ctx->compaction) {
+    log_error("Can not merge while a compaction round is in progress");
+    return KVSM_ERROR;
+  }
+
+  // Open snapshots may still walk anything up to their heads
+  pinned = _kvsm_snapshot_height(ctx);
+
+  // Learn the shape of the graph, every transaction's distinct parents
+  node  = malloc((ctx->txtable->count ? ctx->txtable->count : 1) * sizeof(struct _kvsm_merge_node));
+  order = malloc((ctx->txtable->count ? ctx->txtable->count : 1) * sizeof(struct _kvsm_merge_node *));
+  chain = malloc((ctx->txtable->count ? ctx->txtable->count : 1) * sizeof(PALLOC_OFFSET));
+  if ((!node) || (!order) || (!chain)) goto cleanup;
+  for( i = 0 ; i < ctx->txtable->cap ; i++ ) {
+    if (!ctx->txtable->tx[i].offset) continue;
+    tx = _kvsm_transaction_load(ctx, ctx->txtable->tx[i].offset);
+    if (!tx) continue;
+    node[count].offset  = tx->offset;
+    node[count].height  = tx->height;
+    node[count].parents = 0;
+    node[count].size    = palloc_size(ctx->fd, tx->offset);
+    node[count].used    = false;
+    memcpy(node[count].id, tx->id->data, KVSM_ID_LENGTH);
+    for( j = 0 ; j < tx->parent_count ; j++ ) {
+      for( k = 0 ; k < j ; k++ ) {
+        if (tx->parent[k] == tx->parent[j]) break;
+      }
+      if (k < j) continue;
+      node[count].parents++;
+      if (_kvsm_children_add(&children, tx->parent[j], tx->offset) != KVSM_OK) {
+        kvsm_transaction_free(tx);
+        goto cleanup;
+      }
+    }
+    kvsm_transaction_free(tx);
+    count++;
+  }
+  qsort(node, count, sizeof(struct _kvsm_merge_node), _kvsm_merge_node_cmp);
+  for( i = 0 ; i < count ; i++ ) order[i] = &(node[i]);
+  qsort(order, count, sizeof(struct _kvsm_merge_node *), _kvsm_merge_order_cmp);
+
+  // Oldest first, follow each chain of small transactions with a single
+  // parent and child, up to the requested size
+  for( o = 0 ; o < count ; o++ ) {
+    current = order[o];
+    if (current->used || (current->size >= size)) continue;
+    if (current->height <= pinned) continue;
+    current->used = true;
+    chain[0] = current->offset;
+    length   = 1;
+    total    = current->size;
+    while(1) {
+      slot = _kvsm_children_get(&children, current->offset, false);
+      if ((!slot) || (slot->count != 1)) break;
+      next = _kvsm_merge_node_find(node, count, slot->child[0]);
+      if ((!next) || next->used || (next->parents != 1)) break;
+      if (next->height <= pinned) break;
+      if ((next->size >= size) || ((total + next->size) > size)) break;
+      next->used      = true;
+      chain[length++] = next->offset;
+      total          += next->size;
+      current         = next;
+    }
+    if (length < 2) continue;
+
+    log_debug("Merging %lld transactions at %llx", length, chain[0]);
+    if (_kvsm_merge_chain(ctx, chain, length, &children) != KVSM_OK) {
+      log_error("Could not merge transactions at %llx", chain[0]);
+      goto cleanup;
+    }
+  }
+  result = kvsm_checkpoint(ctx);
+
+cleanup:
+  _kvsm_children_free(&children);
+  free(node);
+  free(order);
+  free(chain);
+  return result;
+}
+
+KVSM_RESPONSE kvsm_compact_merge(struct kvsm *ctx, uint64_t size) {
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_compact_merge(ctx, size);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+#ifndef _WIN32
+// Compacts in small steps, letting other calls in between
+static void * _kvsm_compact_run(void *arg) {
+  struct kvsm *ctx = arg;
+  struct kvsm_worker *worker = ctx->worker;
+  struct timespec deadline;
+  KVSM_RESPONSE result;
+  bool due;
+
+  pthread_mutex_lock(&(worker->lock));
+  while(!worker->stop) {
+    pthread_mutex_unlock(&(worker->lock));
+    _kvsm_lock(ctx);
+    due    = ctx->compaction || _kvsm_compact_due(ctx);
+    result = due ? _kvsm_compact_step(ctx, KVSM_COMPACT_STEP, KVSM_COMPACT_BYTES) : KVSM_OK;
+    _kvsm_unlock(ctx);
+    if (due && (result == KVSM_OK)) {
+      sched_yield();
+      pthread_mutex_lock(&(worker->lock));
+      continue;
+    }
+    if (due) log_warn("Background compaction failed, retrying later");
+
+    pthread_mutex_lock(&(worker->lock));
+    if (worker->stop) break;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += KVSM_COMPACT_WAIT;
+    pthread_cond_timedwait(&(worker->wake), &(worker->lock), &deadline);
+  }
+  pthread_mutex_unlock(&(worker->lock));
+
+  return NULL;
+}
+#endif
+
+KVSM_RESPONSE kvsm_compact_start(struct kvsm *ctx, double ratio) {
+  if (!ctx) return KVSM_ERROR;
+  if (ctx->worker) return KVSM_ERROR;
+#ifdef _WIN32
+  log_error("Background compaction is not supported on this platform");
+  return KVSM_ERROR;
+#else
+  struct kvsm_worker *worker = calloc(1, sizeof(struct kvsm_worker));
+  if (!worker) {
+    log_error("Could not reserve memory for background compaction");
+    return KVSM_ERROR;
+  }
+  worker->ratio = ratio;
+  pthread_mutex_init(&(worker->lock), NULL);
+  pthread_cond_init(&(worker->wake), NULL);
+
+  _kvsm_lock(ctx);
+  ctx->worker = worker;
+  if (pthread_create(&(worker->thread), NULL, _kvsm_compact_run, ctx)) {
+    log_error("Could not start background compaction");
+    ctx->worker = NULL;
+    _kvsm_unlock(ctx);
+    pthread_cond_destroy(&(worker->wake));
+    pthread_mutex_destroy(&(worker->lock));
+    free(worker);
+    return KVSM_ERROR;
+  }
+  _kvsm_unlock(ctx);
+  return KVSM_OK;
+#endif
+}
+
+KVSM_RESPONSE kvsm_compact_stop(struct kvsm *ctx) {
+  if (!ctx) return KVSM_ERROR;
+  if (!ctx->worker) return KVSM_OK;
+#ifndef _WIN32
+  struct kvsm_worker *worker = ctx->worker;
+  pthread_mutex_lock(&(worker->lock));
+  worker->stop = true;
+  pthread_cond_signal(&(worker->wake));
+  pthread_mutex_unlock(&(worker->lock));
+  pthread_join(worker->thread, NULL);
+
+  _kvsm_lock(ctx);
+  ctx->worker = NULL;
+  _kvsm_unlock(ctx);
+  pthread_cond_destroy(&(worker->wake));
+  pthread_mutex_destroy(&(worker->lock));
+  free(worker);
+#endif
+  return KVSM_OK;
+}
+
+static struct buf * _kvsm_transaction_get_id(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct buf *id;
+  uint8_t version;
+
+  if (!ctx) return NULL;
+  if (_kvsm_read(ctx, offset, &version, sizeof(version)) != KVSM_OK) return NULL;
+  if (version & ~KVSM_VERSION_SUPPORTED) return NULL;
+
+  id = calloc(1, sizeof(struct buf));
+  if (!id) return NULL;
+  id->data = malloc(KVSM_ID_LENGTH);
+  id->len  = KVSM_ID_LENGTH;
+  id->cap  = KVSM_ID_LENGTH;
+  if ((!id->data) || (_kvsm_read(ctx, offset + 1, id->data, KVSM_ID_LENGTH) != KVSM_OK)) {
+    buf_clear(id);
+    free(id);
+    return NULL;
+  }
+
+  return id;
+}
+
+struct buf * kvsm_transaction_get_id(const struct kvsm *ctx, PALLOC_OFFSET offset) {
+  struct buf *result;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_transaction_get_id(ctx, offset);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+static PALLOC_OFFSET _kvsm_find_id(const struct kvsm *ctx, const char *identifier) {
+  struct kvsm_idinfo *found = _kvsm_idtable_find(ctx->idtable, identifier);
+  return found ? found->offset : 0;
+}
+
+static struct kvsm_transaction * _kvsm_transaction_load_id(const struct kvsm *ctx, const struct buf *identifier) {
+  PALLOC_OFFSET offset;
+  if (!ctx) return NULL;
+  if (!identifier) return NULL;
+  if (identifier->len != KVSM_ID_LENGTH) return NULL;
+  offset = _kvsm_find_id(ctx, identifier->data);
+  if (!offset) return NULL;
+  return _kvsm_transaction_load(ctx, offset);
+}
+
+struct kvsm_transaction * kvsm_transaction_load_id(const struct kvsm *ctx, const struct buf *identifier) {
+  struct kvsm_transaction *result;
+  _kvsm_lock_read(ctx);
+  result = _kvsm_transaction_load_id(ctx, identifier);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+// Finds the closest transaction after (direction 1) or before (direction -1)
+// the reference in height order, NULL reference = from the edge
+static struct kvsm_transaction * _kvsm_transaction_step(const struct kvsm *ctx, const struct kvsm_transaction *reference, int direction) {
+  const struct kvsm_txorder *order;
+  struct kvsm_transaction *found = NULL;
+  ssize_t pos;
+
+  _kvsm_lock_read(ctx);
+  order = ctx->txorder;
+  if (!reference) {
+    pos = (direction > 0) ? 0 : ((ssize_t)order->count - 1);
+  } else {
+    pos = _kvsm_txorder_seek(order, reference->height, reference->id->data);
+    if (direction < 0) {
+      pos--;
+    } else if (((size_t)pos < order->count) && !_kvsm_txorder_cmp(&(order->tx[pos]), reference->height, reference->id->data)) {
+      pos++;
+    }
+  }
+
+  while((pos = _kvsm_txorder_step(order, pos, direction)) >= 0) {
+    if ((found = _kvsm_transaction_load(ctx, order->tx[pos].offset))) break;
+    pos += direction;
+  }
+  _kvsm_unlock(ctx);
+
+  return found;
+}
+
+// Fetches a specific height, not a specific offset
+struct kvsm_transaction * kvsm_transaction_fetch(const struct kvsm *ctx, uint64_t height) {
+  struct buf id = { .data = (char[KVSM_ID_LENGTH]){0}, .len = KVSM_ID_LENGTH, .cap = KVSM_ID_LENGTH };
+  struct kvsm_transaction reference = { .id = &id };
+  if (!ctx) return NULL;
+  if (!height) return _kvsm_transaction_step(ctx, NULL, 1);
+
+  // Just below the lowest identifier at the requested height
+  reference.height = height - 1;
+  memset(id.data, 0xFF, KVSM_ID_LENGTH);
+  return _kvsm_transaction_step(ctx, &reference, 1);
+}
+
+// The transaction itself may have been removed by compaction since
+struct kvsm_transaction * kvsm_transaction_next(const struct kvsm_transaction *tx) {
+  if (!tx) return NULL;
+  if (!tx->ctx) return NULL;
+  return _kvsm_transaction_step(tx->ctx, tx, 1);
+}
+
+// The transaction itself may have been removed by compaction since
+struct kvsm_transaction * kvsm_transaction_previous(const struct kvsm_transaction *tx) {
+  if (!tx) return NULL;
+  if (!tx->ctx) return NULL;
+  return _kvsm_transaction_step(tx->ctx, tx, -1);
+}
+
+// Serialized layout
+//   1 byte version (KVSM_SERIAL_COMPRESS | KVSM_SERIAL_MERGED, 0 = neither)
+//   15 bytes transaction identifier
+//   8 bytes height
+//   15 bytes parent identifier [] (all-zero = end-of-list)
+//   entry[] as stored on the medium
+static struct buf * _kvsm_transaction_serialize(const struct kvsm_transaction *tx) {
+  log_trace("call: kvsm_transaction_serialize(%lld)", tx ? tx->height : 0);
+  const struct kvsm *ctx;
+  struct _kvsm_entry entry;
+  struct buf *output;
+  PALLOC_OFFSET start, end;
+  uint64_t height;
+  char *data;
+  char id[KVSM_ID_LENGTH];
+  int i, j;
+
+  if (!tx) return NULL;
+  if (!tx->ctx) return NULL;
+  ctx = tx->ctx;
+
+  output = calloc(1, sizeof(struct buf));
+  if (!output) return NULL;
+
+  // Compressed values and merged entries' heights are shipped as stored
+  buf_append_byte(output, (tx->compressed ? KVSM_SERIAL_COMPRESS : 0) | (tx->merged ? KVSM_SERIAL_MERGED : 0));
+  buf_append(output, tx->id->data, KVSM_ID_LENGTH);
+  height = htobe64(tx->height);
+  buf_append(output, (char *)&height, sizeof(height));
+
+  for( i = 0 ; i < tx->parent_count ; i++ ) {
+    // Skip padding left behind by compaction
+    for( j = 0 ; j < i ; j++ ) {
+      if (tx->parent[j] == tx->parent[i]) break;
+    }
+    if (j < i) continue;
+    if (_kvsm_read(ctx, tx->parent[i] + 1, id, KVSM_ID_LENGTH) != KVSM_OK) {
+      buf_clear(output);
+      free(output);
+      return NULL;
+    }
+    buf_append(output, id, KVSM_ID_LENGTH);
+  }
+  memset(id, 0, KVSM_ID_LENGTH);
+  buf_append(output, id, KVSM_ID_LENGTH);
+
+  // Find the end of the entry list, it's copied as-is
+  start = end = KVSM_TX_ENTRIES(tx);
+  while(_kvsm_entry_read(ctx, tx, end, &entry)) end = entry.next;
+  end++;
+
+  if ((output->cap - output->len) < (end - start)) {
+    data = realloc(output->data, output->len + (end - start));
+    if (!data) {
+      buf_clear(output);
+      free(output);
+      return NULL;
+    }
+    output->data = data;
+    output->cap  = output->len + (end - start);
+  }
+  if (_kvsm_read(ctx, start, output->data + output->len, end - start) != KVSM_OK) {
+    buf_clear(output);
+    free(output);
+    return NULL;
+  }
+  output->len += end - start;
+
+  return output;
+}
+
+struct buf * kvsm_transaction_serialize(const struct kvsm_transaction *tx) {
+  struct buf *result;
+  _kvsm_lock_read(tx ? tx->ctx : NULL);
+  result = _kvsm_transaction_serialize(tx);
+  _kvsm_unlock(tx ? tx->ctx : NULL);
+  return result;
+}
+
+// Checks whether the data is exactly one well-formed entry list, merged
+// entries may not claim to be newer than their transaction
+static bool _kvsm_entries_valid(const char *data, size_t len, uint8_t version, uint64_t height) {
+  size_t pos = 0;
+  uint64_t len64;
+  uint16_t len16;
+  uint8_t len8;
+
+  while(pos < len) {
+    len8 = data[pos++];
+    if (!len8) return pos == len;
+    len16 = len8 & 127;
+    if (len8 & 128) {
+      if (pos >= len) return false;
+      len16 = (len16 << 8) | (uint8_t)data[pos++];
+    }
+    if ((len - pos) < (len16 + sizeof(len64))) return false;
+    pos += len16;
+    if (version & KVSM_SERIAL_MERGED) {
+      memcpy(&len64, data + pos, sizeof(len64));
+      pos += sizeof(len64);
+      if (be64toh(len64) > height) return false;
+      if ((len - pos) < sizeof(len64)) return false;
+    }
+    memcpy(&len64, data + pos, sizeof(len64));
+    pos  += sizeof(len64);
+    len64 = be64toh(len64);
+    if ((version & KVSM_SERIAL_COMPRESS) && (len64 & KVSM_ENTRY_COMPRESSED)) {
+      len64 &= ~KVSM_ENTRY_COMPRESSED;
+      if (len64 < KVSM_COMPRESS_HEADER) return false;
+    }
+    if (len64 > (len - pos)) return false;
+    pos += len64;
+  }
+
+  return false;
+}
+
+struct _kvsm_entry_ref {
+  const char *key;
+  uint16_t    keylen;
+  uint64_t    offset;
+};
+
+// Key order, position order on duplicates so lookups find the first one
+static int _kvsm_entry_ref_cmp(const void *a, const void *b) {
+  const struct _kvsm_entry_ref *ra = a;
+  const struct _kvsm_entry_ref *rb = b;
+  int r = _kvsm_key_cmp(ra->key, ra->keylen, rb->key, rb->keylen);
+  if (r) return r;
+  return (ra->offset < rb->offset) ? -1 : 1;
+}
+
+// Hashes the keys of a validated entry list and, if large enough, builds it's
+// ordered offset table
+static KVSM_RESPONSE _kvsm_entries_scan(const char *data, bool merged, size_t *count_out, uint64_t **hash, uint64_t **rel) {
+  struct _kvsm_entry_ref *ref = NULL;
+  struct _kvsm_entry_ref *grown;
+  size_t pos = 0, count = 0, i;
+  uint64_t len64;
+  uint16_t len16;
+  uint8_t len8;
+
+  *hash = NULL;
+  *rel  = NULL;
+  while((len8 = data[pos])) {
+    grown = realloc(ref, (count + 1) * sizeof(struct _kvsm_entry_ref));
+    if (!grown) {
+      free(ref);
+      return KVSM_ERROR;
+    }
+    ref = grown;
+    ref[count].offset = pos++;
+    len16 = len8 & 127;
+    if (len8 & 128) len16 = (len16 << 8) | (uint8_t)data[pos++];
+    ref[count].key    = data + pos;
+    ref[count].keylen = len16;
+    count++;
+    pos += len16 + (merged ? sizeof(uint64_t) : 0);
+    memcpy(&len64, data + pos, sizeof(len64));
+    pos += sizeof(len64) + (be64toh(len64) & ~KVSM_ENTRY_COMPRESSED);
+  }
+
+  *count_out = count;
+  if (!count) return KVSM_OK;
+  *hash = malloc(count * sizeof(uint64_t));
+  if (count >= KVSM_SORTED_MIN) *rel = malloc(count * sizeof(uint64_t));
+  if ((!*hash) || ((count >= KVSM_SORTED_MIN) && !*rel)) {
+    free(ref);
+    free(*hash);
+    free(*rel);
+    return KVSM_ERROR;
+  }
+  for( i = 0 ; i < count ; i++ ) {
+    (*hash)[i] = _kvsm_hash(ref[i].key, ref[i].keylen);
+  }
+  if (*rel) {
+    qsort(ref, count, sizeof(struct _kvsm_entry_ref), _kvsm_entry_ref_cmp);
+    for( i = 0 ; i < count ; i++ ) {
+      (*rel)[i] = ref[i].offset;
+    }
+  }
+  free(ref);
+  return KVSM_OK;
+}
+
+// Stores a single serialized transaction without touching the anchor,
+// counting it in written if it wasn't known yet
+static KVSM_RESPONSE _kvsm_ingest_one(struct kvsm *ctx, const struct buf *serialized, uint64_t *written) {
+  struct kvsm_transaction *tx;
+  struct kvsm_txinfo *info;
+  PALLOC_OFFSET *parent = NULL;
+  PALLOC_OFFSET *list;
+  PALLOC_OFFSET offset, tmp;
+  uint64_t height;
+  const char *zero = (char[KVSM_ID_LENGTH]){0};
+  struct buf image = {0};
+  uint64_t *hash = NULL;
+  uint64_t *rel  = NULL;
+  size_t pos, entries, count;
+  int parent_count = 0;
+  int i, j;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!serialized) return KVSM_ERROR;
+
+  if (serialized->len < (KVSM_HEADER_SIZE + KVSM_ID_LENGTH + 1)) {
+    log_error("Invalid length to ingest");
+    return KVSM_ERROR;
+  }
+
+  if (((uint8_t)serialized->data[0]) & ~(KVSM_SERIAL_COMPRESS | KVSM_SERIAL_MERGED)) {
+    log_error("Ingestable has unsupported version");
+    return KVSM_ERROR;
+  }
+
+  // Already known = nothing to do
+  if (_kvsm_find_id(ctx, serialized->data + 1)) {
+    log_debug("Transaction already known");
+    return KVSM_OK;
+  }
+
+  memcpy(&height, serialized->data + 1 + KVSM_ID_LENGTH, sizeof(height));
+  height = be64toh(height);
+
+  // Resolve parents from the tracked transactions, they must exist and be
+  // lower than us
+  pos = KVSM_HEADER_SIZE;
+  while(1) {
+    if ((pos + KVSM_ID_LENGTH) > serialized->len) {
+      log_error("Truncated parent list");
+      free(parent);
+      return KVSM_ERROR;
+    }
+    if (!memcmp(serialized->data + pos, zero, KVSM_ID_LENGTH)) break;
+    tmp  = _kvsm_find_id(ctx, serialized->data + pos);
+    info = tmp ? _kvsm_txtable_find(ctx->txtable, tmp) : NULL;
+    if (!info) {
+      log_error("Ingestable refers to unknown parent");
+      free(parent);
+      return KVSM_ERROR;
+    }
+    if (info->height >= height) {
+      log_error("Ingestable height does not follow it's parents");
+      free(parent);
+      return KVSM_ERROR;
+    }
+    list = realloc(parent, (parent_count + 1) * sizeof(PALLOC_OFFSET));
+    if (!list) {
+      log_error("Could not reserve memory for transaction");
+      free(parent);
+      return KVSM_ERROR;
+    }
+    parent = list;
+    parent[parent_count++] = htobe64(tmp);
+    pos += KVSM_ID_LENGTH;
+  }
+  pos += KVSM_ID_LENGTH;
+
+  // Validate the entry list before writing anything
+  entries = pos;
+  if (!_kvsm_entries_valid(serialized->data + entries, serialized->len - entries, serialized->data[0], height)) {
+    log_error("Malformed entry list");
+    free(parent);
+    return KVSM_ERROR;
+  }
+
+  // The filter is local, it's not part of the serialized format
+  if (_kvsm_entries_scan(serialized->data + entries, serialized->data[0] & KVSM_SERIAL_MERGED, &count, &hash, &rel) != KVSM_OK) {
+    log_error("Could not reserve memory for transaction");
+    free(parent);
+    return KVSM_ERROR;
+  }
+
+  // Reserve our head slot up-front, nothing may fail halfway through
+  list = realloc(ctx->head, (ctx->head_count + 1) * sizeof(PALLOC_OFFSET));
+  if (!list) {
+    log_error("Could not reserve memory for transaction");
+    free(parent);
+    free(hash);
+    free(rel);
+    return KVSM_ERROR;
+  }
+  ctx->head = list;
+
+  // Start actually writing
+  image.cap = KVSM_HEADER_SIZE + ((parent_count + 1) * sizeof(PALLOC_OFFSET)) + KVSM_FILTER_SIZE(count) + (serialized->len - entries);
+  if (rel) image.cap += KVSM_SORTED_SIZE(count);
+  offset = palloc(ctx->fd, image.cap);
+  if (!offset) {
+    log_error("Could not allocate space for transaction");
+    free(parent);
+    free(hash);
+    free(rel);
+    return KVSM_ERROR;
+  }
+
+  // Entries are copied as-is, they match our on-disk format
+  image.data = calloc(1, image.cap);
+  if (!image.data) {
+    log_error("Could not reserve memory for transaction");
+    pfree(ctx->fd, offset);
+    free(parent);
+    free(hash);
+    free(rel);
+    return KVSM_ERROR;
+  }
+  memcpy(image.data, serialized->data, KVSM_HEADER_SIZE);
+  image.data[0] = KVSM_VERSION_FILTER | (rel ? KVSM_VERSION_SORTED : 0) |
+    ((serialized->data[0] & KVSM_SERIAL_COMPRESS) ? KVSM_VERSION_COMPRESS : 0) |
+    ((serialized->data[0] & KVSM_SERIAL_MERGED  ) ? KVSM_VERSION_MERGED   : 0);
+  image.len     = KVSM_HEADER_SIZE;
+  if (parent_count) memcpy(image.data + image.len, parent, parent_count * sizeof(PALLOC_OFFSET));
+  image.len += (parent_count + 1) * sizeof(PALLOC_OFFSET);
+  image.len += _kvsm_filter_write(image.data + image.len, hash, count);
+  free(hash);
+  if (rel) image.len += _kvsm_sorted_write(image.data + image.len, rel, count);
+  free(rel);
+  memcpy(image.data + image.len, serialized->data + entries, serialized->len - entries);
+  image.len += serialized->len - entries;
+  if (_kvsm_write(ctx, offset, image.data, image.len) != KVSM_OK) {
+    log_error("Could not write transaction");
+    buf_clear(&image);
+    pfree(ctx->fd, offset);
+    free(parent);
+    return KVSM_ERROR;
+  }
+  buf_clear(&image);
+
+  // Register before touching the heads, a failure only releases the blob
+  for( i = 0 ; i < parent_count ; i++ ) parent[i] = be64toh(parent[i]);
+  if (
+    (_kvsm_compaction_link(ctx, offset, parent, parent_count) != KVSM_OK) ||
+    (!_kvsm_track(ctx, offset, height, serialized->data + 1))
+  ) {
+    log_error("Could not register transaction");
+    _kvsm_compaction_unlink(ctx, offset, parent, parent_count);
+    pfree(ctx->fd, offset);
+    free(parent);
+    return KVSM_ERROR;
+  }
+
+  // Our parents are no longer heads, we are
+  for( i = 0 ; i < parent_count ; i++ ) {
+    for( j = 0 ; j < ctx->head_count ; j++ ) {
+      if (ctx->head[j] != parent[i]) continue;
+      ctx->head[j] = ctx->head[--ctx->head_count];
+      break;
+    }
+  }
+  free(parent);
+  ctx->head[ctx->head_count++] = offset;
+  (*written)++;
+
+  ctx->bytes_total += palloc_size(ctx->fd, offset);
+  _kvsm_sync_queue(ctx, serialized->data + 1, height, palloc_size(ctx->fd, offset));
+  if (!ctx->index) ctx->bytes_dead += serialized->len - entries - 1;
+
+  if (ctx->index) {
+    tx = _kvsm_transaction_load(ctx, offset);
+    if (!tx) return KVSM_ERROR;
+    if (_kvsm_index_tx(ctx, tx) != KVSM_OK) {
+      kvsm_transaction_free(tx);
+      return KVSM_ERROR;
+    }
+    kvsm_transaction_free(tx);
+  }
+
+  return KVSM_OK;
+}
+
+// Publishes what was ingested, heads are only written to the anchor here
+static KVSM_RESPONSE _kvsm_ingest_finish(struct kvsm *ctx, uint64_t written) {
+  if (!written) return KVSM_OK;
+  if (_kvsm_anchor_write(ctx) != KVSM_OK) {
+    log_error("Could not update anchor");
+    return KVSM_ERROR;
+  }
+  _kvsm_sync_commit(ctx);
+  _kvsm_checkpoint_tick(ctx, written);
+  _kvsm_compact_wake(ctx);
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_transaction_ingest(struct kvsm *ctx, const struct buf *serialized) {
+  log_trace("call: kvsm_transaction_ingest(...)");
+  uint64_t written = 0;
+  KVSM_RESPONSE result;
+  if (!ctx) return KVSM_ERROR;
+  result = _kvsm_ingest_one(ctx, serialized, &written);
+  if (_kvsm_ingest_finish(ctx, written) != KVSM_OK) return KVSM_ERROR;
+  return result;
+}
+
+KVSM_RESPONSE kvsm_transaction_ingest(struct kvsm *ctx, const struct buf *serialized) {
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_transaction_ingest(ctx, serialized);
+  _kvsm_unlock(ctx);
+  return result;
+}
+
+// Stream layout: [8 bytes length, serialized transaction] repeated
+static KVSM_RESPONSE _kvsm_transaction_ingest_bulk(struct kvsm *ctx, const struct buf *stream) {
+  log_trace("call: kvsm_transaction_ingest_bulk(...)");
+  KVSM_RESPONSE result = KVSM_OK;
+  uint64_t written = 0;
+  struct buf item;
+  uint64_t len;
+  size_t pos = 0;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!stream) return KVSM_ERROR;
+
+  while(pos < stream->len) {
+    if ((stream->len - pos) < sizeof(len)) {
+      log_error("Truncated length in bulk stream");
+      result = KVSM_ERROR;
+      break;
+    }
+    memcpy(&len, stream->data + pos, sizeof(len));
+    len  = be64toh(len);
+    pos += sizeof(len);
+    if (len > (stream->len - pos)) {
+      log_error("Truncated transaction in bulk stream");
+      result = KVSM_ERROR;
+      break;
+    }
+    item.data = stream->data + pos;
+    item.len  = len;
+    item.cap  = len;
+    if (_kvsm_ingest_one(ctx, &item, &written) != KVSM_OK) {
+      log_error("Could not ingest transaction at %lld in bulk stream", (long long)pos);
+      result = KVSM_ERROR;
+      break;
+    }
+    pos += len;
+  }
+
+  // Whatever made it in is kept, even if the stream broke off
+  log_debug("Ingested %lld transaction(s)", (long long)written);
+  if (_kvsm_ingest_finish(ctx, written) != KVSM_OK) return KVSM_ERROR;
+  return result;
+}
+
+KVSM_RESPONSE kvsm_transaction_ingest_bulk(struct kvsm *ctx, const struct buf *stream) {
+  KVSM_RESPONSE result;
+  _kvsm_lock(ctx);
+  result = _kvsm_transaction_ingest_bulk(ctx, stream);
+  _kvsm_unlock(ctx);
+  return result;
+}
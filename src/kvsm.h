@@ -34,10 +34,12 @@
 /// of older transactions, and even having multiple nodes sync up their
 /// transactions in a deterministic manner
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "finwo/palloc.h"
-/*#include "tidwall/buf.h"*/
+#include "tidwall/buf.h"
 
 ///
 /// ## API
@@ -74,6 +76,104 @@
 ///>
 /// </details>
 
+/// <details>
+///   <summary>KVSM_FLAGS</summary>
+///
+///   A type declaring the options a medium is opened with
+///<C
+#define KVSM_FLAGS int
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_DEFAULT</summary>
+///
+///   Open a regular file, no optional features enabled
+///<C
+#define KVSM_DEFAULT 0
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_BLOCKDEV</summary>
+///
+///   The medium is a block device, it will not be grown on demand
+///<C
+#define KVSM_BLOCKDEV 1
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_INDEX</summary>
+///
+///   Keep an in-memory index of all keys, turning lookups into a single probe
+///   and blob read at the cost of holding every key in memory
+///<C
+#define KVSM_INDEX 2
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_MMAP</summary>
+///
+///   Map the medium read-only into memory and parse transactions straight
+///   from the mapping, enabling kvsm_get_view. Ignored where mmap is not
+///   available.
+///<C
+#define KVSM_MMAP 4
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_SYNC</summary>
+///
+///   Flush the medium to stable storage before every commit or ingest returns
+///<C
+#define KVSM_SYNC 8
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_GROUP</summary>
+///
+///   Group commit, flush the medium from a background thread at most
+///   `sync_interval` milliseconds after a commit, or as soon as `sync_bytes`
+///   were written. Transactions written in between share a single flush.
+///   Behaves like KVSM_SYNC where threads are not available.
+///<C
+#define KVSM_GROUP 16
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_COMPRESS</summary>
+///
+///   Store values of at least `compress_min` bytes compressed, whenever that
+///   saves space. Compressed values are read regardless of this flag.
+///<C
+#define KVSM_COMPRESS 32
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_ID_LENGTH</summary>
+///
+///   The length of a transaction identifier in bytes
+///<C
+#define KVSM_ID_LENGTH 15
+///>
+/// </details>
+
+/// <details>
+///   <summary>KVSM_AIO_POOL</summary>
+///
+///   Flag for kvsm_aio_open, reading with the thread pool even where io_uring
+///   is available
+///<C
+#define KVSM_AIO_POOL 1
+///>
+/// </details>
+
 ///
 /// ### Structures
 ///
@@ -82,11 +182,77 @@
 ///   <summary>struct kvsm</summary>
 ///
 ///   Represents a state descriptor for kvsm, holds internal state
+///
+///   Reading calls (gets, values, loading, fetching and serializing
+///   transactions) may be made from several threads at once, they share the
+///   descriptor's lock and read the medium with positioned reads. Writing
+///   calls take the lock exclusively. On Windows a descriptor must only be
+///   used by one thread at a time.
+///
+///   `checkpoint_interval` may be changed after opening, it's the amount of
+///   transactions written between checkpoints (0 = only on close).
+///
+///   `compact_memory` may be changed after opening, it's the amount of bytes
+///   compaction may use to remember keys. Compaction re-reads the medium once
+///   per extra key partition it needs to stay within it.
+///
+///   `compaction` is non-NULL while a compaction round is in progress.
+///
+///   `compress_min` may be changed after opening, it's the smallest value
+///   KVSM_COMPRESS compresses.
+///
+///   `sync_interval` and `sync_bytes` may be changed after opening, before
+///   the first write, they're the window of KVSM_GROUP. `sync_callback` may
+///   be set likewise, it's called with `sync_udata` for every transaction once
+///   it's durable. With KVSM_GROUP it runs on the flushing thread. Without
+///   KVSM_SYNC or KVSM_GROUP it's never called.
+///
+///   `bytes_total` is the size of all transactions on the medium, `bytes_dead`
+///   the part of it holding superseded entries. Without KVSM_INDEX, every entry
+///   written since the last compaction round counts as dead. `bytes_kept` is
+///   what the last compaction round could not reclaim, `bytes_pinned` the
+///   part of that held back for open snapshots.
+///
+///   `snapshot` is the list of open snapshots, newest first.
+///
+///   `cache` is the read cache set up by kvsm_cache_resize. Transaction
+///   headers, filters, key tables and keys are read through it, values only
+///   when `cache_values` is set, which may be changed after opening.
 ///<C
 struct kvsm {
-  PALLOC_FD      fd;
-  PALLOC_OFFSET *head;
-  int            head_count;
+  PALLOC_FD               fd;
+  PALLOC_OFFSET          *head;
+  int                     head_count;
+  KVSM_FLAGS              flags;
+  uint64_t                seed;
+  struct kvsm_index      *index;
+  struct kvsm_txtable    *txtable;
+  struct kvsm_idtable    *idtable;
+  struct kvsm_txorder    *txorder;
+  struct kvsm_map        *map;
+  PALLOC_OFFSET           anchor;
+  PALLOC_OFFSET           anchor_heads;
+  PALLOC_OFFSET           checkpoint;
+  bool                    live;
+  uint64_t                checkpoint_interval;
+  uint64_t                checkpoint_pending;
+  uint64_t                compact_memory;
+  uint64_t                compress_min;
+  struct kvsm_compaction *compaction;
+  uint64_t                bytes_total;
+  uint64_t                bytes_dead;
+  uint64_t                bytes_kept;
+  uint64_t                bytes_pinned;
+  struct kvsm_snapshot   *snapshot;
+  struct kvsm_cache      *cache;
+  bool                    cache_values;
+  struct kvsm_worker     *worker;
+  struct kvsm_lock       *lock;
+  uint64_t                sync_interval;
+  uint64_t                sync_bytes;
+  void                  (*sync_callback)(struct kvsm *ctx, const struct buf *id, uint64_t height, void *udata);
+  void                   *sync_udata;
+  struct kvsm_sync       *sync;
 };
 ///>
 /// </details>
@@ -95,13 +261,148 @@ struct kvsm {
 /// <details>
 ///   <summary>struct kvsm_transaction</summary>
 ///
-///   TBD
+///   Represents the metadata of a single transaction, without it's data
+///
+///   `entries` is the offset of the entry list, behind the key filter of
+///   `filter_blocks` 64-bit blocks and the key-ordered table of
+///   `sorted_count` entry offsets (0 = section not present).
+///
+///   `merged` transactions were consolidated from a chain of transactions by
+///   kvsm_compact_merge, their entries carry the height they were written at.
+///
+///   `compressed` transactions may hold values stored compressed.
 ///<C
 struct kvsm_transaction {
   const struct kvsm *ctx;
-  const struct buf  *id;
+  struct buf        *id;
+  PALLOC_OFFSET      offset;
+  uint64_t           height;
   PALLOC_OFFSET     *parent;
   int                parent_count;
+  uint32_t           filter_blocks;
+  uint32_t           sorted_count;
+  PALLOC_OFFSET      entries;
+  bool               merged;
+  bool               compressed;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_value</summary>
+///
+///   A handle to a stored value, allowing it to be read in parts
+///
+///   `data` holds the whole value when it was stored compressed, it's read
+///   from memory instead of the medium then. Otherwise `snapshot` pins the
+///   version the handle refers to.
+///<C
+struct kvsm_value {
+  const struct kvsm    *ctx;
+  PALLOC_OFFSET         offset;
+  uint64_t              length;
+  char                 *data;
+  struct kvsm_snapshot *snapshot;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_batch</summary>
+///
+///   Collects entries to be written as a single transaction
+///<C
+struct kvsm_batch {
+  struct kvsm *ctx;
+  struct buf  *key;
+  struct buf  *value;
+  int          count;
+  int          cap;
+  int         *slot;
+  int          slot_cap;
+  bool        *compressed;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_snapshot</summary>
+///
+///   A consistent view of the medium as of the heads it pinned, `height` is
+///   the highest of them
+///<C
+struct kvsm_snapshot {
+  struct kvsm          *ctx;
+  PALLOC_OFFSET        *head;
+  int                   head_count;
+  uint64_t              height;
+  struct kvsm_snapshot *prev;
+  struct kvsm_snapshot *next;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_cache_stats</summary>
+///
+///   Counters of the read cache, sizes in bytes. `hits` and `misses` count
+///   cache blocks, a read spanning two blocks counts twice.
+///<C
+struct kvsm_cache_stats {
+  uint64_t size;
+  uint64_t used;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_aio</summary>
+///
+///   An asynchronous request queue on a descriptor, keeping up to `depth`
+///   value reads in flight. `pending` counts the requests whose callback did
+///   not run yet, `uring` tells whether reads go through io_uring instead of
+///   the thread pool.
+///<C
+struct kvsm_aio {
+  struct kvsm           *ctx;
+  unsigned int           depth;
+  unsigned int           pending;
+  bool                   uring;
+  struct kvsm_aio_state *state;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_transport</summary>
+///
+///   A byte stream to a peer, like a socket or a pair of pipes. `read` and
+///   `write` behave like read(2) and write(2) on it, moving up to `len`
+///   bytes and returning how many, 0 once the stream ended or negative on
+///   failure. They're called with `udata`.
+///<C
+struct kvsm_transport {
+  ssize_t (*read)(void *udata, void *data, size_t len);
+  ssize_t (*write)(void *udata, const void *data, size_t len);
+  void     *udata;
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct kvsm_peer_stats</summary>
+///
+///   What kvsm_peer_pull did, `transactions` pulled and the `bytes` received
+///   in `requests` requests, over `seconds`
+///<C
+struct kvsm_peer_stats {
+  uint64_t transactions;
+  uint64_t bytes;
+  uint64_t requests;
+  double   seconds;
 };
 ///>
 /// </details>
@@ -111,12 +412,12 @@ struct kvsm_transaction {
 ///
 
 /// <details>
-///   <summary>kvsm_open(filename, isBlockDev)</summary>
+///   <summary>kvsm_open(filename, flags)</summary>
 ///
 ///   Initializes a new `struct kvsm`, handling creating the file if needed.
 ///   Returns a new descriptor or `NULL` on failure.
 ///<C
-struct kvsm * kvsm_open(const char *filename, const int isBlockDev);
+struct kvsm * kvsm_open(const char *filename, const KVSM_FLAGS flags);
 ///>
 /// </details>
 
@@ -129,13 +430,108 @@ KVSM_RESPONSE kvsm_close(struct kvsm *ctx);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>kvsm_checkpoint(ctx)</summary>
+///
+///   Writes the in-memory state to the medium, allowing the next open to skip
+///   scanning the medium and only replay transactions written afterwards.
+///   Called automatically every `checkpoint_interval` transactions and during
+///   close.
+///<C
+KVSM_RESPONSE kvsm_checkpoint(struct kvsm *ctx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_sync(ctx)</summary>
+///
+///   Flushes everything written so far to stable storage, reporting pending
+///   transactions to `sync_callback`. Not needed with KVSM_SYNC, and only
+///   shortens the wait with KVSM_GROUP.
+///<C
+KVSM_RESPONSE kvsm_sync(struct kvsm *ctx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_cache_resize(ctx, size)</summary>
+///
+///   Replaces the read cache by one of `size` bytes, evicting blocks with
+///   CLOCK once it's full. A size below one block removes the cache, it's
+///   off after opening. Counters start over. Reads through a KVSM_MMAP
+///   mapping don't use it.
+///<C
+KVSM_RESPONSE kvsm_cache_resize(struct kvsm *ctx, uint64_t size);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_cache_stats(ctx, stats)</summary>
+///
+///   Fills `stats` with the read cache's counters, all 0 without a cache
+///<C
+KVSM_RESPONSE kvsm_cache_stats(const struct kvsm *ctx, struct kvsm_cache_stats *stats);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>kvsm_compact(ctx)</summary>
 ///
 ///   Reduces used storage by removing all transactions only containing
 ///   non-current versions.
 ///<C
-KVSM_RESPONSE kvsm_compact(const struct kvsm *ctx);
+KVSM_RESPONSE kvsm_compact(struct kvsm *ctx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_compact_step(ctx, limit, bytes)</summary>
+///
+///   Performs part of a compaction round, visiting at most `limit`
+///   transactions or reading about `bytes` bytes before returning, whichever
+///   comes first, so it can be interleaved with other calls. Large
+///   transactions are visited over several steps. The round continues where
+///   the previous step left off, across checkpoints and reopening, and
+///   finishes once `ctx->compaction` is NULL. The last step only writes a
+///   checkpoint.
+///<C
+KVSM_RESPONSE kvsm_compact_step(struct kvsm *ctx, uint64_t limit, uint64_t bytes);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_compact_merge(ctx, size)</summary>
+///
+///   Consolidates chains of transactions smaller than `size` bytes, each
+///   having a single parent and child, into transactions of up to `size`
+///   bytes holding only their visible entries. The result takes the place of
+///   the chain's newest transaction, entries keep the height they were
+///   written at. Can not run while a compaction round is in progress.
+///<C
+KVSM_RESPONSE kvsm_compact_merge(struct kvsm *ctx, uint64_t size);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_compact_start(ctx, ratio)</summary>
+///
+///   Starts a background thread that compacts in small steps whenever the
+///   bytes superseded since the last round reach `ratio` of `bytes_total`.
+///   Each step holds the descriptor's lock exclusively. Must not be called
+///   concurrently with other calls on the descriptor.
+///<C
+KVSM_RESPONSE kvsm_compact_start(struct kvsm *ctx, double ratio);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_compact_stop(ctx)</summary>
+///
+///   Stops background compaction, waiting for the current step to finish. A
+///   round in progress continues with the next step or start. Called
+///   automatically during close.
+///<C
+KVSM_RESPONSE kvsm_compact_stop(struct kvsm *ctx);
 ///>
 /// </details>
 
@@ -149,6 +545,148 @@ struct buf * kvsm_get(const struct kvsm *ctx, const struct buf *key);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>kvsm_multiget(ctx, keys, count, results)</summary>
+///
+///   Looks up `count` keys at once, filling `results` with what kvsm_get
+///   would return for each. Without KVSM_INDEX the history is walked once
+///   for all keys, until every one of them is found or deleted. Returns
+///   KVSM_ERROR, with all results NULL, if the lookup failed.
+///<C
+KVSM_RESPONSE kvsm_multiget(const struct kvsm *ctx, const struct buf *keys, size_t count, struct buf **results);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_get_view(ctx, key, view)</summary>
+///
+///   Points the given view at the value of the key inside the mapped medium,
+///   without copying or allocating. Requires KVSM_MMAP, combine with
+///   KVSM_INDEX to also skip the history walk. The view's cap is 0 and it
+///   must not be cleared, it remains readable until kvsm_close but may refer
+///   to reused space after kvsm_compact or kvsm_compact_merge. Refused while
+///   compacting in the background, as there's no telling when that happens,
+///   use kvsm_snapshot_get_view then.
+///
+///   Values stored compressed can not be viewed, they return KVSM_ERROR.
+///
+///   Returns KVSM_ERROR if the key is not found or deleted.
+///<C
+KVSM_RESPONSE kvsm_get_view(const struct kvsm *ctx, const struct buf *key, struct buf *view);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_scan(ctx, start, end, callback, udata)</summary>
+///
+///   Calls `callback` with every current key in [`start`, `end`) and it's
+///   value, in byte-wise key order. A NULL `start` or `end` leaves that side
+///   open. Requires KVSM_INDEX, which keeps the keys ordered as they're
+///   written, ingested or loaded. Deleted keys are skipped.
+///
+///   The key and value are only valid during the call. Returning non-zero
+///   from `callback` stops the scan. The descriptor's lock is held
+///   throughout, so `callback` must not call into the descriptor.
+///<C
+KVSM_RESPONSE kvsm_scan(const struct kvsm *ctx, const struct buf *start, const struct buf *end, int (*callback)(const struct buf *key, const struct buf *value, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_scan_prefix(ctx, prefix, callback, udata)</summary>
+///
+///   Like kvsm_scan, over every current key starting with `prefix`
+///<C
+KVSM_RESPONSE kvsm_scan_prefix(const struct kvsm *ctx, const struct buf *prefix, int (*callback)(const struct buf *key, const struct buf *value, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_value_open(ctx, key)</summary>
+///
+///   Looks up the current value of the key once, returning a handle to read
+///   it by range instead of loading it into memory. Returns NULL if the key is
+///   not found or deleted.
+///
+///   The handle keeps referring to the version it was opened on. It holds a
+///   snapshot, so compaction leaves that version in place until the handle
+///   is freed, which must happen before kvsm_close.
+///<C
+struct kvsm_value * kvsm_value_open(struct kvsm *ctx, const struct buf *key);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_value_read(value, offset, data, len)</summary>
+///
+///   Reads len bytes, starting offset bytes into the value
+///<C
+KVSM_RESPONSE kvsm_value_read(const struct kvsm_value *value, uint64_t offset, void *data, size_t len);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_value_send(value, offset, len, fd)</summary>
+///
+///   Writes len bytes, starting offset bytes into the value, to the given file
+///   descriptor. Uses copy_file_range or sendfile where possible, bounded
+///   chunks otherwise.
+///<C
+KVSM_RESPONSE kvsm_value_send(const struct kvsm_value *value, uint64_t offset, uint64_t len, int fd);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_value_free(value)</summary>
+///
+///   Frees the value handle
+///<C
+KVSM_RESPONSE kvsm_value_free(struct kvsm_value *value);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_snapshot_begin(ctx)</summary>
+///
+///   Pins the current heads, returning a snapshot that keeps reading the
+///   values they held while writing and compaction continue. Compaction
+///   leaves transactions up to the snapshot's height in place until it ends.
+///   Returns NULL on failure.
+///<C
+struct kvsm_snapshot * kvsm_snapshot_begin(struct kvsm *ctx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_snapshot_get(snapshot, key)</summary>
+///
+///   Like kvsm_get, as of the snapshot's heads. Walks the history unless the
+///   heads are still current and the medium is indexed.
+///<C
+struct buf * kvsm_snapshot_get(const struct kvsm_snapshot *snapshot, const struct buf *key);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_snapshot_get_view(snapshot, key, view)</summary>
+///
+///   Like kvsm_get_view, as of the snapshot's heads. The view stays valid
+///   until the snapshot ends, whatever compaction runs in the meantime.
+///<C
+KVSM_RESPONSE kvsm_snapshot_get_view(const struct kvsm_snapshot *snapshot, const struct buf *key, struct buf *view);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_snapshot_end(snapshot)</summary>
+///
+///   Releases the snapshot, once the last one ends compaction may reclaim
+///   what they held back. Snapshots must be ended before kvsm_close.
+///<C
+KVSM_RESPONSE kvsm_snapshot_end(struct kvsm_snapshot *snapshot);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>kvsm_set(ctx, key, value)</summary>
 ///
@@ -167,6 +705,192 @@ KVSM_RESPONSE kvsm_set(struct kvsm *ctx, const struct buf *key, const struct buf
 ///>
 /// </details>
 
+/// <details>
+///   <summary>kvsm_batch_begin(ctx)</summary>
+///
+///   Starts collecting entries for a new multi-key transaction
+///<C
+struct kvsm_batch * kvsm_batch_begin(struct kvsm *ctx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_batch_put(batch, key, value)</summary>
+///
+///   Adds a key-value pair to the batch, replacing the value if the key was
+///   already added. Empty keys are rejected with KVSM_ERROR, which goes for
+///   kvsm_set, kvsm_del and kvsm_batch_del as well.
+///<C
+KVSM_RESPONSE kvsm_batch_put(struct kvsm_batch *batch, const struct buf *key, const struct buf *value);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_batch_del(batch, key)</summary>
+///
+///   Adds a tombstone for the given key to the batch
+///<C
+#define kvsm_batch_del(batch,key) (kvsm_batch_put(batch,key,&((struct buf){ .len = 0, .cap = 0 })))
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_batch_commit(batch)</summary>
+///
+///   Writes all entries in the batch to the medium as a single transaction,
+///   making them visible at once. Frees the batch, regardless of the outcome.
+///<C
+KVSM_RESPONSE kvsm_batch_commit(struct kvsm_batch *batch);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_batch_free(batch)</summary>
+///
+///   Discards the batch without writing anything
+///<C
+KVSM_RESPONSE kvsm_batch_free(struct kvsm_batch *batch);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_aio_open(ctx, depth, flags)</summary>
+///
+///   Starts an asynchronous request queue on the descriptor, keeping up to
+///   `depth` value reads in flight (0 = 64). Reads go through io_uring where
+///   the platform and kernel allow it, a small thread pool otherwise, or
+///   KVSM_AIO_POOL forces the latter. Requires KVSM_INDEX, so a get only
+///   probes the index before it's read is issued. Returns NULL on failure,
+///   or when the descriptor was opened without it.
+///
+///   An aio descriptor must only be used by one thread at a time, the
+///   descriptor it's opened on may be shared as usual. It must be closed
+///   before that descriptor is.
+///<C
+struct kvsm_aio * kvsm_aio_open(struct kvsm *ctx, unsigned int depth, KVSM_FLAGS flags);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_aio_get(aio, key, callback, udata)</summary>
+///
+///   Looks up the key in the index right away and starts reading it's value,
+///   `callback` runs from kvsm_aio_wait once it's read. The value is what
+///   kvsm_get would return at the time of the call, NULL if the key is
+///   missing or deleted, and it's the callback's to free.
+///
+///   Values being read are pinned like a snapshot, so compaction leaves them
+///   in place until their callback ran. Waits for a read to finish first when
+///   `depth` are in flight. Returns KVSM_ERROR, without calling `callback`,
+///   if the request could not be issued.
+///<C
+KVSM_RESPONSE kvsm_aio_get(struct kvsm_aio *aio, const struct buf *key, void (*callback)(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_aio_commit(aio, batch, callback, udata)</summary>
+///
+///   Commits the batch right away, `callback` runs from kvsm_aio_wait once
+///   it's flushed to stable storage, with a NULL value. Commits written while
+///   a flush is in flight share the next one. Frees the batch, like
+///   kvsm_batch_commit, returning KVSM_ERROR without calling `callback` if it
+///   could not be written.
+///<C
+KVSM_RESPONSE kvsm_aio_commit(struct kvsm_aio *aio, struct kvsm_batch *batch, void (*callback)(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_aio_wait(aio, count)</summary>
+///
+///   Runs the callbacks of completed requests, waiting until at least `count`
+///   ran or nothing is pending anymore. A `count` of 0 only runs what already
+///   completed. Callbacks may issue new requests.
+///<C
+KVSM_RESPONSE kvsm_aio_wait(struct kvsm_aio *aio, unsigned int count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_aio_close(aio)</summary>
+///
+///   Waits for every pending request, running it's callback, then frees the
+///   aio descriptor
+///<C
+KVSM_RESPONSE kvsm_aio_close(struct kvsm_aio *aio);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_peer_serve(ctx, transport)</summary>
+///
+///   Answers a peer's sync requests over the transport until it hangs up,
+///   returning KVSM_OK if it did so between requests. The heads it hands out
+///   are pinned like a snapshot until the next time it's asked for them, so
+///   compaction leaves what the peer is about to pull.
+///<C
+KVSM_RESPONSE kvsm_peer_serve(struct kvsm *ctx, const struct kvsm_transport *transport);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_peer_pull(ctx, transport, stats)</summary>
+///
+///   Pulls every transaction the peer at the other end of the transport,
+///   served by kvsm_peer_serve, has and this descriptor does not. Ancestry
+///   of unknown heads is requested in batches, each reply describing up to
+///   1024 transactions, then the missing transactions are fetched lowest
+///   first and ingested as they arrive. Several requests are kept in flight
+///   in both phases. Fetch replies are bounded to a few MB, what didn't fit
+///   is requested again. Fills `stats` if given, even on failure.
+///
+///   What was ingested before a failure is kept, pulling again continues
+///   from there.
+///<C
+KVSM_RESPONSE kvsm_peer_pull(struct kvsm *ctx, const struct kvsm_transport *transport, struct kvsm_peer_stats *stats);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_transaction_load(ctx, offset)</summary>
+///
+///   Loads the metadata of the transaction located at the given offset
+///<C
+struct kvsm_transaction * kvsm_transaction_load(const struct kvsm *ctx, PALLOC_OFFSET offset);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_transaction_fetch(ctx, height)</summary>
+///
+///   Loads the oldest transaction with at least the given height, ordered by
+///   height and identifier
+///<C
+struct kvsm_transaction * kvsm_transaction_fetch(const struct kvsm *ctx, uint64_t height);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_transaction_next(tx)</summary>
+///
+///   Loads the transaction following the given one in height order, the given
+///   one may have been removed by compaction in the meantime
+///<C
+struct kvsm_transaction * kvsm_transaction_next(const struct kvsm_transaction *tx);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_transaction_previous(tx)</summary>
+///
+///   Loads the transaction preceding the given one in height order, the given
+///   one may have been removed by compaction in the meantime
+///<C
+struct kvsm_transaction * kvsm_transaction_previous(const struct kvsm_transaction *tx);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>kvsm_transaction_get_id(ctx, offset)</summary>
 ///
@@ -179,7 +903,8 @@ struct buf * kvsm_transaction_get_id(const struct kvsm *ctx, PALLOC_OFFSET offse
 /// <details>
 ///   <summary>kvsm_transaction_load_id(ctx, identifier)</summary>
 ///
-///   Loads the metadata for the given transaction id and returns a transaction struct for it
+///   Loads the metadata for the given transaction id and returns a transaction struct for it.
+///   Identifiers are resolved through an in-memory table, without touching the medium.
 ///<C
 struct kvsm_transaction * kvsm_transaction_load_id(const struct kvsm *ctx, const struct buf *identifier);
 ///>
@@ -195,20 +920,37 @@ KVSM_RESPONSE kvsm_transaction_free(struct kvsm_transaction *tx);
 /// </details>
 
 /// <details>
-///   <summary>kvsm_transaction_serialize</summary>
+///   <summary>kvsm_transaction_serialize(tx)</summary>
 ///
-///   Serializes the transaction, including contents
+///   Serializes the transaction, including contents. Parents are referenced by
+///   their identifier instead of their offset, making the result portable
+///   between media. Compressed values are carried as they are stored, merged
+///   transactions carry every entry they retained.
 ///<C
 struct buf * kvsm_transaction_serialize(const struct kvsm_transaction *tx);
 ///>
 /// </details>
 
 /// <details>
-///   <summary>kvsm_transaction_ingest</summary>
+///   <summary>kvsm_transaction_ingest(ctx, data)</summary>
+///
+///   Stores the given serialized transaction and it's data. All of it's parents
+///   must already be known. Ingesting an already-known transaction is a no-op.
+///<C
+KVSM_RESPONSE kvsm_transaction_ingest(struct kvsm *ctx, const struct buf *data);
+///>
+/// </details>
+
+/// <details>
+///   <summary>kvsm_transaction_ingest_bulk(ctx, stream)</summary>
 ///
-///   Stores the given transaction and it's data
+///   Ingests a stream of serialized transactions, each prefixed by it's length
+///   as 8-byte big-endian integer. Parents must be known or come earlier in
+///   the stream. The anchor is written once, after the last transaction.
+///   Ingestion stops at the first invalid transaction, returning KVSM_ERROR
+///   while keeping everything before it.
 ///<C
-KVSM_RESPONSE kvsm_transaction_ingest(const struct buf *data);
+KVSM_RESPONSE kvsm_transaction_ingest_bulk(struct kvsm *ctx, const struct buf *stream);
 ///>
 /// </details>
 
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define KVSM_LZ_MIN_MATCH 4
+#define KVSM_LZ_HASH_LOG  12
+#define KVSM_LZ_DISTANCE  65535
+
+// Matches stop this far from the end, the last literals are never matched
+#define KVSM_LZ_END_LITERALS 5
+#define KVSM_LZ_END_MATCH    12
+
+static uint32_t _kvsm_lz_read32(const char *ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+static uint32_t _kvsm_lz_hash(uint32_t value) {
+  return (value * 2654435761U) >> (32 - KVSM_LZ_HASH_LOG);
+}
+
+// Bytes needed to encode a length beyond it's nibble
+static size_t _kvsm_lz_length_size(size_t len) {
+  if (len < 15) return 0;
+  return 1 + ((len - 15) / 255);
+}
+
+static size_t _kvsm_lz_length_write(char *output, size_t len) {
+  size_t n = 0;
+  if (len < 15) return 0;
+  len -= 15;
+  while(len >= 255) {
+    output[n++] = (char)255;
+    len -= 255;
+  }
+  output[n++] = len;
+  return n;
+}
+
+// Writes a sequence of literals, followed by a match if mlen is non-zero
+static int _kvsm_lz_sequence(char *output, size_t cap, size_t *pos, const char *literals, size_t llen, size_t distance, size_t mlen) {
+  size_t needed = 1 + _kvsm_lz_length_size(llen) + llen;
+  size_t mcode  = mlen ? (mlen - KVSM_LZ_MIN_MATCH) : 0;
+  if (mlen) needed += 2 + _kvsm_lz_length_size(mcode);
+  if ((cap - *pos) < needed) return -1;
+
+  output[(*pos)++] = ((llen < 15 ? llen : 15) << 4) | (mcode < 15 ? mcode : 15);
+  *pos += _kvsm_lz_length_write(output + *pos, llen);
+  memcpy(output + *pos, literals, llen);
+  *pos += llen;
+  if (!mlen) return 0;
+
+  output[(*pos)++] = distance & 255;
+  output[(*pos)++] = distance >> 8;
+  *pos += _kvsm_lz_length_write(output + *pos, mcode);
+  return 0;
+}
+
+size_t kvsm_lz_compress(const char *input, size_t len, char *output, size_t cap) {
+  uint32_t table[1 << KVSM_LZ_HASH_LOG];
+  size_t ip = 0, anchor = 0, pos = 0, ref, mlen;
+  uint32_t h;
+
+  if (len > UINT32_MAX) return 0;
+  memset(table, 0, sizeof(table));
+
+  // Greedy, taking the most recent position with the same 4 bytes
+  while((len > KVSM_LZ_END_MATCH) && (ip < (len - KVSM_LZ_END_MATCH))) {
+    h        = _kvsm_lz_hash(_kvsm_lz_read32(input + ip));
+    ref      = table[h];
+    table[h] = ip + 1;
+    if (
+      (!ref) ||
+      ((ip - (ref - 1)) > KVSM_LZ_DISTANCE) ||
+      (_kvsm_lz_read32(input + ref - 1) != _kvsm_lz_read32(input + ip))
+    ) {
+      ip++;
+      continue;
+    }
+    ref--;
+
+    mlen = KVSM_LZ_MIN_MATCH;
+    while(((ip + mlen) < (len - KVSM_LZ_END_LITERALS)) && (input[ref + mlen] == input[ip + mlen])) mlen++;
+    if (_kvsm_lz_sequence(output, cap, &pos, input + anchor, ip - anchor, ip - ref, mlen)) return 0;
+    ip    += mlen;
+    anchor = ip;
+  }
+
+  if (_kvsm_lz_sequence(output, cap, &pos, input + anchor, len - anchor, 0, 0)) return 0;
+  return pos;
+}
+
+// Reads a length beyond it's nibble, failing on truncated input
+static int _kvsm_lz_length_read(const unsigned char *input, size_t len, size_t *ip, size_t *value) {
+  unsigned char b;
+  if (*value != 15) return 0;
+  do {
+    if (*ip >= len) return -1;
+    b       = input[(*ip)++];
+    *value += b;
+  } while(b == 255);
+  return 0;
+}
+
+int kvsm_lz_decompress(const char *input, size_t len, char *output, size_t output_len) {
+  const unsigned char *in = (const unsigned char *)input;
+  size_t ip = 0, op = 0, llen, mlen, distance;
+  unsigned char token;
+
+  while(ip < len) {
+    token = in[ip++];
+    llen  = token >> 4;
+    if (_kvsm_lz_length_read(in, len, &ip, &llen)) return -1;
+    if ((llen > (len - ip)) || (llen > (output_len - op))) return -1;
+    memcpy(output + op, in + ip, llen);
+    ip += llen;
+    op += llen;
+
+    // The last sequence ends the input after it's literals
+    if (ip == len) break;
+
+    if ((len - ip) < 2) return -1;
+    distance = in[ip] | (in[ip + 1] << 8);
+    ip      += 2;
+    if ((!distance) || (distance > op)) return -1;
+    mlen = token & 15;
+    if (_kvsm_lz_length_read(in, len, &ip, &mlen)) return -1;
+    mlen += KVSM_LZ_MIN_MATCH;
+    if (mlen > (output_len - op)) return -1;
+
+    // Byte by byte, matches may overlap what they produce
+    while(mlen--) {
+      output[op] = output[op - distance];
+      op++;
+    }
+  }
+
+  return (op == output_len) ? 0 : -1;
+}
@@ -0,0 +1,19 @@
+#ifndef __FINWO_KVSM_LZ_H__
+#define __FINWO_KVSM_LZ_H__
+
+#include <stddef.h>
+
+// Built-in LZ77 codec for stored values, producing LZ4 block format
+// sequences: a token of literal and match length nibbles, extended by
+// 255-runs, the literals, then a 2-byte little-endian match distance. The
+// last sequence only carries literals.
+
+// Compresses len bytes into at most cap bytes
+// Returns the compressed length, or 0 if it does not fit
+size_t kvsm_lz_compress(const char *input, size_t len, char *output, size_t cap);
+
+// Decompresses into exactly len bytes, rejecting malformed or short input
+// Returns 0 on success, -1 otherwise
+int kvsm_lz_decompress(const char *input, size_t len, char *output, size_t output_len);
+
+#endif // __FINWO_KVSM_LZ_H__
@@ -0,0 +1,768 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "finwo/endian.h"
+#include "rxi/log.h"
+#include "tidwall/buf.h"
+
+#include "kvsm.h"
+
+// Sync protocol between two descriptors, built on the public API only. A
+// frame is a 1-byte type, an 8-byte big-endian payload length, then the
+// payload. Requests are answered in order, so a puller may keep several in
+// flight without tagging them.
+#define KVSM_PEER_FRAME_HEADER 9
+#define KVSM_PEER_FRAME_MAX    (1ULL << 30)
+
+// Payloads beyond a part go out as P frames of that size, the last piece in
+// the frame of the reply itself
+#define KVSM_PEER_FRAME_PART   (4ULL << 20)
+#define KVSM_PEER_PART         'P'
+
+#define KVSM_PEER_HEADS           'H'
+#define KVSM_PEER_HEADS_REPLY     'h'
+#define KVSM_PEER_ANCESTRY        'A'
+#define KVSM_PEER_ANCESTRY_REPLY  'a'
+#define KVSM_PEER_FETCH           'F'
+#define KVSM_PEER_FETCH_REPLY     'f'
+
+// Identifiers per request, requests in flight, and the most transactions an
+// ancestry reply describes. Requests in flight stay well within a pipe's
+// buffer, so neither side blocks writing while the other does too
+#define KVSM_PEER_BATCH  256
+#define KVSM_PEER_WINDOW 8
+#define KVSM_PEER_LIMIT  1024
+
+// A fetch reply stops taking transactions once it's this large
+#define KVSM_PEER_BUDGET (4ULL << 20)
+
+// id + height
+#define KVSM_PEER_HEAD_SIZE (KVSM_ID_LENGTH + sizeof(uint64_t))
+
+// Identifier states while pulling
+#define KVSM_PEER_CANDIDATE 1 // Parent seen, not checked against the medium yet
+#define KVSM_PEER_QUEUED    2 // Missing here, it's ancestry is requested
+#define KVSM_PEER_DONE      3 // Known here, or described by the peer
+
+struct _kvsm_peer_slot {
+  char    id[KVSM_ID_LENGTH];
+  uint8_t state;
+};
+
+// Set of identifiers, they're random so their first bytes hash well enough
+struct _kvsm_peer_set {
+  struct _kvsm_peer_slot *slot;
+  size_t                  count;
+  size_t                  mask;
+};
+
+struct _kvsm_peer_missing {
+  char     id[KVSM_ID_LENGTH];
+  uint64_t height;
+};
+
+// Max-heap of transactions on height, for walking back from requested ones
+struct _kvsm_peer_heap {
+  struct kvsm_transaction **tx;
+  size_t                    count;
+  size_t                    cap;
+};
+
+static void _kvsm_peer_set_free(struct _kvsm_peer_set *set) {
+  free(set->slot);
+  set->slot  = NULL;
+  set->count = 0;
+  set->mask  = 0;
+}
+
+static size_t _kvsm_peer_set_hash(const char *id) {
+  uint64_t hash;
+  memcpy(&hash, id, sizeof(hash));
+  return (hash * 0x9E3779B97F4A7C15ULL) >> 17;
+}
+
+// Returns the identifier's slot, created as candidate if asked for
+static struct _kvsm_peer_slot * _kvsm_peer_set_get(struct _kvsm_peer_set *set, const char *id, bool create) {
+  struct _kvsm_peer_slot *slot, *old;
+  size_t i, j, size;
+
+  if (set->slot) {
+    for( i = _kvsm_peer_set_hash(id) & set->mask ; set->slot[i].state ; i = (i + 1) & set->mask ) {
+      if (!memcmp(set->slot[i].id, id, KVSM_ID_LENGTH)) return &(set->slot[i]);
+    }
+  }
+  if (!create) return NULL;
+
+  // Grow at 50% load
+  if ((!set->slot) || ((set->count + 1) * 2 > (set->mask + 1))) {
+    size = set->slot ? (set->mask + 1) * 2 : 1024;
+    slot = calloc(size, sizeof(struct _kvsm_peer_slot));
+    if (!slot) {
+      log_error("Could not reserve memory for identifier set");
+      return NULL;
+    }
+    old = set->slot;
+    for( i = 0 ; old && (i <= set->mask) ; i++ ) {
+      if (!old[i].state) continue;
+      for( j = _kvsm_peer_set_hash(old[i].id) & (size - 1) ; slot[j].state ; j = (j + 1) & (size - 1) );
+      slot[j] = old[i];
+    }
+    free(old);
+    set->slot = slot;
+    set->mask = size - 1;
+  }
+
+  for( i = _kvsm_peer_set_hash(id) & set->mask ; set->slot[i].state ; i = (i + 1) & set->mask );
+  memcpy(set->slot[i].id, id, KVSM_ID_LENGTH);
+
+  // Marked used, callers set the actual state
+  set->slot[i].state = KVSM_PEER_CANDIDATE;
+  set->count++;
+  return &(set->slot[i]);
+}
+
+static void _kvsm_peer_heap_free(struct _kvsm_peer_heap *heap) {
+  size_t i;
+  for( i = 0 ; i < heap->count ; i++ ) {
+    kvsm_transaction_free(heap->tx[i]);
+  }
+  free(heap->tx);
+  heap->tx    = NULL;
+  heap->count = 0;
+  heap->cap   = 0;
+}
+
+static KVSM_RESPONSE _kvsm_peer_heap_push(struct _kvsm_peer_heap *heap, struct kvsm_transaction *tx) {
+  struct kvsm_transaction **list, *tmp;
+  size_t i, parent;
+
+  if (heap->count == heap->cap) {
+    heap->cap = heap->cap ? heap->cap * 2 : 64;
+    list = realloc(heap->tx, heap->cap * sizeof(struct kvsm_transaction *));
+    if (!list) {
+      log_error("Could not reserve memory for ancestry walk");
+      kvsm_transaction_free(tx);
+      return KVSM_ERROR;
+    }
+    heap->tx = list;
+  }
+
+  i = heap->count++;
+  heap->tx[i] = tx;
+  while(i) {
+    parent = (i - 1) / 2;
+    if (heap->tx[parent]->height >= heap->tx[i]->height) break;
+    tmp              = heap->tx[parent];
+    heap->tx[parent] = heap->tx[i];
+    heap->tx[i]      = tmp;
+    i = parent;
+  }
+  return KVSM_OK;
+}
+
+static struct kvsm_transaction * _kvsm_peer_heap_pop(struct _kvsm_peer_heap *heap) {
+  struct kvsm_transaction *top, *tmp;
+  size_t i, child;
+
+  if (!heap->count) return NULL;
+  top         = heap->tx[0];
+  heap->tx[0] = heap->tx[--heap->count];
+  i = 0;
+  while((child = (i * 2) + 1) < heap->count) {
+    if (((child + 1) < heap->count) && (heap->tx[child + 1]->height > heap->tx[child]->height)) child++;
+    if (heap->tx[i]->height >= heap->tx[child]->height) break;
+    tmp             = heap->tx[i];
+    heap->tx[i]     = heap->tx[child];
+    heap->tx[child] = tmp;
+    i = child;
+  }
+  return top;
+}
+
+// Transfers exactly len bytes, a transport may move less per call
+static KVSM_RESPONSE _kvsm_peer_read(const struct kvsm_transport *transport, void *data, size_t len, bool *eof) {
+  size_t done = 0;
+  ssize_t n;
+  while(done < len) {
+    n = transport->read(transport->udata, ((char *)data) + done, len - done);
+    if (n <= 0) {
+      if (eof) *eof = (!n) && (!done);
+      return KVSM_ERROR;
+    }
+    done += n;
+  }
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_peer_write(const struct kvsm_transport *transport, const void *data, size_t len) {
+  size_t done = 0;
+  ssize_t n;
+  while(done < len) {
+    n = transport->write(transport->udata, ((const char *)data) + done, len - done);
+    if (n <= 0) return KVSM_ERROR;
+    done += n;
+  }
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_peer_send(const struct kvsm_transport *transport, char type, const char *payload, size_t len) {
+  char header[KVSM_PEER_FRAME_HEADER];
+  uint64_t len64;
+  size_t part;
+
+  // Leading parts first, so no frame exceeds what the other side accepts
+  do {
+    part      = (len > KVSM_PEER_FRAME_PART) ? KVSM_PEER_FRAME_PART : len;
+    len64     = htobe64(part);
+    header[0] = (part < len) ? KVSM_PEER_PART : type;
+    memcpy(header + 1, &len64, sizeof(len64));
+    if (_kvsm_peer_write(transport, header, sizeof(header)) != KVSM_OK) {
+      log_error("Could not write to peer");
+      return KVSM_ERROR;
+    }
+    if (_kvsm_peer_write(transport, payload, part) != KVSM_OK) {
+      log_error("Could not write to peer");
+      return KVSM_ERROR;
+    }
+    payload += part;
+    len     -= part;
+  } while(len);
+  return KVSM_OK;
+}
+
+// Reads the next message into payload, joining it's parts, `eof` is set if
+// the peer closed before it
+static KVSM_RESPONSE _kvsm_peer_recv(const struct kvsm_transport *transport, char *type, struct buf *payload, bool *eof) {
+  char header[KVSM_PEER_FRAME_HEADER];
+  uint64_t len64;
+  char *data;
+  size_t cap;
+
+  payload->len = 0;
+  do {
+    if (_kvsm_peer_read(transport, header, sizeof(header), payload->len ? NULL : eof) != KVSM_OK) return KVSM_ERROR;
+    memcpy(&len64, header + 1, sizeof(len64));
+    len64 = be64toh(len64);
+    if (len64 > KVSM_PEER_FRAME_MAX) {
+      log_error("Peer sent an oversized frame");
+      return KVSM_ERROR;
+    }
+    *type = header[0];
+
+    if ((payload->cap - payload->len) < len64) {
+      cap  = (payload->cap * 2 > payload->len + len64) ? payload->cap * 2 : payload->len + len64;
+      data = realloc(payload->data, cap);
+      if (!data) {
+        log_error("Could not reserve memory for peer frame");
+        return KVSM_ERROR;
+      }
+      payload->data = data;
+      payload->cap  = cap;
+    }
+    if (_kvsm_peer_read(transport, payload->data + payload->len, len64, NULL) != KVSM_OK) {
+      log_error("Peer closed mid-frame");
+      return KVSM_ERROR;
+    }
+    payload->len += len64;
+  } while(*type == KVSM_PEER_PART);
+  return KVSM_OK;
+}
+
+// Waits for the reply to the oldest request in flight
+static KVSM_RESPONSE _kvsm_peer_reply(const struct kvsm_transport *transport, char expected, struct buf *payload) {
+  char type;
+  if (_kvsm_peer_recv(transport, &type, payload, NULL) != KVSM_OK) {
+    log_error("Could not read from peer");
+    return KVSM_ERROR;
+  }
+  if (type != expected) {
+    log_error("Peer sent an unexpected reply");
+    return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+static bool _kvsm_peer_known(const struct kvsm *ctx, const char *id) {
+  struct buf identifier = { .data = (char *)id, .len = KVSM_ID_LENGTH, .cap = KVSM_ID_LENGTH };
+  struct kvsm_transaction *tx = kvsm_transaction_load_id(ctx, &identifier);
+  if (!tx) return false;
+  kvsm_transaction_free(tx);
+  return true;
+}
+
+static void _kvsm_peer_append64(struct buf *output, uint64_t value) {
+  value = htobe64(value);
+  buf_append(output, (char *)&value, sizeof(value));
+}
+
+// Current heads as identifier and height, pinned for the rest of the session
+// so compaction leaves what the puller is about to ask for
+static KVSM_RESPONSE _kvsm_peer_heads(struct kvsm *ctx, struct kvsm_snapshot **snapshot, struct buf *response) {
+  struct kvsm_transaction *tx;
+  int i;
+
+  if (*snapshot) kvsm_snapshot_end(*snapshot);
+  *snapshot = kvsm_snapshot_begin(ctx);
+  if (!*snapshot) return KVSM_ERROR;
+
+  for( i = 0 ; i < (*snapshot)->head_count ; i++ ) {
+    tx = kvsm_transaction_load(ctx, (*snapshot)->head[i]);
+    if (!tx) {
+      log_error("Could not load head at %lld", (*snapshot)->head[i]);
+      return KVSM_ERROR;
+    }
+    buf_append(response, tx->id->data, KVSM_ID_LENGTH);
+    _kvsm_peer_append64(response, tx->height);
+    kvsm_transaction_free(tx);
+  }
+  return KVSM_OK;
+}
+
+// Describes the requested transactions and their ancestors, highest first,
+// up to a limit. Each as identifier, height, 4-byte parent count and parent
+// identifiers. Unknown identifiers are left out
+static KVSM_RESPONSE _kvsm_peer_ancestry(struct kvsm *ctx, const struct buf *request, struct buf *response) {
+  struct _kvsm_peer_heap heap = {0};
+  struct _kvsm_peer_set seen = {0};
+  struct _kvsm_peer_slot *slot;
+  struct kvsm_transaction *tx, *parent;
+  struct buf identifier = { .len = KVSM_ID_LENGTH, .cap = KVSM_ID_LENGTH };
+  KVSM_RESPONSE result = KVSM_ERROR;
+  uint32_t limit, count, emitted = 0;
+  size_t pos, mark;
+  int i, j;
+
+  if ((request->len < sizeof(limit)) || ((request->len - sizeof(limit)) % KVSM_ID_LENGTH)) {
+    log_error("Malformed ancestry request");
+    return KVSM_ERROR;
+  }
+  memcpy(&limit, request->data, sizeof(limit));
+  limit = be32toh(limit);
+  if (limit > KVSM_PEER_LIMIT) limit = KVSM_PEER_LIMIT;
+
+  for( pos = sizeof(limit) ; pos < request->len ; pos += KVSM_ID_LENGTH ) {
+    identifier.data = request->data + pos;
+    if (!(tx = kvsm_transaction_load_id(ctx, &identifier))) continue;
+    if (!(slot = _kvsm_peer_set_get(&seen, tx->id->data, true))) goto done;
+    if (slot->state == KVSM_PEER_DONE) {
+      kvsm_transaction_free(tx);
+      continue;
+    }
+    slot->state = KVSM_PEER_DONE;
+    if (_kvsm_peer_heap_push(&heap, tx) != KVSM_OK) goto done;
+  }
+
+  while((emitted < limit) && (tx = _kvsm_peer_heap_pop(&heap))) {
+    buf_append(response, tx->id->data, KVSM_ID_LENGTH);
+    _kvsm_peer_append64(response, tx->height);
+    mark  = response->len;
+    count = 0;
+    buf_append(response, (char *)&count, sizeof(count));
+
+    for( i = 0 ; i < tx->parent_count ; i++ ) {
+      // Skip padding left behind by compaction
+      for( j = 0 ; j < i ; j++ ) {
+        if (tx->parent[j] == tx->parent[i]) break;
+      }
+      if (j < i) continue;
+      if (!(parent = kvsm_transaction_load(ctx, tx->parent[i]))) {
+        log_error("Could not load parent at %lld", tx->parent[i]);
+        kvsm_transaction_free(tx);
+        goto done;
+      }
+      buf_append(response, parent->id->data, KVSM_ID_LENGTH);
+      count++;
+
+      if (!(slot = _kvsm_peer_set_get(&seen, parent->id->data, true))) {
+        kvsm_transaction_free(parent);
+        kvsm_transaction_free(tx);
+        goto done;
+      }
+      if (slot->state == KVSM_PEER_DONE) {
+        kvsm_transaction_free(parent);
+        continue;
+      }
+      slot->state = KVSM_PEER_DONE;
+      if (_kvsm_peer_heap_push(&heap, parent) != KVSM_OK) {
+        kvsm_transaction_free(tx);
+        goto done;
+      }
+    }
+
+    count = htobe32(count);
+    memcpy(response->data + mark, &count, sizeof(count));
+    kvsm_transaction_free(tx);
+    emitted++;
+  }
+  result = KVSM_OK;
+
+done:
+  _kvsm_peer_heap_free(&heap);
+  _kvsm_peer_set_free(&seen);
+  return result;
+}
+
+// Serializes the requested transactions as a bulk stream, in request order,
+// until the reply reaches it's budget. Prefixed with how many of the
+// identifiers it got to, the puller asks for the rest again
+static KVSM_RESPONSE _kvsm_peer_fetch(struct kvsm *ctx, const struct buf *request, struct buf *response) {
+  struct buf identifier = { .len = KVSM_ID_LENGTH, .cap = KVSM_ID_LENGTH };
+  struct kvsm_transaction *tx;
+  struct buf *serialized;
+  uint32_t handled = 0;
+  size_t pos;
+
+  if (request->len % KVSM_ID_LENGTH) {
+    log_error("Malformed fetch request");
+    return KVSM_ERROR;
+  }
+
+  buf_append(response, (char *)&handled, sizeof(handled));
+  for( pos = 0 ; (pos < request->len) && (response->len < KVSM_PEER_BUDGET) ; pos += KVSM_ID_LENGTH ) {
+    handled++;
+    identifier.data = request->data + pos;
+    if (!(tx = kvsm_transaction_load_id(ctx, &identifier))) continue;
+    serialized = kvsm_transaction_serialize(tx);
+    kvsm_transaction_free(tx);
+    if (!serialized) return KVSM_ERROR;
+    _kvsm_peer_append64(response, serialized->len);
+    buf_append(response, serialized->data, serialized->len);
+    buf_clear(serialized);
+    free(serialized);
+  }
+  handled = htobe32(handled);
+  memcpy(response->data, &handled, sizeof(handled));
+  return KVSM_OK;
+}
+
+KVSM_RESPONSE kvsm_peer_serve(struct kvsm *ctx, const struct kvsm_transport *transport) {
+  struct kvsm_snapshot *snapshot = NULL;
+  struct buf request  = {0};
+  struct buf response = {0};
+  KVSM_RESPONSE result = KVSM_OK;
+  bool eof = false;
+  char type, reply;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!transport) return KVSM_ERROR;
+
+  // Until the peer hangs up between requests
+  for(;;) {
+    if (_kvsm_peer_recv(transport, &type, &request, &eof) != KVSM_OK) {
+      if (!eof) result = KVSM_ERROR;
+      break;
+    }
+
+    response.len = 0;
+    switch(type) {
+      case KVSM_PEER_HEADS:
+        reply  = KVSM_PEER_HEADS_REPLY;
+        result = _kvsm_peer_heads(ctx, &snapshot, &response);
+        break;
+      case KVSM_PEER_ANCESTRY:
+        reply  = KVSM_PEER_ANCESTRY_REPLY;
+        result = _kvsm_peer_ancestry(ctx, &request, &response);
+        break;
+      case KVSM_PEER_FETCH:
+        reply  = KVSM_PEER_FETCH_REPLY;
+        result = _kvsm_peer_fetch(ctx, &request, &response);
+        break;
+      default:
+        log_error("Unknown request from peer");
+        result = KVSM_ERROR;
+        break;
+    }
+    if (result != KVSM_OK) break;
+    if ((result = _kvsm_peer_send(transport, reply, response.data, response.len)) != KVSM_OK) break;
+  }
+
+  if (snapshot) kvsm_snapshot_end(snapshot);
+  buf_clear(&request);
+  buf_clear(&response);
+  return result;
+}
+
+struct _kvsm_peer_pull {
+  struct kvsm                 *ctx;
+  const struct kvsm_transport *transport;
+  struct _kvsm_peer_set        seen;
+  char                        *frontier; // Identifiers to request the ancestry of
+  size_t                       frontier_count;
+  size_t                       frontier_cap;
+  struct _kvsm_peer_missing   *missing;
+  size_t                       missing_count;
+  size_t                       missing_cap;
+  struct buf                   payload;
+  struct buf                   request;
+  struct kvsm_peer_stats       stats;
+};
+
+static KVSM_RESPONSE _kvsm_peer_queue(struct _kvsm_peer_pull *pull, const char *id) {
+  char *frontier;
+  size_t cap;
+  if (pull->frontier_count == pull->frontier_cap) {
+    cap      = pull->frontier_cap ? pull->frontier_cap * 2 : 256;
+    frontier = realloc(pull->frontier, cap * KVSM_ID_LENGTH);
+    if (!frontier) {
+      log_error("Could not reserve memory for sync frontier");
+      return KVSM_ERROR;
+    }
+    pull->frontier     = frontier;
+    pull->frontier_cap = cap;
+  }
+  memcpy(pull->frontier + (pull->frontier_count * KVSM_ID_LENGTH), id, KVSM_ID_LENGTH);
+  pull->frontier_count++;
+  return KVSM_OK;
+}
+
+static KVSM_RESPONSE _kvsm_peer_miss(struct _kvsm_peer_pull *pull, const char *id, uint64_t height) {
+  struct _kvsm_peer_missing *missing;
+  size_t cap;
+  if (pull->missing_count == pull->missing_cap) {
+    cap     = pull->missing_cap ? pull->missing_cap * 2 : 256;
+    missing = realloc(pull->missing, cap * sizeof(struct _kvsm_peer_missing));
+    if (!missing) {
+      log_error("Could not reserve memory for missing transactions");
+      return KVSM_ERROR;
+    }
+    pull->missing     = missing;
+    pull->missing_cap = cap;
+  }
+  memcpy(pull->missing[pull->missing_count].id, id, KVSM_ID_LENGTH);
+  pull->missing[pull->missing_count].height = height;
+  pull->missing_count++;
+  return KVSM_OK;
+}
+
+// Queues an identifier the peer mentioned, unless it's known or queued already
+static KVSM_RESPONSE _kvsm_peer_follow(struct _kvsm_peer_pull *pull, const char *id) {
+  struct _kvsm_peer_slot *slot = _kvsm_peer_set_get(&(pull->seen), id, true);
+  if (!slot) return KVSM_ERROR;
+  if (slot->state != KVSM_PEER_CANDIDATE) return KVSM_OK;
+  if (_kvsm_peer_known(pull->ctx, id)) {
+    slot->state = KVSM_PEER_DONE;
+    return KVSM_OK;
+  }
+  slot->state = KVSM_PEER_QUEUED;
+  return _kvsm_peer_queue(pull, id);
+}
+
+// Records what an ancestry reply describes, then follows the parents it did
+// not describe itself. Entries known here end the walk along their path
+static KVSM_RESPONSE _kvsm_peer_discover(struct _kvsm_peer_pull *pull) {
+  const struct buf *payload = &(pull->payload);
+  struct _kvsm_peer_slot *slot;
+  const char *id;
+  uint64_t height;
+  uint32_t count;
+  size_t pos, start, first, parents;
+
+  // Identify the parents to follow first, entries later in the reply may
+  // describe them already
+  start   = pull->frontier_count;
+  parents = 0;
+  for( pos = 0 ; pos < payload->len ; pos += count * KVSM_ID_LENGTH ) {
+    if ((payload->len - pos) < (KVSM_PEER_HEAD_SIZE + sizeof(count))) goto malformed;
+    id = payload->data + pos;
+    memcpy(&height, id + KVSM_ID_LENGTH, sizeof(height));
+    memcpy(&count, id + KVSM_PEER_HEAD_SIZE, sizeof(count));
+    height = be64toh(height);
+    count  = be32toh(count);
+    pos   += KVSM_PEER_HEAD_SIZE + sizeof(count);
+    if (((payload->len - pos) / KVSM_ID_LENGTH) < count) goto malformed;
+
+    if (!(slot = _kvsm_peer_set_get(&(pull->seen), id, true))) return KVSM_ERROR;
+    if (slot->state == KVSM_PEER_DONE) continue;
+    if ((slot->state == KVSM_PEER_CANDIDATE) && _kvsm_peer_known(pull->ctx, id)) {
+      slot->state = KVSM_PEER_DONE;
+      continue;
+    }
+    slot->state = KVSM_PEER_DONE;
+    if (_kvsm_peer_miss(pull, id, height) != KVSM_OK) return KVSM_ERROR;
+
+    // Parked on the frontier, checked once the whole reply is in
+    for( first = pos ; first < (pos + (count * KVSM_ID_LENGTH)) ; first += KVSM_ID_LENGTH ) {
+      if (!_kvsm_peer_set_get(&(pull->seen), payload->data + first, true)) return KVSM_ERROR;
+      if (_kvsm_peer_queue(pull, payload->data + first) != KVSM_OK) return KVSM_ERROR;
+      parents++;
+    }
+  }
+
+  // Take the parked parents back off, following those still undescribed
+  pull->frontier_count = start;
+  for( first = 0 ; first < parents ; first++ ) {
+    if (_kvsm_peer_follow(pull, pull->frontier + ((start + first) * KVSM_ID_LENGTH)) != KVSM_OK) return KVSM_ERROR;
+  }
+  return KVSM_OK;
+
+malformed:
+  log_error("Malformed ancestry reply");
+  return KVSM_ERROR;
+}
+
+static int _kvsm_peer_missing_cmp(const void *a, const void *b) {
+  const struct _kvsm_peer_missing *ma = a;
+  const struct _kvsm_peer_missing *mb = b;
+  if (ma->height != mb->height) return (ma->height < mb->height) ? -1 : 1;
+  return memcmp(ma->id, mb->id, KVSM_ID_LENGTH);
+}
+
+// Asks the peer for it's heads, following any unknown ones
+static KVSM_RESPONSE _kvsm_peer_pull_heads(struct _kvsm_peer_pull *pull) {
+  size_t pos;
+  if (_kvsm_peer_send(pull->transport, KVSM_PEER_HEADS, NULL, 0) != KVSM_OK) return KVSM_ERROR;
+  pull->stats.requests++;
+  if (_kvsm_peer_reply(pull->transport, KVSM_PEER_HEADS_REPLY, &(pull->payload)) != KVSM_OK) return KVSM_ERROR;
+  pull->stats.bytes += pull->payload.len;
+  if (pull->payload.len % KVSM_PEER_HEAD_SIZE) {
+    log_error("Malformed heads reply");
+    return KVSM_ERROR;
+  }
+  for( pos = 0 ; pos < pull->payload.len ; pos += KVSM_PEER_HEAD_SIZE ) {
+    if (_kvsm_peer_follow(pull, pull->payload.data + pos) != KVSM_OK) return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+// Requests the ancestry of the frontier in batches, several in flight, until
+// every path reached something known here
+static KVSM_RESPONSE _kvsm_peer_pull_ancestry(struct _kvsm_peer_pull *pull) {
+  uint32_t limit = htobe32(KVSM_PEER_LIMIT);
+  size_t pos = 0, count;
+  int inflight = 0;
+
+  while((pos < pull->frontier_count) || inflight) {
+    while((inflight < KVSM_PEER_WINDOW) && (pos < pull->frontier_count)) {
+      count = pull->frontier_count - pos;
+      if (count > KVSM_PEER_BATCH) count = KVSM_PEER_BATCH;
+      pull->request.len = 0;
+      buf_append(&(pull->request), (char *)&limit, sizeof(limit));
+      buf_append(&(pull->request), pull->frontier + (pos * KVSM_ID_LENGTH), count * KVSM_ID_LENGTH);
+      if (_kvsm_peer_send(pull->transport, KVSM_PEER_ANCESTRY, pull->request.data, pull->request.len) != KVSM_OK) return KVSM_ERROR;
+      pull->stats.requests++;
+      pos += count;
+      inflight++;
+    }
+
+    if (_kvsm_peer_reply(pull->transport, KVSM_PEER_ANCESTRY_REPLY, &(pull->payload)) != KVSM_OK) return KVSM_ERROR;
+    pull->stats.bytes += pull->payload.len;
+    inflight--;
+    if (_kvsm_peer_discover(pull) != KVSM_OK) return KVSM_ERROR;
+  }
+  return KVSM_OK;
+}
+
+// Transactions in a bulk stream, ingest already rejected malformed ones
+static uint64_t _kvsm_peer_count(const struct buf *stream) {
+  uint64_t count = 0, len;
+  size_t pos = 0;
+  while((stream->len - pos) >= sizeof(len)) {
+    memcpy(&len, stream->data + pos, sizeof(len));
+    len = be64toh(len);
+    if (len > (stream->len - pos - sizeof(len))) break;
+    pos += sizeof(len) + len;
+    count++;
+  }
+  return count;
+}
+
+// Fetches the missing transactions lowest first, so every batch only refers
+// to what's known or came before it, ingesting each as it arrives. A reply
+// cut off by the server's budget is continued where it stopped, later
+// replies could refer to what it left out so they're dropped and the rest
+// is asked for one request at a time, each reply being large anyway
+static KVSM_RESPONSE _kvsm_peer_pull_fetch(struct _kvsm_peer_pull *pull) {
+  struct buf stream = {0};
+  size_t pos = 0, acked = 0, i, count;
+  uint32_t handled;
+  int inflight = 0;
+  int window   = KVSM_PEER_WINDOW;
+
+  if (pull->missing_count) qsort(pull->missing, pull->missing_count, sizeof(struct _kvsm_peer_missing), _kvsm_peer_missing_cmp);
+
+  while((pos < pull->missing_count) || inflight) {
+    while((inflight < window) && (pos < pull->missing_count)) {
+      count = pull->missing_count - pos;
+      if (count > KVSM_PEER_BATCH) count = KVSM_PEER_BATCH;
+      pull->request.len = 0;
+      for( i = 0 ; i < count ; i++ ) {
+        buf_append(&(pull->request), pull->missing[pos + i].id, KVSM_ID_LENGTH);
+      }
+      if (_kvsm_peer_send(pull->transport, KVSM_PEER_FETCH, pull->request.data, pull->request.len) != KVSM_OK) return KVSM_ERROR;
+      pull->stats.requests++;
+      pos += count;
+      inflight++;
+    }
+
+    if (_kvsm_peer_reply(pull->transport, KVSM_PEER_FETCH_REPLY, &(pull->payload)) != KVSM_OK) return KVSM_ERROR;
+    pull->stats.bytes += pull->payload.len;
+    inflight--;
+
+    // Batches went out back to back, the oldest starts where the last ended
+    count = pull->missing_count - acked;
+    if (count > KVSM_PEER_BATCH) count = KVSM_PEER_BATCH;
+    if (pull->payload.len < sizeof(handled)) goto malformed;
+    memcpy(&handled, pull->payload.data, sizeof(handled));
+    handled = be32toh(handled);
+    if ((!handled) || (handled > count)) goto malformed;
+
+    stream.data = pull->payload.data + sizeof(handled);
+    stream.len  = pull->payload.len  - sizeof(handled);
+    stream.cap  = stream.len;
+    if (kvsm_transaction_ingest_bulk(pull->ctx, &stream) != KVSM_OK) {
+      log_error("Could not ingest transactions from peer");
+      return KVSM_ERROR;
+    }
+    pull->stats.transactions += _kvsm_peer_count(&stream);
+    acked += handled;
+    if (handled == count) continue;
+
+    for( ; inflight ; inflight-- ) {
+      if (_kvsm_peer_reply(pull->transport, KVSM_PEER_FETCH_REPLY, &(pull->payload)) != KVSM_OK) return KVSM_ERROR;
+      pull->stats.bytes += pull->payload.len;
+    }
+    pos    = acked;
+    window = 1;
+  }
+  return KVSM_OK;
+
+malformed:
+  log_error("Malformed fetch reply");
+  return KVSM_ERROR;
+}
+
+KVSM_RESPONSE kvsm_peer_pull(struct kvsm *ctx, const struct kvsm_transport *transport, struct kvsm_peer_stats *stats) {
+  struct _kvsm_peer_pull pull = {0};
+  KVSM_RESPONSE result = KVSM_ERROR;
+  struct timespec start, end;
+
+  if (!ctx) return KVSM_ERROR;
+  if (!transport) return KVSM_ERROR;
+  pull.ctx       = ctx;
+  pull.transport = transport;
+  timespec_get(&start, TIME_UTC);
+
+  if (_kvsm_peer_pull_heads(&pull) != KVSM_OK) goto done;
+  if (_kvsm_peer_pull_ancestry(&pull) != KVSM_OK) goto done;
+  if (_kvsm_peer_pull_fetch(&pull) != KVSM_OK) goto done;
+  result = KVSM_OK;
+
+done:
+  timespec_get(&end, TIME_UTC);
+  pull.stats.seconds = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+  log_debug(
+    "Pulled %lld transaction(s), %lld bytes in %lld requests, %.3fs",
+    (long long)pull.stats.transactions, (long long)pull.stats.bytes, (long long)pull.stats.requests, pull.stats.seconds
+  );
+  if (stats) *stats = pull.stats;
+  _kvsm_peer_set_free(&(pull.seen));
+  free(pull.frontier);
+  free(pull.missing);
+  buf_clear(&(pull.payload));
+  buf_clear(&(pull.request));
+  return result;
+}
@@ -2,23 +2,1783 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/socket.h>
+#endif
 
 #include "finwo/assert.h"
+#include "finwo/endian.h"
 #include "rxi/log.h"
 
 #include "src/kvsm.h"
 
+#define BUF(s) (&((struct buf){ .data = (s), .len = strlen(s), .cap = strlen(s) }))
+
+static int buf_is(struct buf *value, const char *expected) {
+  int result = value && (value->len == strlen(expected)) && !memcmp(value->data, expected, value->len);
+  if (value) {
+    buf_clear(value);
+    free(value);
+  }
+  return result;
+}
+
 void test_kvsm_regular() {
-  /*struct kvsm *ctx;*/
-  /**/
-  /*ctx = kvsm_open("test.db", 0);*/
-  /*ASSERT("Opening a file returns a context", ctx != NULL);*/
-  /*ASSERT("Closing a file context returns OK", kvsm_close(ctx) == KVSM_OK);*/
-  /**/
-  /*ctx = kvsm_open(NULL, 0);*/
-  /*ASSERT("Opening a NULL returns no context", ctx == NULL);*/
-  /*ASSERT("Closing a NULL context returns ERROR", kvsm_close(ctx) != KVSM_OK);*/
-  /**/
+  struct kvsm *ctx;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", 0);
+  ASSERT("Opening a file returns a context", ctx != NULL);
+  ASSERT("Closing a file context returns OK", kvsm_close(ctx) == KVSM_OK);
+
+  ctx = kvsm_open(NULL, 0);
+  ASSERT("Opening a NULL returns no context", ctx == NULL);
+  ASSERT("Closing a NULL context returns ERROR", kvsm_close(ctx) != KVSM_OK);
+
+}
+
+void test_kvsm_get_set() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP, KVSM_MMAP | KVSM_INDEX };
+  struct kvsm *ctx;
+  int i;
+
+  for( i = 0 ; i < 4 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Missing key returns NULL", kvsm_get(ctx, BUF("foo")) == NULL);
+    ASSERT("Setting a key returns OK", kvsm_set(ctx, BUF("foo"), BUF("bar")) == KVSM_OK);
+    ASSERT("Setting another key returns OK", kvsm_set(ctx, BUF("hello"), BUF("world")) == KVSM_OK);
+    ASSERT("Overwriting a key returns OK", kvsm_set(ctx, BUF("foo"), BUF("baz")) == KVSM_OK);
+    ASSERT("Get returns the latest value", buf_is(kvsm_get(ctx, BUF("foo")), "baz"));
+    ASSERT("Get finds older transactions", buf_is(kvsm_get(ctx, BUF("hello")), "world"));
+    ASSERT("Single head after local writes", ctx->head_count == 1);
+    ASSERT("Deleting a key returns OK", kvsm_del(ctx, BUF("hello")) == KVSM_OK);
+    ASSERT("Deleted key returns NULL", kvsm_get(ctx, BUF("hello")) == NULL);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Values persist after reopen", buf_is(kvsm_get(ctx, BUF("foo")), "baz"));
+    ASSERT("Tombstones persist after reopen", kvsm_get(ctx, BUF("hello")) == NULL);
+    ASSERT("Compaction returns OK", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Values survive compaction", buf_is(kvsm_get(ctx, BUF("foo")), "baz"));
+    ASSERT("Tombstones survive compaction", kvsm_get(ctx, BUF("hello")) == NULL);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Compacted medium reopens", buf_is(kvsm_get(ctx, BUF("foo")), "baz"));
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_transaction() {
+  struct kvsm *src, *dst;
+  struct kvsm_transaction *tx, *next;
+  struct buf *serialized;
+  int count = 0;
+
+  remove("test.db");
+  remove("test2.db");
+  src = kvsm_open("test.db", KVSM_DEFAULT);
+  dst = kvsm_open("test2.db", KVSM_INDEX);
+  kvsm_set(src, BUF("foo"), BUF("bar"));
+  kvsm_set(src, BUF("hello"), BUF("world"));
+  kvsm_set(src, BUF("foo"), BUF("baz"));
+
+  tx = kvsm_transaction_fetch(src, 0);
+  ASSERT("Fetch returns the oldest transaction", tx && (tx->height == 1));
+  while(tx) {
+    serialized = kvsm_transaction_serialize(tx);
+    if (kvsm_transaction_ingest(dst, serialized) == KVSM_OK) count++;
+    buf_clear(serialized);
+    free(serialized);
+    next = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+  ASSERT("All transactions are ingested", count == 3);
+  ASSERT("Ingested values are readable", buf_is(kvsm_get(dst, BUF("foo")), "baz"));
+  ASSERT("Ingested history is readable", buf_is(kvsm_get(dst, BUF("hello")), "world"));
+
+  tx = kvsm_transaction_load(src, src->head[0]);
+  serialized = kvsm_transaction_serialize(tx);
+  ASSERT("Ingesting a known transaction is a no-op", kvsm_transaction_ingest(dst, serialized) == KVSM_OK);
+  ASSERT("No-op ingest keeps a single head", dst->head_count == 1);
+  kvsm_transaction_free(tx);
+
+  tx = kvsm_transaction_load_id(dst, &((struct buf){ .data = serialized->data + 1, .len = KVSM_ID_LENGTH }));
+  ASSERT("Transactions can be loaded by id", tx && (tx->height == 3));
+  kvsm_transaction_free(tx);
+
+  serialized->data[1] ^= 0xFF;
+  serialized->data[serialized->len - 1] = 1;
+  ASSERT("Malformed transactions are rejected", kvsm_transaction_ingest(src, serialized) != KVSM_OK);
+  buf_clear(serialized);
+  free(serialized);
+
+  kvsm_close(src);
+  kvsm_close(dst);
+  remove("test2.db");
+}
+
+void test_kvsm_checkpoint() {
+  struct kvsm_transaction *tx;
+  PALLOC_OFFSET orphan, off;
+  struct buf *serialized;
+  struct kvsm *ctx;
+  // header, parent, end of parents, end of entries
+  char sibling[1 + KVSM_ID_LENGTH + 8 + KVSM_ID_LENGTH + KVSM_ID_LENGTH + 1];
+  char key[16];
+  int i, ok;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_INDEX);
+  ctx->checkpoint_interval = 0;
+  for( i = 0 ; i < 100 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    kvsm_set(ctx, BUF(key), BUF(key));
+  }
+  ASSERT("Manual checkpoint returns OK", kvsm_checkpoint(ctx) == KVSM_OK);
+  ASSERT("Checkpoint resets the pending count", ctx->checkpoint_pending == 0);
+  kvsm_set(ctx, BUF("key-1"), BUF("changed"));
+  kvsm_set(ctx, BUF("late"), BUF("value"));
+
+  // Skip the checkpoint on close, as if we crashed
+  ctx->checkpoint_pending = 0;
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_INDEX);
+  ASSERT("Reopen uses the checkpoint", ctx->checkpoint != 0);
+  ASSERT("Reopen replays writes after the checkpoint", ctx->checkpoint_pending == 2);
+  ASSERT("Single head after replay", ctx->head_count == 1);
+  ASSERT("Replayed overwrite is visible", buf_is(kvsm_get(ctx, BUF("key-1")), "changed"));
+  ASSERT("Replayed key is visible", buf_is(kvsm_get(ctx, BUF("late")), "value"));
+  ok = 1;
+  for( i = 2 ; i < 100 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    ok &= buf_is(kvsm_get(ctx, BUF(key)), key);
+  }
+  ASSERT("Checkpointed keys are visible", ok);
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ASSERT("Opening without index uses the checkpoint", (ctx->checkpoint != 0) && (ctx->checkpoint_pending == 0));
+  ASSERT("Unindexed reads match", buf_is(kvsm_get(ctx, BUF("key-1")), "changed"));
+
+  // Siblings of the current head, more than the anchor holds
+  tx         = kvsm_transaction_load(ctx, ctx->head[0]);
+  serialized = kvsm_transaction_serialize(tx);
+  kvsm_transaction_free(tx);
+  ok = 1;
+  for( i = 0 ; i < 40 ; i++ ) {
+    memset(sibling, 0, sizeof(sibling));
+    snprintf(sibling + 1, KVSM_ID_LENGTH, "sibling-%d", i);
+    memcpy(sibling + 1 + KVSM_ID_LENGTH, serialized->data + 1 + KVSM_ID_LENGTH, sizeof(uint64_t));
+    sibling[1 + KVSM_ID_LENGTH + 7]++;
+    memcpy(sibling + 1 + KVSM_ID_LENGTH + 8, serialized->data + 1, KVSM_ID_LENGTH);
+    ok &= kvsm_transaction_ingest(ctx, &((struct buf){ .data = sibling, .len = sizeof(sibling) })) == KVSM_OK;
+  }
+  buf_clear(serialized);
+  free(serialized);
+  ASSERT("Ingested siblings are all heads", ok && (ctx->head_count == 40));
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ASSERT("Heads beyond the anchor are restored without a scan", (ctx->anchor_heads != 0) && (ctx->head_count == 40) && (ctx->checkpoint_pending == 0));
+  kvsm_set(ctx, BUF("joined"), BUF("value"));
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ASSERT("Joining the heads releases the overflow", (ctx->anchor_heads == 0) && (ctx->head_count == 1));
+
+  // Allocated before the anchor referred to it, then crash before closing
+  orphan = palloc(ctx->fd, 64);
+  ctx->checkpoint_pending = 0;
+  ctx->anchor             = 0;
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  for( off = palloc_next(ctx->fd, 0) ; off && (off != orphan) ; off = palloc_next(ctx->fd, off) );
+  ASSERT("Reopening after a crash releases unreferenced blobs", !off);
+  ASSERT("Reopening after a crash keeps the data", buf_is(kvsm_get(ctx, BUF("joined")), "value"));
+  kvsm_close(ctx);
+}
+
+void test_kvsm_identifier() {
+  struct kvsm *ctx;
+  struct kvsm_transaction *tx;
+  struct buf *dead, *live;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  kvsm_set(ctx, BUF("x"), BUF("1"));
+  kvsm_set(ctx, BUF("foo"), BUF("a"));
+  dead = kvsm_transaction_get_id(ctx, ctx->head[0]);
+  kvsm_set(ctx, BUF("foo"), BUF("b"));
+  live = kvsm_transaction_get_id(ctx, ctx->head[0]);
+  kvsm_set(ctx, BUF("y"), BUF("2"));
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  tx  = kvsm_transaction_load_id(ctx, dead);
+  ASSERT("Identifiers resolve after reopen", tx && (tx->height == 2));
+  kvsm_transaction_free(tx);
+
+  kvsm_compact(ctx);
+  ASSERT("Compacted identifiers no longer resolve", kvsm_transaction_load_id(ctx, dead) == NULL);
+  tx = kvsm_transaction_load_id(ctx, live);
+  ASSERT("Live identifiers still resolve", tx && (tx->height == 3));
+  kvsm_transaction_free(tx);
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ASSERT("Compaction is reflected after reopen", kvsm_transaction_load_id(ctx, dead) == NULL);
+  tx = kvsm_transaction_load_id(ctx, live);
+  ASSERT("Live identifiers resolve after reopen", tx && (tx->height == 3));
+  kvsm_transaction_free(tx);
+  kvsm_close(ctx);
+
+  buf_clear(dead);
+  buf_clear(live);
+  free(dead);
+  free(live);
+}
+
+void test_kvsm_batch() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX };
+  struct kvsm *ctx;
+  struct kvsm_batch *batch;
+  struct kvsm_transaction *tx;
+  char key[16], value[16];
+  int i, j, found;
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    kvsm_set(ctx, BUF("gone"), BUF("soon"));
+
+    batch = kvsm_batch_begin(ctx);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_batch_put(batch, BUF(key), BUF(value));
+    }
+    kvsm_batch_put(batch, BUF("key-7"), BUF("replaced"));
+    kvsm_batch_del(batch, BUF("gone"));
+    ASSERT("Batch rejects empty keys", kvsm_batch_put(batch, BUF(""), BUF("nothing")) != KVSM_OK);
+    ASSERT("Batch rejects empty key deletes", kvsm_batch_del(batch, BUF("")) != KVSM_OK);
+    ASSERT("Batch collapses duplicate keys", batch->count == 101);
+    ASSERT("Committing a batch returns OK", kvsm_batch_commit(batch) == KVSM_OK);
+
+    tx = kvsm_transaction_load(ctx, ctx->head[0]);
+    ASSERT("Batch is written as a single transaction", tx && (tx->height == 2));
+    kvsm_transaction_free(tx);
+
+    found = 0;
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), j == 7 ? "replaced" : value);
+    }
+    ASSERT("All batch entries are visible", found == 100);
+    ASSERT("Batch deletes are visible", kvsm_get(ctx, BUF("gone")) == NULL);
+    ASSERT("Set rejects empty keys", kvsm_set(ctx, BUF(""), BUF("nothing")) != KVSM_OK);
+
+    batch = kvsm_batch_begin(ctx);
+    kvsm_batch_put(batch, BUF("key-1"), BUF("aborted"));
+    ASSERT("Freeing a batch returns OK", kvsm_batch_free(batch) == KVSM_OK);
+    ASSERT("Freed batches are not written", buf_is(kvsm_get(ctx, BUF("key-1")), "value-1"));
+
+    batch = kvsm_batch_begin(ctx);
+    ASSERT("Committing an empty batch returns OK", kvsm_batch_commit(batch) == KVSM_OK);
+    tx = kvsm_transaction_load(ctx, ctx->head[0]);
+    ASSERT("Empty batches are not written", tx && (tx->height == 2));
+    kvsm_transaction_free(tx);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Batch entries survive reopen", buf_is(kvsm_get(ctx, BUF("key-99")), "value-99"));
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_view() {
+  KVSM_FLAGS flags[] = { KVSM_MMAP, KVSM_MMAP | KVSM_INDEX };
+  struct kvsm_snapshot *snapshot;
+  struct kvsm *ctx;
+  struct buf view;
+  char key[16], value[2048], other[2048];
+  int i, j, found;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  kvsm_set(ctx, BUF("foo"), BUF("bar"));
+  ASSERT("Views require a mapped medium", kvsm_get_view(ctx, BUF("foo"), &view) != KVSM_OK);
+  kvsm_close(ctx);
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    kvsm_set(ctx, BUF("foo"), BUF("bar"));
+    ASSERT("View of a key returns OK", kvsm_get_view(ctx, BUF("foo"), &view) == KVSM_OK);
+    ASSERT("View points at the value", (view.len == 3) && !memcmp(view.data, "bar", 3) && !view.cap);
+
+    // Grow the medium well beyond the initial mapping
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+    ASSERT("Older views remain readable", (view.len == 3) && !memcmp(view.data, "bar", 3));
+
+    found = 0;
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      found += (kvsm_get_view(ctx, BUF(key), &view) == KVSM_OK) && (view.len == strlen(value));
+    }
+    ASSERT("Views follow the growing medium", found == 100);
+
+    kvsm_del(ctx, BUF("foo"));
+    ASSERT("Deleted keys have no view", kvsm_get_view(ctx, BUF("foo"), &view) != KVSM_OK);
+    ASSERT("Missing keys have no view", kvsm_get_view(ctx, BUF("bar"), &view) != KVSM_OK);
+
+    // Views through a snapshot survive compaction reusing their space
+    snapshot = kvsm_snapshot_begin(ctx);
+    ASSERT("Snapshot view returns OK", kvsm_snapshot_get_view(snapshot, BUF("key-1"), &view) == KVSM_OK);
+    memset(other, 'y', sizeof(other) - 1);
+    other[sizeof(other) - 1] = '\0';
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(other));
+    }
+    kvsm_compact(ctx);
+    kvsm_compact_merge(ctx, 1024 * 1024);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "new-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(other));
+    }
+    ASSERT("Snapshot views keep their value", (view.len == strlen(value)) && !memcmp(view.data, value, view.len));
+
+    // Nothing pins a plain view against the background worker
+    ASSERT("Background compaction starts", kvsm_compact_start(ctx, 0.5) == KVSM_OK);
+    ASSERT("Views are refused while compacting in the background", kvsm_get_view(ctx, BUF("key-1"), &view) != KVSM_OK);
+    ASSERT("Snapshot views are not", kvsm_snapshot_get_view(snapshot, BUF("key-2"), &view) == KVSM_OK);
+    kvsm_compact_stop(ctx);
+    kvsm_snapshot_end(snapshot);
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_value() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_MMAP };
+  struct kvsm *ctx;
+  struct kvsm_value *value;
+  char data[100000], other[100000], part[16];
+  struct buf *copy;
+  FILE *out;
+  int i, j, pipefd[2];
+
+  for( j = 0 ; j < (int)sizeof(data) ; j++ ) data[j] = 'a' + (j % 26);
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    kvsm_set(ctx, BUF("big"), &((struct buf){ .data = data, .len = sizeof(data), .cap = sizeof(data) }));
+    kvsm_set(ctx, BUF("gone"), BUF("soon"));
+    kvsm_del(ctx, BUF("gone"));
+
+    ASSERT("Missing keys have no handle", kvsm_value_open(ctx, BUF("missing")) == NULL);
+    ASSERT("Deleted keys have no handle", kvsm_value_open(ctx, BUF("gone")) == NULL);
+    value = kvsm_value_open(ctx, BUF("big"));
+    ASSERT("Handle reports the value length", value && (value->length == sizeof(data)));
+
+    ASSERT("Reading a range returns OK", kvsm_value_read(value, 50000, part, sizeof(part)) == KVSM_OK);
+    ASSERT("Reading a range returns the right bytes", !memcmp(part, data + 50000, sizeof(part)));
+    ASSERT("Reading beyond the value is refused", kvsm_value_read(value, sizeof(data) - 8, part, sizeof(part)) != KVSM_OK);
+
+    remove("test.out");
+    out = fopen("test.out", "w+b");
+    ASSERT("Sending to a file returns OK", kvsm_value_send(value, 10, sizeof(data) - 10, fileno(out)) == KVSM_OK);
+    fflush(out);
+    fseek(out, 0, SEEK_END);
+    ASSERT("Sending writes the requested length", ftell(out) == (long)(sizeof(data) - 10));
+    fseek(out, 0, SEEK_SET);
+    copy = calloc(1, sizeof(struct buf));
+    copy->data = malloc(sizeof(data));
+    copy->len  = fread(copy->data, 1, sizeof(data), out);
+    fclose(out);
+    ASSERT("Sending writes the requested bytes", (copy->len == sizeof(data) - 10) && !memcmp(copy->data, data + 10, copy->len));
+    buf_clear(copy);
+    free(copy);
+    remove("test.out");
+
+    ASSERT("Creating a pipe", pipe(pipefd) == 0);
+    ASSERT("Sending to a pipe returns OK", kvsm_value_send(value, 26, 1000, pipefd[1]) == KVSM_OK);
+    memset(part, 0, sizeof(part));
+    ASSERT("Reading from the pipe", read(pipefd[0], part, sizeof(part)) == sizeof(part));
+    ASSERT("Pipe carries the requested bytes", !memcmp(part, data, sizeof(part)));
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    ASSERT("Sending beyond the value is refused", kvsm_value_send(value, 1, sizeof(data), pipefd[1]) != KVSM_OK);
+
+    // Superseded, compacted and it's space written over, the handle still
+    // reads the version it was opened on
+    memset(other, 'Z', sizeof(other));
+    kvsm_set(ctx, BUF("big"), &((struct buf){ .data = other, .len = sizeof(other), .cap = sizeof(other) }));
+    ASSERT("Compaction returns OK with a handle open", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Merging returns OK with a handle open", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+    for( j = 0 ; j < 4 ; j++ ) {
+      kvsm_set(ctx, BUF("filler"), &((struct buf){ .data = other, .len = sizeof(other), .cap = sizeof(other) }));
+    }
+    copy = calloc(1, sizeof(struct buf));
+    copy->data = malloc(sizeof(data));
+    copy->len  = sizeof(data);
+    ASSERT("Handle reads after compaction", kvsm_value_read(value, 0, copy->data, copy->len) == KVSM_OK);
+    ASSERT("Handle keeps the original bytes", !memcmp(copy->data, data, sizeof(data)));
+    buf_clear(copy);
+    free(copy);
+
+    ASSERT("Freeing a handle returns OK", kvsm_value_free(value) == KVSM_OK);
+    ASSERT("Freed handles release their version", !ctx->snapshot);
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_filter() {
+  struct kvsm *src, *dst;
+  struct kvsm_transaction *tx;
+  struct buf *serialized;
+  char key[16];
+  int i, found;
+
+  remove("test.db");
+  remove("test2.db");
+  src = kvsm_open("test.db", KVSM_DEFAULT);
+  dst = kvsm_open("test2.db", KVSM_DEFAULT);
+  for( i = 0 ; i < 200 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    kvsm_set(src, BUF(key), BUF(key));
+    tx = kvsm_transaction_load(src, src->head[0]);
+    serialized = kvsm_transaction_serialize(tx);
+    kvsm_transaction_free(tx);
+    kvsm_transaction_ingest(dst, serialized);
+    buf_clear(serialized);
+    free(serialized);
+  }
+
+  tx = kvsm_transaction_load(src, src->head[0]);
+  ASSERT("Committed transactions carry a filter", tx && (tx->filter_blocks == 1));
+  kvsm_transaction_free(tx);
+  tx = kvsm_transaction_load(dst, dst->head[0]);
+  ASSERT("Ingested transactions carry a filter", tx && (tx->filter_blocks == 1));
+  kvsm_transaction_free(tx);
+
+  found = 0;
+  for( i = 0 ; i < 200 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    found += buf_is(kvsm_get(src, BUF(key)), key);
+    found += buf_is(kvsm_get(dst, BUF(key)), key);
+    snprintf(key, sizeof(key), "missing-%d", i);
+    found += kvsm_get(src, BUF(key)) != NULL;
+  }
+  ASSERT("Filters do not hide existing keys", found == 400);
+
+  kvsm_close(src);
+  kvsm_close(dst);
+}
+
+void test_kvsm_sorted() {
+  struct kvsm *src, *dst;
+  struct kvsm_batch *batch;
+  struct kvsm_transaction *tx;
+  struct buf *serialized;
+  struct buf raw = {0};
+  char key[200], value[16];
+  uint64_t len64;
+  int i, found;
+
+  remove("test.db");
+  remove("test2.db");
+  src = kvsm_open("test.db", KVSM_DEFAULT);
+  dst = kvsm_open("test2.db", KVSM_DEFAULT);
+
+  // Mixed key lengths, sharing prefixes
+  batch = kvsm_batch_begin(src);
+  for( i = 0 ; i < 1000 ; i++ ) {
+    snprintf(key, sizeof(key), "%s%d", (i % 10) ? "k" : "a-long-prefix-that-makes-this-key-exceed-128-bytes-so-it-uses-the-two-byte-length-encoding-in-the-entry-list-of-the-transaction-", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    kvsm_batch_put(batch, BUF(key), BUF(value));
+  }
+  kvsm_batch_commit(batch);
+
+  tx = kvsm_transaction_load(src, src->head[0]);
+  ASSERT("Large transactions carry an ordered table", tx && (tx->sorted_count == 1000));
+  serialized = kvsm_transaction_serialize(tx);
+  kvsm_transaction_free(tx);
+  kvsm_transaction_ingest(dst, serialized);
+  buf_clear(serialized);
+  free(serialized);
+  tx = kvsm_transaction_load(dst, dst->head[0]);
+  ASSERT("Ingested large transactions carry an ordered table", tx && (tx->sorted_count == 1000));
+  kvsm_transaction_free(tx);
+
+  found = 0;
+  for( i = 0 ; i < 1000 ; i++ ) {
+    snprintf(key, sizeof(key), "%s%d", (i % 10) ? "k" : "a-long-prefix-that-makes-this-key-exceed-128-bytes-so-it-uses-the-two-byte-length-encoding-in-the-entry-list-of-the-transaction-", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    found += buf_is(kvsm_get(src, BUF(key)), value);
+    found += buf_is(kvsm_get(dst, BUF(key)), value);
+  }
+  ASSERT("Binary search finds every key", found == 2000);
+  ASSERT("Binary search misses absent keys", kvsm_get(src, BUF("k")) == NULL);
+  ASSERT("Binary search misses absent prefixes", kvsm_get(src, BUF("k10000")) == NULL);
+  kvsm_close(src);
+
+  // Unordered entries with a duplicate, the first one wins like in a scan
+  buf_append_byte(&raw, 0);
+  buf_append(&raw, "unordered-tx-id", 15);
+  len64 = htobe64(2);
+  buf_append(&raw, (char *)&len64, sizeof(len64));
+  tx = kvsm_transaction_load(dst, dst->head[0]);
+  buf_append(&raw, tx->id->data, 15);
+  kvsm_transaction_free(tx);
+  buf_append(&raw, (char[15]){0}, 15);
+  for( i = 40 ; i >= 0 ; i-- ) {
+    snprintf(key, sizeof(key), "u%d", i % 20);
+    snprintf(value, sizeof(value), "w%d", i);
+    buf_append_byte(&raw, strlen(key));
+    buf_append(&raw, key, strlen(key));
+    len64 = htobe64(strlen(value));
+    buf_append(&raw, (char *)&len64, sizeof(len64));
+    buf_append(&raw, value, strlen(value));
+  }
+  buf_append_byte(&raw, 0);
+  ASSERT("Ingesting unordered entries returns OK", kvsm_transaction_ingest(dst, &raw) == KVSM_OK);
+  buf_clear(&raw);
+  tx = kvsm_transaction_load(dst, dst->head[0]);
+  ASSERT("Unordered entries get an ordered table", tx && (tx->sorted_count == 41));
+  kvsm_transaction_free(tx);
+  ASSERT("First duplicate wins", buf_is(kvsm_get(dst, BUF("u0")), "w40"));
+  ASSERT("First entry wins", buf_is(kvsm_get(dst, BUF("u19")), "w39"));
+  ASSERT("Older transactions still reachable", buf_is(kvsm_get(dst, BUF("k1")), "v1"));
+  kvsm_close(dst);
+}
+
+static int count_transactions(struct kvsm *ctx) {
+  struct kvsm_transaction *tx, *next;
+  int count = 0;
+  tx = kvsm_transaction_fetch(ctx, 0);
+  while(tx) {
+    count++;
+    next = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+  return count;
+}
+
+// Copies the transaction at the given offset between media
+static void copy_transaction(struct kvsm *src, PALLOC_OFFSET offset, struct kvsm *dst) {
+  struct kvsm_transaction *tx = kvsm_transaction_load(src, offset);
+  struct buf *serialized = kvsm_transaction_serialize(tx);
+  kvsm_transaction_ingest(dst, serialized);
+  buf_clear(serialized);
+  free(serialized);
+  kvsm_transaction_free(tx);
+}
+
+void test_kvsm_order() {
+  struct kvsm_transaction *tx, *next, *removed;
+  struct kvsm *ctx, *other;
+  char key[16];
+  int i, count, ordered;
+  uint64_t height;
+
+  remove("test.db");
+  remove("test2.db");
+  ctx   = kvsm_open("test.db", KVSM_DEFAULT);
+  other = kvsm_open("test2.db", KVSM_DEFAULT);
+  for( i = 0 ; i < 400 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i % 10);
+    kvsm_set(ctx, BUF(key), BUF(key));
+  }
+
+  tx = kvsm_transaction_fetch(ctx, 250);
+  ASSERT("Fetch seeks the requested height", tx && (tx->height == 250));
+  next = kvsm_transaction_previous(tx);
+  ASSERT("Previous steps one height back", next && (next->height == 249));
+  kvsm_transaction_free(next);
+  removed = tx;
+
+  // Ingested below what the other side already wrote
+  for( i = 0 ; i < 5 ; i++ ) kvsm_set(other, BUF("local"), BUF("local"));
+  tx = kvsm_transaction_fetch(ctx, 0);
+  while(tx) {
+    if (tx->height <= 3) copy_transaction(ctx, tx->offset, other);
+    next = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+  count   = 0;
+  ordered = 1;
+  height  = 0;
+  tx = kvsm_transaction_fetch(other, 0);
+  while(tx) {
+    count++;
+    ordered &= tx->height >= height;
+    height   = tx->height;
+    next     = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+  ASSERT("Ingested transactions are ordered", ordered && (count == 8));
+
+  ASSERT("Compaction returns OK", kvsm_compact(ctx) == KVSM_OK);
+  next = kvsm_transaction_next(removed);
+  ASSERT("Next steps past a removed transaction", next && (next->height > 250));
+  kvsm_transaction_free(next);
+  kvsm_transaction_free(removed);
+
+  count   = 0;
+  ordered = 1;
+  height  = 0;
+  tx = kvsm_transaction_fetch(ctx, 0);
+  while(tx) {
+    count++;
+    ordered &= tx->height > height;
+    height   = tx->height;
+    next     = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+  ASSERT("Compaction leaves the remainder in order", ordered && (count >= 10) && (count <= 12));
+
+  tx = kvsm_transaction_previous(&(struct kvsm_transaction){ .ctx = ctx, .id = BUF("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"), .height = ~0ULL });
+  ASSERT("Previous from the end finds the newest", tx && (tx->height == 400));
+  kvsm_transaction_free(tx);
+
+  kvsm_close(ctx);
+  kvsm_close(other);
+}
+
+void test_kvsm_ingest_bulk() {
+  struct kvsm_transaction *tx, *next;
+  struct buf *serialized;
+  struct buf stream = {0};
+  struct kvsm *ctx, *other;
+  char key[16], value[16];
+  uint64_t len;
+  int i, found;
+
+  remove("test.db");
+  remove("test2.db");
+  ctx   = kvsm_open("test.db", KVSM_DEFAULT);
+  other = kvsm_open("test2.db", KVSM_INDEX);
+  for( i = 0 ; i < 200 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i % 50);
+    snprintf(value, sizeof(value), "value-%d", i);
+    kvsm_set(ctx, BUF(key), BUF(value));
+  }
+
+  tx = kvsm_transaction_fetch(ctx, 0);
+  while(tx) {
+    serialized = kvsm_transaction_serialize(tx);
+    len = htobe64(serialized->len);
+    buf_append(&stream, (char *)&len, sizeof(len));
+    buf_append(&stream, serialized->data, serialized->len);
+    buf_clear(serialized);
+    free(serialized);
+    next = kvsm_transaction_next(tx);
+    kvsm_transaction_free(tx);
+    tx = next;
+  }
+
+  ASSERT("Bulk ingest of a truncated stream returns ERROR", kvsm_transaction_ingest_bulk(other, &((struct buf){ .data = stream.data, .len = stream.len - 1 })) != KVSM_OK);
+  ASSERT("Bulk ingest keeps what came before the break", count_transactions(other) == 199);
+  ASSERT("Bulk ingest returns OK", kvsm_transaction_ingest_bulk(other, &stream) == KVSM_OK);
+  ASSERT("Bulk ingest skips known transactions", count_transactions(other) == 200);
+  ASSERT("Bulk ingest leaves a single head", other->head_count == 1);
+  kvsm_close(other);
+
+  other = kvsm_open("test2.db", KVSM_DEFAULT);
+  found = 0;
+  for( i = 0 ; i < 50 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    snprintf(value, sizeof(value), "value-%d", 150 + i);
+    found += buf_is(kvsm_get(other, BUF(key)), value);
+  }
+  ASSERT("Bulk ingested values survive reopening", found == 50);
+
+  kvsm_close(other);
+
+  // Without the root, the first transaction refers to an unknown parent
+  remove("test2.db");
+  other = kvsm_open("test2.db", KVSM_DEFAULT);
+  memcpy(&len, stream.data, sizeof(len));
+  len = sizeof(len) + be64toh(len);
+  ASSERT("Bulk ingest rejects unknown parents", kvsm_transaction_ingest_bulk(other, &((struct buf){ .data = stream.data + len, .len = stream.len - len })) != KVSM_OK);
+  ASSERT("Rejected bulk ingest writes nothing", (count_transactions(other) == 0) && (other->head_count == 0));
+
+  buf_clear(&stream);
+  kvsm_close(ctx);
+  kvsm_close(other);
+}
+
+static int durable_count;
+static uint64_t durable_height;
+
+static void count_durable(struct kvsm *ctx, const struct buf *id, uint64_t height, void *udata) {
+  if (id->len != KVSM_ID_LENGTH) return;
+  if (height <= __sync_fetch_and_add(&durable_height, 0)) return;
+  __sync_lock_test_and_set(&durable_height, height);
+  __sync_fetch_and_add(&durable_count, 1);
+  __sync_fetch_and_add((int *)udata, 1);
+}
+
+void test_kvsm_sync() {
+  struct kvsm *ctx;
+  int i, calls;
+
+  // No durability mode, nothing is reported
+  remove("test.db");
+  durable_count  = 0;
+  durable_height = 0;
+  calls          = 0;
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ctx->sync_callback = count_durable;
+  ctx->sync_udata    = &calls;
+  kvsm_set(ctx, BUF("key"), BUF("value"));
+  ASSERT("Explicit sync returns OK", kvsm_sync(ctx) == KVSM_OK);
+  ASSERT("Without durability mode nothing is reported", calls == 0);
+  kvsm_close(ctx);
+
+  // Every commit is durable once it returns
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_SYNC);
+  ctx->sync_callback = count_durable;
+  ctx->sync_udata    = &calls;
+  for( i = 0 ; i < 5 ; i++ ) {
+    kvsm_set(ctx, BUF("key"), BUF("value"));
+    if (durable_count != (i + 1)) break;
+  }
+  ASSERT("Synchronous commits are reported before returning", (i == 5) && (durable_height == 5));
+  kvsm_close(ctx);
+
+  // Group commit reports everything in order, close flushes the remainder
+  remove("test.db");
+  durable_count  = 0;
+  durable_height = 0;
+  calls          = 0;
+  ctx = kvsm_open("test.db", KVSM_GROUP);
+  ctx->sync_interval = 5;
+  ctx->sync_callback = count_durable;
+  ctx->sync_udata    = &calls;
+  for( i = 0 ; i < 200 ; i++ ) {
+    kvsm_set(ctx, BUF("key"), BUF("value"));
+  }
+  for( i = 0 ; (i < 200) && (__sync_fetch_and_add(&durable_count, 0) < 200) ; i++ ) {
+    usleep(10000);
+  }
+  ASSERT("Group commit reports every transaction in order", __sync_fetch_and_add(&durable_count, 0) == 200);
+  kvsm_set(ctx, BUF("key"), BUF("last"));
+  kvsm_close(ctx);
+  ASSERT("Closing flushes pending group commits", (durable_count == 201) && (calls == 201));
+
+  ctx = kvsm_open("test.db", KVSM_GROUP);
+  ASSERT("Group committed data reopens", buf_is(kvsm_get(ctx, BUF("key")), "last"));
+  kvsm_close(ctx);
+}
+
+#ifndef _WIN32
+struct reader_args {
+  struct kvsm *ctx;
+  int          found;
+};
+
+static void * read_stable(void *arg) {
+  struct reader_args *args = arg;
+  struct kvsm_transaction *tx;
+  char key[16], value[16];
+  int i;
+  for( i = 0 ; i < 2000 ; i++ ) {
+    snprintf(key, sizeof(key), "stable-%d", i % 100);
+    snprintf(value, sizeof(value), "value-%d", i % 100);
+    args->found += buf_is(kvsm_get(args->ctx, BUF(key)), value);
+    if (i % 100) continue;
+    tx = kvsm_transaction_fetch(args->ctx, 1);
+    kvsm_transaction_free(tx);
+  }
+  return NULL;
+}
+
+void test_kvsm_threads() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP, KVSM_DEFAULT };
+  uint64_t cache[]   = { 0, 0, 0, 16384 };
+  struct reader_args args[4];
+  pthread_t thread[4];
+  struct kvsm *ctx;
+  char key[16], value[16];
+  int i, j, found;
+
+  for( i = 0 ; i < 4 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    kvsm_cache_resize(ctx, cache[i]);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "stable-%d", j);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+
+    // Readers share the context while this thread keeps writing
+    for( j = 0 ; j < 4 ; j++ ) {
+      args[j].ctx   = ctx;
+      args[j].found = 0;
+      pthread_create(&(thread[j]), NULL, read_stable, &(args[j]));
+    }
+    for( j = 0 ; j < 200 ; j++ ) {
+      snprintf(key, sizeof(key), "moving-%d", j % 10);
+      kvsm_set(ctx, BUF(key), BUF(key));
+    }
+    found = 0;
+    for( j = 0 ; j < 4 ; j++ ) {
+      pthread_join(thread[j], NULL);
+      found += args[j].found;
+    }
+    ASSERT("Concurrent readers see consistent values", found == (4 * 2000));
+    kvsm_close(ctx);
+  }
+}
+#endif
+
+#ifndef _WIN32
+struct peer_args {
+  struct kvsm  *ctx;
+  int           fd;
+  KVSM_RESPONSE result;
+};
+
+static ssize_t fd_read(void *udata, void *data, size_t len) {
+  return read(*((int *)udata), data, len);
+}
+
+static ssize_t fd_write(void *udata, const void *data, size_t len) {
+  return write(*((int *)udata), data, len);
+}
+
+static void * peer_serve(void *arg) {
+  struct peer_args *args = arg;
+  struct kvsm_transport transport = { fd_read, fd_write, &(args->fd) };
+  args->result = kvsm_peer_serve(args->ctx, &transport);
+  close(args->fd);
+  return NULL;
+}
+
+// Pulls from the source over a socketpair, served from another thread
+static KVSM_RESPONSE peer_pull(struct kvsm *ctx, struct kvsm *source, struct kvsm_peer_stats *stats) {
+  struct kvsm_transport transport = { fd_read, fd_write, NULL };
+  struct peer_args args = { .ctx = source };
+  KVSM_RESPONSE result;
+  pthread_t thread;
+  int fd[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) return KVSM_ERROR;
+  args.fd = fd[1];
+  transport.udata = &(fd[0]);
+  pthread_create(&thread, NULL, peer_serve, &args);
+  result = kvsm_peer_pull(ctx, &transport, stats);
+  close(fd[0]);
+  pthread_join(thread, NULL);
+  if (args.result != KVSM_OK) return KVSM_ERROR;
+  return result;
+}
+
+void test_kvsm_peer() {
+  struct kvsm_peer_stats stats;
+  struct kvsm_transaction *tx;
+  struct kvsm_batch *batch;
+  struct kvsm *a, *b;
+  struct buf *id, large;
+  char key[16], value[16];
+  int i, found;
+
+  remove("test.db");
+  remove("test-peer.db");
+  a = kvsm_open("test.db", KVSM_DEFAULT);
+  b = kvsm_open("test-peer.db", KVSM_INDEX);
+
+  // More than one ancestry reply and several fetches deep
+  for( i = 0 ; i < 1500 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i % 300);
+    snprintf(value, sizeof(value), "value-%d", i);
+    kvsm_set(a, BUF(key), BUF(value));
+  }
+  batch = kvsm_batch_begin(a);
+  for( i = 0 ; i < 50 ; i++ ) {
+    snprintf(key, sizeof(key), "batch-%d", i);
+    kvsm_batch_put(batch, BUF(key), BUF(key));
+  }
+  kvsm_batch_commit(batch);
+
+  ASSERT("Pulling into an empty node returns OK", peer_pull(b, a, &stats) == KVSM_OK);
+  ASSERT("Pulling into an empty node fetches everything", stats.transactions == 1501);
+  ASSERT("Pulling keeps requests in flight", stats.requests < 20);
+  found = 0;
+  for( i = 0 ; i < 300 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    snprintf(value, sizeof(value), "value-%d", 1200 + i);
+    found += buf_is(kvsm_get(b, BUF(key)), value);
+  }
+  ASSERT("Pulled node holds the latest values", found == 300);
+  ASSERT("Pulled node holds batched values", buf_is(kvsm_get(b, BUF("batch-49")), "batch-49"));
+  tx = kvsm_transaction_load(b, b->head[0]);
+  id = kvsm_transaction_get_id(a, a->head[0]);
+  ASSERT("Pulled node shares the source's head", (b->head_count == 1) && tx && id && !memcmp(tx->id->data, id->data, KVSM_ID_LENGTH));
+  kvsm_transaction_free(tx);
+  buf_clear(id);
+  free(id);
+
+  ASSERT("Pulling again returns OK", peer_pull(b, a, &stats) == KVSM_OK);
+  ASSERT("Pulling again fetches nothing", stats.transactions == 0);
+
+  // Diverged nodes only exchange what the other is missing
+  for( i = 0 ; i < 10 ; i++ ) {
+    kvsm_set(a, BUF("from-a"), BUF("a"));
+  }
+  for( i = 0 ; i < 5 ; i++ ) {
+    kvsm_set(b, BUF("from-b"), BUF("b"));
+  }
+  ASSERT("Pulling diverged history returns OK", peer_pull(b, a, &stats) == KVSM_OK);
+  ASSERT("Pulling diverged history fetches the new part", stats.transactions == 10);
+  ASSERT("Pulled node has both branches as heads", b->head_count == 2);
+  ASSERT("Pulled node sees the source's branch", buf_is(kvsm_get(b, BUF("from-a")), "a"));
+  ASSERT("Pulled node keeps it's own branch", buf_is(kvsm_get(b, BUF("from-b")), "b"));
+
+  ASSERT("Pulling the other way returns OK", peer_pull(a, b, &stats) == KVSM_OK);
+  ASSERT("Pulling the other way fetches the other branch", stats.transactions == 5);
+  ASSERT("Both nodes agree after pulling both ways", buf_is(kvsm_get(a, BUF("from-b")), "b") && (a->head_count == 2));
+  kvsm_close(b);
+
+  // Merged history reaches a fresh node in full
+  remove("test-peer.db");
+  b = kvsm_open("test-peer.db", KVSM_DEFAULT);
+  ASSERT("Merging the source returns OK", kvsm_compact_merge(a, 1024 * 1024) == KVSM_OK);
+  ASSERT("Pulling merged history returns OK", peer_pull(b, a, &stats) == KVSM_OK);
+  found = 0;
+  for( i = 0 ; i < 300 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    snprintf(value, sizeof(value), "value-%d", 1200 + i);
+    found += buf_is(kvsm_get(b, BUF(key)), value);
+  }
+  ASSERT("Pulled merged history holds the latest values", found == 300);
+  ASSERT("Pulled merged history holds both branches", buf_is(kvsm_get(b, BUF("from-a")), "a") && buf_is(kvsm_get(b, BUF("from-b")), "b"));
+  kvsm_close(a);
+  kvsm_close(b);
+
+  // Fetches larger than a reply's budget, and a transaction larger than a
+  // frame's part, still arrive in full
+  remove("test.db");
+  remove("test-peer.db");
+  a = kvsm_open("test.db", KVSM_DEFAULT);
+  b = kvsm_open("test-peer.db", KVSM_DEFAULT);
+  large.len  = 6 * 1024 * 1024;
+  large.cap  = large.len;
+  large.data = malloc(large.len);
+  for( i = 0 ; i < (int)large.len ; i++ ) large.data[i] = 'a' + (i % 26);
+  kvsm_set(a, BUF("large"), &large);
+  large.len = 64 * 1024;
+  for( i = 0 ; i < 300 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    large.data[0] = 'a' + (i % 26);
+    kvsm_set(a, BUF(key), &large);
+  }
+  ASSERT("Pulling beyond the reply budget returns OK", peer_pull(b, a, &stats) == KVSM_OK);
+  ASSERT("Pulling beyond the reply budget fetches everything", stats.transactions == 301);
+  ASSERT("Replies cut off by their budget are continued", stats.requests > 4);
+  found = 0;
+  for( i = 0 ; i < 300 ; i++ ) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    id = kvsm_get(b, BUF(key));
+    found += id && (id->len == large.len) && (id->data[0] == ('a' + (i % 26))) && !memcmp(id->data + 1, large.data + 1, large.len - 1);
+    if (id) buf_clear(id);
+    free(id);
+  }
+  ASSERT("Pulled node holds every budgeted value", found == 300);
+  id = kvsm_get(b, BUF("large"));
+  large.data[0] = 'a';
+  ASSERT("Pulled node holds the value larger than a frame", id && (id->len == 6 * 1024 * 1024) && !memcmp(id->data, large.data, 64 * 1024));
+  if (id) buf_clear(id);
+  free(id);
+  free(large.data);
+
+  kvsm_close(a);
+  kvsm_close(b);
+  remove("test-peer.db");
+}
+#endif
+
+void test_kvsm_snapshot() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP };
+  struct kvsm_snapshot *snapshot, *empty;
+  struct kvsm *ctx;
+  char key[16], value[16];
+  int i, j, found, pinned;
+
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    empty = kvsm_snapshot_begin(ctx);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j % 20);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+
+    snapshot = kvsm_snapshot_begin(ctx);
+    ASSERT("Snapshot pins the heads", snapshot && (snapshot->head_count == 1) && (snapshot->height == 100));
+    ASSERT("Snapshot reads current values", buf_is(kvsm_snapshot_get(snapshot, BUF("key-1")), "value-81"));
+
+    // Overwrite and delete after the snapshot, then compact it all away
+    for( j = 100 ; j < 200 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j % 20);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+    kvsm_del(ctx, BUF("key-0"));
+    ASSERT("Compaction returns OK with a snapshot open", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Merging returns OK with a snapshot open", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+    pinned = count_transactions(ctx);
+    ASSERT("Compaction holds back pinned transactions", pinned > 22);
+
+    found = 0;
+    for( j = 0 ; j < 20 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", 80 + j);
+      found += buf_is(kvsm_snapshot_get(snapshot, BUF(key)), value);
+    }
+    ASSERT("Snapshot keeps reading pinned values", found == 20);
+    ASSERT("Empty snapshot reads nothing", kvsm_snapshot_get(empty, BUF("key-1")) == NULL);
+    ASSERT("Regular reads see new values", buf_is(kvsm_get(ctx, BUF("key-1")), "value-181"));
+    ASSERT("Regular reads see deletes", kvsm_get(ctx, BUF("key-0")) == NULL);
+
+    ASSERT("Ending a snapshot returns OK", kvsm_snapshot_end(snapshot) == KVSM_OK);
+    ASSERT("Ending the empty snapshot returns OK", kvsm_snapshot_end(empty) == KVSM_OK);
+    ASSERT("Ending releases the pinned bytes", ctx->bytes_pinned == 0);
+    ASSERT("Compaction returns OK after the snapshot", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Compaction reclaims what was pinned", count_transactions(ctx) < pinned);
+    ASSERT("Compaction keeps current values", buf_is(kvsm_get(ctx, BUF("key-19")), "value-199"));
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_compress() {
+  KVSM_FLAGS flags[] = { KVSM_COMPRESS, KVSM_COMPRESS | KVSM_INDEX, KVSM_COMPRESS | KVSM_MMAP };
+  struct kvsm_transaction *tx;
+  struct kvsm_value *value;
+  struct kvsm *ctx, *other;
+  struct buf *serialized, view;
+  char json[4096], noise[1024], part[64];
+  char key[16];
+  int i, j, found;
+
+  for( j = 0 ; j < (int)sizeof(json) ; j++ ) {
+    json[j] = "{\"name\":\"kvsm\",\"tags\":[\"a\",\"b\"],\"id\":1234}"[j % 42];
+  }
+  json[sizeof(json) - 1] = 0;
+  srand(1);
+  for( j = 0 ; j < (int)sizeof(noise) ; j++ ) noise[j] = 'a' + (rand() % 26);
+  noise[sizeof(noise) - 1] = 0;
+
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    remove("test2.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    kvsm_set(ctx, BUF("json"), BUF(json));
+    kvsm_set(ctx, BUF("small"), BUF("{\"a\":1,\"a\":1,\"a\":1}"));
+    kvsm_set(ctx, BUF("noise"), BUF(noise));
+
+    tx = kvsm_transaction_fetch(ctx, 1);
+    ASSERT("Compressible values are stored compressed", tx && tx->compressed);
+    ASSERT("Compressed values take less space", ctx->bytes_total < 2048 + sizeof(noise));
+    kvsm_transaction_free(tx);
+    tx = kvsm_transaction_fetch(ctx, 2);
+    ASSERT("Small values are stored as-is", tx && !tx->compressed);
+    kvsm_transaction_free(tx);
+
+    ASSERT("Compressed values read back", buf_is(kvsm_get(ctx, BUF("json")), json));
+    ASSERT("Small values read back", buf_is(kvsm_get(ctx, BUF("small")), "{\"a\":1,\"a\":1,\"a\":1}"));
+    ASSERT("Incompressible values read back", buf_is(kvsm_get(ctx, BUF("noise")), noise));
+
+    value = kvsm_value_open(ctx, BUF("json"));
+    ASSERT("Compressed value handle has the full length", value && (value->length == strlen(json)));
+    ASSERT("Compressed value reads by range", value && (kvsm_value_read(value, 1000, part, sizeof(part)) == KVSM_OK) && !memcmp(part, json + 1000, sizeof(part)));
+    kvsm_value_free(value);
+    if (flags[i] & KVSM_MMAP) {
+      ASSERT("Compressed values can not be viewed", kvsm_get_view(ctx, BUF("json"), &view) == KVSM_ERROR);
+      ASSERT("Uncompressed values are still viewed", kvsm_get_view(ctx, BUF("noise"), &view) == KVSM_OK);
+    }
+
+    // Shipped compressed, readable without the flag
+    other = kvsm_open("test2.db", KVSM_DEFAULT);
+    tx = kvsm_transaction_fetch(ctx, 1);
+    serialized = kvsm_transaction_serialize(tx);
+    ASSERT("Serialized compressed transaction uses format 1", serialized && (serialized->data[0] == 1));
+    ASSERT("Serialized compressed transaction stays small", serialized && (serialized->len < 2048));
+    ASSERT("Compressed transaction ingests", kvsm_transaction_ingest(other, serialized) == KVSM_OK);
+    ASSERT("Ingested compressed value reads back", buf_is(kvsm_get(other, BUF("json")), json));
+    buf_clear(serialized);
+    free(serialized);
+    kvsm_transaction_free(tx);
+    kvsm_close(other);
+
+    // Merging keeps values compressed, reopening keeps the index's flags
+    for( j = 0 ; j < 20 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(json));
+    }
+    ASSERT("Merging compressed transactions returns OK", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+    ASSERT("Merging compressed transactions consolidates", count_transactions(ctx) == 1);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    found = 0;
+    for( j = 0 ; j < 20 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), json);
+    }
+    ASSERT("Merged compressed values reopen", found == 20);
+    ASSERT("Merged uncompressed values reopen", buf_is(kvsm_get(ctx, BUF("noise")), noise));
+    kvsm_close(ctx);
+  }
+  remove("test2.db");
+}
+
+struct scan_args {
+  char last[32];
+  int  count;
+  int  ordered;
+  int  valued;
+  int  limit;
+};
+
+static int scan_collect(const struct buf *key, const struct buf *value, void *udata) {
+  struct scan_args *args = udata;
+  char current[32], expected[48];
+  if ((key->len >= sizeof(current)) || (value->len >= sizeof(expected))) return 1;
+  memcpy(current, key->data, key->len);
+  current[key->len] = 0;
+  if (args->count && (strcmp(args->last, current) >= 0)) args->ordered = 0;
+  strcpy(args->last, current);
+  snprintf(expected, sizeof(expected), "value-%s", current);
+  if ((value->len == strlen(expected)) && !memcmp(value->data, expected, value->len)) args->valued++;
+  args->count++;
+  return args->limit && (args->count >= args->limit);
+}
+
+void test_kvsm_scan() {
+  KVSM_FLAGS flags[] = { KVSM_INDEX, KVSM_INDEX | KVSM_COMPRESS };
+  struct scan_args args;
+  struct kvsm *ctx, *other;
+  char key[32], value[64];
+  int i, j, reopen;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  memset(&args, 0, sizeof(args));
+  ASSERT("Scans require the index", kvsm_scan(ctx, NULL, NULL, scan_collect, &args) == KVSM_ERROR);
+  kvsm_close(ctx);
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    remove("test2.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    ctx->compress_min = 1;
+
+    // Written out of order, with some overwritten and some deleted
+    for( j = 49 ; j >= 0 ; j-- ) {
+      snprintf(key, sizeof(key), "user:%03d", (j * 7) % 50);
+      snprintf(value, sizeof(value), "value-%s", key);
+      kvsm_set(ctx, BUF(key), BUF("stale"));
+      kvsm_set(ctx, BUF(key), BUF(value));
+      snprintf(key, sizeof(key), "item:%03d", j);
+      snprintf(value, sizeof(value), "value-%s", key);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+    kvsm_del(ctx, BUF("user:010"));
+    kvsm_del(ctx, BUF("user:011"));
+
+    // Keys arriving by ingest are ordered too
+    other = kvsm_open("test2.db", KVSM_DEFAULT);
+    kvsm_set(other, BUF("user:100"), BUF("value-user:100"));
+    copy_transaction(other, other->head[0], ctx);
+    kvsm_close(other);
+
+    for( reopen = 0 ; reopen < 2 ; reopen++ ) {
+      memset(&args, 0, sizeof(args));
+      args.ordered = 1;
+      ASSERT("Full scan returns OK", kvsm_scan(ctx, NULL, NULL, scan_collect, &args) == KVSM_OK);
+      ASSERT("Full scan visits every current key", args.count == 99);
+      ASSERT("Full scan is ordered", args.ordered);
+      ASSERT("Full scan returns current values", args.valued == 99);
+      ASSERT("Full scan ends at the highest key", !strcmp(args.last, "user:100"));
+
+      memset(&args, 0, sizeof(args));
+      args.ordered = 1;
+      ASSERT("Range scan returns OK", kvsm_scan(ctx, BUF("user:005"), BUF("user:015"), scan_collect, &args) == KVSM_OK);
+      ASSERT("Range scan skips deleted keys", args.count == 8);
+      ASSERT("Range scan excludes the end", !strcmp(args.last, "user:014"));
+
+      memset(&args, 0, sizeof(args));
+      args.ordered = 1;
+      ASSERT("Prefix scan returns OK", kvsm_scan_prefix(ctx, BUF("item:"), scan_collect, &args) == KVSM_OK);
+      ASSERT("Prefix scan stays within the prefix", (args.count == 50) && !strcmp(args.last, "item:049"));
+
+      memset(&args, 0, sizeof(args));
+      args.limit = 3;
+      kvsm_scan_prefix(ctx, BUF("user:"), scan_collect, &args);
+      ASSERT("Scan stops when the callback asks", (args.count == 3) && !strcmp(args.last, "user:002"));
+
+      memset(&args, 0, sizeof(args));
+      kvsm_scan_prefix(ctx, BUF("none:"), scan_collect, &args);
+      ASSERT("Prefix scan without matches calls nothing", args.count == 0);
+
+      // Merging moves values, the order keeps pointing at the current ones
+      if (!reopen) {
+        ASSERT("Merging before scanning returns OK", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+        kvsm_close(ctx);
+        ctx = kvsm_open("test.db", flags[i]);
+      }
+    }
+    kvsm_close(ctx);
+  }
+  remove("test2.db");
+}
+
+void test_kvsm_multiget() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP };
+  struct buf keys[64], *results[64], *expected;
+  struct kvsm_batch *batch;
+  struct kvsm *ctx;
+  char key[64][16], value[16];
+  int i, j, same, found;
+
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(value, sizeof(value), "key-%d", j % 40);
+      snprintf(key[0], sizeof(key[0]), "value-%d", j);
+      kvsm_set(ctx, BUF(value), BUF(key[0]));
+    }
+
+    // Merged transactions hold entries older than themselves
+    kvsm_compact_merge(ctx, 512);
+
+    // Large enough for the ordered table, probed per key
+    batch = kvsm_batch_begin(ctx);
+    for( j = 0 ; j < 20 ; j++ ) {
+      snprintf(value, sizeof(value), "key-%d", j * 2);
+      kvsm_batch_put(batch, BUF(value), BUF("batched"));
+    }
+    kvsm_batch_commit(batch);
+    kvsm_del(ctx, BUF("key-7"));
+    kvsm_set(ctx, BUF("key-9"), BUF("latest"));
+
+    for( j = 0 ; j < 64 ; j++ ) {
+      snprintf(key[j], sizeof(key[j]), "key-%d", (j < 60) ? j : 9);
+      keys[j].data = key[j];
+      keys[j].len  = strlen(key[j]);
+      keys[j].cap  = keys[j].len;
+    }
+    ASSERT("Multiget returns OK", kvsm_multiget(ctx, keys, 64, results) == KVSM_OK);
+
+    same = found = 0;
+    for( j = 0 ; j < 64 ; j++ ) {
+      expected = kvsm_get(ctx, &(keys[j]));
+      if (results[j]) found++;
+      if ((!expected) && (!results[j])) same++;
+      if (expected && results[j] && (expected->len == results[j]->len) && !memcmp(expected->data, results[j]->data, expected->len)) same++;
+      if (expected) {
+        buf_clear(expected);
+        free(expected);
+      }
+      if (results[j]) {
+        buf_clear(results[j]);
+        free(results[j]);
+      }
+    }
+    ASSERT("Multiget matches individual gets", same == 64);
+    ASSERT("Multiget skips deleted and missing keys", found == 43);
+
+    ASSERT("Empty multiget returns OK", kvsm_multiget(ctx, keys, 0, results) == KVSM_OK);
+    keys[0].data = "key-9";
+    keys[0].len  = 5;
+    ASSERT("Single multiget returns OK", kvsm_multiget(ctx, keys, 1, results) == KVSM_OK);
+    ASSERT("Single multiget finds the latest value", buf_is(results[0], "latest"));
+    kvsm_close(ctx);
+  }
+}
+
+struct aio_request {
+  char   expected[16];
+  size_t len;
+  int    result;
+};
+
+void aio_collect(struct kvsm_aio *aio, KVSM_RESPONSE status, struct buf *value, void *udata) {
+  struct aio_request *request = udata;
+  request->result = -1;
+  if ((status == KVSM_OK) && !value) request->result = 2;
+  if (
+    (status == KVSM_OK) && value &&
+    (value->len == request->len) &&
+    !memcmp(value->data, request->expected, strlen(request->expected))
+  ) {
+    request->result = 1;
+  }
+  if (value) {
+    buf_clear(value);
+    free(value);
+  }
+}
+
+void test_kvsm_aio() {
+  KVSM_FLAGS flags[]     = { KVSM_INDEX, KVSM_INDEX, KVSM_INDEX | KVSM_COMPRESS, KVSM_INDEX | KVSM_MMAP };
+  KVSM_FLAGS aio_flags[] = { 0, KVSM_AIO_POOL, 0, KVSM_AIO_POOL };
+  static struct aio_request request[120];
+  struct kvsm_batch *batch;
+  struct kvsm_aio *aio;
+  struct kvsm *ctx;
+  char key[16], large[600];
+  int i, j, matched, missing;
+
+  // Gets would walk the history synchronously without the index
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  ASSERT("Aio requires the key index", kvsm_aio_open(ctx, 8, 0) == NULL);
+  kvsm_close(ctx);
+
+  for( i = 0 ; i < 4 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(request[j].expected, sizeof(request[j].expected), "value-%d", j);
+      request[j].len = strlen(request[j].expected);
+      kvsm_set(ctx, BUF(key), BUF(request[j].expected));
+    }
+
+    // Compressed where asked for, inflated once read
+    for( j = 0 ; j < (int)sizeof(large) ; j++ ) large[j] = "value-0"[j % 7];
+    request[0].len = sizeof(large);
+    snprintf(key, sizeof(key), "key-0");
+    kvsm_set(ctx, BUF(key), &((struct buf){ .data = large, .len = sizeof(large), .cap = sizeof(large) }));
+    kvsm_del(ctx, BUF("key-5"));
+
+    aio = kvsm_aio_open(ctx, 8, aio_flags[i]);
+    ASSERT("Aio descriptor opens", aio != NULL);
+    for( j = 0 ; j < 120 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      request[j].result = 0;
+      if (kvsm_aio_get(aio, BUF(key), aio_collect, &(request[j])) != KVSM_OK) break;
+    }
+    ASSERT("Aio gets are issued beyond the depth", j == 120);
+    ASSERT("Aio wait returns OK", kvsm_aio_wait(aio, 120) == KVSM_OK);
+    ASSERT("Aio wait runs every callback", aio->pending == 0);
+
+    matched = missing = 0;
+    for( j = 0 ; j < 120 ; j++ ) {
+      if (request[j].result == 1) matched++;
+      if (request[j].result == 2) missing++;
+    }
+    ASSERT("Aio gets return the stored values", matched == 99);
+    ASSERT("Aio gets skip deleted and missing keys", missing == 21);
+
+    // Durable once called back
+    batch = kvsm_batch_begin(ctx);
+    kvsm_batch_put(batch, BUF("key-200"), BUF("value-200"));
+    request[0].result = 1;
+    ASSERT("Aio commit returns OK", kvsm_aio_commit(aio, batch, aio_collect, &(request[0])) == KVSM_OK);
+    ASSERT("Aio wait returns OK after commit", kvsm_aio_wait(aio, 1) == KVSM_OK);
+    ASSERT("Aio commit is called back", request[0].result == 2);
+
+    snprintf(request[1].expected, sizeof(request[1].expected), "value-200");
+    request[1].len = 9;
+    kvsm_aio_get(aio, BUF("key-200"), aio_collect, &(request[1]));
+    kvsm_aio_wait(aio, 1);
+    ASSERT("Aio get sees the committed value", request[1].result == 1);
+
+    // Values in flight survive being overwritten and compacted
+    snprintf(request[2].expected, sizeof(request[2].expected), "value-2");
+    request[2].len    = 7;
+    request[2].result = 0;
+    kvsm_aio_get(aio, BUF("key-2"), aio_collect, &(request[2]));
+    kvsm_set(ctx, BUF("key-2"), BUF("replaced"));
+    kvsm_compact(ctx);
+    ASSERT("Aio close returns OK", kvsm_aio_close(aio) == KVSM_OK);
+    ASSERT("Aio get in flight returns the value of it's time", request[2].result == 1);
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_cache() {
+  struct kvsm_cache_stats stats;
+  struct kvsm *ctx;
+  char key[16], value[16];
+  int i, j, found;
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", KVSM_DEFAULT);
+    for( j = 0 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+
+    ASSERT("Stats without a cache are empty", (kvsm_cache_stats(ctx, &stats) == KVSM_OK) && !stats.size && !stats.hits);
+    ASSERT("Cache resize returns OK", kvsm_cache_resize(ctx, i ? 8192 : 1024 * 1024) == KVSM_OK);
+    ctx->cache_values = i;
+
+    found = 0;
+    for( j = 0 ; j < 300 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", 90 + (j % 10));
+      snprintf(value, sizeof(value), "value-%d", 90 + (j % 10));
+      found += buf_is(kvsm_get(ctx, BUF(key)), value);
+    }
+    ASSERT("Cached reads return the stored values", found == 300);
+    kvsm_cache_stats(ctx, &stats);
+    ASSERT("Cache counts misses", stats.misses > 0);
+    ASSERT("Cache counts hits", stats.hits > stats.misses);
+    ASSERT("Cache stays within it's size", stats.used <= stats.size);
+
+    // Writes drop what they overwrite, compaction rewrites parents in place
+    kvsm_set(ctx, BUF("key-99"), BUF("other"));
+    ASSERT("Cache sees overwritten values", buf_is(kvsm_get(ctx, BUF("key-99")), "other"));
+    ASSERT("Compaction returns OK with a cache", kvsm_compact(ctx) == KVSM_OK);
+    found = 0;
+    for( j = 0 ; j < 99 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), value);
+    }
+    ASSERT("Cache survives compaction", found == 99);
+    kvsm_cache_stats(ctx, &stats);
+    if (i) ASSERT("Small cache evicts", stats.evictions > 0);
+
+    ASSERT("Cache removal returns OK", kvsm_cache_resize(ctx, 0) == KVSM_OK);
+    ASSERT("Removed cache has no size", (kvsm_cache_stats(ctx, &stats) == KVSM_OK) && !stats.size);
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_compact() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_DEFAULT, KVSM_INDEX };
+  uint64_t memory[]  = { 0, 1, 0 };
+  struct kvsm *ctx;
+  char key[16], value[16];
+  int i, j, found;
+
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    if (memory[i]) ctx->compact_memory = memory[i];
+    for( j = 0 ; j < 200 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j % 20);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+    kvsm_del(ctx, BUF("key-0"));
+
+    ASSERT("Compaction returns OK", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Compaction discards shadowed transactions", count_transactions(ctx) <= 22);
+
+    found = 0;
+    for( j = 1 ; j < 20 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", 180 + j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), value);
+    }
+    ASSERT("Compaction keeps current values", found == 19);
+    ASSERT("Compaction keeps tombstones", kvsm_get(ctx, BUF("key-0")) == NULL);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Compacted medium reopens", buf_is(kvsm_get(ctx, BUF("key-19")), "value-199"));
+    ASSERT("Compacted tombstones reopen", kvsm_get(ctx, BUF("key-0")) == NULL);
+    kvsm_close(ctx);
+  }
+}
+
+void test_kvsm_compact_step() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX };
+  struct kvsm_batch *batch;
+  struct kvsm *ctx;
+  char key[16], value[16];
+  int i, j, steps, found;
+
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    for( j = 0 ; j < 200 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j % 20);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+
+    ASSERT("Compaction step returns OK", kvsm_compact_step(ctx, 50, UINT64_MAX) == KVSM_OK);
+    ASSERT("Compaction step leaves the round in progress", ctx->compaction != NULL);
+
+    // Writes keep working in between steps
+    kvsm_set(ctx, BUF("key-1"), BUF("value-200"));
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Compaction progress survives reopening", ctx->compaction != NULL);
+    steps = 0;
+    while(ctx->compaction && (steps < 100)) {
+      kvsm_compact_step(ctx, 10, UINT64_MAX);
+      snprintf(value, sizeof(value), "value-%d", 201 + steps);
+      kvsm_set(ctx, BUF("key-2"), BUF(value));
+      steps++;
+    }
+    ASSERT("Compaction round finishes", ctx->compaction == NULL);
+    ASSERT("Compaction steps discard shadowed transactions", count_transactions(ctx) < 100);
+
+    found = 0;
+    for( j = 3 ; j < 20 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", 180 + j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), value);
+    }
+    ASSERT("Compaction steps keep current values", found == 17);
+    ASSERT("Compaction steps keep values written in between", buf_is(kvsm_get(ctx, BUF("key-1")), "value-200"));
+    snprintf(value, sizeof(value), "value-%d", 200 + steps);
+    ASSERT("Compaction steps keep the latest value", buf_is(kvsm_get(ctx, BUF("key-2")), value));
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Step-compacted medium reopens", buf_is(kvsm_get(ctx, BUF("key-1")), "value-200"));
+    ASSERT("Step-compacted medium has no round in progress", ctx->compaction == NULL);
+    kvsm_close(ctx);
+  }
+
+  // A byte budget spreads even a single transaction over several steps
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_DEFAULT);
+  kvsm_set(ctx, BUF("root"), BUF("value"));
+  for( i = 0 ; i < 2 ; i++ ) {
+    batch = kvsm_batch_begin(ctx);
+    for( j = 0 ; j < 1000 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", i);
+      kvsm_batch_put(batch, BUF(key), BUF(value));
+    }
+    kvsm_batch_commit(batch);
+  }
+  steps = found = 0;
+  do {
+    found += kvsm_compact_step(ctx, UINT64_MAX, 1024) == KVSM_OK;
+    steps++;
+  } while(ctx->compaction && (steps < 1000));
+  ASSERT("Budgeted compaction steps return OK", found == steps);
+  ASSERT("Byte budget splits large transactions", steps > 10);
+  ASSERT("Budgeted compaction round finishes", ctx->compaction == NULL);
+  ASSERT("Budgeted compaction discards the superseded batch", count_transactions(ctx) == 2);
+  ASSERT("Budgeted compaction keeps current values", buf_is(kvsm_get(ctx, BUF("key-999")), "value-1"));
+  kvsm_close(ctx);
+}
+
+void test_kvsm_compact_auto() {
+  struct kvsm *ctx;
+  char key[16], value[16];
+  uint64_t total, dead;
+  int j, found, waited;
+
+  remove("test.db");
+  ctx = kvsm_open("test.db", KVSM_INDEX);
+  kvsm_set(ctx, BUF("foo"), BUF("bar"));
+  ASSERT("Written bytes are counted", ctx->bytes_total > 0);
+  ASSERT("Fresh keys are not dead", ctx->bytes_dead == 0);
+  kvsm_set(ctx, BUF("foo"), BUF("baz"));
+  ASSERT("Superseded entries are dead", ctx->bytes_dead == 15);
+  total = ctx->bytes_total;
+  dead  = ctx->bytes_dead;
+  kvsm_close(ctx);
+
+  ctx = kvsm_open("test.db", KVSM_INDEX);
+  ASSERT("Byte counts survive reopening", (ctx->bytes_total == total) && (ctx->bytes_dead == dead));
+
+  ASSERT("Background compaction starts", kvsm_compact_start(ctx, 0.1) == KVSM_OK);
+  ASSERT("Background compaction only starts once", kvsm_compact_start(ctx, 0.1) == KVSM_ERROR);
+  for( j = 0 ; j < 300 ; j++ ) {
+    snprintf(key, sizeof(key), "key-%d", j % 10);
+    snprintf(value, sizeof(value), "value-%d", j);
+    kvsm_set(ctx, BUF(key), BUF(value));
+  }
+
+  // Give the thread a chance to catch up, only locked calls while it runs
+  for( waited = 0 ; waited < 500 ; waited++ ) {
+    if (count_transactions(ctx) < 100) break;
+    usleep(10000);
+  }
+  ASSERT("Background compaction stops", kvsm_compact_stop(ctx) == KVSM_OK);
+  ASSERT("Background compaction reclaims space", count_transactions(ctx) < 100);
+
+  found = 0;
+  for( j = 0 ; j < 10 ; j++ ) {
+    snprintf(key, sizeof(key), "key-%d", j);
+    snprintf(value, sizeof(value), "value-%d", 290 + j);
+    found += buf_is(kvsm_get(ctx, BUF(key)), value);
+  }
+  ASSERT("Background compaction keeps current values", found == 10);
+  ASSERT("Background compaction keeps untouched keys", buf_is(kvsm_get(ctx, BUF("foo")), "baz"));
+  kvsm_close(ctx);
+}
+
+void test_kvsm_merge() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP };
+  struct kvsm_transaction *tx;
+  struct kvsm *ctx, *other;
+  char key[16], value[16];
+  int i, j, found, before;
+
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    for( j = 0 ; j < 300 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j % 100);
+      snprintf(value, sizeof(value), "value-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(value));
+    }
+    kvsm_del(ctx, BUF("key-0"));
+
+    // Small consolidated blobs first, then everything into one
+    before = count_transactions(ctx);
+    ASSERT("Merging returns OK", kvsm_compact_merge(ctx, 2048) == KVSM_OK);
+    ASSERT("Merging shortens the chain", count_transactions(ctx) < (before / 4));
+    ASSERT("Merging again returns OK", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+    ASSERT("Merging consolidates the whole chain", count_transactions(ctx) == 1);
+
+    tx = kvsm_transaction_fetch(ctx, 0);
+    ASSERT("Merged transaction keeps the newest height", tx && (tx->height == 301));
+    ASSERT("Merged transaction is marked as such", tx && tx->merged);
+    kvsm_transaction_free(tx);
+
+    // Replicas get every entry the merged transaction retained
+    remove("test2.db");
+    other = kvsm_open("test2.db", flags[i]);
+    copy_transaction(ctx, ctx->head[0], other);
+    found = 0;
+    for( j = 1 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", 200 + j);
+      found += buf_is(kvsm_get(other, BUF(key)), value);
+    }
+    ASSERT("Merged transaction replicates all current values", found == 99);
+    ASSERT("Merged transaction replicates tombstones", kvsm_get(other, BUF("key-0")) == NULL);
+    tx = kvsm_transaction_fetch(other, 0);
+    ASSERT("Replicated merged transaction keeps it's identity", tx && tx->merged && (tx->height == 301) && (other->head_count == 1));
+    kvsm_transaction_free(tx);
+    kvsm_close(other);
+
+    found = 0;
+    for( j = 1 ; j < 100 ; j++ ) {
+      snprintf(key, sizeof(key), "key-%d", j);
+      snprintf(value, sizeof(value), "value-%d", 200 + j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), value);
+    }
+    ASSERT("Merging keeps current values", found == 99);
+    ASSERT("Merging keeps tombstones", kvsm_get(ctx, BUF("key-0")) == NULL);
+
+    kvsm_set(ctx, BUF("key-1"), BUF("updated"));
+    ASSERT("Writes continue on a merged chain", buf_is(kvsm_get(ctx, BUF("key-1")), "updated"));
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Merged medium reopens", buf_is(kvsm_get(ctx, BUF("key-99")), "value-299"));
+    ASSERT("Merged medium keeps newer writes", buf_is(kvsm_get(ctx, BUF("key-1")), "updated"));
+    ASSERT("Merged medium keeps tombstones", kvsm_get(ctx, BUF("key-0")) == NULL);
+    ASSERT("Merged medium compacts", kvsm_compact(ctx) == KVSM_OK);
+    ASSERT("Compacted merged medium keeps values", buf_is(kvsm_get(ctx, BUF("key-50")), "value-250"));
+    kvsm_close(ctx);
+  }
+
+  // A branch written in between the merged heights still wins
+  for( i = 0 ; i < 2 ; i++ ) {
+    remove("test.db");
+    remove("test2.db");
+    ctx = kvsm_open("test.db", flags[i]);
+    other = kvsm_open("test2.db", KVSM_DEFAULT);
+    kvsm_set(ctx, BUF("x"), BUF("1"));
+    copy_transaction(ctx, ctx->head[0], other);
+    kvsm_set(ctx, BUF("k"), BUF("a"));
+    kvsm_set(ctx, BUF("z"), BUF("3"));
+    kvsm_set(ctx, BUF("w"), BUF("4"));
+    kvsm_set(other, BUF("q"), BUF("2"));
+    copy_transaction(other, other->head[0], ctx);
+    kvsm_set(other, BUF("k"), BUF("b"));
+    copy_transaction(other, other->head[0], ctx);
+    ASSERT("Branches are merged by height", buf_is(kvsm_get(ctx, BUF("k")), "b"));
+    ASSERT("Merging branched media returns OK", kvsm_compact_merge(ctx, 1024 * 1024) == KVSM_OK);
+    ASSERT("Merging keeps both branches", ctx->head_count == 2);
+    ASSERT("Merged entries keep their height", buf_is(kvsm_get(ctx, BUF("k")), "b"));
+    ASSERT("Merged entries remain visible", buf_is(kvsm_get(ctx, BUF("z")), "3"));
+    kvsm_close(ctx);
+    kvsm_close(other);
+  }
+}
+
+void test_kvsm_diamond() {
+  KVSM_FLAGS flags[] = { KVSM_DEFAULT, KVSM_INDEX, KVSM_MMAP };
+  struct kvsm *ctx, *other;
+  char key[16], value[16];
+  int i, j, found;
+
+  // Both sides branch off and join again every round
+  for( i = 0 ; i < 3 ; i++ ) {
+    remove("test.db");
+    remove("test2.db");
+    ctx   = kvsm_open("test.db", flags[i]);
+    other = kvsm_open("test2.db", KVSM_DEFAULT);
+    kvsm_set(ctx, BUF("base"), BUF("0"));
+    copy_transaction(ctx, ctx->head[0], other);
+    for( j = 0 ; j < 40 ; j++ ) {
+      snprintf(key, sizeof(key), "a-%d", j);
+      kvsm_set(ctx, BUF(key), BUF(key));
+      snprintf(key, sizeof(key), "b-%d", j);
+      kvsm_set(other, BUF(key), BUF(key));
+      copy_transaction(ctx, ctx->head[0], other);
+      copy_transaction(other, other->head[0], ctx);
+      snprintf(value, sizeof(value), "%d", j);
+      kvsm_set(ctx, BUF("joined"), BUF(value));
+      copy_transaction(ctx, ctx->head[0], other);
+    }
+    ASSERT("Joined histories converge on a single head", (ctx->head_count == 1) && (other->head_count == 1));
+
+    found = 0;
+    for( j = 0 ; j < 40 ; j++ ) {
+      snprintf(key, sizeof(key), "a-%d", j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), key);
+      snprintf(key, sizeof(key), "b-%d", j);
+      found += buf_is(kvsm_get(ctx, BUF(key)), key);
+    }
+    ASSERT("Both branches are visible through every diamond", found == 80);
+    ASSERT("Oldest value is found below all diamonds", buf_is(kvsm_get(ctx, BUF("base")), "0"));
+    ASSERT("Latest join wins", buf_is(kvsm_get(other, BUF("joined")), "39"));
+    ASSERT("Missing keys walk the whole history", kvsm_get(ctx, BUF("missing")) == NULL);
+    kvsm_close(ctx);
+
+    ctx = kvsm_open("test.db", flags[i]);
+    ASSERT("Diamonds replay on reopen", buf_is(kvsm_get(ctx, BUF("b-0")), "b-0"));
+    ASSERT("Replayed diamonds keep the latest join", buf_is(kvsm_get(ctx, BUF("joined")), "39"));
+    kvsm_close(ctx);
+    kvsm_close(other);
+  }
 }
 
 int main() {
@@ -35,6 +1795,32 @@ int main() {
 
   // Run the actual tests
   RUN(test_kvsm_regular);
-  /*RUN(test_mindex_structs);*/
+  RUN(test_kvsm_get_set);
+  RUN(test_kvsm_transaction);
+  RUN(test_kvsm_checkpoint);
+  RUN(test_kvsm_identifier);
+  RUN(test_kvsm_batch);
+  RUN(test_kvsm_view);
+  RUN(test_kvsm_value);
+  RUN(test_kvsm_filter);
+  RUN(test_kvsm_sorted);
+  RUN(test_kvsm_order);
+  RUN(test_kvsm_ingest_bulk);
+  RUN(test_kvsm_sync);
+  RUN(test_kvsm_cache);
+  RUN(test_kvsm_compress);
+  RUN(test_kvsm_scan);
+  RUN(test_kvsm_multiget);
+  RUN(test_kvsm_aio);
+#ifndef _WIN32
+  RUN(test_kvsm_threads);
+  RUN(test_kvsm_peer);
+#endif
+  RUN(test_kvsm_compact);
+  RUN(test_kvsm_compact_step);
+  RUN(test_kvsm_compact_auto);
+  RUN(test_kvsm_merge);
+  RUN(test_kvsm_diamond);
+  RUN(test_kvsm_snapshot);
   return TEST_REPORT();
 }
@@ -1,234 +1,337 @@
-/*#include <limits.h>*/
-/*#include <stdio.h>*/
-/*#include <string.h>*/
-/*#include <unistd.h>*/
-/**/
-/*#include "finwo/io.h"*/
-/*#include "rxi/log.h"*/
-/*#include "tidwall/buf.h"*/
-/**/
-/*#include "kvsm.h"*/
-/**/
-/*void usage_global(char **argv) {*/
-/*  printf("\n");*/
-/*  printf("Usage: %s [global opts] command [command opts]\n", argv[0]);*/
-/*  printf("\n");*/
-/*  printf("Global options\n");*/
-/*  printf("  -h           Show this usage\n");*/
-/*  printf("  -f filename  Set database file to operate on\n");*/
-/*  printf("  -v level     Set verbosity level (fatal,error,warn,info,debug,trace)\n");*/
-/*  printf("\n");*/
-/*  printf("Commands\n");*/
-/*  printf("  current-increment      Outputs the current transaction increment\n");*/
-/*  printf("  compact                Merge transactions, potentially freeing up disk space\n");*/
-/*  printf("  serialize <increment>  Serialize a transaction into hex\n");*/
-/*  printf("  ingest                 Ingest a hex transaction and store it\n");*/
-/*  printf("  get [key]              Outputs the value of the given/stdin key to stdout\n");*/
-/*  printf("  del [key]              Writes a tombstone on the given/stdin key in a new transaction\n");*/
-/*  printf("  set <key>              Sets the value of the given key to stdin data in a new transaction\n");*/
-/*  printf("\n");*/
-/*}*/
-/**/
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "finwo/endian.h"
+#include "finwo/io.h"
+#include "rxi/log.h"
+#include "tidwall/buf.h"
+
+#include "kvsm.h"
+
+#define KVSMCTL_BULK_BATCH (16 * 1024 * 1024)
+
+void usage_global(char **argv) {
+  printf("\n");
+  printf("Usage: %s [global opts] command [command opts]\n", argv[0]);
+  printf("\n");
+  printf("Global options\n");
+  printf("  -h           Show this usage\n");
+  printf("  -f filename  Set database file to operate on\n");
+  printf("  -v level     Set verbosity level (fatal,error,warn,info,debug,trace)\n");
+  printf("\n");
+  printf("Commands\n");
+  printf("  heads                  Outputs the current heads as height and identifier\n");
+  printf("  compact                Merge transactions, potentially freeing up disk space\n");
+  printf("  serialize [id]         Serialize a transaction into hex, defaults to the first head\n");
+  printf("  ingest <hex>           Ingest a hex transaction and store it\n");
+  printf("  ingest-bulk [file]     Ingest a length-prefixed transaction stream from the given file/stdin\n");
+  printf("  get [key]              Outputs the value of the given/stdin key to stdout\n");
+  printf("  scan [prefix]          Outputs every current key with the given prefix and it's value, tab-separated\n");
+  printf("  del [key]              Writes a tombstone on the given/stdin key in a new transaction\n");
+  printf("  set <key>              Sets the value of the given key to stdin data in a new transaction\n");
+  printf("\n");
+}
+
+void print_hex(const char *data, size_t len) {
+  size_t i;
+  for( i = 0 ; i < len ; i++ ) {
+    printf("%02x", (uint8_t)data[i]);
+  }
+}
+
+// Decodes hex into a newly allocated buffer
+struct buf * parse_hex(const char *raw) {
+  struct buf *output = calloc(1, sizeof(struct buf));
+  size_t i;
+  if (!output) return NULL;
+  output->cap  = strlen(raw) / 2;
+  output->data = malloc(output->cap + 1);
+  if (!output->data) {
+    free(output);
+    return NULL;
+  }
+  for( i = 0 ; (i + 1) < strlen(raw) ; i += 2 ) {
+    sscanf(raw + i, "%2hhx", &(output->data[i/2]));
+    output->len++;
+  }
+  return output;
+}
+
+// Length of the complete transactions at the start of a bulk stream
+size_t bulk_complete(const struct buf *stream) {
+  size_t pos = 0;
+  uint64_t len;
+  while((stream->len - pos) >= sizeof(len)) {
+    memcpy(&len, stream->data + pos, sizeof(len));
+    len = be64toh(len);
+    if (len > (stream->len - pos - sizeof(len))) break;
+    pos += sizeof(len) + len;
+  }
+  return pos;
+}
+
+int scan_print(const struct buf *key, const struct buf *value, void *udata) {
+  fwrite(key->data, 1, key->len, stdout);
+  fputc('\t', stdout);
+  fwrite(value->data, 1, value->len, stdout);
+  fputc('\n', stdout);
+  return 0;
+}
+
 int main(int argc, char **argv) {
-/*  log_set_level(LOG_INFO);*/
-/*  char *filename = NULL;*/
-/*  char *command  = NULL;*/
-/*  int64_t i;*/
-/**/
-/*  // Parse global options*/
-/*  int c;*/
-/*  while((c = getopt(argc, argv, "hf:v:")) != -1) {*/
-/*    switch(c) {*/
-/*      case 'h':*/
-/*        usage_global(argv);*/
-/*        return 0;*/
-/*      case 'f':*/
-/*        filename = optarg;*/
-/*        break;*/
-/*      case 'v':*/
-/*        if (0) {*/
-/*          // Intentionally empty*/
-/*        } else if (!strcasecmp(optarg, "trace")) {*/
-/*          log_set_level(LOG_TRACE);*/
-/*        } else if (!strcasecmp(optarg, "debug")) {*/
-/*          log_set_level(LOG_DEBUG);*/
-/*        } else if (!strcasecmp(optarg, "info")) {*/
-/*          log_set_level(LOG_INFO);*/
-/*        } else if (!strcasecmp(optarg, "warn")) {*/
-/*          log_set_level(LOG_WARN);*/
-/*        } else if (!strcasecmp(optarg, "error")) {*/
-/*          log_set_level(LOG_ERROR);*/
-/*        } else if (!strcasecmp(optarg, "fatal")) {*/
-/*          log_set_level(LOG_FATAL);*/
-/*        } else {*/
-/*          log_fatal("Unknown log level: %s", optarg);*/
-/*          return 1;*/
-/*        }*/
-/*        break;*/
-/*      default:*/
-/*        log_fatal("illegal option", c);*/
-/*        return 1;*/
-/*    }*/
-/*  }*/
-/*  if (optind < argc) {*/
-/*    command = argv[optind++];*/
-/*  }*/
-/*  if (!command) {*/
-/*    log_fatal("No command given");*/
-/*    return 1;*/
-/*  }*/
-/*  if (!filename) {*/
-/*    log_fatal("No storage file given");*/
-/*    return 1;*/
-/*  }*/
-/**/
-/*  struct kvsm *ctx = kvsm_open(filename, 0);*/
-/**/
-/*  if (0) {*/
-/*    // Intentionally empty*/
-/*  } else if (!strcasecmp(command, "mini-stat")) {*/
-/**/
-/*    struct kvsm_cursor *current   = kvsm_cursor_load(ctx, ctx->current_offset);*/
-/*    struct kvsm_cursor *fetched   = kvsm_cursor_fetch(ctx, ctx->current_increment);*/
-/*    struct kvsm_cursor *parent    = kvsm_cursor_previous(current);*/
-/*    struct kvsm_cursor *recurrent = kvsm_cursor_next(parent);*/
-/**/
-/*    printf("Current  : %lld @ %llx\n", current->increment  , current->offset  );*/
-/*    printf("Fetched  : %lld @ %llx\n", fetched->increment  , fetched->offset  );*/
-/*    printf("Parent   : %lld @ %llx\n", parent->increment   , parent->offset   );*/
-/*    printf("Recurrent: %lld @ %llx\n", recurrent->increment, recurrent->offset);*/
-/**/
-/*  } else if (!strcasecmp(command, "current-increment")) {*/
-/*    printf("%lld\n", ctx->current_increment);*/
-/*  } else if (!strcasecmp(command, "compact")) {*/
-/*    kvsm_compact(ctx);*/
-/*  } else if (!strcasecmp(command, "get")) {*/
-/*    struct buf *key = calloc(1, sizeof(struct buf));*/
-/**/
-/*    if (optind < argc) {*/
-/*      buf_append(key, argv[optind], strlen(argv[optind]));*/
-/*      optind++;*/
-/*    } else {*/
-/*      log_fatal("Reading key from stdin not implemented");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    struct buf *response = kvsm_get(ctx, key);*/
-/*    if (!response) {*/
-/*      printf("(NULL)\n");*/
-/*    } else {*/
-/*      write(STDOUT_FILENO, response->data, response->len);*/
-/*      buf_clear(response);*/
-/*      free(response);*/
-/*    }*/
-/**/
-/*  } else if (!strcasecmp(command, "del")) {*/
-/*    struct buf *key = calloc(1, sizeof(struct buf));*/
-/**/
-/*    if (optind < argc) {*/
-/*      buf_append(key, argv[optind], strlen(argv[optind]));*/
-/*      optind++;*/
-/*    } else {*/
-/*      log_fatal("Reading key from stdin not implemented");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    KVSM_RESPONSE response = kvsm_del(ctx, key);*/
-/*    if (response != KVSM_OK) {*/
-/*      fprintf(stderr, "Error during deletion\n");*/
-/*    }*/
-/**/
-/*  } else if (!strcasecmp(command, "set")) {*/
-/*    struct buf *key   = calloc(1, sizeof(struct buf));*/
-/*    struct buf *value = calloc(1, sizeof(struct buf));*/
-/**/
-/*    if (optind < argc) {*/
-/*      buf_append(key, argv[optind], strlen(argv[optind]));*/
-/*      optind++;*/
-/*    } else {*/
-/*      log_fatal("Reading key from stdin not implemented");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    if (optind < argc) {*/
-/*      buf_append(value, argv[optind], strlen(argv[optind]));*/
-/*      optind++;*/
-/*    } else {*/
-/*      log_fatal("Reading value from stdin not implemented");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    KVSM_RESPONSE response = kvsm_set(ctx, key, value);*/
-/*    if (response != KVSM_OK) {*/
-/*      fprintf(stderr, "Error during setting of value\n");*/
-/*    }*/
-/**/
-/*  } else if (!strcasecmp(command, "serialize")) {*/
-/*    uint64_t increment = ctx->current_increment;*/
-/**/
-/*    if (optind < argc) {*/
-/*      increment = atoll(argv[optind]);*/
-/*      optind++;*/
-/*    } else {*/
-/*      // Intentionally empty, serialized the current increment;*/
-/*    }*/
-/**/
-/*    struct kvsm_cursor *cursor = kvsm_cursor_fetch(ctx, increment);*/
-/*    if (!cursor) {*/
-/*      printf("(NULL)\n");*/
-/*      return 0;*/
-/*    }*/
-/**/
-/*    struct buf         *serialized = kvsm_cursor_serialize(cursor);*/
-/*    if (!serialized) {*/
-/*      printf("(NULL)\n");*/
-/*      return 0;*/
-/*    }*/
-/**/
-/*    // TODO: optimize?*/
-/*    i = 0;*/
-/*    while(i < serialized->len) {*/
-/*      printf("%02x", *(serialized->data + i));*/
-/*      i++;*/
-/*    }*/
-/*    printf("\n");*/
-/**/
-/*    buf_clear(serialized);*/
-/*    free(serialized);*/
-/**/
-/*  } else {*/
-/*    const char * serialized_raw = NULL;*/
-/**/
-/*    if (optind < argc) {*/
-/*      serialized_raw = argv[optind];*/
-/*      optind++;*/
-/*    } else {*/
-/*      log_fatal("Must provide a serialized transaction");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    struct buf *serialized = calloc(1, sizeof(struct buf));*/
-/*    serialized->cap  = strlen(serialized_raw);*/
-/*    serialized->data = malloc(serialized->cap);*/
-/*    if (!serialized->data) {*/
-/*      log_fatal("Unable to reserve memory for decoded increment");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    for( i = 0 ; i < serialized->cap ; i += 2 ) {*/
-/*      sscanf(serialized_raw + i, "%2hhx", &(serialized->data[i/2]));*/
-/*      serialized->len++;*/
-/*    }*/
-/**/
-/*    if (kvsm_cursor_ingest(ctx, serialized) != KVSM_OK) {*/
-/*      log_fatal("Unable to ingest transaction");*/
-/*      return 1;*/
-/*    }*/
-/**/
-/*    return 0;*/
-/*  }*/
-/**/
-/*  kvsm_close(ctx);*/
+  log_set_level(LOG_INFO);
+  char *filename = NULL;
+  char *command  = NULL;
+  int i;
+
+  // Parse global options
+  int c;
+  while((c = getopt(argc, argv, "hf:v:")) != -1) {
+    switch(c) {
+      case 'h':
+        usage_global(argv);
+        return 0;
+      case 'f':
+        filename = optarg;
+        break;
+      case 'v':
+        if (0) {
+          // Intentionally empty
+        } else if (!strcasecmp(optarg, "trace")) {
+          log_set_level(LOG_TRACE);
+        } else if (!strcasecmp(optarg, "debug")) {
+          log_set_level(LOG_DEBUG);
+        } else if (!strcasecmp(optarg, "info")) {
+          log_set_level(LOG_INFO);
+        } else if (!strcasecmp(optarg, "warn")) {
+          log_set_level(LOG_WARN);
+        } else if (!strcasecmp(optarg, "error")) {
+          log_set_level(LOG_ERROR);
+        } else if (!strcasecmp(optarg, "fatal")) {
+          log_set_level(LOG_FATAL);
+        } else {
+          log_fatal("Unknown log level: %s", optarg);
+          return 1;
+        }
+        break;
+      default:
+        log_fatal("illegal option", c);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    command = argv[optind++];
+  }
+  if (!command) {
+    log_fatal("No command given");
+    return 1;
+  }
+  if (!filename) {
+    log_fatal("No storage file given");
+    return 1;
+  }
+
+  // Scans walk the index's key order
+  struct kvsm *ctx = kvsm_open(filename, strcasecmp(command, "scan") ? KVSM_DEFAULT : KVSM_INDEX);
+  if (!ctx) {
+    log_fatal("Could not open storage file: %s", filename);
+    return 1;
+  }
+
+  if (0) {
+    // Intentionally empty
+  } else if (!strcasecmp(command, "heads")) {
+    struct kvsm_transaction *tx;
+    for( i = 0 ; i < ctx->head_count ; i++ ) {
+      tx = kvsm_transaction_load(ctx, ctx->head[i]);
+      if (!tx) continue;
+      printf("%lld ", (long long)tx->height);
+      print_hex(tx->id->data, tx->id->len);
+      printf("\n");
+      kvsm_transaction_free(tx);
+    }
+
+  } else if (!strcasecmp(command, "compact")) {
+    kvsm_compact(ctx);
+  } else if (!strcasecmp(command, "get")) {
+    struct buf *key = calloc(1, sizeof(struct buf));
+
+    if (optind < argc) {
+      buf_append(key, argv[optind], strlen(argv[optind]));
+      optind++;
+    } else {
+      log_fatal("Reading key from stdin not implemented");
+      return 1;
+    }
+
+    struct buf *response = kvsm_get(ctx, key);
+    if (!response) {
+      printf("(NULL)\n");
+    } else {
+      write(STDOUT_FILENO, response->data, response->len);
+      buf_clear(response);
+      free(response);
+    }
+
+  } else if (!strcasecmp(command, "del")) {
+    struct buf *key = calloc(1, sizeof(struct buf));
+
+    if (optind < argc) {
+      buf_append(key, argv[optind], strlen(argv[optind]));
+      optind++;
+    } else {
+      log_fatal("Reading key from stdin not implemented");
+      return 1;
+    }
+
+    KVSM_RESPONSE response = kvsm_del(ctx, key);
+    if (response != KVSM_OK) {
+      fprintf(stderr, "Error during deletion\n");
+    }
+
+  } else if (!strcasecmp(command, "set")) {
+    struct buf *key   = calloc(1, sizeof(struct buf));
+    struct buf *value = calloc(1, sizeof(struct buf));
+
+    if (optind < argc) {
+      buf_append(key, argv[optind], strlen(argv[optind]));
+      optind++;
+    } else {
+      log_fatal("Reading key from stdin not implemented");
+      return 1;
+    }
+
+    if (optind < argc) {
+      buf_append(value, argv[optind], strlen(argv[optind]));
+      optind++;
+    } else {
+      log_fatal("Reading value from stdin not implemented");
+      return 1;
+    }
+
+    KVSM_RESPONSE response = kvsm_set(ctx, key, value);
+    if (response != KVSM_OK) {
+      fprintf(stderr, "Error during setting of value\n");
+    }
+
+  } else if (!strcasecmp(command, "serialize")) {
+    struct kvsm_transaction *tx = NULL;
+
+    if (optind < argc) {
+      struct buf *id = parse_hex(argv[optind]);
+      optind++;
+      tx = kvsm_transaction_load_id(ctx, id);
+      buf_clear(id);
+      free(id);
+    } else if (ctx->head_count) {
+      tx = kvsm_transaction_load(ctx, ctx->head[0]);
+    }
+
+    if (!tx) {
+      printf("(NULL)\n");
+      return 0;
+    }
+
+    struct buf *serialized = kvsm_transaction_serialize(tx);
+    kvsm_transaction_free(tx);
+    if (!serialized) {
+      printf("(NULL)\n");
+      return 0;
+    }
+
+    print_hex(serialized->data, serialized->len);
+    printf("\n");
+
+    buf_clear(serialized);
+    free(serialized);
+
+  } else if (!strcasecmp(command, "ingest")) {
+    if (optind >= argc) {
+      log_fatal("Must provide a serialized transaction");
+      return 1;
+    }
+
+    struct buf *serialized = parse_hex(argv[optind++]);
+    if (!serialized) {
+      log_fatal("Unable to reserve memory for decoded transaction");
+      return 1;
+    }
+
+    if (kvsm_transaction_ingest(ctx, serialized) != KVSM_OK) {
+      log_fatal("Unable to ingest transaction");
+      return 1;
+    }
+
+    buf_clear(serialized);
+    free(serialized);
+
+  } else if (!strcasecmp(command, "ingest-bulk")) {
+    struct buf stream = {0};
+    struct buf batch;
+    char chunk[65536];
+    size_t complete;
+    ssize_t n;
+    int fd = STDIN_FILENO;
+
+    if (optind < argc) {
+      fd = open(argv[optind++], O_RDONLY);
+      if (fd < 0) {
+        log_fatal("Could not open stream: %s", argv[optind - 1]);
+        return 1;
+      }
+    }
+
+    // Ingest in batches, the anchor is only written once per batch
+    while(1) {
+      n = read(fd, chunk, sizeof(chunk));
+      if (n < 0) {
+        log_fatal("Could not read stream");
+        return 1;
+      }
+      if (n) buf_append(&stream, chunk, n);
+      if (n && (stream.len < KVSMCTL_BULK_BATCH)) continue;
+      complete   = n ? bulk_complete(&stream) : stream.len;
+      batch.data = stream.data;
+      batch.len  = complete;
+      batch.cap  = complete;
+      if (complete && (kvsm_transaction_ingest_bulk(ctx, &batch) != KVSM_OK)) {
+        log_fatal("Unable to ingest transaction stream");
+        return 1;
+      }
+      memmove(stream.data, stream.data + complete, stream.len - complete);
+      stream.len -= complete;
+      if (!n) break;
+    }
+
+    if (fd != STDIN_FILENO) close(fd);
+    buf_clear(&stream);
+
+  } else if (!strcasecmp(command, "scan")) {
+    struct buf prefix = {0};
+
+    if (optind < argc) {
+      prefix.data = argv[optind];
+      prefix.len  = strlen(argv[optind]);
+      optind++;
+    }
+
+    if (kvsm_scan_prefix(ctx, &prefix, scan_print, NULL) != KVSM_OK) {
+      log_fatal("Unable to scan keys");
+      return 1;
+    }
+
+  } else {
+    log_fatal("Unknown command: %s", command);
+    kvsm_close(ctx);
+    return 1;
+  }
+
+  kvsm_close(ctx);
 
   return 0;
 }